@@ -0,0 +1,826 @@
+#include "pnlfs.h"
+#include "pnlfs_trace.h"
+
+/*
+ * Free blocks are also kept in memory as extents, in two rbtrees: one
+ * sorted by start to find the neighbours of a block, one sorted by length
+ * to find an extent large enough for a request. The trees are changed
+ * under balloc_lock. They only hold the groups of the bitmap read so far,
+ * the others are read when the trees cannot serve a request, or when one
+ * of their blocks is the goal or is freed.
+ *
+ * Each CPU takes a window of PNLFS_BWIN_SIZE blocks out of the trees and
+ * hands them out under the lock of its window only. A block of a window
+ * is still free in the bitmap until it is handed out, so the bitmap, the
+ * copy written to disk, is right whatever the windows hold. Its bits are
+ * changed with atomic bitops since windows may share a word.
+ */
+#define PNLFS_BWIN_SIZE 64
+struct pnlfs_free_ext {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	u32 start;
+	u32 len;
+};
+
+static void pnlfs_fext_insert_start(struct pnlfs_sb_info *sbi,
+				    struct pnlfs_free_ext *fe)
+{
+	struct rb_node **p = &sbi->free_by_start.rb_node, *parent = NULL;
+	struct pnlfs_free_ext *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct pnlfs_free_ext, by_start);
+		if (fe->start < cur->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->by_start, parent, p);
+	rb_insert_color(&fe->by_start, &sbi->free_by_start);
+}
+
+/* Sorted by length, then by start so that equal lengths stay in order */
+static void pnlfs_fext_insert_len(struct pnlfs_sb_info *sbi,
+				  struct pnlfs_free_ext *fe)
+{
+	struct rb_node **p = &sbi->free_by_len.rb_node, *parent = NULL;
+	struct pnlfs_free_ext *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct pnlfs_free_ext, by_len);
+		if (fe->len < cur->len ||
+		    (fe->len == cur->len && fe->start < cur->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->by_len, parent, p);
+	rb_insert_color(&fe->by_len, &sbi->free_by_len);
+}
+
+static void pnlfs_fext_add(struct pnlfs_sb_info *sbi,
+			   struct pnlfs_free_ext *fe)
+{
+	pnlfs_fext_insert_start(sbi, fe);
+	pnlfs_fext_insert_len(sbi, fe);
+}
+
+static void pnlfs_fext_del(struct pnlfs_sb_info *sbi,
+			   struct pnlfs_free_ext *fe)
+{
+	rb_erase(&fe->by_start, &sbi->free_by_start);
+	rb_erase(&fe->by_len, &sbi->free_by_len);
+	kfree(fe);
+}
+
+/* Change an extent, it must not move past its neighbours */
+static void pnlfs_fext_resize(struct pnlfs_sb_info *sbi,
+			      struct pnlfs_free_ext *fe, u32 start, u32 len)
+{
+	if (!len) {
+		pnlfs_fext_del(sbi, fe);
+		return;
+	}
+	rb_erase(&fe->by_len, &sbi->free_by_len);
+	fe->start = start;
+	fe->len = len;
+	pnlfs_fext_insert_len(sbi, fe);
+}
+
+/* Last extent starting at or before blk, it does not always contain it */
+static struct pnlfs_free_ext *pnlfs_fext_lookup(struct pnlfs_sb_info *sbi,
+						u32 blk)
+{
+	struct rb_node *n = sbi->free_by_start.rb_node;
+	struct pnlfs_free_ext *fe, *best = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct pnlfs_free_ext, by_start);
+		if (fe->start <= blk) {
+			best = fe;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return best;
+}
+
+/* Smallest extent of at least len blocks */
+static struct pnlfs_free_ext *pnlfs_fext_best(struct pnlfs_sb_info *sbi,
+					      u32 len)
+{
+	struct rb_node *n = sbi->free_by_len.rb_node;
+	struct pnlfs_free_ext *fe, *best = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct pnlfs_free_ext, by_len);
+		if (fe->len >= len) {
+			best = fe;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return best;
+}
+
+static struct pnlfs_free_ext *pnlfs_fext_next(struct pnlfs_free_ext *fe)
+{
+	return rb_entry_safe(rb_next(&fe->by_start), struct pnlfs_free_ext,
+			     by_start);
+}
+
+/* Take [start, start + len) out of fe, spare is used to split it */
+static void pnlfs_fext_carve(struct pnlfs_sb_info *sbi,
+			     struct pnlfs_free_ext *fe, u32 start, u32 len,
+			     struct pnlfs_free_ext **spare)
+{
+	u32 end = fe->start + fe->len;
+	struct pnlfs_free_ext *tail;
+
+	if (start == fe->start) {
+		pnlfs_fext_resize(sbi, fe, start + len, fe->len - len);
+	} else if (start + len == end) {
+		pnlfs_fext_resize(sbi, fe, fe->start, fe->len - len);
+	} else {
+		tail = *spare;
+		*spare = NULL;
+		tail->start = start + len;
+		tail->len = end - tail->start;
+		pnlfs_fext_resize(sbi, fe, fe->start, start - fe->start);
+		pnlfs_fext_add(sbi, tail);
+	}
+}
+
+/*
+ * Take up to want blocks from the trees, nr_blocks if they are empty. If
+ * !partial, nr_blocks is also returned when only the goal or extents
+ * shorter than want are left.
+ */
+static u32 pnlfs_fext_alloc(struct pnlfs_sb_info *sbi, u32 goal, u32 want,
+			    u32 *count, bool partial)
+{
+	struct pnlfs_free_ext *fe, *spare;
+	u32 start;
+
+	/* Allocating in the middle of an extent splits it in two */
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	spin_lock(&sbi->balloc_lock);
+	if (!goal || goal >= sbi->nr_blocks)
+		goal = sbi->balloc_cursor;
+
+	fe = pnlfs_fext_lookup(sbi, goal);
+	if (fe && goal < fe->start + fe->len && (goal == fe->start || spare)) {
+		start = goal;
+		goto found;
+	}
+
+	fe = fe ? pnlfs_fext_next(fe) :
+		rb_entry_safe(rb_first(&sbi->free_by_start),
+			      struct pnlfs_free_ext, by_start);
+	if (!fe || fe->len < want) {
+		fe = pnlfs_fext_best(sbi, want);
+		if (!fe && partial)
+			fe = rb_entry_safe(rb_last(&sbi->free_by_len),
+					   struct pnlfs_free_ext, by_len);
+		if (!fe) {
+			spin_unlock(&sbi->balloc_lock);
+			kfree(spare);
+			return sbi->nr_blocks;
+		}
+	}
+	start = fe->start;
+found:
+	*count = min_t(u32, want, fe->start + fe->len - start);
+	pnlfs_fext_carve(sbi, fe, start, *count, &spare);
+	sbi->balloc_cursor = start + *count;
+	spin_unlock(&sbi->balloc_lock);
+
+	kfree(spare);
+	return start;
+}
+
+/* Take up to want blocks at goal if it is free, nr_blocks otherwise */
+static u32 pnlfs_fext_alloc_at(struct pnlfs_sb_info *sbi, u32 goal, u32 want,
+			       u32 *count)
+{
+	struct pnlfs_free_ext *fe, *spare;
+
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	spin_lock(&sbi->balloc_lock);
+	fe = pnlfs_fext_lookup(sbi, goal);
+	if (!fe || goal >= fe->start + fe->len ||
+	    (goal != fe->start && !spare)) {
+		spin_unlock(&sbi->balloc_lock);
+		kfree(spare);
+		return sbi->nr_blocks;
+	}
+	*count = min_t(u32, want, fe->start + fe->len - goal);
+	pnlfs_fext_carve(sbi, fe, goal, *count, &spare);
+	sbi->balloc_cursor = goal + *count;
+	spin_unlock(&sbi->balloc_lock);
+
+	kfree(spare);
+	return goal;
+}
+
+/* True if some of [start, start + count) is in the trees */
+static bool pnlfs_fext_overlaps(struct pnlfs_sb_info *sbi, u32 start,
+				u32 count)
+{
+	struct pnlfs_free_ext *prev, *next;
+	bool ret;
+
+	spin_lock(&sbi->balloc_lock);
+	prev = pnlfs_fext_lookup(sbi, start);
+	next = prev ? pnlfs_fext_next(prev) :
+		rb_entry_safe(rb_first(&sbi->free_by_start),
+			      struct pnlfs_free_ext, by_start);
+	ret = (prev && prev->start + prev->len > start) ||
+	      (next && start + count > next->start);
+	spin_unlock(&sbi->balloc_lock);
+	return ret;
+}
+
+/* Put blocks back in the trees, false if some of them already are */
+static bool pnlfs_fext_free(struct pnlfs_sb_info *sbi, u32 start, u32 count)
+{
+	struct pnlfs_free_ext *prev, *next, *fe;
+	u32 len;
+
+	fe = kmalloc(sizeof(*fe), GFP_NOFS | __GFP_NOFAIL);
+
+	spin_lock(&sbi->balloc_lock);
+	prev = pnlfs_fext_lookup(sbi, start);
+	next = prev ? pnlfs_fext_next(prev) :
+		rb_entry_safe(rb_first(&sbi->free_by_start),
+			      struct pnlfs_free_ext, by_start);
+	if ((prev && prev->start + prev->len > start) ||
+	    (next && start + count > next->start)) {
+		spin_unlock(&sbi->balloc_lock);
+		kfree(fe);
+		return false;
+	}
+
+	if (prev && prev->start + prev->len == start) {
+		len = prev->len + count;
+		if (next && start + count == next->start) {
+			len += next->len;
+			pnlfs_fext_del(sbi, next);
+		}
+		pnlfs_fext_resize(sbi, prev, prev->start, len);
+	} else if (next && start + count == next->start) {
+		pnlfs_fext_resize(sbi, next, start, next->len + count);
+	} else {
+		fe->start = start;
+		fe->len = count;
+		pnlfs_fext_add(sbi, fe);
+		fe = NULL;
+	}
+	spin_unlock(&sbi->balloc_lock);
+
+	kfree(fe);
+	return true;
+}
+
+/* Add the free extents of a group being read to the trees */
+static void pnlfs_bgroup_loaded(struct super_block *sb, u32 group,
+				struct buffer_head *bh)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	u32 base = group * PNLFS_BITS_PER_GROUP(sb), start, end = 0, bits;
+
+	pnlfs_stat_inc(sb, PNLFS_STAT_BGROUP_READ);
+	bits = min_t(u32, sbi->nr_blocks - base, PNLFS_BITS_PER_GROUP(sb));
+	for (;;) {
+		start = find_next_bit_le(bh->b_data, bits, end);
+		if (start >= bits)
+			break;
+		end = find_next_zero_bit_le(bh->b_data, bits, start);
+		pnlfs_fext_free(sbi, base + start, end - start);
+	}
+}
+
+/* Read the groups holding [start, start + count), false on I/O error */
+static bool pnlfs_bgroup_load_range(struct super_block *sb, u32 start,
+				    u32 count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	u32 group;
+
+	for (group = start / PNLFS_BITS_PER_GROUP(sb);
+	     group <= (start + count - 1) / PNLFS_BITS_PER_GROUP(sb); group++)
+		if (!pnlfs_bitmap_load(sb, &sbi->bbitmap, group))
+			return false;
+	return true;
+}
+
+/* Read the first group not read yet, false if there is none */
+static bool pnlfs_bgroup_load_next(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_bitmap *bm = &sbi->bbitmap;
+	u32 group;
+
+	for (group = READ_ONCE(sbi->bload_cursor); group < bm->nr_groups;
+	     group++) {
+		if (smp_load_acquire(&bm->bh[group]))
+			continue;
+		/* A group that cannot be read is left out */
+		WRITE_ONCE(sbi->bload_cursor, group + 1);
+		pnlfs_bitmap_load(sb, bm, group);
+		return true;
+	}
+	WRITE_ONCE(sbi->bload_cursor, group);
+	return false;
+}
+
+/*
+ * Take up to want blocks from the trees, reading new groups until one
+ * has an extent of want blocks. Only the last groups read may give less.
+ */
+static u32 pnlfs_balloc_tree(struct super_block *sb, u32 goal, u32 want,
+			     u32 *count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	bool partial;
+	u32 start;
+
+	if (goal && goal < sbi->nr_blocks)
+		pnlfs_bitmap_load(sb, &sbi->bbitmap,
+				  goal / PNLFS_BITS_PER_GROUP(sb));
+	do {
+		partial = READ_ONCE(sbi->bload_cursor) >=
+			sbi->bbitmap.nr_groups;
+		start = pnlfs_fext_alloc(sbi, goal, want, count, partial);
+		if (start != sbi->nr_blocks)
+			return start;
+	} while (pnlfs_bgroup_load_next(sb));
+
+	return pnlfs_fext_alloc(sbi, goal, want, count, true);
+}
+
+/* Give the windows of all the CPUs back to the trees */
+static void pnlfs_bwin_drain(struct pnlfs_sb_info *sbi)
+{
+	struct pnlfs_window *win;
+	u32 start, end;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		win = per_cpu_ptr(sbi->bwin, cpu);
+		spin_lock(&win->lock);
+		start = win->start;
+		end = win->end;
+		win->start = win->end = 0;
+		spin_unlock(&win->lock);
+		if (start < end)
+			pnlfs_fext_free(sbi, start, end - start);
+	}
+}
+
+/*
+ * Reserve up to *count contiguous blocks and return the first one, or
+ * nr_blocks if the disk is full. *count is set to the number of blocks
+ * reserved, at least one.
+ *
+ * Small requests are served from the window of the CPU, unless goal is
+ * elsewhere and free: files written in turn on one CPU must not share a
+ * window, their blocks would interleave. When the window is too short, a
+ * new one is taken at goal if it is free. Otherwise it goes
+ * on from the last window (next-fit) if the free extent there is large
+ * enough, and falls back to the smallest extent that holds the whole
+ * window, or to the largest one. Large requests skip the windows. A goal
+ * of 0 means no preference.
+ */
+u32 pnlfs_new_blocks(struct super_block *sb, u32 goal, u32 *count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_window *win;
+	u32 start, want = max_t(u32, *count, 1), wstart, wlen, old_start, old_end;
+
+	if (goal >= sbi->nr_blocks)
+		goal = 0;
+	win = raw_cpu_ptr(sbi->bwin);
+	spin_lock(&win->lock);
+	if (win->end - win->start >= want &&
+	    (!goal || goal == win->start)) {
+		start = win->start;
+		win->start += want;
+		spin_unlock(&win->lock);
+		*count = want;
+		goto found;
+	}
+	wstart = win->end - win->start >= want ? win->start : 0;
+	spin_unlock(&win->lock);
+
+	if (wstart && pnlfs_bitmap_load(sb, &sbi->bbitmap,
+					goal / PNLFS_BITS_PER_GROUP(sb))) {
+		start = pnlfs_fext_alloc_at(sbi, goal, want, count);
+		if (start != sbi->nr_blocks)
+			goto found;
+		/* The goal is taken, the window does as well as anything */
+		spin_lock(&win->lock);
+		if (win->start == wstart && win->end - win->start >= want) {
+			win->start += want;
+			spin_unlock(&win->lock);
+			start = wstart;
+			*count = want;
+			goto found;
+		}
+		spin_unlock(&win->lock);
+	}
+
+	if (want >= PNLFS_BWIN_SIZE / 2) {
+		start = pnlfs_balloc_tree(sb, goal, want, count);
+		if (start != sbi->nr_blocks)
+			goto found;
+		goto drain;
+	}
+
+	/* Slow path: a new window, the rest of the old one goes back */
+	wstart = pnlfs_balloc_tree(sb, goal, PNLFS_BWIN_SIZE, &wlen);
+	if (wstart == sbi->nr_blocks)
+		goto drain;
+	*count = min(want, wlen);
+	start = wstart;
+	spin_lock(&win->lock);
+	old_start = win->start;
+	old_end = win->end;
+	win->start = wstart + *count;
+	win->end = wstart + wlen;
+	spin_unlock(&win->lock);
+	if (old_start < old_end)
+		pnlfs_fext_free(sbi, old_start, old_end - old_start);
+	goto found;
+
+drain:
+	/* Every group is read and empty, what is left is in the windows */
+	pnlfs_bwin_drain(sbi);
+	start = pnlfs_fext_alloc(sbi, 0, want, count, true);
+	if (start == sbi->nr_blocks) {
+		*count = 0;
+		return start;
+	}
+found:
+	/* The blocks come from the trees, their groups are read */
+	if (pnlfs_bitmap_set_range(sb, &sbi->bbitmap, start, *count, false)) {
+		/* Still free on disk, they must not be used */
+		pnlfs_fext_free(sbi, start, *count);
+		*count = 0;
+		return sbi->nr_blocks;
+	}
+	percpu_counter_sub(&sbi->free_blocks, *count);
+	pnlfs_stat_inc(sb, PNLFS_STAT_BALLOC);
+	pnlfs_stat_add(sb, PNLFS_STAT_BALLOC_BLOCKS, *count);
+	pnlfs_commit_kick(sb);
+
+	trace_pnlfs_alloc_blocks(sb, goal, start, *count);
+	return start;
+}
+
+/* Give back count blocks from start */
+void pnlfs_free_blocks(struct super_block *sb, u32 start, u32 count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_window *win;
+	bool done = false;
+
+	trace_pnlfs_free_blocks(sb, start, count);
+
+	/* Their free neighbours must be in the trees before they are */
+	if (!pnlfs_bgroup_load_range(sb, start, count))
+		goto lost;
+	if (pnlfs_fext_overlaps(sbi, start, count))
+		goto twice;
+	/* Only blocks free on disk can be given out again */
+	if (pnlfs_bitmap_set_range(sb, &sbi->bbitmap, start, count, true))
+		goto lost;
+
+	/* Blocks next to the window of the CPU go back to it */
+	win = raw_cpu_ptr(sbi->bwin);
+	spin_lock(&win->lock);
+	if (win->start < win->end) {
+		if (win->end == start) {
+			win->end += count;
+			done = true;
+		} else if (start + count == win->start) {
+			win->start = start;
+			done = true;
+		}
+	}
+	spin_unlock(&win->lock);
+
+	if (!done && !pnlfs_fext_free(sbi, start, count))
+		goto twice;
+
+	percpu_counter_add(&sbi->free_blocks, count);
+	pnlfs_commit_kick(sb);
+	return;
+
+lost:
+	pr_err("%s : blocks %u to %u are lost\n",
+	       __func__, start, start + count - 1);
+	return;
+twice:
+	pr_err("%s : blocks %u to %u are already free\n",
+	       __func__, start, start + count - 1);
+}
+
+/* Register a new block in the bitmap and return its index */
+int pnlfs_reserv_new_block(struct super_block *sb)
+{
+	u32 count = 1;
+
+	return pnlfs_new_blocks(sb, 0, &count);
+}
+
+/* Free the block bno in the bitmap */
+int pnlfs_free_block(struct super_block *sb, int bno)
+{
+	pnlfs_free_blocks(sb, bno, 1);
+	return 0;
+}
+
+/*
+ * Metadata is allocated without a reservation, delayed writes leave that
+ * much room for it.
+ */
+#define PNLFS_META_RESERVE 64
+
+/* Reserve count blocks for delayed allocation, without choosing them */
+int pnlfs_claim_blocks(struct super_block *sb, u32 count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	s64 free, dirty;
+
+	free = percpu_counter_read_positive(&sbi->free_blocks);
+	dirty = percpu_counter_read_positive(&sbi->dirty_blocks);
+
+	/* The per-CPU deltas only matter when the disk is nearly full */
+	if (free - dirty < count + PNLFS_META_RESERVE +
+	    4 * percpu_counter_batch * nr_cpu_ids) {
+		free = percpu_counter_sum_positive(&sbi->free_blocks);
+		dirty = percpu_counter_sum_positive(&sbi->dirty_blocks);
+		if (free - dirty < count + PNLFS_META_RESERVE)
+			return -ENOSPC;
+	}
+	percpu_counter_add(&sbi->dirty_blocks, count);
+	return 0;
+}
+
+void pnlfs_unclaim_blocks(struct super_block *sb, u32 count)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+
+	percpu_counter_sub(&sbi->dirty_blocks, count);
+}
+
+/*
+ * Inodes are not kept in extents, a window is a word of the bitmap with
+ * free inodes. Only one CPU works in a word, the others look for another
+ * one, iclaimed being the words in use. Bits are taken with
+ * test_and_clear_bit, so a CPU may still take an inode anywhere when all
+ * the words with free inodes are claimed. Full groups are skipped.
+ */
+#define PNLFS_WORDS_PER_GROUP(sb) (PNLFS_BITS_PER_GROUP(sb) / BITS_PER_LONG)
+
+static bool pnlfs_iwin_refill(struct super_block *sb,
+			      struct pnlfs_window *win)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_bitmap *bm = &sbi->ibitmap;
+	u32 nwords = BITS_TO_LONGS(sbi->nr_inodes), cursor, i, w, group;
+	unsigned long *words;
+
+	cursor = READ_ONCE(sbi->ialloc_cursor);
+	for (i = 0; i < nwords; i++) {
+		w = (cursor + i) % nwords;
+		group = w / PNLFS_WORDS_PER_GROUP(sb);
+		if (!pnlfs_bitmap_nr_free(sb, bm, group)) {
+			/* Go to the last word of the group */
+			i += min_t(u32, (group + 1) * PNLFS_WORDS_PER_GROUP(sb),
+				   nwords) - 1 - w;
+			continue;
+		}
+		words = (unsigned long *) bm->bh[group]->b_data;
+		if (!READ_ONCE(words[w % PNLFS_WORDS_PER_GROUP(sb)]))
+			continue;
+
+		spin_lock(&sbi->ialloc_lock);
+		if (test_bit(w, sbi->iclaimed)) {
+			spin_unlock(&sbi->ialloc_lock);
+			continue;
+		}
+		__set_bit(w, sbi->iclaimed);
+		sbi->ialloc_cursor = w + 1;
+
+		spin_lock(&win->lock);
+		if (win->end)
+			__clear_bit((win->end - 1) / BITS_PER_LONG,
+				    sbi->iclaimed);
+		win->start = w * BITS_PER_LONG;
+		win->end = min_t(u32, win->start + BITS_PER_LONG,
+				 sbi->nr_inodes);
+		spin_unlock(&win->lock);
+		spin_unlock(&sbi->ialloc_lock);
+		pnlfs_stat_add(sb, PNLFS_STAT_IALLOC_SCANNED, i + 1);
+		return true;
+	}
+	pnlfs_stat_add(sb, PNLFS_STAT_IALLOC_SCANNED, nwords);
+	return false;
+}
+
+/* Register a new inode in the bitmap and return its index */
+unsigned long pnlfs_reserv_new_inode(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_bitmap *bm = &sbi->ibitmap;
+	struct pnlfs_window *win;
+	unsigned long ino;
+	bool refilled = false;
+	u32 group, end, accessed = U32_MAX;
+
+	win = raw_cpu_ptr(sbi->iwin);
+retry:
+	spin_lock(&win->lock);
+	while (win->start < win->end) {
+		/* A window is one word, so it is in one group */
+		group = win->start / bm->group_bits;
+		/* The journal may sleep, it gets the group unlocked */
+		if (sbi->journal && group != accessed) {
+			spin_unlock(&win->lock);
+			if (pnlfs_bitmap_access(sb, bm, group))
+				return sbi->nr_inodes;
+			accessed = group;
+			goto retry;
+		}
+		ino = pnlfs_bitmap_find(bm, group, win->start, win->end);
+		win->start = min_t(unsigned long, ino + 1, win->end);
+		pnlfs_stat_inc(sb, PNLFS_STAT_IALLOC_SCANNED);
+		if (ino < win->end && pnlfs_bitmap_take(bm, ino)) {
+			spin_unlock(&win->lock);
+			goto found;
+		}
+	}
+	spin_unlock(&win->lock);
+
+	if (!refilled && pnlfs_iwin_refill(sb, win)) {
+		refilled = true;
+		goto retry;
+	}
+
+	/* Every word with free inodes is claimed, take one anyway */
+	for (group = 0; group < bm->nr_groups; group++) {
+		if (!pnlfs_bitmap_nr_free(sb, bm, group))
+			continue;
+		if (pnlfs_bitmap_access(sb, bm, group))
+			return sbi->nr_inodes;
+		end = min_t(u32, (group + 1) * bm->group_bits,
+			    sbi->nr_inodes);
+		for (ino = pnlfs_bitmap_find(bm, group,
+					     group * bm->group_bits, end);
+		     ino < end;
+		     ino = pnlfs_bitmap_find(bm, group, ino + 1, end)) {
+			pnlfs_stat_inc(sb, PNLFS_STAT_IALLOC_SCANNED);
+			if (pnlfs_bitmap_take(bm, ino))
+				goto found;
+		}
+	}
+	return sbi->nr_inodes;
+
+found:
+	pnlfs_bitmap_dirty(sb, bm, ino / bm->group_bits);
+	percpu_counter_dec(&sbi->free_inodes);
+	pnlfs_stat_inc(sb, PNLFS_STAT_IALLOC);
+	pnlfs_commit_kick(sb);
+	trace_pnlfs_alloc_ino(sb, ino);
+	return ino;
+}
+
+/* Free the inode bit at index ino in the bitmap */
+int pnlfs_free_inode(struct super_block *sb, unsigned long ino)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	int err;
+
+	trace_pnlfs_free_ino(sb, ino);
+	err = pnlfs_bitmap_set_range(sb, &sbi->ibitmap, ino, 1, true);
+	if (err)
+		return err;
+	percpu_counter_inc(&sbi->free_inodes);
+	pnlfs_commit_kick(sb);
+	return 0;
+}
+
+static void pnlfs_fext_destroy(struct pnlfs_sb_info *sbi)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&sbi->free_by_start)))
+		pnlfs_fext_del(sbi, rb_entry(n, struct pnlfs_free_ext,
+					     by_start));
+}
+
+static void pnlfs_window_init(struct pnlfs_window __percpu *wins)
+{
+	struct pnlfs_window *win;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		win = per_cpu_ptr(wins, cpu);
+		spin_lock_init(&win->lock);
+		win->start = win->end = 0;
+	}
+}
+
+/*
+ * Set up the bitmaps and the allocators. No group is read here, the free
+ * counts are the ones of the superblock.
+ */
+int pnlfs_balloc_init(struct super_block *sb, u32 free_blocks,
+		      u32 free_inodes)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	int err;
+
+	spin_lock_init(&sbi->balloc_lock);
+	spin_lock_init(&sbi->ialloc_lock);
+	sbi->free_by_start = RB_ROOT;
+	sbi->free_by_len = RB_ROOT;
+	sbi->balloc_cursor = 0;
+	sbi->bload_cursor = 0;
+	sbi->ialloc_cursor = 0;
+
+	err = pnlfs_bitmap_init(sb, &sbi->ibitmap, 1 + sbi->nr_istore_blocks,
+				sbi->nr_inodes, NULL);
+	if (err)
+		return err;
+	err = pnlfs_bitmap_init(sb, &sbi->bbitmap, 1 + sbi->nr_istore_blocks +
+				sbi->nr_ifree_blocks, sbi->nr_blocks,
+				pnlfs_bgroup_loaded);
+	if (err)
+		goto err_ibitmap;
+
+	err = -ENOMEM;
+	sbi->iclaimed = vzalloc(BITS_TO_LONGS(BITS_TO_LONGS(sbi->nr_inodes)) *
+				sizeof(unsigned long));
+	if (!sbi->iclaimed)
+		goto err_bbitmap;
+	sbi->bwin = alloc_percpu(struct pnlfs_window);
+	if (!sbi->bwin)
+		goto err_claimed;
+	sbi->iwin = alloc_percpu(struct pnlfs_window);
+	if (!sbi->iwin)
+		goto err_bwin;
+	pnlfs_window_init(sbi->bwin);
+	pnlfs_window_init(sbi->iwin);
+
+	err = percpu_counter_init(&sbi->free_blocks, free_blocks, GFP_KERNEL);
+	if (err)
+		goto err_iwin;
+	err = percpu_counter_init(&sbi->free_inodes, free_inodes, GFP_KERNEL);
+	if (err)
+		goto err_counter;
+	err = percpu_counter_init(&sbi->dirty_blocks, 0, GFP_KERNEL);
+	if (err)
+		goto err_icounter;
+	return 0;
+
+err_icounter:
+	percpu_counter_destroy(&sbi->free_inodes);
+err_counter:
+	percpu_counter_destroy(&sbi->free_blocks);
+err_iwin:
+	free_percpu(sbi->iwin);
+err_bwin:
+	free_percpu(sbi->bwin);
+err_claimed:
+	vfree(sbi->iclaimed);
+err_bbitmap:
+	pnlfs_bitmap_destroy(&sbi->bbitmap);
+err_ibitmap:
+	pnlfs_bitmap_destroy(&sbi->ibitmap);
+	return err;
+}
+
+void pnlfs_balloc_exit(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+
+	percpu_counter_destroy(&sbi->dirty_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+	percpu_counter_destroy(&sbi->free_blocks);
+	free_percpu(sbi->iwin);
+	free_percpu(sbi->bwin);
+	vfree(sbi->iclaimed);
+	pnlfs_fext_destroy(sbi);
+	pnlfs_bitmap_destroy(&sbi->bbitmap);
+	pnlfs_bitmap_destroy(&sbi->ibitmap);
+}
@@ -0,0 +1,255 @@
+#!/bin/bash
+# Benchmarks of pnlfs, run as root. The module needs the virtual machine
+# (see start.sh), pnlfs-fuse only libfuse 3; a missing one is skipped.
+#
+# usage: ./bench.sh [-o out.csv] [-f "kernel fuse"] [-b "4096 65536"]
+#                   [-i "4096 1048576"] [-w workloads] [-s image_size]
+#                   [-S file_size] [-F fsck_image_size] [-d direct_workloads]
+#                   [-t "1 4 16"] [-T "1 2 4 8"] [-a "1 4 16"]
+#
+# For each file system and block size an image is made by mkfs-pnlfs and
+# mounted over loop, or served by pnlfs-fuse. Each workload of pnlfs-bench
+# runs at each I/O size with cold caches, then warm. The file workloads run
+# again with O_DIRECT, "direct" in the cache column, at the I/O sizes that
+# are multiples of the block size: their throughput and system time per
+# byte compare with the buffered rows. copy and sendfile send the file to
+# a socket, by read() and write() or by sendfile(): the rows of an I/O
+# size compare the two. fsync then runs with each number of writers of
+# -t: when a journal commit carries the fsyncs of several writers, the
+# throughput grows with them while the latency of an fsync stays close.
+# create then makes CREATE_FILES empty files with each number of creators
+# of -T, each in its own directory: the files made per second show how
+# the inode and block allocators scale with the creators. pnlfs-extract
+# and fsck.pnlfs are timed on the image after it is unmounted, fsck.pnlfs
+# again at the end on a large image. Every run is a row of the CSV.
+#
+# An image of AGED_SIZE is then filled to 90 % by pnlfs-bench -w aged,
+# which times appends on it. appenders then writes APPEND_SIZE in records
+# of APPEND_IO bytes from each number of writers of -a, on a new image
+# each time. How fragmented the files of each image are, as counted by
+# fsck.pnlfs, goes to the -frag.csv next to the CSV; the allocator calls
+# of the module during appenders go to the -alloc.csv.
+
+cd "$(dirname "$0")" || exit 1
+
+OUT=bench.csv
+FS="kernel fuse"
+BLOCK_SIZES="4096 16384 65536"
+IO_SIZES="4096 65536 1048576"
+WORKLOADS="seqwrite seqread randread randwrite append overwrite smallcat \
+  copy sendfile"
+DIRECT_WORKLOADS="seqwrite seqread randread randwrite append overwrite"
+IMAGE_SIZE=8G
+FILE_SIZE=$((1 << 30))
+SMALL_FILES=2000
+FSYNC_THREADS="1 4 16"
+FSYNC_SIZE=$((64 << 20))
+CREATE_THREADS="1 2 4 8"
+CREATE_FILES=20000
+FSCK_SIZE=100G
+AGED_SIZE=2G
+AGED_FILE_SIZE=$((64 << 20))
+APPEND_THREADS="1 4 16"
+APPEND_IO=512
+APPEND_SIZE=$((256 << 20))
+
+IMG=/tmp/pnlfs-bench.img
+MNT=/tmp/pnlfs-bench.mnt
+DEST=/tmp/pnlfs-bench.out
+FUSE_PID=
+
+while getopts "o:f:b:i:w:s:S:F:d:t:T:a:" opt; do
+  case $opt in
+    o) OUT=$OPTARG ;;
+    f) FS=$OPTARG ;;
+    b) BLOCK_SIZES=$OPTARG ;;
+    i) IO_SIZES=$OPTARG ;;
+    w) WORKLOADS=$OPTARG ;;
+    s) IMAGE_SIZE=$OPTARG ;;
+    S) FILE_SIZE=$OPTARG ;;
+    F) FSCK_SIZE=$OPTARG ;;
+    d) DIRECT_WORKLOADS=$OPTARG ;;
+    t) FSYNC_THREADS=$OPTARG ;;
+    T) CREATE_THREADS=$OPTARG ;;
+    a) APPEND_THREADS=$OPTARG ;;
+    *) sed -n '5,8p' "$0" >&2; exit 1 ;;
+  esac
+done
+
+if [[ $EUID -ne 0 ]]; then
+  echo Mounting and dropping the caches need root
+  exit 1
+fi
+for tool in mkfs-pnlfs pnlfs-bench pnlfs-extract fsck.pnlfs; do
+  if [ ! -x $tool ]; then
+    echo $tool is missing, run make first
+    exit 1
+  fi
+done
+
+available() {
+  case $1 in
+    kernel) [[ `uname -r` == "4.9.83" && -f pnlfs.ko ]] ;;
+    fuse) [[ -x pnlfs-fuse && -e /dev/fuse ]] ;;
+    *) false ;;
+  esac
+}
+
+mount_fs() {
+  mkdir -p $MNT
+  if [ $1 = kernel ]; then
+    grep -q "^pnlfs " /proc/modules || insmod pnlfs.ko || return 1
+    mount -t pnlfs -o loop $IMG $MNT
+  else
+    ./pnlfs-fuse -f $IMG $MNT &
+    FUSE_PID=$!
+    for i in $(seq 50); do
+      mountpoint -q $MNT && return 0
+      sleep 0.1
+    done
+    return 1
+  fi
+}
+
+# pnlfs-fuse marks the image clean when it exits, wait for it
+umount_fs() {
+  mountpoint -q $MNT && umount $MNT
+  if [ -n "$FUSE_PID" ]; then
+    wait $FUSE_PID
+    FUSE_PID=
+  fi
+}
+trap umount_fs EXIT
+
+# bench label [pnlfs-bench options...]
+bench() {
+  local label=$1
+  shift
+  ./pnlfs-bench -l "$label" "$@" >> "$OUT" || echo "failed: $label $*" >&2
+}
+
+# frag label: data runs of the files of the unmounted image
+frag() {
+  ./fsck.pnlfs -f -n $IMG |
+    awk -v l="$1" '/files with data/ { print l "," $2 "," $7 "," $9 }' \
+    >> "$FRAG_OUT"
+}
+
+# counter name: a counter of the module for the image mounted on $MNT
+counter() {
+  local dev=$(basename "$(findmnt -n -o SOURCE $MNT)")
+  awk -v n=$1 '$1 == n { print $2 }' /sys/fs/pnlfs/$dev/stats
+}
+
+[ -s "$OUT" ] || ./pnlfs-bench -H fs,block_size,cache > "$OUT"
+FRAG_OUT=${OUT%.csv}-frag.csv
+[ -s "$FRAG_OUT" ] ||
+  echo fs,block_size,image,files,runs,fragmented > "$FRAG_OUT"
+ALLOC_OUT=${OUT%.csv}-alloc.csv
+[ -s "$ALLOC_OUT" ] ||
+  echo fs,block_size,threads,io_size,balloc_calls,balloc_blocks \
+  > "$ALLOC_OUT"
+
+for fs in $FS; do
+  if ! available $fs; then
+    echo Skipping $fs, not available here
+    continue
+  fi
+  for bs in $BLOCK_SIZES; do
+    if [[ $fs == kernel && $bs -gt `getconf PAGESIZE` ]]; then
+      echo Skipping $fs, block size $bs, the module needs it within a page
+      continue
+    fi
+    echo "$fs, block size $bs"
+    rm -f $IMG
+    ./mkfs-pnlfs -s $IMAGE_SIZE -b $bs $IMG > /dev/null || exit 1
+    mount_fs $fs || exit 1
+    for w in $WORKLOADS; do
+      for io in $IO_SIZES; do
+        bench "$fs,$bs,cold" -c -w $w -s $io -S $FILE_SIZE -n $SMALL_FILES $MNT
+        bench "$fs,$bs,warm" -w $w -s $io -S $FILE_SIZE -n $SMALL_FILES $MNT
+      done
+    done
+    for w in $DIRECT_WORKLOADS; do
+      for io in $IO_SIZES; do
+        [ $((io % bs)) -eq 0 ] || continue
+        bench "$fs,$bs,direct" -d -w $w -s $io -S $FILE_SIZE $MNT
+      done
+    done
+    for t in $FSYNC_THREADS; do
+      bench "$fs,$bs,warm" -w fsync -t $t -s 4096 -S $FSYNC_SIZE $MNT
+    done
+    for t in $CREATE_THREADS; do
+      bench "$fs,$bs,warm" -w create -t $t -n $CREATE_FILES $MNT
+    done
+    umount_fs
+
+    rm -rf $DEST && mkdir $DEST
+    bench "$fs,$bs,cold" -c -w exec -- ./pnlfs-extract $IMG $DEST
+    bench "$fs,$bs,cold" -c -w exec -- ./fsck.pnlfs -f -n $IMG
+    frag "$fs,$bs,workloads"
+    rm -rf $DEST
+  done
+done
+
+# Appends on a nearly full image, the free space in pieces
+for fs in $FS; do
+  available $fs || continue
+  echo "$fs, aged image of $AGED_SIZE"
+  rm -f $IMG
+  ./mkfs-pnlfs -s $AGED_SIZE $IMG > /dev/null || exit 1
+  mount_fs $fs || exit 1
+  for io in $IO_SIZES; do
+    bench "$fs,4096,warm" -w aged -p 90 -s $io -S $AGED_FILE_SIZE $MNT
+  done
+  umount_fs
+  frag "$fs,4096,aged"
+done
+
+# Small records appended by interleaved writers, each on a new image
+for fs in $FS; do
+  available $fs || continue
+  for t in $APPEND_THREADS; do
+    echo "$fs, $t appenders"
+    rm -f $IMG
+    ./mkfs-pnlfs -s $IMAGE_SIZE $IMG > /dev/null || exit 1
+    mount_fs $fs || exit 1
+    if [ $fs = kernel ]; then
+      calls=$(counter balloc_calls)
+      blocks=$(counter balloc_blocks)
+    fi
+    bench "$fs,4096,warm" -w appenders -t $t -s $APPEND_IO -S $APPEND_SIZE \
+      $MNT
+    if [ $fs = kernel ]; then
+      sync
+      calls=$(($(counter balloc_calls) - calls))
+      blocks=$(($(counter balloc_blocks) - blocks))
+      echo "$fs,4096,$t,$APPEND_IO,$calls,$blocks" >> "$ALLOC_OUT"
+    fi
+    umount_fs
+    frag "$fs,4096,appenders-$t"
+  done
+done
+
+# fsck.pnlfs on a large image, filled through the first file system there is
+for fs in $FS; do
+  available $fs || continue
+  echo "fsck.pnlfs on $FSCK_SIZE"
+  rm -f $IMG
+  ./mkfs-pnlfs -s $FSCK_SIZE $IMG > /dev/null || exit 1
+  mount_fs $fs || exit 1
+  # 8 GiB of data in files of 2 GiB, a file stays under 4 GiB
+  for i in 0 1 2 3; do
+    mkdir -p $MNT/big$i
+    ./pnlfs-bench -w seqread -s 1048576 -S $((2 << 30)) $MNT/big$i \
+      > /dev/null || exit 1
+  done
+  ./pnlfs-bench -w smallcat -s 4096 -n 100000 $MNT > /dev/null || exit 1
+  umount_fs
+  bench "$fs,4096,cold" -c -w exec -- ./fsck.pnlfs -f -n $IMG
+  break
+done
+
+rm -f $IMG
+rmdir $MNT 2>/dev/null
+echo Results in $OUT, $FRAG_OUT and $ALLOC_OUT
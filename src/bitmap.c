@@ -0,0 +1,215 @@
+#include "pnlfs.h"
+
+/*
+ * The free inode and free block bitmaps are used in place, in the buffer
+ * of each of their blocks, a group being the bits of one block. A group
+ * is read the first time something needs it, so the mount does not
+ * depend on the size of the disk. Bits are little endian on disk and are
+ * changed with the atomic _le bitops.
+ *
+ * nr_free[] counts the free bits of each group read, it lets the
+ * allocators skip full groups without looking at their bits. It is set
+ * before the buffer of the group is published in bh[].
+ *
+ * A group changed since it was last written has its bit set in dirty[],
+ * so a commit only looks at the groups that changed. With a journal the
+ * groups are journaled like the rest of the metadata instead.
+ */
+
+int pnlfs_bitmap_init(struct super_block *sb, struct pnlfs_bitmap *bm,
+		      u32 first, u32 nr_bits,
+		      void (*on_load)(struct super_block *, u32,
+				      struct buffer_head *))
+{
+	bm->first = first;
+	bm->nr_bits = nr_bits;
+	bm->group_bits = PNLFS_BITS_PER_GROUP(sb);
+	bm->nr_groups = DIV_ROUND_UP(nr_bits, bm->group_bits);
+	bm->on_load = on_load;
+	mutex_init(&bm->lock);
+
+	bm->bh = vzalloc(bm->nr_groups * sizeof(*bm->bh));
+	if (!bm->bh)
+		return -ENOMEM;
+	bm->nr_free = vzalloc(bm->nr_groups * sizeof(*bm->nr_free));
+	if (!bm->nr_free)
+		goto err_bh;
+	bm->dirty = vzalloc(BITS_TO_LONGS(bm->nr_groups) *
+			    sizeof(unsigned long));
+	if (!bm->dirty)
+		goto err_free;
+	return 0;
+
+err_free:
+	vfree(bm->nr_free);
+err_bh:
+	vfree(bm->bh);
+	return -ENOMEM;
+}
+
+void pnlfs_bitmap_destroy(struct pnlfs_bitmap *bm)
+{
+	u32 i;
+
+	for (i = 0; i < bm->nr_groups; i++)
+		brelse(bm->bh[i]);
+	vfree(bm->dirty);
+	vfree(bm->nr_free);
+	vfree(bm->bh);
+}
+
+/* Number of bits of group, the last one may be short */
+static u32 pnlfs_group_bits(struct pnlfs_bitmap *bm, u32 group)
+{
+	return min_t(u32, bm->nr_bits - group * bm->group_bits,
+		     bm->group_bits);
+}
+
+/* Buffer of group, read from disk if needed. NULL on I/O error */
+struct buffer_head *pnlfs_bitmap_load(struct super_block *sb,
+				      struct pnlfs_bitmap *bm, u32 group)
+{
+	struct buffer_head *bh;
+	u32 bits, nr_free, i;
+
+	bh = smp_load_acquire(&bm->bh[group]);
+	if (bh)
+		return bh;
+
+	mutex_lock(&bm->lock);
+	bh = bm->bh[group];
+	if (bh)
+		goto out;
+	bh = sb_bread(sb, bm->first + group);
+	if (!bh) {
+		pr_err("%s : cannot read bitmap block %u\n",
+		       __func__, bm->first + group);
+		goto out;
+	}
+
+	/* The byte order does not change the weight of whole words */
+	bits = pnlfs_group_bits(bm, group);
+	nr_free = bitmap_weight((unsigned long *) bh->b_data,
+				round_down(bits, BITS_PER_LONG));
+	for (i = round_down(bits, BITS_PER_LONG); i < bits; i++)
+		nr_free += test_bit_le(i, bh->b_data);
+	atomic_set(&bm->nr_free[group], nr_free);
+
+	if (bm->on_load)
+		bm->on_load(sb, group, bh);
+	smp_store_release(&bm->bh[group], bh);
+out:
+	mutex_unlock(&bm->lock);
+	return bh;
+}
+
+/* Free bits of group, 0 if it cannot be read */
+u32 pnlfs_bitmap_nr_free(struct super_block *sb, struct pnlfs_bitmap *bm,
+			 u32 group)
+{
+	if (!pnlfs_bitmap_load(sb, bm, group))
+		return 0;
+	return atomic_read(&bm->nr_free[group]);
+}
+
+/* First free bit of [start, end) in group, end if none */
+u32 pnlfs_bitmap_find(struct pnlfs_bitmap *bm, u32 group, u32 start, u32 end)
+{
+	u32 base = group * bm->group_bits;
+
+	return base + find_next_bit_le(bm->bh[group]->b_data, end - base,
+				       start - base);
+}
+
+/* Before bits of group change, the group must have been read */
+int pnlfs_bitmap_access(struct super_block *sb, struct pnlfs_bitmap *bm,
+			u32 group)
+{
+	return pnlfs_journal_access(sb, bm->bh[group]);
+}
+
+/* After they changed */
+void pnlfs_bitmap_dirty(struct super_block *sb, struct pnlfs_bitmap *bm,
+			u32 group)
+{
+	if (PNLFS_SB(sb)->journal) {
+		pnlfs_journal_dirty(sb, bm->bh[group]);
+		return;
+	}
+	mark_buffer_dirty(bm->bh[group]);
+	if (!test_bit(group, bm->dirty))
+		set_bit(group, bm->dirty);
+}
+
+/*
+ * Mark bit used, returns false if it already was. It may be called under
+ * a spinlock: the caller gives the group to pnlfs_bitmap_access() before
+ * and to pnlfs_bitmap_dirty() after.
+ */
+bool pnlfs_bitmap_take(struct pnlfs_bitmap *bm, u32 bit)
+{
+	u32 group = bit / bm->group_bits;
+	struct buffer_head *bh = bm->bh[group];
+
+	if (!test_and_clear_bit_le(bit % bm->group_bits, bh->b_data))
+		return false;
+	atomic_dec(&bm->nr_free[group]);
+	return true;
+}
+
+/*
+ * Mark count bits from start used or free. The groups are read if needed,
+ * returns -EIO if one cannot be.
+ */
+int pnlfs_bitmap_set_range(struct super_block *sb, struct pnlfs_bitmap *bm,
+			   u32 start, u32 count, bool free)
+{
+	struct buffer_head *bh;
+	u32 group, first, bit, end = start + count, n;
+	int err;
+
+	while (start < end) {
+		group = start / bm->group_bits;
+		first = start % bm->group_bits;
+		n = min(end - start, bm->group_bits - first);
+		bh = pnlfs_bitmap_load(sb, bm, group);
+		if (!bh)
+			return -EIO;
+		err = pnlfs_bitmap_access(sb, bm, group);
+		if (err)
+			return err;
+		for (bit = first; bit < first + n; bit++) {
+			if (free)
+				set_bit_le(bit, bh->b_data);
+			else
+				clear_bit_le(bit, bh->b_data);
+		}
+		atomic_add(free ? (int) n : -(int) n, &bm->nr_free[group]);
+		pnlfs_bitmap_dirty(sb, bm, group);
+		start += n;
+	}
+	return 0;
+}
+
+/*
+ * Write the groups changed since the last call, waiting for them if wait.
+ * Returns the number of groups written.
+ */
+u32 pnlfs_bitmap_sync(struct pnlfs_bitmap *bm, int wait)
+{
+	struct buffer_head *bh;
+	u32 group, n = 0;
+
+	for_each_set_bit(group, bm->dirty, bm->nr_groups) {
+		/* A change after this point sets the bit again */
+		if (!test_and_clear_bit(group, bm->dirty))
+			continue;
+		bh = bm->bh[group];
+		if (wait)
+			sync_dirty_buffer(bh);
+		else
+			write_dirty_buffer(bh, 0);
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,417 @@
+#include "pnlfs.h"
+
+/*
+ * Names of a directory, kept in memory once the directory has been read.
+ * The table always holds every name of the directory, so a miss is an
+ * answer too and looking for a missing name does not read any block.
+ *
+ * Readers only take rcu_read_lock. Changes are made under dcache_lock of
+ * the directory, and the whole table is freed after a grace period when
+ * the directory goes away or when the shrinker takes it back.
+ */
+struct pnlfs_dcache {
+	struct rcu_head rcu;
+	unsigned int bits;              /* log2 of the number of buckets */
+	unsigned int nr;                /* Number of names */
+	bool referenced;                /* Used since the last shrinker pass */
+	DECLARE_BITMAP(used, PNLFS_MAX_DIR_ENTRIES); /* Slots of the old format */
+	struct hlist_head buckets[];
+};
+
+struct pnlfs_dcache_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	unsigned long ino;
+	u32 hash;
+	int slot;                       /* -1 in a hashed directory */
+	u8 len;
+	char name[];
+};
+
+/* Directories with a table, oldest first */
+static LIST_HEAD(pnlfs_dcache_lru);
+static DEFINE_SPINLOCK(pnlfs_dcache_lru_lock);
+
+/* Number of names in all the tables */
+static atomic_long_t pnlfs_dcache_nr;
+
+static struct pnlfs_dcache *pnlfs_dcache_alloc(unsigned int nr)
+{
+	struct pnlfs_dcache *dc;
+	unsigned int bits;
+
+	bits = ilog2(roundup_pow_of_two(max_t(unsigned int, nr, 16)));
+	dc = kzalloc(sizeof(*dc) + (sizeof(struct hlist_head) << bits),
+		     GFP_NOFS);
+	if (dc)
+		dc->bits = bits;
+	return dc;
+}
+
+static void pnlfs_dcache_free(struct pnlfs_dcache *dc)
+{
+	struct pnlfs_dcache_entry *e;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < (1 << dc->bits); i++)
+		hlist_for_each_entry_safe(e, n, &dc->buckets[i], node)
+			kfree(e);
+	kfree(dc);
+}
+
+static void pnlfs_dcache_free_rcu(struct rcu_head *head)
+{
+	pnlfs_dcache_free(container_of(head, struct pnlfs_dcache, rcu));
+}
+
+static struct pnlfs_dcache_entry *pnlfs_dcache_new_entry
+(const char *name, int len, unsigned long ino, int slot)
+{
+	struct pnlfs_dcache_entry *e;
+
+	e = kmalloc(sizeof(*e) + len, GFP_NOFS);
+	if (!e)
+		return NULL;
+	e->ino = ino;
+	e->hash = pnlfs_dirhash(name, len);
+	e->slot = slot;
+	e->len = len;
+	memcpy(e->name, name, len);
+	return e;
+}
+
+static inline struct hlist_head *pnlfs_dcache_bucket
+(struct pnlfs_dcache *dc, u32 hash)
+{
+	return &dc->buckets[hash & ((1 << dc->bits) - 1)];
+}
+
+static void pnlfs_dcache_link(struct pnlfs_dcache *dc,
+			      struct pnlfs_dcache_entry *e)
+{
+	hlist_add_head_rcu(&e->node, pnlfs_dcache_bucket(dc, e->hash));
+	if (e->slot >= 0)
+		__set_bit(e->slot, dc->used);
+	dc->nr++;
+}
+
+static struct pnlfs_dcache_entry *pnlfs_dcache_find
+(struct pnlfs_dcache *dc, const char *name, int len)
+{
+	struct pnlfs_dcache_entry *e;
+	u32 hash = pnlfs_dirhash(name, len);
+
+	hlist_for_each_entry_rcu(e, pnlfs_dcache_bucket(dc, hash), node)
+		if (e->hash == hash && e->len == len &&
+		    !memcmp(e->name, name, len))
+			return e;
+	return NULL;
+}
+
+/* Unpublish the table, the caller holds dcache_lock and took it off the lru */
+static void pnlfs_dcache_release(struct pnlfs_inode_info *info)
+{
+	struct pnlfs_dcache *dc;
+
+	dc = rcu_dereference_protected(info->dcache,
+				       lockdep_is_held(&info->dcache_lock));
+	RCU_INIT_POINTER(info->dcache, NULL);
+	atomic_long_sub(dc->nr, &pnlfs_dcache_nr);
+	call_rcu(&dc->rcu, pnlfs_dcache_free_rcu);
+}
+
+static void pnlfs_dcache_detach(struct pnlfs_inode_info *info)
+{
+	if (!rcu_access_pointer(info->dcache))
+		return;
+	spin_lock(&pnlfs_dcache_lru_lock);
+	list_del_init(&info->dcache_lru);
+	spin_unlock(&pnlfs_dcache_lru_lock);
+	pnlfs_dcache_release(info);
+}
+
+/* Forget the names of a directory */
+void pnlfs_dcache_drop(struct inode *dir)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(dir);
+
+	if (!rcu_access_pointer(info->dcache))
+		return;
+	spin_lock(&info->dcache_lock);
+	pnlfs_dcache_detach(info);
+	spin_unlock(&info->dcache_lock);
+}
+
+struct pnlfs_dcache_fill {
+	struct dir_context ctx;
+	struct pnlfs_dcache *dc;
+};
+
+static int pnlfs_dcache_filldir(struct dir_context *ctx, const char *name,
+				int len, loff_t pos, u64 ino, unsigned int type)
+{
+	struct pnlfs_dcache_fill *fill;
+	struct pnlfs_dcache_entry *e;
+
+	fill = container_of(ctx, struct pnlfs_dcache_fill, ctx);
+	e = pnlfs_dcache_new_entry(name, len, ino, -1);
+	if (!e)
+		return -ENOMEM;
+	pnlfs_dcache_link(fill->dc, e);
+	return 0;
+}
+
+/* Read every name of the directory */
+static struct pnlfs_dcache *pnlfs_dcache_build(struct inode *dir)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(dir);
+	struct pnlfs_dcache_fill fill = {
+		.ctx.actor = pnlfs_dcache_filldir,
+		.ctx.pos = 2,
+	};
+	struct pnlfs_dcache_entry *e;
+	struct pnlfs_dir_block *dblk;
+	struct buffer_head *bh;
+	struct pnlfs_file *files;
+	int i, err = 0;
+
+	fill.dc = pnlfs_dcache_alloc(info->nr_entries);
+	if (!fill.dc)
+		return ERR_PTR(-ENOMEM);
+
+	if (info->flags & PNLFS_INODE_HTREE) {
+		err = pnlfs_dx_iterate(dir, &fill.ctx);
+		/* The walk stops early when a name could not be added */
+		if (!err && fill.ctx.pos != PNLFS_DX_POS_END)
+			err = -ENOMEM;
+		goto out;
+	}
+
+	bh = sb_bread(dir->i_sb, info->index_block);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	dblk = (struct pnlfs_dir_block *) bh->b_data;
+	files = dblk->files;
+	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+		if (!files[i].inode)
+			continue;
+		e = pnlfs_dcache_new_entry(files[i].filename,
+			strnlen(files[i].filename, PNLFS_FILENAME_LEN),
+			le32_to_cpu(files[i].inode), i);
+		if (!e) {
+			err = -ENOMEM;
+			break;
+		}
+		pnlfs_dcache_link(fill.dc, e);
+	}
+	brelse(bh);
+out:
+	if (err) {
+		pnlfs_dcache_free(fill.dc);
+		return ERR_PTR(err);
+	}
+	return fill.dc;
+}
+
+static void pnlfs_dcache_install(struct inode *dir, struct pnlfs_dcache *dc)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(dir);
+
+	spin_lock(&info->dcache_lock);
+	if (rcu_access_pointer(info->dcache)) {
+		/* Another lookup was faster */
+		spin_unlock(&info->dcache_lock);
+		pnlfs_dcache_free(dc);
+		return;
+	}
+	rcu_assign_pointer(info->dcache, dc);
+	atomic_long_add(dc->nr, &pnlfs_dcache_nr);
+	spin_lock(&pnlfs_dcache_lru_lock);
+	list_add_tail(&info->dcache_lru, &pnlfs_dcache_lru);
+	spin_unlock(&pnlfs_dcache_lru_lock);
+	spin_unlock(&info->dcache_lock);
+}
+
+static int __pnlfs_dcache_lookup(struct inode *dir, const char *name, int len,
+				 unsigned long *ino, int *slot)
+{
+	struct pnlfs_dcache_entry *e;
+	struct pnlfs_dcache *dc;
+	int err = 0;
+
+	rcu_read_lock();
+	dc = rcu_dereference(PNLFS_I(dir)->dcache);
+	if (!dc) {
+		err = -ENODATA;
+		goto out;
+	}
+	if (!READ_ONCE(dc->referenced))
+		WRITE_ONCE(dc->referenced, true);
+	e = pnlfs_dcache_find(dc, name, len);
+	*ino = e ? e->ino : 0;
+	if (slot)
+		*slot = e ? e->slot : -1;
+out:
+	rcu_read_unlock();
+	return err;
+}
+
+/*
+ * Look for a name in memory, reading the directory the first time.
+ * Returns 0 with *ino set to 0 when the name does not exist, or an error
+ * when the caller has to search the blocks itself.
+ */
+int pnlfs_dcache_lookup(struct inode *dir, const char *name, int len,
+			unsigned long *ino, int *slot)
+{
+	struct pnlfs_dcache *dc;
+
+	if (!__pnlfs_dcache_lookup(dir, name, len, ino, slot))
+		return 0;
+
+	dc = pnlfs_dcache_build(dir);
+	if (IS_ERR(dc))
+		return PTR_ERR(dc);
+	pnlfs_dcache_install(dir, dc);
+
+	return __pnlfs_dcache_lookup(dir, name, len, ino, slot);
+}
+
+/* First free slot of an old format directory, -1 if unknown */
+int pnlfs_dcache_free_slot(struct inode *dir)
+{
+	struct pnlfs_dcache *dc;
+	int slot = -1;
+
+	rcu_read_lock();
+	dc = rcu_dereference(PNLFS_I(dir)->dcache);
+	if (dc) {
+		slot = find_first_zero_bit(dc->used, PNLFS_MAX_DIR_ENTRIES);
+		if (slot == PNLFS_MAX_DIR_ENTRIES)
+			slot = -1;
+	}
+	rcu_read_unlock();
+	return slot;
+}
+
+/* A name was added to the directory */
+void pnlfs_dcache_insert(struct inode *dir, const char *name, int len,
+			 unsigned long ino, int slot)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(dir);
+	struct pnlfs_dcache_entry *e;
+	struct pnlfs_dcache *dc;
+
+	if (!rcu_access_pointer(info->dcache))
+		return;
+
+	e = pnlfs_dcache_new_entry(name, len, ino, slot);
+	spin_lock(&info->dcache_lock);
+	dc = rcu_dereference_protected(info->dcache,
+				       lockdep_is_held(&info->dcache_lock));
+	if (!dc) {
+		kfree(e);
+	} else if (!e || dc->nr >= (2U << dc->bits)) {
+		/* Better no table than a wrong one, or a too small one */
+		kfree(e);
+		pnlfs_dcache_detach(info);
+	} else {
+		pnlfs_dcache_link(dc, e);
+		atomic_long_inc(&pnlfs_dcache_nr);
+	}
+	spin_unlock(&info->dcache_lock);
+}
+
+/* A name was removed from the directory */
+void pnlfs_dcache_remove(struct inode *dir, const char *name, int len)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(dir);
+	struct pnlfs_dcache_entry *e;
+	struct pnlfs_dcache *dc;
+
+	if (!rcu_access_pointer(info->dcache))
+		return;
+
+	spin_lock(&info->dcache_lock);
+	dc = rcu_dereference_protected(info->dcache,
+				       lockdep_is_held(&info->dcache_lock));
+	if (dc) {
+		e = pnlfs_dcache_find(dc, name, len);
+		if (e) {
+			hlist_del_rcu(&e->node);
+			if (e->slot >= 0)
+				__clear_bit(e->slot, dc->used);
+			dc->nr--;
+			atomic_long_dec(&pnlfs_dcache_nr);
+			kfree_rcu(e, rcu);
+		} else {
+			pnlfs_dcache_detach(info);
+		}
+	}
+	spin_unlock(&info->dcache_lock);
+}
+
+static unsigned long pnlfs_dcache_count(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	return atomic_long_read(&pnlfs_dcache_nr);
+}
+
+/*
+ * Free whole tables, oldest first. A table used since the last pass gets
+ * a second chance at the end of the list. The lock order is dcache_lock
+ * then the lru lock, so the directory lock is only tried here.
+ */
+static unsigned long pnlfs_dcache_scan(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct pnlfs_inode_info *info;
+	struct pnlfs_dcache *dc;
+	unsigned long freed = 0, scanned = 0;
+
+	spin_lock(&pnlfs_dcache_lru_lock);
+	while (scanned++ < sc->nr_to_scan && freed < sc->nr_to_scan &&
+	       !list_empty(&pnlfs_dcache_lru)) {
+		info = list_first_entry(&pnlfs_dcache_lru,
+					struct pnlfs_inode_info, dcache_lru);
+		if (!spin_trylock(&info->dcache_lock)) {
+			list_move_tail(&info->dcache_lru, &pnlfs_dcache_lru);
+			continue;
+		}
+		dc = rcu_dereference_protected(info->dcache,
+				lockdep_is_held(&info->dcache_lock));
+		if (dc->referenced) {
+			dc->referenced = false;
+			list_move_tail(&info->dcache_lru, &pnlfs_dcache_lru);
+		} else {
+			list_del_init(&info->dcache_lru);
+			freed += dc->nr;
+			pnlfs_dcache_release(info);
+		}
+		spin_unlock(&info->dcache_lock);
+	}
+	spin_unlock(&pnlfs_dcache_lru_lock);
+
+	return freed;
+}
+
+static struct shrinker pnlfs_dcache_shrinker = {
+	.count_objects = pnlfs_dcache_count,
+	.scan_objects = pnlfs_dcache_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int pnlfs_dcache_init(void)
+{
+	return register_shrinker(&pnlfs_dcache_shrinker);
+}
+
+void pnlfs_dcache_exit(void)
+{
+	unregister_shrinker(&pnlfs_dcache_shrinker);
+	/* Wait for the tables still in flight */
+	rcu_barrier();
+}
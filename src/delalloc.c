@@ -0,0 +1,211 @@
+#include "pnlfs.h"
+
+/*
+ * Delayed allocation for the files mapped with an extent tree. write()
+ * only reserves space: the buffer is mapped to a fake block with BH_Delay
+ * set. The blocks are chosen at writeback, each run of delayed blocks
+ * being allocated in one call, so a file gets contiguous blocks whatever
+ * the other writers do. A file removed before writeback never touches
+ * the bitmap.
+ *
+ * The delayed blocks of an inode are kept as sorted ranges in da_ranges,
+ * under da_lock. Being in a range is what makes a block reserved.
+ */
+struct pnlfs_da_range {
+	struct list_head list;
+	u32 start;
+	u32 len;
+};
+
+/* Block number of delayed buffers, it is never read nor written */
+#define PNLFS_DA_FAKE_BLOCK ((sector_t) ~0ULL)
+
+/* Make iblock delayed, returns 0 if it already was */
+static int pnlfs_da_add(struct inode *inode, u32 iblock)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(inode);
+	struct pnlfs_da_range *r, *prev = NULL, *next = NULL, *new;
+	int ret = 1;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+
+	spin_lock(&info->da_lock);
+	/* Appends hit the last range, look from the end */
+	list_for_each_entry_reverse(r, &info->da_ranges, list) {
+		if (r->start <= iblock) {
+			prev = r;
+			break;
+		}
+		next = r;
+	}
+	if (prev && iblock < prev->start + prev->len) {
+		ret = 0;
+		goto out;
+	}
+
+	if (prev && prev->start + prev->len == iblock) {
+		prev->len++;
+		if (next && iblock + 1 == next->start) {
+			prev->len += next->len;
+			list_del(&next->list);
+			kfree(next);
+		}
+	} else if (next && iblock + 1 == next->start) {
+		next->start--;
+		next->len++;
+	} else if (new) {
+		new->start = iblock;
+		new->len = 1;
+		list_add(&new->list, prev ? &prev->list : &info->da_ranges);
+		new = NULL;
+	} else {
+		ret = -ENOMEM;
+		goto out;
+	}
+	info->da_reserved++;
+out:
+	spin_unlock(&info->da_lock);
+	kfree(new);
+	return ret;
+}
+
+/* Forget the delayed blocks in [iblock, iblock + len), returns how many */
+static u32 pnlfs_da_remove(struct inode *inode, u32 iblock, u32 len)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(inode);
+	struct pnlfs_da_range *r, *n, *tail;
+	u32 end = iblock + len, a, b, removed = 0;
+
+	/* Removing the middle of a range splits it in two */
+	tail = kmalloc(sizeof(*tail), GFP_NOFS | __GFP_NOFAIL);
+
+	spin_lock(&info->da_lock);
+	list_for_each_entry_safe(r, n, &info->da_ranges, list) {
+		if (r->start >= end)
+			break;
+		if (r->start + r->len <= iblock)
+			continue;
+		a = max(r->start, iblock);
+		b = min(r->start + r->len, end);
+		removed += b - a;
+		if (a == r->start && b == r->start + r->len) {
+			list_del(&r->list);
+			kfree(r);
+		} else if (a == r->start) {
+			r->len -= b - a;
+			r->start = b;
+		} else if (b == r->start + r->len) {
+			r->len = a - r->start;
+		} else {
+			tail->start = b;
+			tail->len = r->start + r->len - b;
+			r->len = a - r->start;
+			list_add(&tail->list, &r->list);
+			tail = NULL;
+			break;
+		}
+	}
+	info->da_reserved -= removed;
+	spin_unlock(&info->da_lock);
+
+	kfree(tail);
+	return removed;
+}
+
+/* Number of delayed blocks from iblock, at most max */
+u32 pnlfs_da_run(struct inode *inode, u32 iblock, u32 max)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(inode);
+	struct pnlfs_da_range *r;
+	u32 run = 0;
+
+	spin_lock(&info->da_lock);
+	list_for_each_entry(r, &info->da_ranges, list) {
+		if (r->start > iblock)
+			break;
+		if (iblock < r->start + r->len) {
+			run = min(r->start + r->len - iblock, max);
+			break;
+		}
+	}
+	spin_unlock(&info->da_lock);
+	return run;
+}
+
+/*
+ * Blocks of [iblock, iblock + len) are no longer delayed: they were
+ * allocated, or thrown away with their page. Release their reservation.
+ */
+void pnlfs_da_unreserve(struct inode *inode, u32 iblock, u32 len)
+{
+	u32 n = pnlfs_da_remove(inode, iblock, len);
+
+	if (n)
+		pnlfs_unclaim_blocks(inode->i_sb, n);
+}
+
+/*
+ * get_block of write_begin: blocks already on disk are mapped, holes are
+ * only reserved and left to writeback. An unwritten block needs no
+ * reservation, it is new (the rest of the block reads as zeroes) and
+ * delayed too: writeback only calls get_block with create set for
+ * unmapped or delayed buffers, and it must map the block for the write
+ * which marks it written (pnlfs_end_buffer_write).
+ */
+int pnlfs_da_get_block_prep(struct inode *inode, sector_t iblock,
+			    struct buffer_head *bh_result, int create)
+{
+	int ret;
+
+	ret = pnlfs_get_block(inode, iblock, bh_result, 0);
+	if (ret || buffer_mapped(bh_result))
+		return ret;
+	if (buffer_unwritten(bh_result)) {
+		map_bh(bh_result, inode->i_sb, bh_result->b_blocknr);
+		set_buffer_new(bh_result);
+		set_buffer_delay(bh_result);
+		return 0;
+	}
+
+	ret = pnlfs_claim_blocks(inode->i_sb, 1);
+	if (ret)
+		return ret;
+	ret = pnlfs_da_add(inode, iblock);
+	if (ret <= 0) {
+		pnlfs_unclaim_blocks(inode->i_sb, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	map_bh(bh_result, inode->i_sb, PNLFS_DA_FAKE_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/* Delayed blocks of the part of the page going away lose their reservation */
+void pnlfs_da_invalidatepage(struct page *page, unsigned int offset,
+			     unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head, *bh;
+	unsigned int curr = 0, stop = offset + length;
+	sector_t iblock;
+
+	if (!page_has_buffers(page))
+		goto out;
+
+	head = bh = page_buffers(page);
+	iblock = (sector_t) page->index << (PAGE_SHIFT - inode->i_blkbits);
+	do {
+		if (curr + bh->b_size > stop)
+			break;
+		if (curr >= offset && buffer_delay(bh))
+			pnlfs_da_unreserve(inode, iblock, 1);
+		curr += bh->b_size;
+		iblock++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+out:
+	block_invalidatepage(page, offset, length);
+}
@@ -0,0 +1,801 @@
+#include "pnlfs.h"
+#include <linux/sort.h>
+
+/* One index node for each level, from the root (level 0) down */
+struct pnlfs_dx_path {
+	struct buffer_head *bh;
+	struct pnlfs_dx_header *hdr;
+	int pos;
+};
+
+/* A name of a leaf, used to split the leaf and to read it in hash order */
+struct pnlfs_dx_map {
+	u32 hash;
+	u16 offs;
+	u16 size;
+};
+
+static inline struct pnlfs_dx_entry *DX_ENTRIES(struct pnlfs_dx_header *dh)
+{
+	return (struct pnlfs_dx_entry *) (dh + 1);
+}
+
+static inline struct pnlfs_dir_entry *DE_AT(struct buffer_head *bh, int offs)
+{
+	return (struct pnlfs_dir_entry *) (bh->b_data + offs);
+}
+
+static inline unsigned char pnlfs_dt_type(umode_t mode)
+{
+	return (mode & S_IFMT) >> 12;
+}
+
+static void pnlfs_dx_init_header(struct super_block *sb,
+				 struct pnlfs_dx_header *dh)
+{
+	dh->dx_magic = cpu_to_le16(PNLFS_DX_MAGIC);
+	dh->dx_count = 0;
+	dh->dx_limit = cpu_to_le16(PNLFS_DX_LIMIT(sb->s_blocksize));
+	dh->dx_levels = 0;
+	dh->dx_reserved = 0;
+}
+
+/* Set up an empty hashed directory in its index block */
+void pnlfs_dx_init_root(struct super_block *sb, struct buffer_head *bh)
+{
+	memset(bh->b_data, 0, bh->b_size);
+	pnlfs_dx_init_header(sb, (struct pnlfs_dx_header *) bh->b_data);
+	pnlfs_journal_dirty(sb, bh);
+}
+
+/* An empty leaf is a single unused record over the whole block */
+static void pnlfs_dx_init_leaf(struct super_block *sb, struct buffer_head *bh)
+{
+	struct pnlfs_dir_entry *de = DE_AT(bh, 0);
+
+	memset(bh->b_data, 0, bh->b_size);
+	pnlfs_set_rec_len(de, bh->b_size);
+	pnlfs_journal_dirty(sb, bh);
+}
+
+static void pnlfs_dx_put_path(struct pnlfs_dx_path *path, int levels)
+{
+	int i;
+
+	for (i = 0; i <= levels; i++) {
+		brelse(path[i].bh);
+		path[i].bh = NULL;
+	}
+}
+
+static int pnlfs_dx_check(struct inode *dir, struct pnlfs_dx_header *dh)
+{
+	u32 limit = PNLFS_DX_LIMIT(dir->i_sb->s_blocksize);
+
+	if (le16_to_cpu(dh->dx_magic) == PNLFS_DX_MAGIC &&
+	    le16_to_cpu(dh->dx_limit) == limit &&
+	    le16_to_cpu(dh->dx_count) <= limit &&
+	    le16_to_cpu(dh->dx_levels) <= PNLFS_DX_MAX_LEVELS)
+		return 0;
+
+	pr_err("%s : corrupted index in directory %lu\n",
+	       __func__, dir->i_ino);
+	return -EIO;
+}
+
+/* Check that the records of a leaf chain up to the end of the block */
+static int pnlfs_dx_check_leaf(struct inode *dir, struct buffer_head *bh)
+{
+	struct pnlfs_dir_entry *de;
+	int offs = 0, rec_len;
+
+	while (offs < bh->b_size) {
+		de = DE_AT(bh, offs);
+		rec_len = pnlfs_rec_len(de);
+		if (rec_len < PNLFS_DIR_REC_LEN(0) || rec_len & 3 ||
+		    offs + rec_len > bh->b_size ||
+		    (de->inode && PNLFS_DIR_REC_LEN(de->name_len) > rec_len))
+			goto corrupted;
+		offs += rec_len;
+	}
+	return 0;
+
+corrupted:
+	pr_err("%s : corrupted block %llu in directory %lu\n", __func__,
+	       (unsigned long long) bh->b_blocknr, dir->i_ino);
+	return -EIO;
+}
+
+/* Child of the node covering hash, the first one covers every lower hash */
+static int pnlfs_dx_search(struct pnlfs_dx_header *dh, u32 hash)
+{
+	struct pnlfs_dx_entry *entries = DX_ENTRIES(dh);
+	int l = 1, r = le16_to_cpu(dh->dx_count) - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (le32_to_cpu(entries[m].hash) <= hash)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+	return l - 1;
+}
+
+/*
+ * Walk the index from the root down to the leaf covering hash. Returns
+ * the number of levels under the root, the leaf being the entry at
+ * path[levels].pos. An empty root has no leaf at all.
+ */
+static int pnlfs_dx_find(struct inode *dir, u32 hash,
+			 struct pnlfs_dx_path *path)
+{
+	struct pnlfs_dx_header *dh;
+	struct buffer_head *bh;
+	u32 bno = PNLFS_I(dir)->index_block;
+	int level = 0, levels = 0, err;
+
+	memset(path, 0, sizeof(*path) * (PNLFS_DX_MAX_LEVELS + 1));
+	for (;;) {
+		bh = sb_bread(dir->i_sb, bno);
+		if (!bh) {
+			err = -EIO;
+			goto err;
+		}
+		dh = (struct pnlfs_dx_header *) bh->b_data;
+		path[level].bh = bh;
+		path[level].hdr = dh;
+
+		err = pnlfs_dx_check(dir, dh);
+		if (err)
+			goto err;
+		if (!level)
+			levels = le16_to_cpu(dh->dx_levels);
+		if (!dh->dx_count) {
+			if (!level)
+				return levels;
+			pr_err("%s : empty index node in directory %lu\n",
+			       __func__, dir->i_ino);
+			err = -EIO;
+			goto err;
+		}
+
+		path[level].pos = pnlfs_dx_search(dh, hash);
+		if (level == levels)
+			return levels;
+		bno = le32_to_cpu(DX_ENTRIES(dh)[path[level].pos].block);
+		level++;
+	}
+err:
+	pnlfs_dx_put_path(path, level);
+	return err;
+}
+
+/* Lowest hash of the leaf after the one of the path, past U32_MAX if none */
+static u64 pnlfs_dx_next_hash(struct pnlfs_dx_path *path, int levels)
+{
+	struct pnlfs_dx_header *dh;
+	int level;
+
+	for (level = levels; level >= 0; level--) {
+		dh = path[level].hdr;
+		if (path[level].pos + 1 < le16_to_cpu(dh->dx_count))
+			return le32_to_cpu(DX_ENTRIES(dh)[path[level].pos + 1].hash);
+	}
+	return (u64) U32_MAX + 1;
+}
+
+/* Read the leaf of the path */
+static struct buffer_head *pnlfs_dx_read_leaf(struct inode *dir,
+					      struct pnlfs_dx_path *path,
+					      int levels)
+{
+	struct pnlfs_dx_header *dh = path[levels].hdr;
+	struct buffer_head *bh;
+	int err;
+
+	bh = sb_bread(dir->i_sb,
+		      le32_to_cpu(DX_ENTRIES(dh)[path[levels].pos].block));
+	if (!bh)
+		return ERR_PTR(-EIO);
+	err = pnlfs_dx_check_leaf(dir, bh);
+	if (err) {
+		brelse(bh);
+		return ERR_PTR(err);
+	}
+	return bh;
+}
+
+/* Record of name in the leaf, NULL if it is not there */
+static struct pnlfs_dir_entry *pnlfs_dx_leaf_find(struct buffer_head *bh,
+						  const char *name, int len,
+						  struct pnlfs_dir_entry **prev)
+{
+	struct pnlfs_dir_entry *de, *p = NULL;
+	int offs = 0;
+
+	while (offs < bh->b_size) {
+		de = DE_AT(bh, offs);
+		if (de->inode && de->name_len == len &&
+		    !memcmp(de->name, name, len)) {
+			if (prev)
+				*prev = p;
+			return de;
+		}
+		p = de;
+		offs += pnlfs_rec_len(de);
+	}
+	return NULL;
+}
+
+/* Put a new record in the leaf if there is room left */
+static int pnlfs_dx_leaf_add(struct buffer_head *bh, const char *name,
+			     int len, unsigned long ino, umode_t mode)
+{
+	struct pnlfs_dir_entry *de;
+	int offs = 0, rec_len, used, need = PNLFS_DIR_REC_LEN(len);
+
+	while (offs < bh->b_size) {
+		de = DE_AT(bh, offs);
+		rec_len = pnlfs_rec_len(de);
+		used = de->inode ? PNLFS_DIR_REC_LEN(de->name_len) : 0;
+		if (rec_len - used >= need) {
+			/* Cut the free space at the end of that record */
+			if (used) {
+				pnlfs_set_rec_len(de, used);
+				de = DE_AT(bh, offs + used);
+				pnlfs_set_rec_len(de, rec_len - used);
+			}
+			de->inode = cpu_to_le32(ino);
+			de->name_len = len;
+			de->file_type = pnlfs_dt_type(mode);
+			memcpy(de->name, name, len);
+			return 0;
+		}
+		offs += rec_len;
+	}
+	return -ENOSPC;
+}
+
+static int pnlfs_dx_map_cmp(const void *a, const void *b)
+{
+	const struct pnlfs_dx_map *ma = a, *mb = b;
+
+	if (ma->hash != mb->hash)
+		return ma->hash < mb->hash ? -1 : 1;
+	/* Names of the same hash keep their order, it gives their rank */
+	return ma->offs < mb->offs ? -1 : ma->offs > mb->offs;
+}
+
+/* List the names of a leaf with a hash of at least from, in hash order */
+static int pnlfs_dx_leaf_map(struct buffer_head *bh, u32 from,
+			     struct pnlfs_dx_map *map)
+{
+	struct pnlfs_dir_entry *de;
+	int offs = 0, n = 0;
+	u32 hash;
+
+	while (offs < bh->b_size) {
+		de = DE_AT(bh, offs);
+		if (de->inode) {
+			hash = pnlfs_dirhash(de->name, de->name_len);
+			if (hash >= from) {
+				map[n].hash = hash;
+				map[n].offs = offs;
+				map[n].size = PNLFS_DIR_REC_LEN(de->name_len);
+				n++;
+			}
+		}
+		offs += pnlfs_rec_len(de);
+	}
+	sort(map, n, sizeof(*map), pnlfs_dx_map_cmp, NULL);
+	return n;
+}
+
+/* Write the records of map packed at the start of the leaf */
+static void pnlfs_dx_leaf_fill(struct super_block *sb, struct buffer_head *bh,
+			       const char *from, struct pnlfs_dx_map *map, int n)
+{
+	struct pnlfs_dir_entry *de = NULL;
+	int i, offs = 0;
+
+	memset(bh->b_data, 0, bh->b_size);
+	for (i = 0; i < n; i++) {
+		de = DE_AT(bh, offs);
+		memcpy(de, from + map[i].offs, map[i].size);
+		pnlfs_set_rec_len(de, map[i].size);
+		offs += map[i].size;
+	}
+	if (!de) {
+		pnlfs_dx_init_leaf(sb, bh);
+		return;
+	}
+	/* The last record takes what is left of the block */
+	pnlfs_set_rec_len(de, pnlfs_rec_len(de) + bh->b_size - offs);
+	pnlfs_journal_dirty(sb, bh);
+}
+
+/* Insert the child (hash, bno) after the current position of the node */
+static int pnlfs_dx_insert(struct super_block *sb, struct pnlfs_dx_path *node,
+			   u32 hash, u32 bno)
+{
+	struct pnlfs_dx_entry *entries = DX_ENTRIES(node->hdr);
+	int pos = node->pos + 1, err;
+
+	err = pnlfs_journal_access(sb, node->bh);
+	if (err)
+		return err;
+	memmove(&entries[pos + 1], &entries[pos],
+		(le16_to_cpu(node->hdr->dx_count) - pos) * sizeof(*entries));
+	entries[pos].hash = cpu_to_le32(hash);
+	entries[pos].block = cpu_to_le32(bno);
+	le16_add_cpu(&node->hdr->dx_count, 1);
+	pnlfs_journal_dirty(sb, node->bh);
+	return 0;
+}
+
+/*
+ * Make room in the full index node at the given level of the path, the
+ * parent being split first if it is full too. When the root is full its
+ * entries move to a new node and the index gets one level deeper.
+ */
+static int pnlfs_dx_split_index(struct inode *dir, struct pnlfs_dx_path *path,
+				int level)
+{
+	struct pnlfs_dx_header *dh = path[level].hdr, *ndh;
+	struct buffer_head *bh;
+	int count = le16_to_cpu(dh->dx_count), move, err;
+
+	if (level && le16_to_cpu(path[level - 1].hdr->dx_count) ==
+		     PNLFS_DX_LIMIT(dir->i_sb->s_blocksize))
+		return pnlfs_dx_split_index(dir, path, level - 1);
+	if (!level && le16_to_cpu(dh->dx_levels) == PNLFS_DX_MAX_LEVELS)
+		return -ENOSPC;
+	err = pnlfs_journal_access(dir->i_sb, path[level].bh);
+	if (err)
+		return err;
+
+	bh = pnlfs_new_meta_block(dir->i_sb);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	ndh = (struct pnlfs_dx_header *) bh->b_data;
+	pnlfs_dx_init_header(dir->i_sb, ndh);
+
+	if (!level) {
+		memcpy(DX_ENTRIES(ndh), DX_ENTRIES(dh),
+		       count * sizeof(struct pnlfs_dx_entry));
+		ndh->dx_count = cpu_to_le16(count);
+		DX_ENTRIES(dh)[0].hash = 0;
+		DX_ENTRIES(dh)[0].block = cpu_to_le32(bh->b_blocknr);
+		dh->dx_count = cpu_to_le16(1);
+		le16_add_cpu(&dh->dx_levels, 1);
+		pnlfs_journal_dirty(dir->i_sb, bh);
+		pnlfs_journal_dirty(dir->i_sb, path[0].bh);
+	} else {
+		move = count / 2;
+		memcpy(DX_ENTRIES(ndh), &DX_ENTRIES(dh)[count - move],
+		       move * sizeof(struct pnlfs_dx_entry));
+		ndh->dx_count = cpu_to_le16(move);
+		pnlfs_journal_dirty(dir->i_sb, bh);
+		/* Linked first, so a failure leaves the node as it was */
+		err = pnlfs_dx_insert(dir->i_sb, &path[level - 1],
+				      le32_to_cpu(DX_ENTRIES(ndh)[0].hash),
+				      bh->b_blocknr);
+		if (err) {
+			pnlfs_free_meta_block(dir->i_sb, bh->b_blocknr);
+		} else {
+			dh->dx_count = cpu_to_le16(count - move);
+			pnlfs_journal_dirty(dir->i_sb, path[level].bh);
+		}
+	}
+
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Move the upper half of the full leaf, in hash order, to a new leaf.
+ * Names with the same hash always stay in the same leaf.
+ */
+static int pnlfs_dx_split_leaf(struct inode *dir, struct pnlfs_dx_path *path,
+			       int levels, struct buffer_head *bh)
+{
+	struct pnlfs_dx_map *map;
+	struct buffer_head *nbh;
+	char *copy;
+	int n, m, err = 0;
+
+	if (le16_to_cpu(path[levels].hdr->dx_count) ==
+	    PNLFS_DX_LIMIT(dir->i_sb->s_blocksize))
+		return pnlfs_dx_split_index(dir, path, levels);
+
+	map = kmalloc_array(bh->b_size / PNLFS_DIR_REC_LEN(1),
+			    sizeof(*map), GFP_NOFS);
+	copy = kmalloc(bh->b_size, GFP_NOFS);
+	if (!map || !copy) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(copy, bh->b_data, bh->b_size);
+	n = pnlfs_dx_leaf_map(bh, 0, map);
+
+	m = n / 2;
+	while (m > 0 && map[m].hash == map[m - 1].hash)
+		m--;
+	if (!m) {
+		m = n / 2;
+		while (m < n && map[m].hash == map[m - 1].hash)
+			m++;
+	}
+	if (!m || m == n) {
+		err = -ENOSPC;
+		goto out;
+	}
+	err = pnlfs_journal_access(dir->i_sb, bh);
+	if (err)
+		goto out;
+
+	nbh = pnlfs_new_meta_block(dir->i_sb);
+	if (IS_ERR(nbh)) {
+		err = PTR_ERR(nbh);
+		goto out;
+	}
+	pnlfs_dx_leaf_fill(dir->i_sb, nbh, copy, &map[m], n - m);
+	/* The old leaf keeps all its names until the new one is linked */
+	err = pnlfs_dx_insert(dir->i_sb, &path[levels], map[m].hash,
+			      nbh->b_blocknr);
+	if (err)
+		pnlfs_free_meta_block(dir->i_sb, nbh->b_blocknr);
+	else
+		pnlfs_dx_leaf_fill(dir->i_sb, bh, copy, map, m);
+	brelse(nbh);
+out:
+	kfree(copy);
+	kfree(map);
+	return err;
+}
+
+int pnlfs_dx_lookup(struct inode *dir, const char *name, int len,
+		    unsigned long *ino)
+{
+	struct pnlfs_dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	struct pnlfs_dir_entry *de;
+	struct buffer_head *bh;
+	int levels, err = -ENOENT;
+
+	levels = pnlfs_dx_find(dir, pnlfs_dirhash(name, len), path);
+	if (levels < 0)
+		return levels;
+	if (!path[0].hdr->dx_count)
+		goto out;
+
+	bh = pnlfs_dx_read_leaf(dir, path, levels);
+	if (IS_ERR(bh)) {
+		err = PTR_ERR(bh);
+		goto out;
+	}
+	de = pnlfs_dx_leaf_find(bh, name, len, NULL);
+	if (de) {
+		*ino = le32_to_cpu(de->inode);
+		err = 0;
+	}
+	brelse(bh);
+out:
+	pnlfs_dx_put_path(path, levels);
+	return err;
+}
+
+int pnlfs_dx_add(struct inode *dir, const char *name, int len,
+		 unsigned long ino, umode_t mode)
+{
+	struct pnlfs_dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	struct pnlfs_dx_header *root;
+	struct buffer_head *bh;
+	u32 hash = pnlfs_dirhash(name, len);
+	int levels, err;
+
+again:
+	levels = pnlfs_dx_find(dir, hash, path);
+	if (levels < 0)
+		return levels;
+
+	/* The first name of the directory gets the first leaf */
+	root = path[0].hdr;
+	if (!root->dx_count) {
+		bh = pnlfs_new_meta_block(dir->i_sb);
+		if (IS_ERR(bh)) {
+			pnlfs_dx_put_path(path, levels);
+			return PTR_ERR(bh);
+		}
+		pnlfs_dx_init_leaf(dir->i_sb, bh);
+		path[0].pos = -1;
+		err = pnlfs_dx_insert(dir->i_sb, &path[0], 0, bh->b_blocknr);
+		brelse(bh);
+		pnlfs_dx_put_path(path, levels);
+		if (err)
+			return err;
+		goto again;
+	}
+
+	bh = pnlfs_dx_read_leaf(dir, path, levels);
+	if (IS_ERR(bh)) {
+		pnlfs_dx_put_path(path, levels);
+		return PTR_ERR(bh);
+	}
+
+	err = pnlfs_journal_access(dir->i_sb, bh);
+	if (!err)
+		err = pnlfs_dx_leaf_add(bh, name, len, ino, mode);
+	if (err == -ENOSPC) {
+		err = pnlfs_dx_split_leaf(dir, path, levels, bh);
+		brelse(bh);
+		pnlfs_dx_put_path(path, levels);
+		if (err)
+			return err;
+		goto again;
+	}
+
+	if (!err)
+		pnlfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+	pnlfs_dx_put_path(path, levels);
+	return err;
+}
+
+int pnlfs_dx_remove(struct inode *dir, const char *name, int len)
+{
+	struct pnlfs_dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	struct pnlfs_dir_entry *de, *prev;
+	struct buffer_head *bh;
+	int levels, err = -ENOENT;
+
+	levels = pnlfs_dx_find(dir, pnlfs_dirhash(name, len), path);
+	if (levels < 0)
+		return levels;
+	if (!path[0].hdr->dx_count)
+		goto out;
+
+	bh = pnlfs_dx_read_leaf(dir, path, levels);
+	if (IS_ERR(bh)) {
+		err = PTR_ERR(bh);
+		goto out;
+	}
+	de = pnlfs_dx_leaf_find(bh, name, len, &prev);
+	if (de)
+		err = pnlfs_journal_access(dir->i_sb, bh);
+	if (de && !err) {
+		/* The previous record gets the space back */
+		if (prev)
+			pnlfs_set_rec_len(prev, pnlfs_rec_len(prev) +
+					  pnlfs_rec_len(de));
+		else
+			de->inode = 0;
+		pnlfs_journal_dirty(dir->i_sb, bh);
+	}
+	brelse(bh);
+out:
+	pnlfs_dx_put_path(path, levels);
+	return err;
+}
+
+/*
+ * Names are given in hash order, ctx->pos being the hash and the rank of
+ * the name to go on from (PNLFS_DX_POS). That order does not change when
+ * leaves split, so a reader does not see a name twice or miss one because
+ * of concurrent creations, even when it stops inside a run of names with
+ * the same hash.
+ */
+int pnlfs_dx_iterate(struct inode *dir, struct dir_context *ctx)
+{
+	struct pnlfs_dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	struct pnlfs_dir_entry *de;
+	struct pnlfs_dx_map *map;
+	struct buffer_head *bh;
+	int levels, n, i, err = 0;
+	u32 hash, rank, r = 0;
+	u64 next;
+
+	map = kmalloc_array(dir->i_sb->s_blocksize / PNLFS_DIR_REC_LEN(1),
+			    sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	while (ctx->pos < PNLFS_DX_POS_END) {
+		hash = (ctx->pos - 2) >> PNLFS_DX_RANK_BITS;
+		rank = (ctx->pos - 2) & ((1 << PNLFS_DX_RANK_BITS) - 1);
+		levels = pnlfs_dx_find(dir, hash, path);
+		if (levels < 0) {
+			err = levels;
+			break;
+		}
+		if (!path[0].hdr->dx_count) {
+			pnlfs_dx_put_path(path, levels);
+			ctx->pos = PNLFS_DX_POS_END;
+			break;
+		}
+
+		bh = pnlfs_dx_read_leaf(dir, path, levels);
+		next = pnlfs_dx_next_hash(path, levels);
+		pnlfs_dx_put_path(path, levels);
+		if (IS_ERR(bh)) {
+			err = PTR_ERR(bh);
+			break;
+		}
+
+		n = pnlfs_dx_leaf_map(bh, hash, map);
+		for (i = 0; i < n; i++) {
+			r = i && map[i].hash == map[i - 1].hash ? r + 1 : 0;
+			/* Already given before the last stop */
+			if (map[i].hash == hash && r < rank)
+				continue;
+			ctx->pos = PNLFS_DX_POS(map[i].hash, r);
+			de = DE_AT(bh, map[i].offs);
+			if (!dir_emit(ctx, de->name, de->name_len,
+				      le32_to_cpu(de->inode), de->file_type)) {
+				brelse(bh);
+				goto out;
+			}
+		}
+		brelse(bh);
+		ctx->pos = PNLFS_DX_POS(next, 0);
+	}
+out:
+	kfree(map);
+	return err;
+}
+
+/* Free a node of the index and everything under it */
+static void pnlfs_dx_free_node(struct inode *dir, u32 bno, int levels)
+{
+	struct pnlfs_dx_header *dh;
+	struct buffer_head *bh;
+	int i;
+
+	if (levels) {
+		bh = sb_bread(dir->i_sb, bno);
+		if (!bh)
+			return;
+		dh = (struct pnlfs_dx_header *) bh->b_data;
+		if (!pnlfs_dx_check(dir, dh)) {
+			for (i = 0; i < le16_to_cpu(dh->dx_count); i++)
+				pnlfs_dx_free_node(dir,
+					le32_to_cpu(DX_ENTRIES(dh)[i].block),
+					levels - 1);
+		}
+		brelse(bh);
+	}
+	pnlfs_free_meta_block(dir->i_sb, bno);
+}
+
+/* Free the blocks of a hashed directory, except its index block */
+void pnlfs_dx_free(struct inode *dir)
+{
+	struct pnlfs_dx_header *dh;
+	struct buffer_head *bh;
+	int i;
+
+	bh = sb_bread(dir->i_sb, PNLFS_I(dir)->index_block);
+	if (!bh)
+		return;
+	dh = (struct pnlfs_dx_header *) bh->b_data;
+	if (!pnlfs_dx_check(dir, dh)) {
+		for (i = 0; i < le16_to_cpu(dh->dx_count); i++)
+			pnlfs_dx_free_node(dir,
+				le32_to_cpu(DX_ENTRIES(dh)[i].block),
+				le16_to_cpu(dh->dx_levels));
+	}
+	brelse(bh);
+}
+
+/* A full directory of long names takes two leaves of 4 KiB */
+#define PNLFS_DX_CONVERT_LEAVES 4
+
+/*
+ * Turn a directory made of a single block of fixed entries into a hashed
+ * one, when it is full or gets a name too long for the old format. The
+ * leaves are written from the old names first, the block becomes the root
+ * of the index only once they are all there: a failure leaves the old
+ * directory as it was.
+ */
+int pnlfs_dx_convert(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct pnlfs_inode_info *dir_info = PNLFS_I(dir);
+	struct buffer_head *leaves[PNLFS_DX_CONVERT_LEAVES];
+	int starts[PNLFS_DX_CONVERT_LEAVES];
+	struct pnlfs_dir_block *old;
+	struct pnlfs_dir_entry *de;
+	struct pnlfs_dx_header *dh;
+	struct pnlfs_dx_map *map;
+	struct pnlfs_file *f;
+	struct buffer_head *bh;
+	char *recs;
+	int i, n = 0, first, used, nr_leaves = 0, offs = 0, len, err = 0;
+
+	pnlfs_debug("%s : directory %lu\n", __func__, dir->i_ino);
+
+	bh = sb_bread(sb, dir_info->index_block);
+	if (!bh)
+		return -EIO;
+	old = (struct pnlfs_dir_block *) bh->b_data;
+	map = kmalloc_array(PNLFS_MAX_DIR_ENTRIES, sizeof(*map), GFP_NOFS);
+	recs = kmalloc(PNLFS_MAX_DIR_ENTRIES *
+		       PNLFS_DIR_REC_LEN(PNLFS_FILENAME_LEN), GFP_NOFS);
+	if (!map || !recs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* The old names as records of a leaf, in hash order */
+	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+		f = &old->files[i];
+		if (!f->inode)
+			continue;
+		len = strnlen(f->filename, PNLFS_FILENAME_LEN);
+		de = (struct pnlfs_dir_entry *) (recs + offs);
+		de->inode = f->inode;
+		de->name_len = len;
+		de->file_type = 0;
+		memcpy(de->name, f->filename, len);
+		map[n].hash = pnlfs_dirhash(f->filename, len);
+		map[n].offs = offs;
+		map[n].size = PNLFS_DIR_REC_LEN(len);
+		offs += map[n].size;
+		n++;
+	}
+	sort(map, n, sizeof(*map), pnlfs_dx_map_cmp, NULL);
+
+	/* Fill the leaves, the names of a hash staying in the same one */
+	for (first = 0; first < n || !nr_leaves; first = i) {
+		used = 0;
+		for (i = first; i < n; i++) {
+			if (used + map[i].size > sb->s_blocksize &&
+			    map[i].hash != map[i - 1].hash)
+				break;
+			used += map[i].size;
+		}
+		if (used > sb->s_blocksize ||
+		    nr_leaves == PNLFS_DX_CONVERT_LEAVES) {
+			err = -ENOSPC;
+			goto out_leaves;
+		}
+		leaves[nr_leaves] = pnlfs_new_meta_block(sb);
+		if (IS_ERR(leaves[nr_leaves])) {
+			err = PTR_ERR(leaves[nr_leaves]);
+			goto out_leaves;
+		}
+		starts[nr_leaves] = first;
+		pnlfs_dx_leaf_fill(sb, leaves[nr_leaves++], recs, &map[first],
+				   i - first);
+	}
+
+	/* Nothing can fail past that point */
+	err = pnlfs_journal_access(sb, bh);
+	if (err)
+		goto out_leaves;
+	pnlfs_dx_init_root(sb, bh);
+	dh = (struct pnlfs_dx_header *) bh->b_data;
+	for (i = 0; i < nr_leaves; i++) {
+		DX_ENTRIES(dh)[i].hash =
+			cpu_to_le32(i ? map[starts[i]].hash : 0);
+		DX_ENTRIES(dh)[i].block = cpu_to_le32(leaves[i]->b_blocknr);
+	}
+	dh->dx_count = cpu_to_le16(nr_leaves);
+	pnlfs_journal_dirty(sb, bh);
+
+	dir_info->flags |= PNLFS_INODE_HTREE;
+	mark_inode_dirty(dir);
+	goto out_put;
+
+out_leaves:
+	for (i = 0; i < nr_leaves; i++)
+		pnlfs_free_meta_block(sb, leaves[i]->b_blocknr);
+out_put:
+	for (i = 0; i < nr_leaves; i++)
+		brelse(leaves[i]);
+out:
+	kfree(recs);
+	kfree(map);
+	brelse(bh);
+	return err;
+}
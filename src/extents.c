@@ -0,0 +1,780 @@
+#include "pnlfs.h"
+
+/* One node of the tree for each level, from the root (level 0) down */
+struct pnlfs_ext_path {
+	struct buffer_head *bh;
+	struct pnlfs_extent_header *hdr;
+	int pos;
+};
+
+static inline struct pnlfs_extent *EXT_FIRST(struct pnlfs_extent_header *eh)
+{
+	return (struct pnlfs_extent *) (eh + 1);
+}
+
+static inline struct pnlfs_extent_idx *IDX_FIRST(struct pnlfs_extent_header *eh)
+{
+	return (struct pnlfs_extent_idx *) (eh + 1);
+}
+
+static inline u32 pnlfs_ext_len(struct pnlfs_extent *ex)
+{
+	return le32_to_cpu(ex->ee_len) & PNLFS_EXT_MAX_LEN;
+}
+
+static inline bool pnlfs_ext_is_unwritten(struct pnlfs_extent *ex)
+{
+	return le32_to_cpu(ex->ee_len) & PNLFS_EXT_UNWRITTEN;
+}
+
+static inline void pnlfs_ext_set_len(struct pnlfs_extent *ex, u32 len,
+				     bool unwritten)
+{
+	ex->ee_len = cpu_to_le32(len | (unwritten ? PNLFS_EXT_UNWRITTEN : 0));
+}
+
+static void pnlfs_ext_init_header(struct super_block *sb,
+				  struct pnlfs_extent_header *eh, int depth)
+{
+	eh->eh_magic = cpu_to_le16(PNLFS_EXT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = cpu_to_le16(PNLFS_EXT_PER_BLOCK(sb->s_blocksize));
+	eh->eh_depth = cpu_to_le16(depth);
+	eh->eh_reserved = 0;
+}
+
+/* Set up an empty tree in the index block of a new file */
+void pnlfs_ext_init_root(struct super_block *sb, struct buffer_head *bh)
+{
+	memset(bh->b_data, 0, bh->b_size);
+	pnlfs_ext_init_header(sb, (struct pnlfs_extent_header *) bh->b_data, 0);
+	pnlfs_journal_dirty(sb, bh);
+}
+
+static void pnlfs_ext_put_path(struct pnlfs_ext_path *path, int depth)
+{
+	int i;
+
+	for (i = 0; i <= depth; i++) {
+		brelse(path[i].bh);
+		path[i].bh = NULL;
+	}
+}
+
+/* Reserve a new node of the tree */
+static struct buffer_head *pnlfs_ext_new_node(struct super_block *sb,
+					      int depth)
+{
+	struct buffer_head *bh;
+
+	bh = pnlfs_new_meta_block(sb);
+	if (!IS_ERR(bh))
+		pnlfs_ext_init_header(sb, (struct pnlfs_extent_header *)
+				      bh->b_data, depth);
+	return bh;
+}
+
+static int pnlfs_ext_check(struct inode *inode, struct pnlfs_extent_header *eh,
+			   int depth)
+{
+	u32 max = PNLFS_EXT_PER_BLOCK(inode->i_sb->s_blocksize);
+
+	if (le16_to_cpu(eh->eh_magic) == PNLFS_EXT_MAGIC &&
+	    le16_to_cpu(eh->eh_max) == max &&
+	    le16_to_cpu(eh->eh_entries) <= le16_to_cpu(eh->eh_max) &&
+	    le16_to_cpu(eh->eh_depth) <= PNLFS_EXT_MAX_DEPTH &&
+	    (depth < 0 || le16_to_cpu(eh->eh_depth) == depth))
+		return 0;
+
+	pr_err("%s : corrupted extent node in inode %lu\n",
+	       __func__, inode->i_ino);
+	return -EIO;
+}
+
+/* Last extent starting at or before iblock, -1 if there is none */
+static int pnlfs_ext_search_leaf(struct pnlfs_extent_header *eh, u32 iblock)
+{
+	struct pnlfs_extent *ex = EXT_FIRST(eh);
+	int l = 0, r = le16_to_cpu(eh->eh_entries) - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (le32_to_cpu(ex[m].ee_block) <= iblock)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+	return l - 1;
+}
+
+/* Child covering iblock, the first one covers everything before it */
+static int pnlfs_ext_search_idx(struct pnlfs_extent_header *eh, u32 iblock)
+{
+	struct pnlfs_extent_idx *ix = IDX_FIRST(eh);
+	int l = 1, r = le16_to_cpu(eh->eh_entries) - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (le32_to_cpu(ix[m].ei_block) <= iblock)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+	return l - 1;
+}
+
+/*
+ * Walk the tree from the root down to the leaf which covers iblock.
+ * Returns the depth of the tree, path[depth] being the leaf.
+ */
+static int pnlfs_ext_find(struct inode *inode, u32 iblock,
+			  struct pnlfs_ext_path *path)
+{
+	struct pnlfs_extent_header *eh;
+	struct buffer_head *bh;
+	u32 bno = PNLFS_I(inode)->index_block;
+	int level = 0, depth = 0, err;
+
+	memset(path, 0, sizeof(*path) * (PNLFS_EXT_MAX_DEPTH + 1));
+	for (;;) {
+		bh = sb_bread(inode->i_sb, bno);
+		if (!bh) {
+			err = -EIO;
+			goto err;
+		}
+		eh = (struct pnlfs_extent_header *) bh->b_data;
+		path[level].bh = bh;
+		path[level].hdr = eh;
+
+		err = pnlfs_ext_check(inode, eh, level ? depth - level : -1);
+		if (err)
+			goto err;
+		if (!level)
+			depth = le16_to_cpu(eh->eh_depth);
+
+		if (level == depth) {
+			path[level].pos = pnlfs_ext_search_leaf(eh, iblock);
+			return depth;
+		}
+
+		if (!eh->eh_entries) {
+			pr_err("%s : empty extent index in inode %lu\n",
+			       __func__, inode->i_ino);
+			err = -EIO;
+			goto err;
+		}
+		path[level].pos = pnlfs_ext_search_idx(eh, iblock);
+		bno = le32_to_cpu(IDX_FIRST(eh)[path[level].pos].ei_leaf);
+		level++;
+	}
+err:
+	pnlfs_ext_put_path(path, level);
+	return err;
+}
+
+/* First logical block after the leaf position of path, U32_MAX if none */
+static u32 pnlfs_ext_next_start(struct pnlfs_ext_path *path, int depth)
+{
+	struct pnlfs_extent_header *eh = path[depth].hdr;
+	int pos = path[depth].pos, level;
+
+	if (pos + 1 < le16_to_cpu(eh->eh_entries))
+		return le32_to_cpu(EXT_FIRST(eh)[pos + 1].ee_block);
+
+	for (level = depth - 1; level >= 0; level--) {
+		eh = path[level].hdr;
+		pos = path[level].pos;
+		if (pos + 1 < le16_to_cpu(eh->eh_entries))
+			return le32_to_cpu(IDX_FIRST(eh)[pos + 1].ei_block);
+	}
+	return U32_MAX;
+}
+
+/*
+ * Look for iblock in the tree. Returns 1 if it is mapped, with in pblk
+ * its physical block and in len the number of blocks mapped contiguously
+ * from there, unwritten telling if the extent is. Returns 0 for a hole,
+ * len being then its length and pblk the block which would follow the
+ * previous extent on disk.
+ */
+static int pnlfs_ext_map(struct inode *inode, u32 iblock, u32 *pblk, u32 *len,
+			 bool *unwritten)
+{
+	struct pnlfs_ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent *ex;
+	u32 start, elen;
+	int depth, ret = 0;
+
+	depth = pnlfs_ext_find(inode, iblock, path);
+	if (depth < 0)
+		return depth;
+
+	if (path[depth].pos >= 0) {
+		ex = &EXT_FIRST(path[depth].hdr)[path[depth].pos];
+		start = le32_to_cpu(ex->ee_block);
+		elen = pnlfs_ext_len(ex);
+		if (iblock < start + elen) {
+			*pblk = le32_to_cpu(ex->ee_start) + iblock - start;
+			*len = start + elen - iblock;
+			*unwritten = pnlfs_ext_is_unwritten(ex);
+			ret = 1;
+			goto out;
+		}
+		*pblk = le32_to_cpu(ex->ee_start) + iblock - start;
+	} else {
+		/* Nothing before, keep the data close to the tree */
+		*pblk = PNLFS_I(inode)->index_block + 1;
+	}
+	*len = pnlfs_ext_next_start(path, depth) - iblock;
+out:
+	pnlfs_ext_put_path(path, depth);
+	return ret;
+}
+
+/* The root is full: move its content in a new node and point to it */
+static int pnlfs_ext_grow(struct inode *inode, struct pnlfs_ext_path *path)
+{
+	struct pnlfs_extent_header *root = path[0].hdr;
+	struct pnlfs_extent_idx *ix;
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(root->eh_depth), err;
+
+	if (depth >= PNLFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+	err = pnlfs_journal_access(inode->i_sb, path[0].bh);
+	if (err)
+		return err;
+
+	bh = pnlfs_ext_new_node(inode->i_sb, depth);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	memcpy(bh->b_data, path[0].bh->b_data, bh->b_size);
+	pnlfs_journal_dirty(inode->i_sb, bh);
+
+	root->eh_entries = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	ix = IDX_FIRST(root);
+	ix->ei_block = 0;
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	ix->ei_unused = 0;
+	pnlfs_journal_dirty(inode->i_sb, path[0].bh);
+
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Make room in the full node at the given level of the path. Its parent
+ * is split first if it is full too. The path is no longer valid after.
+ */
+static int pnlfs_ext_split(struct inode *inode, struct pnlfs_ext_path *path,
+			   int depth, int level)
+{
+	struct pnlfs_extent_header *eh, *neh, *peh;
+	struct pnlfs_extent_idx *pix;
+	struct buffer_head *bh;
+	int entries, move, ppos, err;
+	u32 key;
+
+	if (!level)
+		return pnlfs_ext_grow(inode, path);
+
+	peh = path[level - 1].hdr;
+	if (le16_to_cpu(peh->eh_entries) == le16_to_cpu(peh->eh_max))
+		return pnlfs_ext_split(inode, path, depth, level - 1);
+
+	err = pnlfs_journal_access(inode->i_sb, path[level].bh);
+	if (!err)
+		err = pnlfs_journal_access(inode->i_sb, path[level - 1].bh);
+	if (err)
+		return err;
+
+	eh = path[level].hdr;
+	entries = le16_to_cpu(eh->eh_entries);
+	bh = pnlfs_ext_new_node(inode->i_sb, le16_to_cpu(eh->eh_depth));
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	neh = (struct pnlfs_extent_header *) bh->b_data;
+
+	/* Appending to a leaf keeps it full, otherwise split in halves */
+	if (level == depth && path[level].pos == entries - 1)
+		move = 1;
+	else
+		move = entries / 2;
+
+	/* Extents and index entries have the same size and start by a key */
+	memcpy(EXT_FIRST(neh), &EXT_FIRST(eh)[entries - move],
+	       move * sizeof(struct pnlfs_extent));
+	neh->eh_entries = cpu_to_le16(move);
+	eh->eh_entries = cpu_to_le16(entries - move);
+	key = le32_to_cpu(EXT_FIRST(neh)[0].ee_block);
+
+	/* Register the new node in the parent, right after the old one */
+	pix = IDX_FIRST(peh);
+	ppos = path[level - 1].pos + 1;
+	memmove(&pix[ppos + 1], &pix[ppos],
+		(le16_to_cpu(peh->eh_entries) - ppos) * sizeof(*pix));
+	pix[ppos].ei_block = cpu_to_le32(key);
+	pix[ppos].ei_leaf = cpu_to_le32(bh->b_blocknr);
+	pix[ppos].ei_unused = 0;
+	le16_add_cpu(&peh->eh_entries, 1);
+
+	pnlfs_journal_dirty(inode->i_sb, bh);
+	pnlfs_journal_dirty(inode->i_sb, path[level].bh);
+	pnlfs_journal_dirty(inode->i_sb, path[level - 1].bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Record that the len blocks from iblock are stored from pblk. Only
+ * extents in the same state are merged.
+ */
+static int pnlfs_ext_insert(struct inode *inode, u32 iblock, u32 pblk, u32 len,
+			    bool unwritten)
+{
+	struct pnlfs_ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent_header *eh;
+	struct pnlfs_extent *ex;
+	int depth, pos, entries, err = 0;
+
+again:
+	depth = pnlfs_ext_find(inode, iblock, path);
+	if (depth < 0)
+		return depth;
+	eh = path[depth].hdr;
+	ex = EXT_FIRST(eh);
+	pos = path[depth].pos;
+	entries = le16_to_cpu(eh->eh_entries);
+	err = pnlfs_journal_access(inode->i_sb, path[depth].bh);
+	if (err)
+		goto out;
+
+	/* Merge with the extent before */
+	if (pos >= 0 && pnlfs_ext_is_unwritten(&ex[pos]) == unwritten &&
+	    le32_to_cpu(ex[pos].ee_block) + pnlfs_ext_len(&ex[pos]) == iblock &&
+	    le32_to_cpu(ex[pos].ee_start) + pnlfs_ext_len(&ex[pos]) == pblk &&
+	    pnlfs_ext_len(&ex[pos]) + len <= PNLFS_EXT_MAX_LEN) {
+		pnlfs_ext_set_len(&ex[pos], pnlfs_ext_len(&ex[pos]) + len,
+				  unwritten);
+		goto dirty;
+	}
+
+	/* Merge with the extent after */
+	if (pos + 1 < entries &&
+	    pnlfs_ext_is_unwritten(&ex[pos + 1]) == unwritten &&
+	    iblock + len == le32_to_cpu(ex[pos + 1].ee_block) &&
+	    pblk + len == le32_to_cpu(ex[pos + 1].ee_start) &&
+	    pnlfs_ext_len(&ex[pos + 1]) + len <= PNLFS_EXT_MAX_LEN) {
+		ex[pos + 1].ee_block = cpu_to_le32(iblock);
+		ex[pos + 1].ee_start = cpu_to_le32(pblk);
+		pnlfs_ext_set_len(&ex[pos + 1], pnlfs_ext_len(&ex[pos + 1]) + len,
+				  unwritten);
+		goto dirty;
+	}
+
+	if (entries == le16_to_cpu(eh->eh_max)) {
+		err = pnlfs_ext_split(inode, path, depth, depth);
+		pnlfs_ext_put_path(path, depth);
+		if (err)
+			return err;
+		goto again;
+	}
+
+	memmove(&ex[pos + 2], &ex[pos + 1], (entries - pos - 1) * sizeof(*ex));
+	ex[pos + 1].ee_block = cpu_to_le32(iblock);
+	ex[pos + 1].ee_start = cpu_to_le32(pblk);
+	pnlfs_ext_set_len(&ex[pos + 1], len, unwritten);
+	le16_add_cpu(&eh->eh_entries, 1);
+dirty:
+	pnlfs_journal_dirty(inode->i_sb, path[depth].bh);
+out:
+	pnlfs_ext_put_path(path, depth);
+	return err;
+}
+
+/*
+ * An extent about to be cut in pieces needs need more entries in its leaf.
+ * Split the leaf first if they do not fit, so that putting the pieces back
+ * cannot fail once the extent changed. Returns 1 after a split, the path
+ * being then released and the caller looking it up again.
+ */
+static int pnlfs_ext_make_room(struct inode *inode,
+			       struct pnlfs_ext_path *path, int depth, int need)
+{
+	struct pnlfs_extent_header *eh = path[depth].hdr;
+	int err;
+
+	if (le16_to_cpu(eh->eh_entries) + need <= le16_to_cpu(eh->eh_max))
+		return 0;
+	err = pnlfs_ext_split(inode, path, depth, depth);
+	pnlfs_ext_put_path(path, depth);
+	return err ? err : 1;
+}
+
+/* Free the empty nodes at the bottom of path, up to the root */
+static void pnlfs_ext_drop_empty(struct inode *inode,
+				 struct pnlfs_ext_path *path, int depth)
+{
+	struct pnlfs_extent_header *peh;
+	struct pnlfs_extent_idx *pix;
+	int level, ppos;
+
+	for (level = depth; level > 0; level--) {
+		if (path[level].hdr->eh_entries)
+			return;
+		/* The journal is aborted, nothing more reaches the disk */
+		if (pnlfs_journal_access(inode->i_sb, path[level - 1].bh))
+			return;
+
+		pnlfs_free_meta_block(inode->i_sb, path[level].bh->b_blocknr);
+
+		peh = path[level - 1].hdr;
+		pix = IDX_FIRST(peh);
+		ppos = path[level - 1].pos;
+		memmove(&pix[ppos], &pix[ppos + 1],
+			(le16_to_cpu(peh->eh_entries) - ppos - 1) * sizeof(*pix));
+		le16_add_cpu(&peh->eh_entries, -1);
+		pnlfs_journal_dirty(inode->i_sb, path[level - 1].bh);
+	}
+
+	/* Nothing left below the root, it becomes a leaf again */
+	if (!path[0].hdr->eh_entries && path[0].hdr->eh_depth &&
+	    !pnlfs_journal_access(inode->i_sb, path[0].bh)) {
+		path[0].hdr->eh_depth = 0;
+		pnlfs_journal_dirty(inode->i_sb, path[0].bh);
+	}
+}
+
+/*
+ * Unmap and free the blocks of the file in [first, end). Called with
+ * map_sem held for writing, in a handle extended at each extent: no more
+ * than a group of blocks is freed at a time.
+ */
+int pnlfs_ext_remove(struct inode *inode, u32 first, u32 end)
+{
+	struct pnlfs_ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent_header *eh;
+	struct pnlfs_extent *ex;
+	u32 start, len, pblk, a, b;
+	int depth, pos, entries, err;
+	bool unwritten;
+
+	while (first < end) {
+		err = pnlfs_journal_extend(inode->i_sb, PNLFS_JOURNAL_CREDITS,
+					   &PNLFS_I(inode)->map_sem);
+		if (err)
+			return err;
+		depth = pnlfs_ext_find(inode, first, path);
+		if (depth < 0)
+			return depth;
+		eh = path[depth].hdr;
+		ex = EXT_FIRST(eh);
+		entries = le16_to_cpu(eh->eh_entries);
+		pos = path[depth].pos;
+
+		/* Skip the extent before first if it does not reach it */
+		if (pos < 0 || le32_to_cpu(ex[pos].ee_block) +
+			       pnlfs_ext_len(&ex[pos]) <= first)
+			pos++;
+
+		/* Nothing more in that leaf, go on with the next one */
+		if (pos >= entries) {
+			path[depth].pos = entries - 1;
+			first = pnlfs_ext_next_start(path, depth);
+			pnlfs_ext_put_path(path, depth);
+			continue;
+		}
+
+		start = le32_to_cpu(ex[pos].ee_block);
+		len = pnlfs_ext_len(&ex[pos]);
+		unwritten = pnlfs_ext_is_unwritten(&ex[pos]);
+		pblk = le32_to_cpu(ex[pos].ee_start);
+		if (start >= end) {
+			pnlfs_ext_put_path(path, depth);
+			break;
+		}
+
+		/* Part of the extent in the range */
+		a = max(start, first);
+		b = min3(start + len, end,
+			 a + PNLFS_BITS_PER_GROUP(inode->i_sb));
+
+		/* A hole in the middle of the extent leaves a tail to map */
+		if (a > start && b < start + len) {
+			err = pnlfs_ext_make_room(inode, path, depth, 1);
+			if (err < 0)
+				return err;
+			if (err)
+				continue;
+		}
+
+		err = pnlfs_journal_access(inode->i_sb, path[depth].bh);
+		if (err) {
+			pnlfs_ext_put_path(path, depth);
+			return err;
+		}
+		if (a == start && b == start + len) {
+			memmove(&ex[pos], &ex[pos + 1],
+				(entries - pos - 1) * sizeof(*ex));
+			le16_add_cpu(&eh->eh_entries, -1);
+		} else if (a == start) {
+			ex[pos].ee_block = cpu_to_le32(b);
+			ex[pos].ee_start = cpu_to_le32(pblk + b - start);
+			pnlfs_ext_set_len(&ex[pos], start + len - b, unwritten);
+		} else {
+			pnlfs_ext_set_len(&ex[pos], a - start, unwritten);
+		}
+		pnlfs_journal_dirty(inode->i_sb, path[depth].bh);
+		path[depth].pos = pos;
+		pnlfs_ext_drop_empty(inode, path, depth);
+		pnlfs_ext_put_path(path, depth);
+
+		/* The leaf had room for it, see above */
+		if (a > start && b < start + len) {
+			err = pnlfs_ext_insert(inode, b, pblk + b - start,
+					       start + len - b, unwritten);
+			if (err)
+				return err;
+		}
+
+		inode->i_blocks -= b - a;
+		pnlfs_free_blocks(inode->i_sb, pblk + a - start, b - a);
+		first = b;
+	}
+
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * The n blocks from iblock, all in one unwritten extent, are written. The
+ * extent is split around them, the written part merging with the written
+ * extent before if there is one. Its leaf gets room for the pieces first.
+ */
+static int pnlfs_ext_mark_written(struct inode *inode, u32 iblock, u32 n)
+{
+	struct pnlfs_ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent *ex;
+	u32 start, pblk, head, tail;
+	int depth, err;
+
+again:
+	depth = pnlfs_ext_find(inode, iblock, path);
+	if (depth < 0)
+		return depth;
+	ex = &EXT_FIRST(path[depth].hdr)[path[depth].pos];
+	start = le32_to_cpu(ex->ee_block);
+	pblk = le32_to_cpu(ex->ee_start);
+	head = iblock - start;
+	tail = start + pnlfs_ext_len(ex) - iblock - n;
+
+	/* The written part and the tail go back in the same leaf */
+	err = pnlfs_ext_make_room(inode, path, depth, !!head + !!tail);
+	if (err < 0)
+		return err;
+	if (err)
+		goto again;
+	err = pnlfs_journal_access(inode->i_sb, path[depth].bh);
+	if (err) {
+		pnlfs_ext_put_path(path, depth);
+		return err;
+	}
+
+	if (head) {
+		pnlfs_ext_set_len(ex, head, true);
+	} else if (tail) {
+		ex->ee_block = cpu_to_le32(iblock + n);
+		ex->ee_start = cpu_to_le32(pblk + n);
+		pnlfs_ext_set_len(ex, tail, true);
+	} else {
+		pnlfs_ext_set_len(ex, n, false);
+	}
+	pnlfs_journal_dirty(inode->i_sb, path[depth].bh);
+	pnlfs_ext_put_path(path, depth);
+	if (!head && !tail)
+		return 0;
+
+	err = pnlfs_ext_insert(inode, iblock, pblk + head, n, false);
+	if (err || !head || !tail)
+		return err;
+	return pnlfs_ext_insert(inode, iblock + n, pblk + head + n, tail, true);
+}
+
+/*
+ * get_block of the files mapped with an extent tree: the whole extent
+ * following iblock can be mapped in one call.
+ *
+ * Unwritten blocks are not mapped for a read, which gives zeroes, only
+ * flagged unwritten with their block in b_blocknr. Writeback maps them
+ * with create set and writes them in place, still flagged: they are
+ * marked written by pnlfs_conv_work once the data is on disk.
+ */
+int pnlfs_ext_get_block(struct inode *inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = sb->s_fs_info;
+	unsigned long max;
+	u32 pblk, len, bno, count, run, claimed, i;
+	bool unwritten;
+	int ret;
+
+	if (iblock >= (PNLFS_MAX_FILESIZE >> inode->i_blkbits) + 1)
+		return -EFBIG;
+
+	ret = pnlfs_ext_map(inode, iblock, &pblk, &len, &unwritten);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		max = bh_result->b_size >> inode->i_blkbits;
+		if (unwritten) {
+			len = min_t(unsigned long, len, max);
+			set_buffer_unwritten(bh_result);
+			if (!create) {
+				bh_result->b_blocknr = pblk;
+				bh_result->b_size = len << inode->i_blkbits;
+				return 0;
+			}
+		}
+		map_bh(bh_result, sb, pblk);
+		bh_result->b_size = min_t(unsigned long, len, max)
+			<< inode->i_blkbits;
+		return 0;
+	}
+
+	/* Nothing mapped here, reading gives zeroes. Report the hole */
+	if (!create) {
+		max = bh_result->b_size >> inode->i_blkbits;
+		bh_result->b_size = min_t(unsigned long, len, max)
+			<< inode->i_blkbits;
+		return 0;
+	}
+
+	/*
+	 * Fill as much of the hole as asked, after the previous extent. The
+	 * writeback of a delayed block allocates its whole run at once.
+	 */
+	max = bh_result->b_size >> inode->i_blkbits;
+	run = pnlfs_da_run(inode, iblock, min_t(u32, len, PNLFS_DA_MAX_RUN));
+	count = run;
+	if (count < max)
+		count = min_t(unsigned long, len, max);
+	/* What one handle can take from the bitmap */
+	count = min_t(u32, count, PNLFS_BITS_PER_GROUP(sb));
+	run = min(run, count);
+	/* Delayed blocks are reserved already, the others are claimed */
+	if (count > run && pnlfs_claim_blocks(sb, count - run)) {
+		if (!run)
+			return -ENOSPC;
+		count = run;
+	}
+	claimed = count - run;
+	bno = pnlfs_new_blocks(sb, pblk, &count);
+	if (claimed)
+		pnlfs_unclaim_blocks(sb, claimed);
+	if (bno == sb_info->nr_blocks)
+		return -ENOSPC;
+	ret = pnlfs_ext_insert(inode, iblock, bno, count, false);
+	if (ret) {
+		pnlfs_free_blocks(sb, bno, count);
+		return ret;
+	}
+	pnlfs_da_unreserve(inode, iblock, count);
+	inode->i_blocks += count;
+	mark_inode_dirty(inode);
+
+	/* The caller only takes care of the old buffers of its own blocks */
+	for (i = max; i < count; i++)
+		unmap_underlying_metadata(sb->s_bdev, bno + i);
+
+	set_buffer_new(bh_result);
+	map_bh(bh_result, sb, bno);
+	bh_result->b_size = min_t(unsigned long, count, max)
+		<< inode->i_blkbits;
+	return 0;
+}
+
+/*
+ * fallocate: give the holes of [first, end) unwritten blocks, each hole
+ * in as few allocator calls as the free extents allow. Blocks already
+ * mapped are kept. Called with map_sem held for writing.
+ */
+int pnlfs_ext_prealloc(struct inode *inode, u32 first, u32 end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = sb->s_fs_info;
+	u32 pblk, len, bno, count, want, i;
+	bool unwritten;
+	int ret;
+
+	while (first < end) {
+		ret = pnlfs_journal_extend(sb, PNLFS_JOURNAL_CREDITS,
+					   &PNLFS_I(inode)->map_sem);
+		if (ret)
+			return ret;
+		ret = pnlfs_ext_map(inode, first, &pblk, &len, &unwritten);
+		if (ret < 0)
+			return ret;
+		want = min3(len, end - first, PNLFS_BITS_PER_GROUP(sb));
+		if (ret) {
+			first += want;
+			continue;
+		}
+
+		/* The space reserved by delayed writes is not for us */
+		ret = pnlfs_claim_blocks(sb, want);
+		if (ret)
+			return ret;
+		count = want;
+		bno = pnlfs_new_blocks(sb, pblk, &count);
+		pnlfs_unclaim_blocks(sb, want);
+		if (bno == sb_info->nr_blocks)
+			return -ENOSPC;
+		ret = pnlfs_ext_insert(inode, first, bno, count, true);
+		if (ret) {
+			pnlfs_free_blocks(sb, bno, count);
+			return ret;
+		}
+		/* Delayed blocks of the range now have their place */
+		pnlfs_da_unreserve(inode, first, count);
+		inode->i_blocks += count;
+		mark_inode_dirty(inode);
+
+		for (i = 0; i < count; i++)
+			unmap_underlying_metadata(sb->s_bdev, bno + i);
+		first += count;
+	}
+	return 0;
+}
+
+/*
+ * Mark the unwritten blocks of [first, end) written, when a write to
+ * them is complete. Called with map_sem held for writing.
+ */
+int pnlfs_ext_convert(struct inode *inode, u32 first, u32 end)
+{
+	u32 pblk, len, n;
+	bool unwritten;
+	int ret;
+
+	while (first < end) {
+		ret = pnlfs_journal_extend(inode->i_sb, PNLFS_JOURNAL_CREDITS,
+					   &PNLFS_I(inode)->map_sem);
+		if (ret)
+			return ret;
+		ret = pnlfs_ext_map(inode, first, &pblk, &len, &unwritten);
+		if (ret < 0)
+			return ret;
+		n = min(len, end - first);
+		if (ret && unwritten) {
+			ret = pnlfs_ext_mark_written(inode, first, n);
+			if (ret)
+				return ret;
+			/* fsync waits for the commit of the change */
+			pnlfs_journal_mark_inode(inode);
+		}
+		first += n;
+	}
+	return 0;
+}
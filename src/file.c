@@ -1,9 +1,5 @@
 #include "pnlfs.h"
-
-//static ssize_t pnlfs_read(struct file *filp, char __user *buf, size_t count,
-//loff_t *pos);
-//static ssize_t pnlfs_write(struct file *filp, const char __user *buf,
-//size_t count, loff_t *pos);
+#include "pnlfs_trace.h"
 
 /* Function called iteratively, with the same context */
 static int pnlfs_iterate_shared(struct file *file, struct dir_context *ctx)
@@ -13,26 +9,29 @@ static int pnlfs_iterate_shared(struct file *file, struct dir_context *ctx)
 	struct buffer_head *bh;
 	struct pnlfs_dir_block *dir_block;
 	struct pnlfs_file *f;
-	int i;
-	bool err = false;
-	pr_info("%s Start\n", __func__);
-
-	/* Check if the name length is not too long */
-	if (file->f_path.dentry->d_name.len > PNLFS_FILENAME_LEN)
-		return -ENAMETOOLONG;
+	int i, err;
+	pnlfs_debug("%s Start\n", __func__);
 
 	/* Add the file . and the file .. */
 	if(!dir_emit_dots(file, ctx))
-		return -EACCES;
+		return 0;
 
 	/* Get the inode of current file */
 	inode = file_inode(file);
 	inode_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+
+	/* Hashed directories are walked in hash order */
+	if (inode_info->flags & PNLFS_INODE_HTREE) {
+		err = pnlfs_dx_iterate(inode, ctx);
+		pnlfs_debug("%s End\n", __func__);
+		return err;
+	}
+
 	/* Check if the cursor hasn't passed all the files */
-	if (ctx->pos >= (le32_to_cpu(inode_info->nr_entries) + 2)) {
-    pr_info("%s End\n", __func__);
+	if (ctx->pos >= PNLFS_MAX_DIR_ENTRIES + 2) {
+		pnlfs_debug("%s End\n", __func__);
 		return 0;
-  }
+	}
 
 	/* Read the block of the inode */
 	bh = sb_bread(inode->i_sb, inode_info->index_block);
@@ -41,192 +40,802 @@ static int pnlfs_iterate_shared(struct file *file, struct dir_context *ctx)
 
 	/* Get the list of files */
 	dir_block = (struct pnlfs_dir_block *) bh->b_data;
-	brelse(bh);
 	f = dir_block->files;
 
 	/* For each files, add it to the list via dit_emit function */
-	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+	for (i = ctx->pos - 2; i < PNLFS_MAX_DIR_ENTRIES; i++) {
 		if (f[i].inode == 0)
 			continue;
-		if ((err = !dir_emit(ctx, f[i].filename, strlen(f[i].filename),
-			f[i].inode, DT_UNKNOWN))) {
+		ctx->pos = i + 2;
+		if (!dir_emit(ctx, f[i].filename,
+			      strnlen(f[i].filename, PNLFS_FILENAME_LEN),
+			      le32_to_cpu(f[i].inode), DT_UNKNOWN))
 			break;
-		}
 	}
+	/* The slot index is the cursor, it survives entries removal */
+	if (i == PNLFS_MAX_DIR_ENTRIES)
+		ctx->pos = PNLFS_MAX_DIR_ENTRIES + 2;
+	brelse(bh);
 
-	/* Increase the offset */
-	ctx->pos += inode_info->nr_entries;
-
-	pr_info("%s Next\n", __func__);
-	if(err)
-		return -EACCES;
+	pnlfs_debug("%s Next\n", __func__);
 	return 0;
 }
 
-/* Read block */
-static ssize_t pnlfs_read
-(struct file * filp, char __user * buf, size_t count, loff_t * pos)
+/* Directory offsets are hashes, they are not bounded by i_size */
+static loff_t pnlfs_dir_llseek(struct file *file, loff_t offset, int whence)
 {
-	struct inode *inode;
-	struct pnlfs_inode_info *file_info;
+	return generic_file_llseek_size(file, offset, whence,
+					PNLFS_DX_POS_END,
+					i_size_read(file_inode(file)));
+}
+
+/* Number of block pointers held by a file index block */
+#define PNLFS_INDEX_ENTRIES(sb) ((sb)->s_blocksize >> 2)
+
+/* Blocks of the file needed to hold size bytes */
+static inline u32 pnlfs_size_blocks(struct inode *inode, loff_t size)
+{
+	return (size + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+}
+
+/*
+ * Map the logical block iblock of the file on a block of the partition.
+ * If the block is not allocated yet and create is set, a new block is
+ * reserved and recorded in the index block of the file.
+ *
+ * The caller gives in bh_result->b_size how many bytes it would like
+ * mapped: blocks following iblock which are contiguous on the disk are
+ * reported in one go, so that mpage can build a single bio for the run.
+ * A block pointer of 0 is a hole, its length is reported the same way.
+ */
+static int pnlfs_map_get_block(struct inode *inode, sector_t iblock,
+			       struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = sb->s_fs_info;
 	struct pnlfs_file_index_block *index_block;
 	struct buffer_head *bh;
-	int i = 0, offset, *blocks;
-	loff_t max, index;
-
-	pr_info("%s Start\n", __func__);
-	inode = file_inode(filp);
+	unsigned long max, n, entries = PNLFS_INDEX_ENTRIES(sb);
+	int bno, ret = 0;
 
-	/* If end of file */
-	if (*pos >= inode->i_size)
-		return 0;
+	if (iblock >= entries)
+		return -EFBIG;
 
-	/* Get the block */
-	file_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	if (!(bh = sb_bread(inode->i_sb, file_info->index_block)))
+	bh = sb_bread(sb, PNLFS_I(inode)->index_block);
+	if (!bh)
 		return -EIO;
-
-	/* Get information on the file */
 	index_block = (struct pnlfs_file_index_block *) bh->b_data;
-	brelse(bh);
-	blocks = index_block->blocks;
-	index = filp->f_pos >> 12;					/* Initial index of cursor */
-	max = inode->i_size - filp->f_pos;	/* Maximum read */
-	if(!(bh=sb_bread(inode->i_sb, le32_to_cpu(index_block->blocks[index]))))
-		return -EIO;
-	offset = filp->f_pos & 0x1fff;			/* Initial offset of block */
-
-	/* Let's read ! */
-	while (count > 0 && max > 0) {
-		/* Copy data to user buffer */
-		put_user(bh->b_data[offset], buf++);
-		/* Update counters */
-		max--;
-		count--;
-		filp->f_pos++;
-		offset++;
-		i++;
-		/* Offset touch end of block */
-		if (offset > PNLFS_BLOCK_SIZE) {
-			/* Stop if current block is final block */
-			if (index == inode->i_blocks) {
+
+	bno = le32_to_cpu(index_block->blocks[iblock]);
+	if (bno) {
+		/* Extend the mapping over the physically contiguous run */
+		max = bh_result->b_size >> inode->i_blkbits;
+		for (n = 1; n < max && iblock + n < entries; n++) {
+			if (le32_to_cpu(index_block->blocks[iblock + n]) !=
+			    bno + n)
+				break;
+		}
+		map_bh(bh_result, sb, bno);
+		bh_result->b_size = n << inode->i_blkbits;
+		goto out;
+	}
+
+	/* Nothing mapped here, reading gives zeroes */
+	if (!create) {
+		max = bh_result->b_size >> inode->i_blkbits;
+		for (n = 1; n < max && iblock + n < entries; n++) {
+			if (index_block->blocks[iblock + n])
 				break;
-			}
-			/* Get new block */
-			brelse(bh);
-			index++;
-			offset = 0;
-			bh = sb_bread(inode->i_sb,le32_to_cpu(blocks[index]));
-			if(!(bh))
-				return -EIO;
 		}
+		bh_result->b_size = n << inode->i_blkbits;
+		goto out;
 	}
-	*pos += i;											/* Update offset */
-	inode->i_atime = CURRENT_TIME;	/* Update inode */
+
+	ret = pnlfs_journal_access(sb, bh);
+	if (ret)
+		goto out;
+	/* The space reserved by delayed writes is not for us */
+	ret = pnlfs_claim_blocks(sb, 1);
+	if (ret)
+		goto out;
+	bno = pnlfs_reserv_new_block(sb);
+	pnlfs_unclaim_blocks(sb, 1);
+	if (bno == sb_info->nr_blocks) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	index_block->blocks[iblock] = cpu_to_le32(bno);
+	pnlfs_journal_dirty(sb, bh);
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+	set_buffer_new(bh_result);
+	map_bh(bh_result, sb, bno);
+	bh_result->b_size = 1 << inode->i_blkbits;
+out:
 	brelse(bh);
-	pr_info("%s : %d bytes red\n", __func__, i);
-	pr_info("%s End\n", __func__);
-	return i;
+	return ret;
 }
 
-/* Write block */
-ssize_t pnlfs_write(struct file *filp, const char __user *buf, size_t count,
-		    loff_t *pos)
+int pnlfs_get_block(struct inode *inode, sector_t iblock,
+		    struct buffer_head *bh_result, int create)
 {
-	struct inode *inode;
-	struct pnlfs_sb_info *sb_info;
-	struct super_block *sb;
-	struct pnlfs_inode_info *file_info;
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	handle_t *handle = NULL;
+	int ret;
+
+	if (create) {
+		handle = pnlfs_journal_start(inode->i_sb,
+					     PNLFS_JOURNAL_CREDITS);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		down_write(&inode_info->map_sem);
+	} else {
+		down_read(&inode_info->map_sem);
+	}
+
+	/* An inline file has no block, its data is never mapped */
+	if (inode_info->flags & PNLFS_INODE_INLINE)
+		ret = create ? -EIO : 0;
+	else if (inode_info->flags & PNLFS_INODE_EXTENTS)
+		ret = pnlfs_ext_get_block(inode, iblock, bh_result, create);
+	else
+		ret = pnlfs_map_get_block(inode, iblock, bh_result, create);
+
+	if (create) {
+		up_write(&inode_info->map_sem);
+		pnlfs_journal_stop(handle);
+	} else {
+		up_read(&inode_info->map_sem);
+	}
+	trace_pnlfs_get_block(inode, iblock, bh_result, create, ret);
+	return ret;
+}
+
+/*
+ * Free the blocks of an index block file which are past i_size. With a
+ * journal, each block freed dirties its bitmap group: the handle is
+ * extended as it goes, the index block being consistent at each step.
+ */
+static void pnlfs_map_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
 	struct pnlfs_file_index_block *index_block;
-	struct buffer_head *blk, *data;
-	int i = 0, *blocks;
-	int new_block;
-	loff_t offset, index;
+	struct buffer_head *bh;
+	int i, bno;
 
-	pr_info("%s Start\n", __func__);
+	bh = sb_bread(sb, PNLFS_I(inode)->index_block);
+	if (!bh)
+		return;
+	index_block = (struct pnlfs_file_index_block *) bh->b_data;
 
-	inode = file_inode(filp);	/* Get file inode */
-	sb = inode->i_sb;
-	if (inode->i_size == PNLFS_MAX_FILESIZE) /* Check for error */
-		return -EFBIG;
+	i = pnlfs_size_blocks(inode, inode->i_size);
+	for (; i < PNLFS_INDEX_ENTRIES(sb); i++) {
+		bno = le32_to_cpu(index_block->blocks[i]);
+		if (!bno)
+			continue;
+		if (pnlfs_journal_extend(sb, PNLFS_JOURNAL_CREDITS,
+					 &PNLFS_I(inode)->map_sem) ||
+		    pnlfs_journal_access(sb, bh))
+			break;
+		index_block->blocks[i] = 0;
+		pnlfs_journal_dirty(sb, bh);
+		pnlfs_free_block(sb, bno);
+		inode->i_blocks--;
+	}
+	brelse(bh);
+	mark_inode_dirty(inode);
+}
+
+/* Free the blocks of the file which are past i_size */
+void pnlfs_truncate_blocks(struct inode *inode)
+{
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	handle_t *handle;
 
-	file_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	sb_info = inode->i_sb->s_fs_info;
+	handle = pnlfs_journal_start(inode->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return;
+	down_write(&inode_info->map_sem);
+	if (inode_info->flags & PNLFS_INODE_EXTENTS)
+		pnlfs_ext_remove(inode, pnlfs_size_blocks(inode, inode->i_size),
+				 U32_MAX);
+	else if (!(inode_info->flags & PNLFS_INODE_INLINE))
+		pnlfs_map_truncate(inode);
+	up_write(&inode_info->map_sem);
+	pnlfs_journal_stop(handle);
+}
 
-	/* If Append mode, the offset is set to the end of file */
-  if (filp->f_flags & O_APPEND)
-		filp->f_pos = inode->i_size;
+/*****************************
+****address_space_operations
+*****************************/
 
-	/* Get blocks */
-	if (!(blk=sb_bread(inode->i_sb, file_info->index_block)))
-		return -EIO;
-	index_block = (struct pnlfs_file_index_block *) blk->b_data;
-	blocks = index_block->blocks;
+/* A block is a page, the counters are in pages */
+static int pnlfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
 
-	offset = filp->f_pos & 0x1fff;	/* Initial offset in the block */
-	index = filp->f_pos >> 12;			/* Initial index of the cursor */
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE)
+		return pnlfs_inline_readpage(inode, page);
+	pnlfs_stat_inc(inode->i_sb, PNLFS_STAT_BLOCKS_READ);
+	return mpage_readpage(page, pnlfs_get_block);
+}
 
-	/* Read the blocks */
-	data = sb_bread(inode->i_sb, le32_to_cpu(blocks[index]));
-	if (!data){
-		brelse(blk);
-		return -EIO;
+/*
+ * Called by the readahead code with the whole window: mpage asks
+ * pnlfs_get_block for long runs and submits each of them as one bio
+ * without waiting for the I/O.
+ */
+static int pnlfs_readpages(struct file *file, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	/* The pages are dropped, readpage fills page 0 of inline files */
+	if (PNLFS_I(mapping->host)->flags & PNLFS_INODE_INLINE)
+		return 0;
+	pnlfs_stat_add(mapping->host->i_sb, PNLFS_STAT_BLOCKS_READ, nr_pages);
+	return mpage_readpages(mapping, pages, nr_pages, pnlfs_get_block);
+}
+
+/*
+ * End of the write of a buffer. Unwritten blocks are written in place and
+ * stay unwritten until their data is on disk, a commit must not show them
+ * written before: they are queued to pnlfs_conv_work, which marks them
+ * written and only then ends their write. The writeback of the page, and
+ * so fsync, waits for it.
+ */
+static void pnlfs_end_buffer_write(struct buffer_head *bh, int uptodate)
+{
+	struct inode *inode = bh->b_page->mapping->host;
+	struct pnlfs_sb_info *sb_info = PNLFS_SB(inode->i_sb);
+	unsigned long flags;
+
+	if (!uptodate || !buffer_unwritten(bh)) {
+		end_buffer_async_write(bh, uptodate);
+		return;
+	}
+	spin_lock_irqsave(&sb_info->conv_lock, flags);
+	bh->b_private = sb_info->conv_list;
+	sb_info->conv_list = bh;
+	spin_unlock_irqrestore(&sb_info->conv_lock, flags);
+	queue_work(pnlfs_conv_wq, &sb_info->conv_work);
+}
+
+/* Mark written the blocks queued by pnlfs_end_buffer_write, in one handle */
+void pnlfs_conv_work(struct work_struct *work)
+{
+	struct pnlfs_sb_info *sb_info = container_of(work, struct pnlfs_sb_info,
+						     conv_work);
+	struct buffer_head *list, *bh;
+	struct inode *inode;
+	handle_t *handle;
+	u32 iblock;
+
+	spin_lock_irq(&sb_info->conv_lock);
+	list = sb_info->conv_list;
+	sb_info->conv_list = NULL;
+	spin_unlock_irq(&sb_info->conv_lock);
+	if (!list)
+		return;
+
+	/* The pages are under writeback, neither truncated nor evicted */
+	handle = pnlfs_journal_start(sb_info->sb, PNLFS_JOURNAL_CREDITS);
+	for (bh = list; bh && !IS_ERR(handle); bh = bh->b_private) {
+		inode = bh->b_page->mapping->host;
+		iblock = ((u32) bh->b_page->index <<
+			  (PAGE_SHIFT - inode->i_blkbits)) +
+			 (bh_offset(bh) >> inode->i_blkbits);
+		down_write(&PNLFS_I(inode)->map_sem);
+		if (!pnlfs_ext_convert(inode, iblock, iblock + 1))
+			clear_buffer_unwritten(bh);
+		up_write(&PNLFS_I(inode)->map_sem);
+	}
+	if (!IS_ERR(handle))
+		pnlfs_journal_stop(handle);
+
+	/* A block left unwritten would read as zeroes, its write failed */
+	while (list) {
+		bh = list;
+		list = bh->b_private;
+		bh->b_private = NULL;
+		if (buffer_unwritten(bh))
+			pr_err("%s : block %llu not marked written\n", __func__,
+			       (unsigned long long) bh->b_blocknr);
+		end_buffer_async_write(bh, !buffer_unwritten(bh));
+	}
+}
+
+/*
+ * block_write_full_page, with pnlfs_end_buffer_write. The part of the
+ * page past i_size is zeroed, a page past it is dropped.
+ */
+static int pnlfs_write_full_page(struct page *page,
+				 struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	pgoff_t end_index = size >> PAGE_SHIFT;
+	unsigned int offset = size & (PAGE_SIZE - 1);
+
+	if (page->index > end_index || (page->index == end_index && !offset)) {
+		pnlfs_da_invalidatepage(page, 0, PAGE_SIZE);
+		unlock_page(page);
+		return 0;
+	}
+	if (page->index == end_index)
+		zero_user_segment(page, offset, PAGE_SIZE);
+	return __block_write_full_page(inode, page, pnlfs_get_block, wbc,
+				       pnlfs_end_buffer_write);
+}
+
+static int pnlfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+
+	/* Reclaim in a handle, allocating here could wait for its commit */
+	if (PNLFS_SB(inode->i_sb)->journal && current->journal_info) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE)
+		return pnlfs_inline_writepage(inode, page);
+	pnlfs_stat_inc(inode->i_sb, PNLFS_STAT_BLOCKS_WRITTEN);
+	return pnlfs_write_full_page(page, wbc);
+}
+
+/* Drop what a failed write allocated past the end of file */
+static void pnlfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if (to > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		pnlfs_truncate_blocks(inode);
+	}
+}
+
+static int pnlfs_write_begin(struct file *file, struct address_space *mapping,
+			     loff_t pos, unsigned len, unsigned flags,
+			     struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	int ret;
+
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE) {
+		if (pos + len <= pnlfs_inline_size(inode->i_sb))
+			return pnlfs_inline_write_begin(mapping, flags, pagep);
+		ret = pnlfs_inline_convert(inode);
+		if (ret)
+			return ret;
+	}
+
+	/* Files with an extent tree get their blocks at writeback */
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+		PNLFS_I(inode)->flags & PNLFS_INODE_EXTENTS ?
+		pnlfs_da_get_block_prep : pnlfs_get_block);
+	if (ret < 0)
+		pnlfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+static int pnlfs_write_end(struct file *file, struct address_space *mapping,
+			   loff_t pos, unsigned len, unsigned copied,
+			   struct page *page, void *fsdata)
+{
+	int ret;
+
+	if (PNLFS_I(mapping->host)->flags & PNLFS_INODE_INLINE)
+		return pnlfs_inline_write_end(mapping, pos, copied, page);
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret < len)
+		pnlfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+/* Given to end_io in b_private: the write went to unwritten blocks */
+#define PNLFS_DIO_UNWRITTEN ((void *) 1)
+
+/*
+ * get_block of the direct writes. Unwritten blocks are written in place
+ * and only marked written by end_io, once the data is on disk, which is
+ * done from a workqueue for AIO. Holes inside i_size are not filled
+ * (create is 0 there), direct I/O then falls back to the page cache.
+ * The blocks taken past i_size are claimed first by the get_block of
+ * the file, so the space reserved by delayed pages stays theirs.
+ */
+static int pnlfs_dio_get_block_write(struct inode *inode, sector_t iblock,
+				     struct buffer_head *bh_result, int create)
+{
+	int ret;
+
+	ret = pnlfs_get_block(inode, iblock, bh_result, 0);
+	if (ret || buffer_mapped(bh_result))
+		return ret;
+	if (buffer_unwritten(bh_result)) {
+		map_bh(bh_result, inode->i_sb, bh_result->b_blocknr);
+		set_buffer_defer_completion(bh_result);
+		bh_result->b_private = PNLFS_DIO_UNWRITTEN;
+		return 0;
 	}
+	if (!create)
+		return 0;
+	return pnlfs_get_block(inode, iblock, bh_result, 1);
+}
+
+static int pnlfs_dio_end_io(struct kiocb *iocb, loff_t offset, ssize_t size,
+			    void *private)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	handle_t *handle;
+	int err;
+
+	if (private != PNLFS_DIO_UNWRITTEN || size <= 0)
+		return 0;
+	handle = pnlfs_journal_start(inode->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	down_write(&inode_info->map_sem);
+	err = pnlfs_ext_convert(inode, offset >> inode->i_blkbits,
+				pnlfs_size_blocks(inode, offset + size));
+	up_write(&inode_info->map_sem);
+	pnlfs_journal_stop(handle);
+	return err;
+}
+
+/*
+ * O_DIRECT. The VFS has written back and invalidated the range, so there
+ * is no delayed block in it. Each run of contiguous blocks mapped by
+ * get_block becomes one bio. Inline files return 0, the VFS then goes
+ * through the page cache.
+ */
+static ssize_t pnlfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+	size_t count = iov_iter_count(iter);
+	loff_t offset = iocb->ki_pos;
+	ssize_t ret;
+
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE)
+		return 0;
 
-	/* Let's write ! */
-	while (count > 0 && inode->i_size < PNLFS_MAX_FILESIZE) {
-		/* Get data from the user buffer */
-		get_user(data->b_data[offset], buf++);
-		/* Update counter */
-		count--;
-		offset++;
-		filp->f_pos++;
-		i++;
-		/* If offset touch the end of block */
-		if (offset > PNLFS_BLOCK_SIZE) {
-			/* Mark the buffer as dirty */
-			mark_buffer_dirty(data);
-			brelse(data);
-			index++;
-			/* If index touch the number of blocks reserved to the inode */
-			if (index == inode->i_blocks) {
-				new_block = pnlfs_reserv_new_block(sb);
-				if (new_block == sb_info->nr_blocks)
-					return -ENOSPC;
-				blocks[index] = cpu_to_le32(new_block);
-				inode->i_blocks++;
-				mark_buffer_dirty(blk);
-			}
-			/* Read new block */
-			data = sb_bread(inode->i_sb,le32_to_cpu(blocks[index]));
-			if (!data){
-				brelse(blk);
-				return -EIO;
-			}
-			/* Reset the offset */
-			offset = 0;
+	if (iov_iter_rw(iter) == READ)
+		return blockdev_direct_IO(iocb, inode, iter, pnlfs_get_block);
+
+	ret = __blockdev_direct_IO(iocb, inode, inode->i_sb->s_bdev, iter,
+				   pnlfs_dio_get_block_write, pnlfs_dio_end_io,
+				   NULL, DIO_LOCKING | DIO_SKIP_HOLES);
+	if (ret < 0)
+		pnlfs_write_failed(mapping, offset + count);
+	return ret;
+}
+
+static sector_t pnlfs_bmap(struct address_space *mapping, sector_t block)
+{
+	/* Delayed blocks have no place on disk yet */
+	if (READ_ONCE(PNLFS_I(mapping->host)->da_reserved))
+		filemap_write_and_wait(mapping);
+	return generic_block_bmap(mapping, block, pnlfs_get_block);
+}
+
+struct address_space_operations pnlfs_aops = {
+	.readpage = pnlfs_readpage,
+	.readpages = pnlfs_readpages,
+	.writepage = pnlfs_writepage,
+	.write_begin = pnlfs_write_begin,
+	.write_end = pnlfs_write_end,
+	.invalidatepage = pnlfs_da_invalidatepage,
+	.direct_IO = pnlfs_direct_IO,
+	.bmap = pnlfs_bmap,
+};
+
+/* The latency goes to the histogram of the mount and to the event */
+static ssize_t pnlfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	ret = generic_file_read_iter(iocb, to);
+	pnlfs_stat_latency(inode->i_sb, PNLFS_HIST_READ, start);
+	if (trace_pnlfs_read_enabled())
+		trace_pnlfs_read(inode, pos, count, ret,
+				 ktime_get_ns() - start);
+	return ret;
+}
+
+static ssize_t pnlfs_file_write_iter(struct kiocb *iocb,
+				     struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	ret = generic_file_write_iter(iocb, from);
+	pnlfs_stat_latency(inode->i_sb, PNLFS_HIST_WRITE, start);
+	if (trace_pnlfs_write_enabled())
+		trace_pnlfs_write(inode, pos, count, ret,
+				  ktime_get_ns() - start);
+	return ret;
+}
+
+/*
+ * Look at the blocks of [iblock, end). Returns 1 if iblock holds data, 0
+ * if it is a hole, len being the number of blocks from iblock in the same
+ * case. A block is a page: a dirty page over a hole is data, it may be a
+ * delayed block or a page written through mmap which gets its block at
+ * writeback.
+ */
+static int pnlfs_seek_run(struct inode *inode, u32 iblock, u32 end, u32 *len)
+{
+	struct buffer_head bh = { .b_state = 0 };
+	struct page *page;
+	pgoff_t index = iblock;
+	int err;
+
+	bh.b_size = (size_t) (end - iblock) << inode->i_blkbits;
+	err = pnlfs_get_block(inode, iblock, &bh, 0);
+	if (err)
+		return err;
+	*len = bh.b_size >> inode->i_blkbits;
+	if (buffer_mapped(&bh))
+		return 1;
+
+	if (!find_get_pages_tag(inode->i_mapping, &index, PAGECACHE_TAG_DIRTY,
+				1, &page))
+		return 0;
+	index = page->index;
+	put_page(page);
+	if (index == iblock) {
+		*len = 1;
+		return 1;
+	}
+	if (index < iblock + *len)
+		*len = index - iblock;
+	return 0;
+}
+
+/* Offset of the first data or hole at or after offset, i_mutex held */
+static loff_t pnlfs_seek_hole_data(struct inode *inode, loff_t offset,
+				   int whence)
+{
+	loff_t size = i_size_read(inode);
+	u32 iblock, end, len;
+	int ret;
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+	/* The whole of an inline file is data */
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE)
+		return whence == SEEK_DATA ? offset : size;
+
+	iblock = offset >> inode->i_blkbits;
+	end = pnlfs_size_blocks(inode, size);
+	while (iblock < end) {
+		ret = pnlfs_seek_run(inode, iblock, end, &len);
+		if (ret < 0)
+			return ret;
+		if (ret == (whence == SEEK_DATA))
+			return max_t(loff_t, offset,
+				     (loff_t) iblock << inode->i_blkbits);
+		iblock += len;
+	}
+	/* There is a virtual hole at the end of file */
+	return whence == SEEK_DATA ? -ENXIO : size;
+}
+
+static loff_t pnlfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	inode_lock(inode);
+	offset = pnlfs_seek_hole_data(inode, offset, whence);
+	inode_unlock(inode);
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Zero [from, to), inside one block, when the block holds data on disk.
+ * Holes and unwritten blocks read as zeroes already, their pages in cache
+ * are zeroed by truncate_pagecache_range.
+ */
+static int pnlfs_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+	struct buffer_head bh = { .b_size = inode->i_sb->s_blocksize };
+	struct page *page;
+	int err;
+
+	if (from >= to)
+		return 0;
+	err = pnlfs_get_block(inode, from >> inode->i_blkbits, &bh, 0);
+	if (err || !buffer_mapped(&bh))
+		return err;
+
+	page = read_mapping_page(inode->i_mapping, from >> PAGE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	zero_user(page, from & (PAGE_SIZE - 1), to - from);
+	set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+	return 0;
+}
+
+/* Free the blocks of [offset, end), the partial blocks are zeroed */
+static int pnlfs_punch_hole(struct inode *inode, loff_t offset, loff_t end)
+{
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	u32 first = pnlfs_size_blocks(inode, offset);
+	u32 last = end >> inode->i_blkbits;
+	handle_t *handle;
+	int err;
+
+	if (first > last) {
+		err = pnlfs_zero_partial(inode, offset, end);
+	} else {
+		err = pnlfs_zero_partial(inode, offset,
+					 (loff_t) first << inode->i_blkbits);
+		if (!err)
+			err = pnlfs_zero_partial(inode,
+				(loff_t) last << inode->i_blkbits, end);
+	}
+	if (err)
+		return err;
+
+	/* Delayed blocks of the pages dropped lose their reservation */
+	truncate_pagecache_range(inode, offset, end - 1);
+	if (first >= last)
+		return 0;
+	handle = pnlfs_journal_start(inode->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	down_write(&inode_info->map_sem);
+	err = pnlfs_ext_remove(inode, first, last);
+	up_write(&inode_info->map_sem);
+	pnlfs_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Preallocate unwritten blocks, the size growing unless KEEP_SIZE is
+ * set, or punch a hole. Only for files mapped by an extent tree, inline
+ * files are converted first.
+ */
+static long pnlfs_fallocate(struct file *file, int mode, loff_t offset,
+			    loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	loff_t end = offset + len;
+	handle_t *handle;
+	int err;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	if (end > inode->i_sb->s_maxbytes)
+		return -EFBIG;
+
+	inode_lock(inode);
+	if (inode_info->flags & PNLFS_INODE_INLINE) {
+		err = pnlfs_inline_convert(inode);
+		if (err)
+			goto out;
+	}
+	/* An index block has no room to flag a block unwritten */
+	if (!(inode_info->flags & PNLFS_INODE_EXTENTS)) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		err = pnlfs_punch_hole(inode, offset, end);
+	} else {
+		handle = pnlfs_journal_start(inode->i_sb,
+					     PNLFS_JOURNAL_CREDITS);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			goto out;
 		}
+		down_write(&inode_info->map_sem);
+		err = pnlfs_ext_prealloc(inode, offset >> inode->i_blkbits,
+					 pnlfs_size_blocks(inode, end));
+		up_write(&inode_info->map_sem);
+		pnlfs_journal_stop(handle);
+		if (!err && !(mode & FALLOC_FL_KEEP_SIZE) &&
+		    end > i_size_read(inode))
+			i_size_write(inode, end);
 	}
-	/* Update counter and inode information */
-	*pos += i;
-	if (filp->f_pos > inode->i_size) {
-		inode->i_size = filp->f_pos;
+	if (!err) {
+		inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(inode);
 	}
+out:
+	inode_unlock(inode);
+	return err;
+}
 
- 	mark_inode_dirty(inode);
-	brelse(blk);
-	mark_buffer_dirty(data);
-	brelse(data);
+/*
+ * With a journal, the data is written and waited for, then the commit
+ * of the last transaction which changed the inode: its metadata and the
+ * blocks allocated for the data.
+ */
+static int pnlfs_fsync(struct file *file, loff_t start, loff_t end,
+		       int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	int err;
 
-	pr_info("%s : %d bytes written\n", __func__, i);
-	pr_info("%s : End\n", __func__);
+	if (!PNLFS_SB(inode->i_sb)->journal)
+		return generic_file_fsync(file, start, end, datasync);
+	err = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (err)
+		return err;
+	return pnlfs_journal_sync_inode(inode);
+}
+
+/*
+ * A page of a shared mapping becomes writable: it gets its blocks, or its
+ * reservation for a file with an extent tree, as write() would, so that
+ * a full disk fails the fault and not writeback.
+ */
+static int pnlfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	int err;
 
-	return i;
+	/* Written back in the inode, an mmap cannot grow the file */
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE)
+		return filemap_page_mkwrite(vma, vmf);
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vma->vm_file);
+	err = block_page_mkwrite(vma, vmf,
+		PNLFS_I(inode)->flags & PNLFS_INODE_EXTENTS ?
+		pnlfs_da_get_block_prep : pnlfs_get_block);
+	sb_end_pagefault(inode->i_sb);
+	return block_page_mkwrite_return(err);
 }
 
+static const struct vm_operations_struct pnlfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = pnlfs_page_mkwrite,
+};
 
+static int pnlfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &pnlfs_file_vm_ops;
+	return 0;
+}
+
+/* Regular files go through the page cache */
 struct file_operations i_fop = {
+	.llseek = pnlfs_file_llseek,
+	.read_iter = pnlfs_file_read_iter,
+	.write_iter = pnlfs_file_write_iter,
+	.mmap = pnlfs_file_mmap,
+	.fsync = pnlfs_fsync,
+	/* sendfile and splice move page cache pages without a user copy */
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.fallocate = pnlfs_fallocate,
+};
+
+struct file_operations d_fop = {
+	.llseek = pnlfs_dir_llseek,
+	.read = generic_read_dir,
 	.iterate_shared = pnlfs_iterate_shared,
-	.read = pnlfs_read,
-	.write = pnlfs_write
+	.fsync = pnlfs_fsync,
 };
@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libpnlfs.h"
+
+/*
+ * Check a pnlfs image and repair what can be repaired.
+ *
+ * usage: fsck.pnlfs [-f] [-n] [-t threads] image
+ *
+ * Pass 1 cuts the inode store in ranges taken by the workers. Each inode
+ * in use sets its blocks in a map of the blocks referenced, a block set
+ * twice is reported, and each directory sets the inodes it names in a
+ * map of its own. Pass 2 settles the inodes the inode bitmap and the
+ * directories disagree on: named but marked free, or in use and named
+ * nowhere. Pass 3 compares both maps with the bitmaps of the image a
+ * word at a time, in parallel, and rewrites the words which differ. The
+ * free counts of the superblock are then set from the maps.
+ *
+ * Only the inode store, the bitmaps and the index blocks are read, never
+ * the data. They are read through the mapping of the image, each range
+ * of the store asked for as a whole before it is scanned.
+ *
+ * The data of the regular files is counted in runs of contiguous blocks,
+ * in the order of the file: a file in more than one run is fragmented.
+ *
+ * An image marked clean is not checked without -f. Exit status is that
+ * of fsck(8): 0 nothing wrong, 1 errors fixed, 4 errors left, 8 the check
+ * could not be done.
+ */
+
+#define FSCK_OK             0
+#define FSCK_FIXED          1
+#define FSCK_LEFT           4
+#define FSCK_ERROR          8
+
+#define CHUNK_INODES  (1 << 14)         /* Inodes scanned by a pass 1 job */
+#define CHUNK_WORDS   (1 << 15)         /* Bitmap words of a pass 3 job */
+
+static struct pnlfs_image img;
+static int repair = 1;
+
+/* A set bit for an item in use, the opposite of the bitmaps on disk */
+static uint64_t *bmap;                  /* Blocks referenced */
+static uint64_t *imap;                  /* Inodes in use */
+static uint64_t *inamed;                /* Inodes named by a directory */
+static uint64_t *ibad;                  /* Inodes without a valid record */
+static uint32_t nr_bwords, nr_iwords;   /* Rounded up to 8 words */
+static int dup_blocks;                  /* A block belongs to two inodes */
+static unsigned long nr_data_files;     /* Regular files with blocks */
+static unsigned long nr_data_runs, nr_fragmented;
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nr_fixed, nr_left;
+static uint32_t next_job;
+
+/* Inodes left to settle by pass 2 */
+static uint32_t *todo;
+static size_t nr_todo, todo_size;
+static int in_pass2;
+
+/*
+ * Report a problem, fixable or not. Returns 1 if the caller must fix it,
+ * which it does only when the image is open for repair.
+ */
+static int problem(int fixable, const char *fmt, ...)
+{
+	int fix = fixable && repair;
+	va_list ap;
+
+	pthread_mutex_lock(&out_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(fix ? ", fixed\n" : fixable ? ", not fixed\n" : "\n");
+	if (fix)
+		nr_fixed++;
+	else
+		nr_left++;
+	pthread_mutex_unlock(&out_lock);
+	return fix;
+}
+
+static inline int test_bit(const uint64_t *map, uint32_t bit)
+{
+	return !!(__atomic_load_n(&map[bit / 64], __ATOMIC_RELAXED) &
+		  (1ULL << (bit % 64)));
+}
+
+static inline int test_and_set(uint64_t *map, uint32_t bit)
+{
+	uint64_t mask = 1ULL << (bit % 64);
+
+	return !!(__atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED) &
+		  mask);
+}
+
+static inline void clear(uint64_t *map, uint32_t bit)
+{
+	__atomic_fetch_and(&map[bit / 64], ~(1ULL << (bit % 64)),
+			   __ATOMIC_RELAXED);
+}
+
+/* Mask of n bits from bit off of a word, n + off <= 64 */
+static inline uint64_t word_mask(uint32_t off, uint32_t n)
+{
+	return (n == 64 ? ~0ULL : (1ULL << n) - 1) << off;
+}
+
+/* Set [bit, bit + len) a word at a time, returns the bits already set */
+static uint32_t set_range(uint64_t *map, uint32_t bit, uint32_t len)
+{
+	uint32_t n, dup = 0;
+	uint64_t mask, old;
+
+	while (len) {
+		n = 64 - bit % 64 < len ? 64 - bit % 64 : len;
+		mask = word_mask(bit % 64, n);
+		old = __atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED);
+		dup += __builtin_popcountll(old & mask);
+		bit += n;
+		len -= n;
+	}
+	return dup;
+}
+
+static void clear_range(uint64_t *map, uint32_t bit, uint32_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		n = 64 - bit % 64 < len ? 64 - bit % 64 : len;
+		__atomic_fetch_and(&map[bit / 64], ~word_mask(bit % 64, n),
+				   __ATOMIC_RELAXED);
+		bit += n;
+		len -= n;
+	}
+}
+
+/* Bits set among the nr_bits first of the map */
+static uint32_t count_set(const uint64_t *map, uint32_t nr_bits)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < nr_bits / 64; i++)
+		n += __builtin_popcountll(map[i]);
+	if (nr_bits % 64)
+		n += __builtin_popcountll(map[i] & word_mask(0, nr_bits % 64));
+	return n;
+}
+
+static void push_todo(uint32_t ino)
+{
+	uint32_t *p;
+
+	if (nr_todo == todo_size) {
+		todo_size = todo_size ? todo_size * 2 : 1024;
+		p = realloc(todo, todo_size * sizeof(*todo));
+		if (!p) {
+			perror("fsck.pnlfs");
+			exit(FSCK_ERROR);
+		}
+		todo = p;
+	}
+	todo[nr_todo++] = ino;
+}
+
+struct block_walk {
+	uint32_t ino;
+	uint32_t data;                  /* Data blocks, for nr_used_blocks */
+	uint32_t dup;
+	uint32_t runs;                  /* Of contiguous data blocks */
+	uint32_t next;                  /* Block after the last data run */
+};
+
+static int mark_blocks(void *priv, uint32_t bno, uint32_t len, int meta)
+{
+	struct block_walk *w = priv;
+
+	w->dup += set_range(bmap, bno, len);
+	if (!meta) {
+		if (!w->data || bno != w->next)
+			w->runs++;
+		w->next = bno + len;
+		w->data += len;
+	}
+	return 0;
+}
+
+static int release_blocks(void *priv, uint32_t bno, uint32_t len, int meta)
+{
+	clear_range(bmap, bno, len);
+	return 0;
+}
+
+struct name_walk {
+	uint32_t dir;
+	uint32_t nr;                    /* Names of the directory */
+};
+
+static int name_actor(void *priv, const char *name, int len, uint32_t ino,
+		      unsigned int type)
+{
+	struct name_walk *w = priv;
+
+	w->nr++;
+	if (!ino || ino >= img.nr_inodes) {
+		problem(0, "Directory %u: %.*s is inode %u, out of the store",
+			w->dir, len, name, ino);
+		return 0;
+	}
+	/* There are no hard links, a second name is corruption */
+	if (test_and_set(inamed, ino))
+		problem(0, "Inode %u has more than one name, one is %.*s in "
+			"directory %u", ino, len, name, w->dir);
+	else if (in_pass2 && !test_bit(imap, ino))
+		push_todo(ino);
+	return 0;
+}
+
+/* Mark the blocks of an inode in use and check its counts */
+static void check_inode(uint32_t ino, struct pnlfs_stat *st)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(&img, ino);
+	struct block_walk bw = { ino, 0, 0, 0, 0 };
+	struct name_walk nw = { ino, 0 };
+	int err;
+
+	if ((st->flags & PNLFS_INODE_INLINE) &&
+	    (!S_ISREG(st->mode) || st->size > pnlfs_inline_size(&img))) {
+		problem(0, "Inode %u: bad inline data", ino);
+		return;
+	}
+
+	err = pnlfs_walk_blocks(&img, st, mark_blocks, &bw);
+	if (err)
+		problem(0, "Inode %u: index corrupted (%s)", ino,
+			strerror(-err));
+	if (bw.dup) {
+		__atomic_store_n(&dup_blocks, 1, __ATOMIC_RELAXED);
+		problem(0, "Inode %u: %u blocks also used elsewhere", ino,
+			bw.dup);
+	}
+
+	if (S_ISREG(st->mode)) {
+		if (!err && bw.runs) {
+			__atomic_add_fetch(&nr_data_files, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&nr_data_runs, bw.runs,
+					   __ATOMIC_RELAXED);
+			if (bw.runs > 1)
+				__atomic_add_fetch(&nr_fragmented, 1,
+						   __ATOMIC_RELAXED);
+		}
+		if (!err && bw.data != st->nr_entries &&
+		    problem(1, "Inode %u: %u blocks used, counted %u", ino,
+			    st->nr_entries, bw.data))
+			raw->nr_used_blocks = htole32(bw.data);
+		return;
+	}
+
+	err = pnlfs_iterate(&img, ino, name_actor, &nw);
+	if (err)
+		problem(0, "Directory %u: corrupted (%s)", ino, strerror(-err));
+	else if (nw.nr != st->nr_entries &&
+		 problem(1, "Directory %u: %u entries, counted %u", ino,
+			 st->nr_entries, nw.nr))
+		raw->nr_entries = htole32(nw.nr);
+}
+
+/* Pass 1: the inodes in use of a range of the store */
+static void scan_inodes(uint32_t first, uint32_t end)
+{
+	uint32_t store = 1 + first / img.inodes_per_block;
+	uint32_t nr = (end - first + img.inodes_per_block - 1) /
+		img.inodes_per_block;
+	struct pnlfs_stat st;
+	uint32_t ino;
+
+	if (first / img.inodes_per_block < img.istore_init) {
+		if (nr > img.istore_init - first / img.inodes_per_block)
+			nr = img.istore_init - first / img.inodes_per_block;
+		madvise(pnlfs_block(&img, store),
+			(size_t) nr * img.block_size, MADV_WILLNEED);
+	}
+
+	for (ino = first; ino < end; ino++) {
+		/* Whole words of free inodes are skipped */
+		if (!(ino % 64) && !imap[ino / 64]) {
+			ino += 63;
+			continue;
+		}
+		if (!test_bit(imap, ino))
+			continue;
+		/* Settled in pass 2, once the names are known */
+		if (pnlfs_stat(&img, ino, &st)) {
+			test_and_set(ibad, ino);
+			continue;
+		}
+		check_inode(ino, &st);
+	}
+}
+
+static void *pass1_worker(void *arg)
+{
+	uint64_t first;
+
+	for (;;) {
+		first = (uint64_t) __atomic_fetch_add(&next_job, 1,
+						      __ATOMIC_RELAXED) *
+			CHUNK_INODES;
+		if (first >= img.nr_inodes)
+			return NULL;
+		scan_inodes(first, img.nr_inodes - first < CHUNK_INODES ?
+			    img.nr_inodes : first + CHUNK_INODES);
+	}
+}
+
+static int unname_actor(void *priv, const char *name, int len, uint32_t ino,
+			unsigned int type)
+{
+	if (ino && ino < img.nr_inodes) {
+		clear(inamed, ino);
+		push_todo(ino);
+	}
+	return 0;
+}
+
+/* Pass 2: an inode whose bitmap bit and names disagree */
+static void settle_inode(uint32_t ino)
+{
+	int named = test_bit(inamed, ino), used = test_bit(imap, ino);
+	int bad = test_bit(ibad, ino);
+	struct pnlfs_stat st;
+
+	if (named && !used) {
+		/* A record never written or garbage cannot be trusted */
+		if (bad || pnlfs_stat(&img, ino, &st)) {
+			problem(0, "Inode %u is named but has no valid record",
+				ino);
+			return;
+		}
+		problem(1, "Inode %u is in use but marked free", ino);
+		test_and_set(imap, ino);
+		check_inode(ino, &st);
+	} else if (!named && used) {
+		problem(1, "Inode %u is %s and in no directory", ino,
+			bad ? "not valid" : "in use");
+		clear(imap, ino);
+		if (bad)
+			return;
+		pnlfs_stat(&img, ino, &st);
+		/* With shared blocks, what is released may be someone's */
+		if (!dup_blocks)
+			pnlfs_walk_blocks(&img, &st, release_blocks, NULL);
+		if (S_ISDIR(st.mode))
+			pnlfs_iterate(&img, ino, unname_actor, NULL);
+	} else if (named && bad) {
+		problem(0, "Inode %u is named but has no valid record", ino);
+	}
+}
+
+static void pass2(void)
+{
+	uint32_t w, ino;
+	uint64_t diff;
+
+	in_pass2 = 1;
+	for (w = 0; w < nr_iwords; w++) {
+		diff = (imap[w] ^ inamed[w]) | (ibad[w] & inamed[w]);
+		for (; diff; diff &= diff - 1) {
+			ino = w * 64 + __builtin_ctzll(diff);
+			if (ino < img.nr_inodes)
+				push_todo(ino);
+		}
+	}
+	while (nr_todo)
+		settle_inode(todo[--nr_todo]);
+}
+
+struct diff {
+	uint32_t marked_free;           /* In use but free on disk */
+	uint32_t marked_used;           /* Free but in use on disk */
+};
+
+static struct diff bdiff, idiff;
+
+/*
+ * Compare words [first, end) of a map with the bitmap on disk, end - first
+ * being a multiple of 8. Eight words at a time are folded in one, which
+ * the compiler turns into vector instructions; only the rare groups which
+ * differ are looked at word by word.
+ */
+static void compare_words(const uint64_t *map, uint64_t *disk,
+			  uint32_t first, uint32_t end, struct diff *d)
+{
+	uint32_t i, j, marked_free = 0, marked_used = 0;
+	uint64_t acc, x;
+
+	for (i = first; i < end; i += 8) {
+		acc = 0;
+		for (j = 0; j < 8; j++)
+			acc |= disk[i + j] ^ htole64(~map[i + j]);
+		if (!acc)
+			continue;
+		for (j = i; j < i + 8; j++) {
+			x = le64toh(disk[j]) ^ ~map[j];
+			marked_free += __builtin_popcountll(x & map[j]);
+			marked_used += __builtin_popcountll(x & ~map[j]);
+			if (repair)
+				disk[j] = htole64(~map[j]);
+		}
+	}
+	__atomic_add_fetch(&d->marked_free, marked_free, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->marked_used, marked_used, __ATOMIC_RELAXED);
+}
+
+static void *pass3_worker(void *arg)
+{
+	uint32_t ijobs = (nr_iwords + CHUNK_WORDS - 1) / CHUNK_WORDS;
+	uint32_t bjobs = (nr_bwords + CHUNK_WORDS - 1) / CHUNK_WORDS;
+	uint32_t job, first, nr_words;
+	const uint64_t *map;
+	uint64_t *disk;
+	struct diff *d;
+
+	for (;;) {
+		job = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+		if (job < ijobs) {
+			map = imap;
+			disk = pnlfs_block(&img, img.ifree_start);
+			nr_words = nr_iwords;
+			d = &idiff;
+		} else if (job - ijobs < bjobs) {
+			job -= ijobs;
+			map = bmap;
+			disk = pnlfs_block(&img, img.bfree_start);
+			nr_words = nr_bwords;
+			d = &bdiff;
+		} else {
+			return NULL;
+		}
+		first = job * CHUNK_WORDS;
+		compare_words(map, disk, first, nr_words - first < CHUNK_WORDS ?
+			      nr_words : first + CHUNK_WORDS, d);
+	}
+}
+
+/*
+ * The bits past nr_bits of the last words are not ours, take them from
+ * the disk so that they compare equal and are written back as they are.
+ */
+static void fill_tail(uint64_t *map, const uint64_t *disk, uint32_t nr_bits,
+		      uint32_t nr_words)
+{
+	uint32_t i = nr_bits / 64;
+
+	if (nr_bits % 64) {
+		map[i] = (map[i] & word_mask(0, nr_bits % 64)) |
+			(~le64toh(disk[i]) & ~word_mask(0, nr_bits % 64));
+		i++;
+	}
+	for (; i < nr_words; i++)
+		map[i] = ~le64toh(disk[i]);
+}
+
+static int run_workers(void *(*fn)(void *), long nr_threads)
+{
+	pthread_t *threads = calloc(nr_threads, sizeof(*threads));
+	long i;
+	int err = 0;
+
+	if (!threads)
+		return ENOMEM;
+	next_job = 0;
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&threads[i], NULL, fn, NULL);
+		if (err)
+			break;
+	}
+	/* The jobs left are taken by the threads which did start */
+	if (err && i)
+		err = 0;
+	while (i--)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	return err;
+}
+
+static uint64_t *alloc_map(uint32_t nr_words)
+{
+	return calloc(nr_words, sizeof(uint64_t));
+}
+
+static void usage(const char *appname)
+{
+	fprintf(stderr,
+		"Usage: %s [-f] [-n] [-t threads] image\n"
+		"\t-f: check even if the image is marked clean\n"
+		"\t-n: report only, the image is opened read-only\n"
+		"\t-t: threads of passes 1 and 3 (default: online CPUs)\n",
+		appname);
+}
+
+int main(int argc, char **argv)
+{
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct pnlfs_superblock *sb;
+	struct pnlfs_stat root;
+	struct timespec t0, t1;
+	uint64_t *disk_imap, *disk_bmap;
+	uint32_t used_inodes, used_blocks, meta, jstart, jlen, i;
+	int opt, force = 0, err;
+
+	while ((opt = getopt(argc, argv, "fnt:")) != -1) {
+		switch (opt) {
+		case 'f':
+			force = 1;
+			break;
+		case 'n':
+			repair = 0;
+			break;
+		case 't':
+			nr_threads = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return FSCK_ERROR;
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1) {
+		usage(argv[0]);
+		return FSCK_ERROR;
+	}
+
+	err = -pnlfs_open(&img, argv[optind], repair);
+	if (err == EUCLEAN || (!err && img.needs_recovery)) {
+		fprintf(stderr, "fsck.pnlfs: %s: the journal needs recovery, "
+			"mount the filesystem once to replay it\n",
+			argv[optind]);
+		return FSCK_ERROR;
+	}
+	if (err) {
+		fprintf(stderr, "fsck.pnlfs: %s: %s\n", argv[optind],
+			strerror(err));
+		return FSCK_ERROR;
+	}
+	sb = img.sb;
+	if (!force && (le32toh(sb->state) & PNLFS_STATE_CLEAN)) {
+		printf("%s: clean, %u/%u inodes, %u/%u blocks\n", argv[optind],
+		       img.nr_inodes - le32toh(sb->nr_free_inodes),
+		       img.nr_inodes, img.nr_blocks -
+		       le32toh(sb->nr_free_blocks), img.nr_blocks);
+		pnlfs_close(&img);
+		return FSCK_OK;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	nr_iwords = ((img.nr_inodes + 63) / 64 + 7) & ~7U;
+	nr_bwords = ((img.nr_blocks + 63) / 64 + 7) & ~7U;
+	imap = alloc_map(nr_iwords);
+	inamed = alloc_map(nr_iwords);
+	ibad = alloc_map(nr_iwords);
+	bmap = alloc_map(nr_bwords);
+	if (!imap || !inamed || !ibad || !bmap) {
+		perror("fsck.pnlfs");
+		return FSCK_ERROR;
+	}
+
+	/* Inodes in use are those of the bitmap, until pass 2 */
+	disk_imap = pnlfs_block(&img, img.ifree_start);
+	disk_bmap = pnlfs_block(&img, img.bfree_start);
+	madvise(disk_imap, (size_t) (img.bfree_start - img.ifree_start +
+				     le32toh(sb->nr_bfree_blocks)) *
+		img.block_size, MADV_WILLNEED);
+	for (i = 0; i < nr_iwords; i++)
+		imap[i] = ~le64toh(disk_imap[i]);
+
+	/* Superblock, inode store, bitmaps and journal belong to no inode */
+	meta = img.bfree_start + le32toh(sb->nr_bfree_blocks);
+	set_range(bmap, 0, meta);
+	jstart = le32toh(sb->journal_start);
+	jlen = le32toh(sb->journal_len);
+	if (jlen)
+		set_range(bmap, jstart, jlen);
+
+	/* The root is named by nobody and must be a directory */
+	test_and_set(inamed, 0);
+	if (pnlfs_stat(&img, 0, &root) || !S_ISDIR(root.mode)) {
+		fprintf(stderr, "fsck.pnlfs: %s: the root inode is not a "
+			"directory\n", argv[optind]);
+		return FSCK_LEFT;
+	}
+
+	printf("Pass 1: inodes and blocks\n");
+	err = run_workers(pass1_worker, nr_threads);
+	if (err) {
+		fprintf(stderr, "fsck.pnlfs: %s\n", strerror(err));
+		return FSCK_ERROR;
+	}
+
+	printf("Pass 2: names\n");
+	pass2();
+
+	printf("Pass 3: bitmaps\n");
+	fill_tail(imap, disk_imap, img.nr_inodes, nr_iwords);
+	fill_tail(bmap, disk_bmap, img.nr_blocks, nr_bwords);
+	/* The workers write the words back only under repair */
+	err = run_workers(pass3_worker, nr_threads);
+	if (err) {
+		fprintf(stderr, "fsck.pnlfs: %s\n", strerror(err));
+		return FSCK_ERROR;
+	}
+	if (idiff.marked_free)
+		problem(1, "%u inodes in use are marked free",
+			idiff.marked_free);
+	if (idiff.marked_used)
+		problem(1, "%u free inodes are marked in use",
+			idiff.marked_used);
+	if (bdiff.marked_free)
+		problem(1, "%u blocks in use are marked free",
+			bdiff.marked_free);
+	if (bdiff.marked_used)
+		problem(1, "%u free blocks are marked in use",
+			bdiff.marked_used);
+
+	used_inodes = count_set(imap, img.nr_inodes);
+	used_blocks = count_set(bmap, img.nr_blocks);
+	if (le32toh(sb->nr_free_inodes) != img.nr_inodes - used_inodes &&
+	    problem(1, "Free inodes count wrong (%u, counted %u)",
+		    le32toh(sb->nr_free_inodes), img.nr_inodes - used_inodes))
+		sb->nr_free_inodes = htole32(img.nr_inodes - used_inodes);
+	if (le32toh(sb->nr_free_blocks) != img.nr_blocks - used_blocks &&
+	    problem(1, "Free blocks count wrong (%u, counted %u)",
+		    le32toh(sb->nr_free_blocks), img.nr_blocks - used_blocks))
+		sb->nr_free_blocks = htole32(img.nr_blocks - used_blocks);
+
+	if (repair) {
+		if (nr_left)
+			sb->state &= htole32(~PNLFS_STATE_CLEAN);
+		else
+			sb->state |= htole32(PNLFS_STATE_CLEAN);
+		err = -pnlfs_sync(&img);
+		if (err) {
+			fprintf(stderr, "fsck.pnlfs: %s: %s\n", argv[optind],
+				strerror(err));
+			return FSCK_ERROR;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("%s: %u/%u inodes, %u/%u blocks, %lu fixed, %lu left "
+	       "in %.3f s\n", argv[optind], used_inodes, img.nr_inodes,
+	       used_blocks, img.nr_blocks, nr_fixed, nr_left,
+	       t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	printf("%s: %lu files with data, in %lu runs, %lu fragmented\n",
+	       argv[optind], nr_data_files, nr_data_runs, nr_fragmented);
+	pnlfs_close(&img);
+	if (nr_left)
+		return FSCK_LEFT;
+	return nr_fixed ? FSCK_FIXED : FSCK_OK;
+}
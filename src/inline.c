@@ -0,0 +1,238 @@
+#include "pnlfs.h"
+
+/*
+ * Inline files. On an image whose inode records are larger than struct
+ * pnlfs_inode, a new regular file keeps its data in the rest of its
+ * record: it has no block at all, and reading it costs the read of one
+ * inode store block, which is likely cached with its neighbours.
+ *
+ * Only page 0 of an inline file is ever used. It is filled from the
+ * record when read, and copied back to the record by write_end and by
+ * writepage for the changes made through mmap. A write or a truncate
+ * past pnlfs_inline_size() moves the data to page 0 of a file mapped by
+ * an extent tree, a file never goes back inline.
+ */
+
+/* Fill page 0, which is locked, with the data of the record */
+static int pnlfs_inline_fill(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh;
+	struct pnlfs_inode *raw;
+	size_t len = min_t(loff_t, i_size_read(inode),
+			   pnlfs_inline_size(inode->i_sb));
+	char *kaddr;
+
+	raw = pnlfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(raw))
+		return PTR_ERR(raw);
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, raw + 1, len);
+	memset(kaddr + len, 0, PAGE_SIZE - len);
+	kunmap_atomic(kaddr);
+	brelse(bh);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/* Copy the first len bytes of page 0 in the record */
+static int pnlfs_inline_store(struct inode *inode, struct page *page,
+			      size_t len)
+{
+	struct buffer_head *bh;
+	struct pnlfs_inode *raw;
+	handle_t *handle;
+	char *kaddr;
+	int err;
+
+	handle = pnlfs_journal_start(inode->i_sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	raw = pnlfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(raw)) {
+		err = PTR_ERR(raw);
+		goto out;
+	}
+	err = pnlfs_journal_access(inode->i_sb, bh);
+	if (err) {
+		brelse(bh);
+		goto out;
+	}
+	kaddr = kmap_atomic(page);
+	memcpy(raw + 1, kaddr, len);
+	kunmap_atomic(kaddr);
+	pnlfs_journal_dirty(inode->i_sb, bh);
+	brelse(bh);
+	/* fsync writes the record with the inode */
+	mark_inode_dirty(inode);
+out:
+	pnlfs_journal_stop(handle);
+	return err;
+}
+
+int pnlfs_inline_readpage(struct inode *inode, struct page *page)
+{
+	int err = 0;
+
+	if (page->index) {
+		zero_user(page, 0, PAGE_SIZE);
+		SetPageUptodate(page);
+	} else {
+		err = pnlfs_inline_fill(inode, page);
+		if (err)
+			SetPageError(page);
+	}
+	unlock_page(page);
+	return err;
+}
+
+int pnlfs_inline_writepage(struct inode *inode, struct page *page)
+{
+	int err = 0;
+
+	if (!page->index)
+		err = pnlfs_inline_store(inode, page,
+					 min_t(loff_t, i_size_read(inode),
+					       pnlfs_inline_size(inode->i_sb)));
+	if (err)
+		mapping_set_error(page->mapping, err);
+	unlock_page(page);
+	return err;
+}
+
+/* The write fits in the record, it goes to page 0 made uptodate */
+int pnlfs_inline_write_begin(struct address_space *mapping, unsigned flags,
+			     struct page **pagep)
+{
+	struct page *page;
+	int err;
+
+	page = grab_cache_page_write_begin(mapping, 0, flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page)) {
+		err = pnlfs_inline_fill(mapping->host, page);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+	*pagep = page;
+	return 0;
+}
+
+int pnlfs_inline_write_end(struct address_space *mapping, loff_t pos,
+			   unsigned copied, struct page *page)
+{
+	struct inode *inode = mapping->host;
+	int err;
+
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	err = pnlfs_inline_store(inode, page, inode->i_size);
+	unlock_page(page);
+	put_page(page);
+	return err ? err : copied;
+}
+
+/*
+ * Called before the size of an inline file changes to newsize, which
+ * must fit in the record. What is past the smaller of the two sizes is
+ * zeroed, in the record and in page 0, so a file growing reads zeroes.
+ */
+int pnlfs_inline_truncate(struct inode *inode, loff_t newsize)
+{
+	struct buffer_head *bh;
+	struct pnlfs_inode *raw;
+	struct page *page;
+	handle_t *handle;
+	u32 from = min_t(loff_t, newsize, inode->i_size);
+	int err;
+
+	handle = pnlfs_journal_start(inode->i_sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	raw = pnlfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(raw)) {
+		pnlfs_journal_stop(handle);
+		return PTR_ERR(raw);
+	}
+	err = pnlfs_journal_access(inode->i_sb, bh);
+	if (!err) {
+		memset((char *) (raw + 1) + from, 0,
+		       pnlfs_inline_size(inode->i_sb) - from);
+		pnlfs_journal_dirty(inode->i_sb, bh);
+	}
+	brelse(bh);
+	pnlfs_journal_stop(handle);
+	if (err)
+		return err;
+
+	/* Not in the handle, page locks come first */
+
+	page = find_lock_page(inode->i_mapping, 0);
+	if (page) {
+		zero_user_segment(page, from, PAGE_SIZE);
+		unlock_page(page);
+		put_page(page);
+	}
+	return 0;
+}
+
+/*
+ * Give an inline file an empty extent tree, its data staying in page 0
+ * which is left dirty: it gets a block at writeback as any page written.
+ * Called with i_mutex held, page 0 is locked while the flags change so
+ * readpage never sees a file half converted.
+ */
+int pnlfs_inline_convert(struct inode *inode)
+{
+	struct pnlfs_inode_info *info = PNLFS_I(inode);
+	struct buffer_head *bh;
+	struct page *page;
+	handle_t *handle;
+	int err = 0;
+
+	page = find_or_create_page(inode->i_mapping, 0,
+				   mapping_gfp_constraint(inode->i_mapping,
+							  ~__GFP_FS));
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page)) {
+		err = pnlfs_inline_fill(inode, page);
+		if (err)
+			goto out;
+	}
+
+	handle = pnlfs_journal_start(inode->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+	bh = pnlfs_new_meta_block(inode->i_sb);
+	if (IS_ERR(bh)) {
+		err = PTR_ERR(bh);
+		pnlfs_journal_stop(handle);
+		goto out;
+	}
+	pnlfs_ext_init_root(inode->i_sb, bh);
+
+	down_write(&info->map_sem);
+	info->index_block = bh->b_blocknr;
+	info->flags = (info->flags & ~PNLFS_INODE_INLINE) |
+		PNLFS_INODE_EXTENTS;
+	up_write(&info->map_sem);
+	brelse(bh);
+
+	if (inode->i_size)
+		set_page_dirty(page);
+	mark_inode_dirty(inode);
+	pnlfs_journal_stop(handle);
+	pnlfs_debug("%s inode %lu now in block %u\n", __func__,
+		    inode->i_ino, info->index_block);
+out:
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
@@ -1,4 +1,96 @@
 #include "pnlfs.h"
+#include "pnlfs_trace.h"
+
+/* Record of inode ino in the inode store, bh is given back in bhp */
+struct pnlfs_inode *pnlfs_raw_inode(struct super_block *sb, unsigned long ino,
+				    struct buffer_head **bhp)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, 1 + ino / sbi->inodes_per_block);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	*bhp = bh;
+	return (struct pnlfs_inode *) (bh->b_data +
+		(ino % sbi->inodes_per_block) * sbi->inode_size);
+}
+
+/*
+ * Zero the next PNLFS_ISTORE_BATCH blocks of the inode store which mkfs
+ * left uninitialized, and record it in the superblock in the same
+ * transaction: a crash can not leave a block in use marked uninitialized.
+ * Without a journal the superblock is written at once, for the same reason.
+ */
+static int pnlfs_istore_zero(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+	struct pnlfs_superblock *superblk;
+	struct buffer_head *bh;
+	u32 b, end = min_t(u32, sbi->istore_init + PNLFS_ISTORE_BATCH,
+			   sbi->nr_istore_blocks);
+	int err;
+
+	for (b = sbi->istore_init; b < end; b++) {
+		bh = sb_getblk(sb, 1 + b);
+		if (!bh)
+			return -EIO;
+		err = pnlfs_journal_access(sb, bh);
+		if (err) {
+			brelse(bh);
+			return err;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		pnlfs_journal_dirty(sb, bh);
+		brelse(bh);
+	}
+
+	bh = sb_bread(sb, PNLFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	err = pnlfs_journal_access(sb, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
+	superblk = (struct pnlfs_superblock *) bh->b_data;
+	superblk->itable_unused = cpu_to_le32(sbi->nr_istore_blocks - end);
+	pnlfs_journal_dirty(sb, bh);
+	if (!sbi->journal)
+		sync_dirty_buffer(bh);
+	brelse(bh);
+
+	pnlfs_debug("%s inode store initialized up to block %u\n",
+		    __func__, end);
+	WRITE_ONCE(sbi->istore_init, end);
+	return 0;
+}
+
+/*
+ * Make sure the record of inode ino is initialized. The handle may be
+ * restarted: it must not hold any change of the operation yet.
+ */
+int pnlfs_istore_init(struct super_block *sb, unsigned long ino)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+	u32 block = ino / sbi->inodes_per_block;
+	int err = 0;
+
+	while (!err && READ_ONCE(sbi->istore_init) <= block) {
+		/* Not while holding istore_lock, a restart waits for a commit */
+		err = pnlfs_journal_extend(sb, PNLFS_ISTORE_BATCH + 1, NULL);
+		if (err)
+			break;
+		mutex_lock(&sbi->istore_lock);
+		if (sbi->istore_init <= block)
+			err = pnlfs_istore_zero(sb);
+		mutex_unlock(&sbi->istore_lock);
+	}
+	return err;
+}
 
 /* That function ask a struct inode to the VFS */
 struct inode *pnlfs_iget(struct super_block *sb, unsigned long ino)
@@ -7,9 +99,8 @@ struct inode *pnlfs_iget(struct super_block *sb, unsigned long ino)
 	struct buffer_head * bh;
 	struct pnlfs_inode* tmp_inode;
 	struct pnlfs_inode_info *inode_info;
-	unsigned long index;
 
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 
 	/* Get an inode from the VFS */
 	i = iget_locked(sb, ino);
@@ -22,31 +113,34 @@ struct inode *pnlfs_iget(struct super_block *sb, unsigned long ino)
 	if (!(i->i_state & I_NEW))
 		return i;
 
-	/* Get the index of inode */
-	index = do_div(ino, PNLFS_INODES_PER_BLOCK);
-
-	/* Read the block containing the node */
-	bh = sb_bread(sb, ino+1);
-	if (!bh) {
+	/* No inode was ever used there, a name pointing to it is corrupted */
+	if (ino / PNLFS_SB(sb)->inodes_per_block >=
+	    READ_ONCE(PNLFS_SB(sb)->istore_init)) {
+		pr_err("%s : inode %lu is not initialized\n", __func__, ino);
 		iget_failed(i);
 		return ERR_PTR(-EIO);
 	}
 
-	/* Fill the inode struct */
-	tmp_inode = (struct pnlfs_inode *) bh->b_data;
+	/* Read the block containing the node */
+	tmp_inode = pnlfs_raw_inode(sb, ino, &bh);
+	if (IS_ERR(tmp_inode)) {
+		iget_failed(i);
+		return ERR_CAST(tmp_inode);
+	}
 
-	i->i_mode = le16_to_cpu(tmp_inode[index].mode);
+	i->i_mode = le16_to_cpu(tmp_inode->mode);
 	i->i_op = &i_op;
-	i->i_fop = &i_fop;
 	i->i_sb = sb;
-	i->i_ino = ino;
-	i->i_size = le32_to_cpu(tmp_inode[index].filesize);
+	i->i_size = le32_to_cpu(tmp_inode->filesize);
 
 	if (S_ISDIR(i->i_mode)){
 		i->i_blocks = 1;
+		i->i_fop = &d_fop;
 	}
 	else if (S_ISREG(i->i_mode)){
-		i->i_blocks = le32_to_cpu(tmp_inode[index].nr_used_blocks);
+		i->i_blocks = le32_to_cpu(tmp_inode->nr_used_blocks);
+		i->i_fop = &i_fop;
+		i->i_mapping->a_ops = &pnlfs_aops;
 	}
 	else{	
 		brelse(bh);
@@ -56,60 +150,22 @@ struct inode *pnlfs_iget(struct super_block *sb, unsigned long ino)
 
 	i->i_ctime = i->i_atime = i->i_mtime = CURRENT_TIME;
 	inode_info = container_of(i, struct pnlfs_inode_info, vfs_inode);
-	inode_info->index_block = le32_to_cpu(tmp_inode[index].index_block);
-	inode_info->nr_entries = le32_to_cpu(tmp_inode[index].nr_entries);
+	inode_info->index_block = le32_to_cpu(tmp_inode->index_block);
+	inode_info->nr_entries = le32_to_cpu(tmp_inode->nr_entries);
+	inode_info->flags = le32_to_cpu(tmp_inode->mode) &
+		PNLFS_INODE_FL_MASK;
+	brelse(bh);
 
 	/* Function used to unlock the new created inode */
 	unlock_new_inode(i);
+	trace_pnlfs_iget(i);
 
-	pr_info("%s End\n",  __func__);
+	pnlfs_debug("%s End\n",  __func__);
 
 	return i;
 
 }
 
-/* Free the inode bit at index ino in the bitmap */
-int pnlfs_free_inode(struct super_block *sb, unsigned long ino)
-{
-	struct pnlfs_sb_info *sb_info;
-	pr_info("%s : freeing inode %ld\n",  __func__, ino);
-
-	sb_info = sb->s_fs_info;
-	bitmap_set(&sb_info->ifree_bitmap[ino >> 6],ino & 0x3f, 1);
-	sb_info->nr_free_inodes++;
-	return 0;
-}
-
-/* Register a new inode in the bitmap and return its index */
-unsigned long pnlfs_reserv_new_inode(struct super_block *sb)
-{
-	struct pnlfs_sb_info *sbi;
-	unsigned long new_ino = 0;
-	unsigned long first_bit =0;
-	int size_bitmap,size_ifree_bitmap;
-	int i = 0;
-
-	sbi = sb->s_fs_info;
-	size_bitmap = sizeof(sbi->ifree_bitmap[0])<<3;
-	size_ifree_bitmap = 512 * sbi->nr_ifree_blocks;
-
-	/* Found first bit avilable from the bitmap  */
- 	for (i=0;i<size_ifree_bitmap;i++){
-    	first_bit = find_first_bit(&sbi->ifree_bitmap[i], size_bitmap);
-		new_ino += first_bit;
-		/* Check result */
-		if (first_bit /= size_bitmap)
-			break;
-	}
-
-	/* Set the bit in the bitmap to acknowledge its record */
-	bitmap_clear(&sbi->ifree_bitmap[new_ino >> 6], new_ino & 0x3f, 1);
-	sbi->nr_free_inodes--;
-
-	pr_info("%s : new inode is %ld\n",  __func__, new_ino);
-	return new_ino;
-}
-
 /* Search for inode with macthing name in directory */
 unsigned long pnlfs_find_inode(struct inode *dir, struct dentry *dentry)
 {
@@ -118,171 +174,233 @@ unsigned long pnlfs_find_inode(struct inode *dir, struct dentry *dentry)
 	struct buffer_head *bh;
 	struct pnlfs_file *files;
 	int i;
-	unsigned long ino;
+	unsigned long ino = 0;
+
+	/* Names already read are answered from memory */
+	if (!pnlfs_dcache_lookup(dir, dentry->d_name.name,
+				 dentry->d_name.len, &ino, NULL)) {
+		pnlfs_stat_inc(dir->i_sb, PNLFS_STAT_LOOKUP_HIT);
+		return ino;
+	}
+	pnlfs_stat_inc(dir->i_sb, PNLFS_STAT_LOOKUP_MISS);
 
-	/* Get the block */
 	dir_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	if (dir_info->flags & PNLFS_INODE_HTREE) {
+		if (pnlfs_dx_lookup(dir, dentry->d_name.name,
+				    dentry->d_name.len, &ino))
+			return 0;
+		return ino;
+	}
+
+	/* Get the block */
 	bh = sb_bread(dir->i_sb, dir_info->index_block);
 	if (!bh)
-		return -EIO;
+		return 0;
 
 	/* Get the files */
 	dir_block = (struct pnlfs_dir_block *) bh->b_data;
 	files = dir_block->files;
-	brelse(bh);
 
 	/* For each files in the block, compare the name */
 	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
-		if (strncmp(files[i].filename, dentry->d_name.name,
-			    dentry->d_name.len) == 0) {
-			ino = files[i].inode;
-			/* Return the inode if founded */
-			pr_info("%s : inode founded is %ld\n",  __func__, ino);
-			return ino;
+		if (files[i].inode &&
+		    strnlen(files[i].filename, PNLFS_FILENAME_LEN) ==
+		    dentry->d_name.len &&
+		    !memcmp(files[i].filename, dentry->d_name.name,
+			    dentry->d_name.len)) {
+			ino = le32_to_cpu(files[i].inode);
+			break;
 		}
 	}
+	brelse(bh);
 
-	pr_info("%s : No inode founded\n",  __func__);
-	return 0;
+	pnlfs_debug("%s : inode found is %ld\n",  __func__, ino);
+	return ino;
 }
 
-/* Register a new block in the bitmap and return its index */
-int pnlfs_reserv_new_block(struct super_block *sb)
+/* Reserve a block for metadata and return it zeroed, not read */
+struct buffer_head *pnlfs_new_meta_block(struct super_block *sb)
 {
-	struct pnlfs_sb_info *sbi;
-	unsigned long new_bloc = 0;
-	unsigned long first_bit =0;
-	int size_bitmap,size_bfree_bitmap;
-	int i = 0;
-
-	sbi = sb->s_fs_info;
-	size_bitmap = sizeof(sbi->bfree_bitmap[0])<<3;
-	size_bfree_bitmap = 512 * sbi->nr_bfree_blocks;
-
-	/* Found first bit avilable from the bitmap  */
- 	for (i=0;i<size_bfree_bitmap;i++){
-    	first_bit = find_first_bit(&sbi->bfree_bitmap[i], size_bitmap);
-		new_bloc += first_bit;
-		/* Check result */
-		if (first_bit /= size_bitmap)
-			break;
-	}
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	int bno, err;
 
-	/* Set the bit in the bitmap to acknowledge its record */
-	bitmap_clear(&sbi->bfree_bitmap[new_bloc >> 6], new_bloc & 0x3f, 1);
-	sbi->nr_free_blocks--;
+	bno = pnlfs_reserv_new_block(sb);
+	if (bno == sbi->nr_blocks)
+		return ERR_PTR(-ENOSPC);
 
-	pr_info("%s : new bloc is %ld\n",  __func__, new_bloc);
-	return new_bloc;
+	bh = sb_getblk(sb, bno);
+	if (!bh) {
+		pnlfs_free_block(sb, bno);
+		return ERR_PTR(-EIO);
+	}
+	err = pnlfs_journal_access(sb, bh);
+	if (err) {
+		brelse(bh);
+		pnlfs_free_block(sb, bno);
+		return ERR_PTR(err);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	pnlfs_journal_dirty(sb, bh);
+	return bh;
 }
 
-/* Free the inode bit at index ino in the bitmap */
-int pnlfs_free_block(struct super_block *sb, int bno)
+/* Free a block of metadata, the journal forgets what it had of it */
+void pnlfs_free_meta_block(struct super_block *sb, u32 bno)
 {
-	struct buffer_head *data_bh;
-	struct pnlfs_sb_info *sb_info;
-
-	pr_info("%s : freeing block %d\n",  __func__, bno);
-
-	sb_info = sb->s_fs_info;
-	if (!(data_bh = sb_bread(sb, bno)))
-		return -EIO;
-
-	/* Reset block value */
-	memset(data_bh->b_data, 0, PNLFS_BLOCK_SIZE);
-
-	/* Free the block index in the bitmap */
-	bitmap_set(&sb_info->bfree_bitmap[bno >> 6], bno & 0x3f, 1);
-	sb_info->nr_free_blocks++;
-
-	mark_buffer_dirty(data_bh);
-	brelse(data_bh);
-
-	pr_info("%s : Block %d freed\n",  __func__, bno);
-	return 0;
+	pnlfs_journal_revoke(sb, bno);
+	pnlfs_free_block(sb, bno);
 }
 
 /* Change the block according to the dentry */
 int pnlfs_add_entry
-(struct inode * dir, struct dentry * dentry, unsigned long ino)
+(struct inode * dir, struct dentry * dentry, struct inode *inode)
 {
-	struct pnlfs_sb_info *sbi;
 	struct pnlfs_file *files;
 	struct pnlfs_inode_info *dir_info;
 	struct buffer_head *bh;
 	struct pnlfs_dir_block *blk;
-	int i;
+	int i, err;
 
-	pr_info("%s : Start\n", __func__);
+	pnlfs_debug("%s : Start\n", __func__);
 
 	/* Get dir_info */
-	sbi = dir->i_sb->s_fs_info;
 	dir_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
 
+	/* The old format has a fixed number of short names */
+	if (!(dir_info->flags & PNLFS_INODE_HTREE) &&
+	    (dir_info->nr_entries >= PNLFS_MAX_DIR_ENTRIES ||
+	     dentry->d_name.len >= PNLFS_FILENAME_LEN)) {
+		/* The slots of the names are gone with the old format */
+		pnlfs_dcache_drop(dir);
+		err = pnlfs_dx_convert(dir);
+		if (err)
+			return err;
+	}
+
+	if (dir_info->flags & PNLFS_INODE_HTREE) {
+		err = pnlfs_dx_add(dir, dentry->d_name.name,
+				   dentry->d_name.len, inode->i_ino,
+				   inode->i_mode);
+		if (err)
+			return err;
+		pnlfs_dcache_insert(dir, dentry->d_name.name,
+				    dentry->d_name.len, inode->i_ino, -1);
+		dir_info->nr_entries++;
+		dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(dir);
+		return 0;
+	}
+
 	/* Read the block */
 	if (!(bh = sb_bread(dir->i_sb, dir_info->index_block)))
 		return -EIO;
+	err = pnlfs_journal_access(dir->i_sb, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
 	blk = (struct pnlfs_dir_block *) bh->b_data;
 
-	/* For each files of the block : */
+	/* For each files of the block, from the first free slot if known */
 	files = blk->files;
-	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+	i = pnlfs_dcache_free_slot(dir);
+	if (i < 0 || files[i].inode)
+		i = 0;
+	for (; i < PNLFS_MAX_DIR_ENTRIES; i++) {
 		if (le32_to_cpu(files[i].inode) == 0) {
 			/* Set the files in the block */
-			files[i].inode = cpu_to_le32(ino);
-			strncpy(files[i].filename, dentry->d_name.name,
-				dentry->d_name.len);
+			files[i].inode = cpu_to_le32(inode->i_ino);
+			memset(files[i].filename, 0, PNLFS_FILENAME_LEN);
+			memcpy(files[i].filename, dentry->d_name.name,
+			       dentry->d_name.len);
+			pnlfs_dcache_insert(dir, dentry->d_name.name,
+					    dentry->d_name.len, inode->i_ino, i);
 			dir_info->nr_entries++;
+			dir->i_mtime = dir->i_ctime = CURRENT_TIME;
 			mark_inode_dirty(dir);
-			mark_buffer_dirty(bh);
+			pnlfs_journal_dirty(dir->i_sb, bh);
 			brelse(bh);
 
-			pr_info("%s : End\n", __func__);
+			pnlfs_debug("%s : End\n", __func__);
 			return 0;
 		}
 	}
 
-	pr_info("%s : Error\n", __func__);
+	pnlfs_debug("%s : Error\n", __func__);
 	brelse(bh);
 	return -EPERM;
 }
 
 /* Remove the dentry from the block */
-int pnlfs_delete_entry(struct inode *dir, unsigned long ino)
+int pnlfs_delete_entry(struct inode *dir, struct dentry *dentry,
+		       unsigned long ino)
 {
 	struct pnlfs_inode_info *dir_info;
 	struct pnlfs_dir_block *dblk;
 	struct buffer_head *bh;
 	struct pnlfs_file *files;
-	int i;
-	pr_info("%s : Start\n", __func__);
+	unsigned long found;
+	int i, err;
+	pnlfs_debug("%s : Start\n", __func__);
 
-	/* Get the block */
 	dir_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	if (dir_info->flags & PNLFS_INODE_HTREE) {
+		err = pnlfs_dx_remove(dir, dentry->d_name.name,
+				      dentry->d_name.len);
+		if (err)
+			return err;
+		pnlfs_dcache_remove(dir, dentry->d_name.name,
+				    dentry->d_name.len);
+		dir_info->nr_entries--;
+		dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(dir);
+		return 0;
+	}
+
+	/* Get the block */
 	if (!(bh = sb_bread(dir->i_sb, dir_info->index_block)))
 		return -EIO;
+	err = pnlfs_journal_access(dir->i_sb, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
 	dblk = (struct pnlfs_dir_block *) bh->b_data;
 
-	/* For each files from the block */
+	/* For each files from the block, from the slot of the name if known */
 	files = dblk->files;
-	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
-		if (files[i].inode == ino) {
+	if (pnlfs_dcache_lookup(dir, dentry->d_name.name, dentry->d_name.len,
+				&found, &i) || found != ino || i < 0)
+		i = 0;
+	for (; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+		/* A rename has the inode under both names for a moment */
+		if (le32_to_cpu(files[i].inode) == ino &&
+		    strnlen(files[i].filename, PNLFS_FILENAME_LEN) ==
+		    dentry->d_name.len &&
+		    !memcmp(files[i].filename, dentry->d_name.name,
+			    dentry->d_name.len)) {
 
 			/* Reset block value */
 			memset(&files[i], 0, sizeof(files[i]));
+			pnlfs_dcache_remove(dir, dentry->d_name.name,
+					    dentry->d_name.len);
 			dir_info->nr_entries--;
 
 			dir->i_mtime = CURRENT_TIME;
 			mark_inode_dirty(dir);
-			mark_buffer_dirty(bh);
+			pnlfs_journal_dirty(dir->i_sb, bh);
 
-			pr_info("%s : End, entry %ld removed\n", __func__, ino);
+			pnlfs_debug("%s : End, entry %ld removed\n", __func__, ino);
 			brelse(bh);
 			return 0;
 		}
 	}
 
-	pr_info("%s : Error\n", __func__);
+	pnlfs_debug("%s : Error\n", __func__);
 	brelse(bh);
 	return -ENOENT;
 }
@@ -295,72 +413,75 @@ int pnlfs_delete_entry(struct inode *dir, unsigned long ino)
 static struct dentry *pnlfs_lookup
 (struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
-	struct pnlfs_inode_info *inode_info;
-	struct buffer_head *bh;
-	struct pnlfs_dir_block *dir_block;
-	struct pnlfs_file *files;
 	struct inode *inode;
-	int i;
+	unsigned long ino;
+	u64 start = ktime_get_ns();
 
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 
-	/* Read block */
-	inode_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
-	bh = sb_bread(dir->i_sb, inode_info->index_block);
-	if (bh == NULL)
-		return ERR_PTR(-EIO);
+	if (dentry->d_name.len > PNLFS_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+	pnlfs_stat_inc(dir->i_sb, PNLFS_STAT_LOOKUP);
 
-	/* Get files contained in that inode */
-	dir_block = (struct pnlfs_dir_block *) bh->b_data;
-	files = dir_block->files;
-	brelse(bh);
+	/* The root inode is never an entry, 0 means no match */
 	inode = NULL;
-	/* Search in the block for the looked inode */
-	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
-		if(!strcmp(files[i].filename, dentry->d_name.name)){
-			inode = pnlfs_iget(dir->i_sb, files[i].inode);
-			if (IS_ERR(inode))
-				return (ERR_PTR(PTR_ERR(inode)));
-			break;
-		}
+	ino = pnlfs_find_inode(dir, dentry);
+	if (ino) {
+		inode = pnlfs_iget(dir->i_sb, ino);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
 	}
 
+	trace_pnlfs_lookup(dir, dentry, ino);
+
 	/* Add dentry to hash queues */
 	d_add(dentry, inode);
 
-	pr_info("%s End\n",  __func__);
+	pnlfs_stat_latency(dir->i_sb, PNLFS_HIST_LOOKUP, start);
+	pnlfs_debug("%s End\n",  __func__);
 	return NULL;
 }
 
 /* Set new inode and save change to the block */
-static int pnlfs_create
-(struct inode *dir, struct dentry *dentry, umode_t mode, bool unused)
+static int pnlfs_do_create(struct inode *dir, struct dentry *dentry,
+			   umode_t mode)
 {
 	struct pnlfs_sb_info *sbi;
 	struct inode *i;
 	struct buffer_head *bh;
-	struct pnlfs_file_index_block *index_block;
-	struct pnlfs_inode_info *dir_info;
 	struct pnlfs_inode_info *new_i_info;
 	unsigned long new_i ;
-	int new_b;
+	u32 new_b = 0, count;
+	bool inline_data;
+	int err;
 
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 	sbi = (struct pnlfs_sb_info *) dir->i_sb->s_fs_info;
 
-	/* Get inode info */ 
-	dir_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
-
 	/* Check for errors */
-	if (dir_info->nr_entries >= PNLFS_MAX_DIR_ENTRIES) 
-		return -ENOSPC;
-	if (dentry->d_name.len > PNLFS_FILENAME_LEN) 
+	if (dentry->d_name.len > PNLFS_NAME_LEN) 
 		return -ENAMETOOLONG;
-	if((new_i = pnlfs_reserv_new_inode(dir->i_sb))== sbi->nr_inodes)
-		return -ENOSPC;
-	if((new_b=pnlfs_reserv_new_block(dir->i_sb))== sbi->nr_blocks){
+	while ((new_i = pnlfs_reserv_new_inode(dir->i_sb)) != sbi->nr_inodes &&
+	       new_i / sbi->inodes_per_block >= READ_ONCE(sbi->istore_init)) {
+		/* Zeroing may restart the handle, it must not hold the inode */
 		pnlfs_free_inode(dir->i_sb, new_i);
+		err = pnlfs_istore_init(dir->i_sb, new_i);
+		if (err)
+			return err;
+	}
+	if (new_i == sbi->nr_inodes)
 		return -ENOSPC;
+	/* Regular files start inline when the records have room for it */
+	inline_data = S_ISREG(mode) && pnlfs_inline_size(dir->i_sb);
+	if (!inline_data) {
+		/* The index block goes next to the one of the parent */
+		count = 1;
+		new_b = pnlfs_new_blocks(dir->i_sb, PNLFS_I(dir)->index_block,
+					 &count);
+		if (new_b == sbi->nr_blocks) {
+			pnlfs_free_inode(dir->i_sb, new_i);
+			return -ENOSPC;
+		}
 	}
 
 	/* Set the new inode */
@@ -368,109 +489,131 @@ static int pnlfs_create
 	i->i_mode = mode;						
 	i->i_sb = dir->i_sb;					
 	i->i_op = dir->i_op;					
-	i->i_fop = dir->i_fop;					
 	i->i_ino = new_i;						
-	i->i_blocks = 1;	
+	i->i_blocks = 0;	
 	i->i_ctime = i->i_atime = i->i_mtime = CURRENT_TIME;
 
 	/* Set the new inode info */
 	new_i_info = container_of(i, struct pnlfs_inode_info, vfs_inode);
 	new_i_info->index_block = new_b;
 	new_i_info->nr_entries = 0;
+	new_i_info->flags = 0;
 
-	pr_info("%s New inode : %lu, block is %d, name is %s \n",
+	pnlfs_debug("%s New inode : %lu, block is %d, name is %s \n",
 	 __func__, new_i, new_i_info->index_block, dentry->d_name.name);
 
-	/* Change the block according to the dentry */
-	if (pnlfs_add_entry(dir, dentry, new_i))
-		goto err1;
-
 	/* If regular file */
-	if (S_ISREG(mode)) {		
+	if (inline_data) {
+		i->i_fop = &i_fop;
+		i->i_mapping->a_ops = &pnlfs_aops;
+		/* The data goes in the record until it is too large */
+		new_i_info->flags |= PNLFS_INODE_INLINE;
+	} else {
+		err = -EIO;
 		if (!(bh = sb_bread(i->i_sb, new_b)))
-			goto err2;
-		index_block = (struct pnlfs_file_index_block *) bh->b_data;
-		if((new_b = pnlfs_reserv_new_block(dir->i_sb))== sbi->nr_blocks)
-		{
-			goto err3;
+			goto err1;
+		err = pnlfs_journal_access(i->i_sb, bh);
+		if (err) {
+			brelse(bh);
+			goto err1;
+		}
+		if (S_ISREG(mode)) {
+			i->i_fop = &i_fop;
+			i->i_mapping->a_ops = &pnlfs_aops;
+			/* New files are mapped by an extent tree, empty for now */
+			pnlfs_ext_init_root(i->i_sb, bh);
+			new_i_info->flags |= PNLFS_INODE_EXTENTS;
+		} else {
+			/* New directories are hashed, without any leaf for now */
+			i->i_fop = &d_fop;
+			pnlfs_dx_init_root(i->i_sb, bh);
+			new_i_info->flags |= PNLFS_INODE_HTREE;
 		}
-		index_block->blocks[0] = cpu_to_le32(new_b);
-		mark_buffer_dirty(bh);
 		brelse(bh);
 	}
 
+	/* Change the block according to the dentry */
+	err = pnlfs_add_entry(dir, dentry, i);
+	if (err)
+		goto err1;
+
 	inode_init_owner(i, dir, mode);
 	insert_inode_hash(i);
 	d_instantiate(dentry, i);
 	mark_inode_dirty(i);
 	mark_inode_dirty(dir);
+	trace_pnlfs_create(dir, dentry, new_i);
 
-	pr_info("%s End\n", __func__);
+	pnlfs_debug("%s End\n", __func__);
 	return 0;
- err3:
-	brelse(bh);
- err2:
-	pnlfs_delete_entry(dir, new_i);
  err1:
 	pnlfs_free_inode(dir->i_sb, new_i);
-	pnlfs_free_block(dir->i_sb, new_i_info->index_block);
+	if (!inline_data)
+		pnlfs_free_meta_block(dir->i_sb, new_i_info->index_block);
 	iput(i);
 
-	pr_info("%s Error\n", __func__);
-	return -EIO;
+	pnlfs_debug("%s Error\n", __func__);
+	return err;
+}
+
+static int pnlfs_create
+(struct inode *dir, struct dentry *dentry, umode_t mode, bool unused)
+{
+	u64 start = ktime_get_ns();
+	handle_t *handle;
+	int err, err2;
+
+	handle = pnlfs_journal_start(dir->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = pnlfs_do_create(dir, dentry, mode);
+	err2 = pnlfs_journal_stop(handle);
+	pnlfs_stat_latency(dir->i_sb, PNLFS_HIST_CREATE, start);
+	return err ? err : err2;
 }
 
 static int pnlfs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	struct buffer_head *bh;
+	handle_t *handle;
 	unsigned long ino;
-	struct pnlfs_inode_info *inode_info;
-	struct pnlfs_file_index_block *fblk;
-	int *blocks, i;
 	int err;
 
-	pr_info("%s Start\n", __func__);
+	pnlfs_debug("%s Start\n", __func__);
 
 	/* Check for errors */
 	if (d_really_is_negative(dentry))
 		return -ENOENT;
 	if (!(ino = pnlfs_find_inode(dir, dentry)))
 		return -ENOENT;
-	if ((err = pnlfs_delete_entry(dir, ino))) 
+	handle = pnlfs_journal_start(dir->i_sb, PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	if ((err = pnlfs_delete_entry(dir, dentry, ino))) {
+		pnlfs_journal_stop(handle);
 		return err;
-
-	/* Get the block */
-	inode_info = container_of(
-		dentry->d_inode, struct pnlfs_inode_info, vfs_inode);
-	if (!(bh = sb_bread(dentry->d_inode->i_sb, inode_info->index_block)))
-		return -EIO;
-	fblk = (struct pnlfs_file_index_block *) bh->b_data;
-	blocks = fblk->blocks;
-	brelse(bh);
-
-	/* If regular file */
-	if (S_ISREG(dentry->d_inode->i_mode)) {
-		/* Free the bitmap for each block of the file */
-		for (i = 0; i < dentry->d_inode->i_blocks; i++)
-			pnlfs_free_block(dentry->d_inode->i_sb, le32_to_cpu(blocks[i]));
 	}
-
-	/* Free the bitmaps */	
-	pnlfs_free_block(dentry->d_inode->i_sb, inode_info->index_block);
-	pnlfs_free_inode(dir->i_sb, dentry->d_inode->i_ino);
+	trace_pnlfs_unlink(dir, dentry, ino);
+
+	/*
+	 * The blocks and the inode are freed by pnlfs_evict_inode once the
+	 * last reference is gone, so that the page cache never writes back
+	 * in blocks already given to another file.
+	 */
+	drop_nlink(d_inode(dentry));
 	mark_inode_dirty(dir);
+	err = pnlfs_journal_stop(handle);
 
-	pr_info("%s End\n", __func__);
-	return 0;
+	pnlfs_debug("%s End\n", __func__);
+	return err;
 }
 
 /* Create a directory */
 static int pnlfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	int return_value;
-	pr_info("%s Start\n", __func__);
+	pnlfs_debug("%s Start\n", __func__);
 	return_value = pnlfs_create(dir, dentry, mode | S_IFDIR, false);
-	pr_info("%s End\n", __func__);
+	pnlfs_debug("%s End\n", __func__);
 	return return_value;
 }
 
@@ -478,14 +621,14 @@ static int pnlfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 static int pnlfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	struct pnlfs_inode_info *dir_info;
-	pr_info("%s Start\n", __func__);
+	pnlfs_debug("%s Start\n", __func__);
 
 	dir_info = container_of(
 		dentry->d_inode, struct pnlfs_inode_info, vfs_inode);
 	if (dir_info->nr_entries)
 		return -ENOTEMPTY;
 
-	pr_info("%s End\n", __func__);
+	pnlfs_debug("%s End\n", __func__);
 	return pnlfs_unlink(dir, dentry);
 }
 
@@ -498,28 +641,92 @@ int pnlfs_rename
  unsigned int flags)
 {
 	struct inode *new_i, *old_i;
-	int err = 0;
-
-	pr_info("%s Start\n", __func__);
-	
+	handle_t *handle;
+	int err = 0, err2;
+
+	pnlfs_debug("%s Start\n", __func__);
+
+	/*
+	 * One handle, but jbd2 does not undo what was done before a failure:
+	 * the new name comes first, the old one only goes once it is there.
+	 */
+	handle = pnlfs_journal_start(old_dir->i_sb, 2 * PNLFS_JOURNAL_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	old_i = old_dentry->d_inode;
 	if((new_i = new_dentry->d_inode))	
 	{
 		if (S_ISREG(new_i->i_mode)){
-			if((err=pnlfs_unlink(new_dir, new_dentry)))return err;
+			if((err=pnlfs_unlink(new_dir, new_dentry)))goto out;
 		}
 		else if (S_ISDIR(new_i->i_mode)){
-			if((err=pnlfs_rmdir(new_dir, new_dentry)))return err;
+			if((err=pnlfs_rmdir(new_dir, new_dentry)))goto out;
 		}
-		else {return -EINVAL;}
+		else {err = -EINVAL; goto out;}
 	}
-	if((err=pnlfs_delete_entry(old_dir, old_dentry->d_inode->i_ino)))
+	if((err=pnlfs_add_entry(new_dir, new_dentry, old_i)))
+		goto out;
+	if((err=pnlfs_delete_entry(old_dir, old_dentry, old_i->i_ino)))
+		pnlfs_delete_entry(new_dir, new_dentry, old_i->i_ino);
+
+	pnlfs_debug("%s End\n", __func__);
+out:
+	err2 = pnlfs_journal_stop(handle);
+	return err ? err : err2;
+}
+
+/* Change the size of a regular file */
+static int pnlfs_setsize(struct inode *inode, loff_t newsize)
+{
+	int err;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	if (PNLFS_I(inode)->flags & PNLFS_INODE_INLINE) {
+		if (newsize <= pnlfs_inline_size(inode->i_sb)) {
+			err = pnlfs_inline_truncate(inode, newsize);
+			if (err)
+				return err;
+			truncate_setsize(inode, newsize);
+			goto out;
+		}
+		err = pnlfs_inline_convert(inode);
+		if (err)
+			return err;
+	}
+
+	/* Zero the end of the last block, it may come back with a regrow */
+	err = block_truncate_page(inode->i_mapping, newsize, pnlfs_get_block);
+	if (err)
 		return err;
 
-	err=pnlfs_add_entry(new_dir, new_dentry, old_i->i_ino);
+	truncate_setsize(inode, newsize);
+	pnlfs_truncate_blocks(inode);
+out:
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	return 0;
+}
 
-	pr_info("%s End\n", __func__);
-	return err;
+static int pnlfs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	err = setattr_prepare(dentry, iattr);
+	if (err)
+		return err;
+
+	if ((iattr->ia_valid & ATTR_SIZE) &&
+	    iattr->ia_size != i_size_read(inode)) {
+		err = pnlfs_setsize(inode, iattr->ia_size);
+		if (err)
+			return err;
+	}
+
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
 }
 
 struct inode_operations i_op = {
@@ -528,5 +735,6 @@ struct inode_operations i_op = {
 	.unlink = pnlfs_unlink,
 	.mkdir = pnlfs_mkdir,
 	.rmdir = pnlfs_rmdir,
-	.rename = pnlfs_rename
+	.rename = pnlfs_rename,
+	.setattr = pnlfs_setattr
 };
\ No newline at end of file
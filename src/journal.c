@@ -0,0 +1,224 @@
+#include "pnlfs.h"
+
+/*
+ * Metadata journal, on jbd2. mkfs-pnlfs lays out journal_len blocks from
+ * journal_start, the first one holding the superblock of the journal.
+ *
+ * Every operation changing metadata runs in a handle. A buffer is given
+ * to the journal by pnlfs_journal_access() before it changes and by
+ * pnlfs_journal_dirty() after, in place of mark_buffer_dirty(). Handles
+ * nest: an operation calling another one stays in the same handle. The
+ * running transaction gathers the handles of every operation until it
+ * is committed, each commit_interval seconds or for an fsync, so that
+ * many operations share one write of the journal and the fsyncs coming
+ * during a commit wait together for the next one. The mount replays what
+ * was committed and not yet written in place, which costs at most one
+ * read of the journal whatever the size of the disk.
+ *
+ * Data blocks are not journaled. The free counts of the superblock are
+ * journaled by the commit work only, they may be behind the bitmaps
+ * after a crash.
+ *
+ * On an image without a journal there is no handle, the metadata is
+ * marked dirty and written in place as before.
+ */
+
+int pnlfs_journal_load(struct super_block *sb, u32 start, u32 len)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+	journal_t *journal;
+	int err;
+
+	if (start < 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+	    sbi->nr_bfree_blocks || start + len < start ||
+	    start + len > sbi->nr_blocks) {
+		pr_err("%s : bad journal, %u blocks from %u\n",
+		       __func__, len, start);
+		return -EINVAL;
+	}
+
+	journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev, start, len,
+					sb->s_blocksize);
+	if (!journal) {
+		pr_err("%s : cannot set up the journal\n", __func__);
+		return -ENOMEM;
+	}
+	/* Replays the transactions committed before a crash */
+	err = jbd2_journal_load(journal);
+	if (err) {
+		pr_err("%s : cannot load the journal (%d)\n", __func__, err);
+		jbd2_journal_destroy(journal);
+		return err;
+	}
+	sbi->journal = journal;
+	pnlfs_journal_params(sb);
+	return 0;
+}
+
+/* Apply the mount options, at mount and remount */
+void pnlfs_journal_params(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+	journal_t *journal = sbi->journal;
+
+	if (!journal)
+		return;
+	write_lock(&journal->j_state_lock);
+	journal->j_commit_interval = sbi->commit_interval * HZ;
+	/* A commit is durable once the cache of the disk is flushed */
+	journal->j_flags |= JBD2_BARRIER;
+	write_unlock(&journal->j_state_lock);
+}
+
+/* Commit what is left and write everything in place */
+void pnlfs_journal_destroy(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+
+	if (!sbi->journal)
+		return;
+	if (jbd2_journal_destroy(sbi->journal))
+		pr_err("%s : the journal was aborted\n", __func__);
+	sbi->journal = NULL;
+}
+
+/* NULL without a journal, an error if the journal is aborted */
+handle_t *pnlfs_journal_start(struct super_block *sb, int credits)
+{
+	journal_t *journal = PNLFS_SB(sb)->journal;
+
+	if (!journal)
+		return NULL;
+	return jbd2_journal_start(journal, credits);
+}
+
+int pnlfs_journal_stop(handle_t *handle)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_stop(handle);
+}
+
+/*
+ * Make sure the running handle may dirty credits more buffers. If the
+ * transaction is too full the handle is restarted, which commits what it
+ * did so far: the caller must have left the metadata consistent, and must
+ * ask for access again to the buffers it changes next. sem, held for
+ * writing by the caller, is dropped meanwhile, the commit waits for the
+ * other handles and they may be waiting for it.
+ */
+int pnlfs_journal_extend(struct super_block *sb, int credits,
+			 struct rw_semaphore *sem)
+{
+	handle_t *handle = journal_current_handle();
+	int err;
+
+	if (!PNLFS_SB(sb)->journal || WARN_ON_ONCE(!handle) ||
+	    handle->h_buffer_credits >= credits)
+		return 0;
+	err = jbd2_journal_extend(handle, credits - handle->h_buffer_credits);
+	if (err <= 0)
+		return err;
+
+	if (sem)
+		up_write(sem);
+	err = jbd2_journal_restart(handle, credits);
+	if (sem)
+		down_write(sem);
+	return err;
+}
+
+/* Before a metadata buffer changes */
+int pnlfs_journal_access(struct super_block *sb, struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!PNLFS_SB(sb)->journal)
+		return 0;
+	if (WARN_ON_ONCE(!handle))
+		return -EIO;
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/* After it changed. An error aborts the journal, the mount goes read-only */
+void pnlfs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	journal_t *journal = PNLFS_SB(sb)->journal;
+	handle_t *handle = journal_current_handle();
+	int err;
+
+	if (!journal) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+	err = WARN_ON_ONCE(!handle) ? -EIO :
+		jbd2_journal_dirty_metadata(handle, bh);
+	if (err) {
+		pr_err("%s : block %llu not journaled (%d)\n", __func__,
+		       (unsigned long long) bh->b_blocknr, err);
+		jbd2_journal_abort(journal, err);
+	}
+}
+
+/*
+ * A metadata block is freed, it may hold data soon: the journal must
+ * neither replay its old content nor write it back in place.
+ */
+void pnlfs_journal_revoke(struct super_block *sb, u32 bno)
+{
+	journal_t *journal = PNLFS_SB(sb)->journal;
+	handle_t *handle = journal_current_handle();
+	int err;
+
+	if (!journal || WARN_ON_ONCE(!handle))
+		return;
+	/* The journal drops the reference on the buffer */
+	err = jbd2_journal_revoke(handle, bno, sb_find_get_block(sb, bno));
+	if (err) {
+		pr_err("%s : block %u not revoked (%d)\n", __func__, bno, err);
+		jbd2_journal_abort(journal, err);
+	}
+}
+
+/* The inode changed in the running transaction, fsync waits for it */
+void pnlfs_journal_mark_inode(struct inode *inode)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (handle && PNLFS_SB(inode->i_sb)->journal)
+		WRITE_ONCE(PNLFS_I(inode)->sync_tid,
+			   handle->h_transaction->t_tid);
+}
+
+/*
+ * Wait for the commit of the last transaction which changed the inode.
+ * If that commit is already past its cache flush, the data written since
+ * needs one of its own.
+ */
+int pnlfs_journal_sync_inode(struct inode *inode)
+{
+	journal_t *journal = PNLFS_SB(inode->i_sb)->journal;
+	tid_t tid = READ_ONCE(PNLFS_I(inode)->sync_tid);
+	bool flush;
+	int err;
+
+	flush = !jbd2_trans_will_send_data_barrier(journal, tid);
+	err = jbd2_complete_transaction(journal, tid);
+	if (!err && flush)
+		err = blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+	return err;
+}
+
+/* Commit the running transaction, waiting for it if wait */
+int pnlfs_journal_commit(struct super_block *sb, int wait)
+{
+	journal_t *journal = PNLFS_SB(sb)->journal;
+	tid_t tid;
+
+	if (jbd2_journal_start_commit(journal, &tid))
+		return wait ? jbd2_log_wait_commit(journal, tid) : 0;
+	/* Nothing to commit, the data may still be in the cache of the disk */
+	if (wait)
+		return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	return 0;
+}
@@ -0,0 +1,2097 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "libpnlfs.h"
+
+/* Records of images made before inline files */
+#define PNLFS_OLD_INODE_SIZE sizeof(struct pnlfs_inode)
+
+/* A record over a whole block of 64 KiB has 0xffff in rec_len */
+static inline uint32_t rec_len(const struct pnlfs_dir_entry *de)
+{
+	uint32_t len = le16toh(de->rec_len);
+
+	return len == 0xffff ? PNLFS_MAX_BLOCK_SIZE : len;
+}
+
+static inline int is_power_of_2(uint32_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+/* Check what the rest of the library relies on */
+static int check_superblock(struct pnlfs_image *img)
+{
+	struct pnlfs_superblock *sb = img->sb;
+	uint64_t meta, bits;
+
+	img->block_size = le32toh(sb->block_size);
+	if (!img->block_size)
+		img->block_size = PNLFS_BLOCK_SIZE;
+	img->inode_size = le32toh(sb->inode_size);
+	if (!img->inode_size)
+		img->inode_size = PNLFS_OLD_INODE_SIZE;
+	if (img->block_size < PNLFS_BLOCK_SIZE ||
+	    img->block_size > PNLFS_MAX_BLOCK_SIZE ||
+	    !is_power_of_2(img->block_size) ||
+	    img->inode_size < PNLFS_OLD_INODE_SIZE ||
+	    img->inode_size > img->block_size / 2 ||
+	    !is_power_of_2(img->inode_size))
+		return -EINVAL;
+
+	img->nr_blocks = le32toh(sb->nr_blocks);
+	img->nr_inodes = le32toh(sb->nr_inodes);
+	img->inodes_per_block = img->block_size / img->inode_size;
+	img->ifree_start = 1 + le32toh(sb->nr_istore_blocks);
+	img->bfree_start = img->ifree_start + le32toh(sb->nr_ifree_blocks);
+	bits = (uint64_t) img->block_size * 8;
+
+	meta = (uint64_t) img->bfree_start + le32toh(sb->nr_bfree_blocks);
+	if (meta > img->nr_blocks ||
+	    (uint64_t) le32toh(sb->nr_istore_blocks) * img->inodes_per_block <
+	    img->nr_inodes ||
+	    (uint64_t) le32toh(sb->nr_ifree_blocks) * bits < img->nr_inodes ||
+	    (uint64_t) le32toh(sb->nr_bfree_blocks) * bits < img->nr_blocks ||
+	    le32toh(sb->itable_unused) >= le32toh(sb->nr_istore_blocks))
+		return -EINVAL;
+	img->istore_init = le32toh(sb->nr_istore_blocks) -
+		le32toh(sb->itable_unused);
+	return 0;
+}
+
+/* A journal with a log start has transactions the module did not apply */
+static int check_journal(struct pnlfs_image *img)
+{
+	uint32_t start = le32toh(img->sb->journal_start);
+	uint32_t len = le32toh(img->sb->journal_len);
+	struct jbd2_superblock *jsb;
+
+	if (!len)
+		return 0;
+	if (start < img->bfree_start + le32toh(img->sb->nr_bfree_blocks) ||
+	    (uint64_t) start + len > img->nr_blocks)
+		return -EINVAL;
+	jsb = pnlfs_block(img, start);
+	if (be32toh(jsb->h_magic) != JBD2_MAGIC_NUMBER)
+		return -EINVAL;
+	img->needs_recovery = !!jsb->s_start;
+	return 0;
+}
+
+int pnlfs_open(struct pnlfs_image *img, const char *path, int writable)
+{
+	struct pnlfs_superblock sb;
+	struct stat st;
+	uint64_t size;
+	int err;
+
+	memset(img, 0, sizeof(*img));
+	pthread_mutex_init(&img->lock, NULL);
+	img->writable = writable;
+	img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (img->fd < 0)
+		return -errno;
+
+	if (pread(img->fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+		err = -EIO;
+		goto err_close;
+	}
+	if (le32toh(sb.magic) != PNLFS_MAGIC) {
+		err = -EINVAL;
+		goto err_close;
+	}
+	img->sb = &sb;
+	err = check_superblock(img);
+	if (err)
+		goto err_close;
+
+	if (fstat(img->fd, &st)) {
+		err = -errno;
+		goto err_close;
+	}
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(img->fd, BLKGETSIZE64, &size)) {
+		err = -errno;
+		goto err_close;
+	}
+	img->map_size = (uint64_t) img->nr_blocks * img->block_size;
+	if (img->map_size > size) {
+		err = -EINVAL;
+		goto err_close;
+	}
+
+	img->map = mmap(NULL, img->map_size,
+			PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+			img->fd, 0);
+	if (img->map == MAP_FAILED) {
+		err = -errno;
+		goto err_close;
+	}
+	img->sb = (struct pnlfs_superblock *) img->map;
+
+	err = check_journal(img);
+	if (err)
+		goto err_unmap;
+	/* The image in place is behind the journal, changes would be lost */
+	if (writable && img->needs_recovery) {
+		err = -EUCLEAN;
+		goto err_unmap;
+	}
+	return 0;
+
+err_unmap:
+	munmap(img->map, img->map_size);
+err_close:
+	close(img->fd);
+	img->map = NULL;
+	img->sb = NULL;
+	return err;
+}
+
+int pnlfs_sync(struct pnlfs_image *img)
+{
+	if (!img->writable)
+		return 0;
+	if (msync(img->map, img->map_size, MS_SYNC) || fsync(img->fd))
+		return -errno;
+	return 0;
+}
+
+void pnlfs_close(struct pnlfs_image *img)
+{
+	if (!img->map)
+		return;
+	pnlfs_sync(img);
+	munmap(img->map, img->map_size);
+	close(img->fd);
+	pthread_mutex_destroy(&img->lock);
+	img->map = NULL;
+	img->sb = NULL;
+}
+
+/* Address of a block in the mapping, NULL past the end of the disk */
+void *pnlfs_block(struct pnlfs_image *img, uint32_t bno)
+{
+	if (bno >= img->nr_blocks)
+		return NULL;
+	return img->map + (uint64_t) bno * img->block_size;
+}
+
+/*
+ * A bitmap is the blocks from first, a bit set for a free item. Bits are
+ * little endian, bit n of the bitmap is bit n % 8 of its byte n / 8.
+ */
+static unsigned char *bitmap_byte(struct pnlfs_image *img, uint32_t first,
+				  uint32_t bit)
+{
+	return img->map + (uint64_t) first * img->block_size + bit / 8;
+}
+
+int pnlfs_inode_is_free(struct pnlfs_image *img, uint32_t ino)
+{
+	if (ino >= img->nr_inodes)
+		return -EINVAL;
+	return !!(*bitmap_byte(img, img->ifree_start, ino) & (1 << (ino % 8)));
+}
+
+int pnlfs_block_is_free(struct pnlfs_image *img, uint32_t bno)
+{
+	if (bno >= img->nr_blocks)
+		return -EINVAL;
+	return !!(*bitmap_byte(img, img->bfree_start, bno) & (1 << (bno % 8)));
+}
+
+/* The free counts of the superblock are left to the caller */
+void pnlfs_inode_set_free(struct pnlfs_image *img, uint32_t ino, int free)
+{
+	unsigned char *p = bitmap_byte(img, img->ifree_start, ino);
+
+	if (free)
+		*p |= 1 << (ino % 8);
+	else
+		*p &= ~(1 << (ino % 8));
+}
+
+void pnlfs_block_set_free(struct pnlfs_image *img, uint32_t bno, int free)
+{
+	unsigned char *p = bitmap_byte(img, img->bfree_start, bno);
+
+	if (free)
+		*p |= 1 << (bno % 8);
+	else
+		*p &= ~(1 << (bno % 8));
+}
+
+/* Set bits of the nr_bits first bits of the bitmap from block first */
+uint32_t pnlfs_count_free(struct pnlfs_image *img, uint32_t first,
+			  uint32_t nr_bits)
+{
+	const uint64_t *words = (const uint64_t *) pnlfs_block(img, first);
+	uint32_t i, n = 0;
+
+	/* The byte order does not change the weight of whole words */
+	for (i = 0; i < nr_bits / 64; i++)
+		n += __builtin_popcountll(words[i]);
+	for (i = nr_bits & ~63U; i < nr_bits; i++)
+		n += !!(*bitmap_byte(img, first, i) & (1 << (i % 8)));
+	return n;
+}
+
+/* Record of ino, NULL if there is none or it was never initialized */
+struct pnlfs_inode *pnlfs_raw_inode(struct pnlfs_image *img, uint32_t ino)
+{
+	uint32_t block = ino / img->inodes_per_block;
+
+	if (ino >= img->nr_inodes || block >= img->istore_init)
+		return NULL;
+	return (struct pnlfs_inode *) ((unsigned char *)
+		pnlfs_block(img, 1 + block) +
+		(ino % img->inodes_per_block) * img->inode_size);
+}
+
+int pnlfs_stat(struct pnlfs_image *img, uint32_t ino, struct pnlfs_stat *st)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(img, ino);
+	uint32_t mode;
+
+	if (!raw)
+		return -ENOENT;
+	mode = le32toh(raw->mode);
+	st->ino = ino;
+	st->mode = mode & ~PNLFS_INODE_FL_MASK;
+	st->flags = mode & PNLFS_INODE_FL_MASK;
+	st->size = le32toh(raw->filesize);
+	st->index_block = le32toh(raw->index_block);
+	st->nr_entries = le32toh(raw->nr_entries);
+	if (!S_ISDIR(st->mode) && !S_ISREG(st->mode))
+		return -EIO;
+	return 0;
+}
+
+/* Bytes of data an inline file keeps in its record */
+uint32_t pnlfs_inline_size(struct pnlfs_image *img)
+{
+	return img->inode_size - sizeof(struct pnlfs_inode);
+}
+
+/* Old directories: a block of PNLFS_MAX_DIR_ENTRIES fixed slots */
+static int old_iterate(struct pnlfs_image *img, const struct pnlfs_stat *st,
+		       pnlfs_filldir_t filldir, void *priv)
+{
+	struct pnlfs_dir_block *db = pnlfs_block(img, st->index_block);
+	struct pnlfs_file *f;
+	int i, ret;
+
+	if (!db)
+		return -EIO;
+	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+		f = &db->files[i];
+		if (!f->inode)
+			continue;
+		ret = filldir(priv, f->filename,
+			      strnlen(f->filename, PNLFS_FILENAME_LEN),
+			      le32toh(f->inode), 0);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static struct pnlfs_dx_header *dx_node(struct pnlfs_image *img, uint32_t bno)
+{
+	struct pnlfs_dx_header *dh = pnlfs_block(img, bno);
+
+	if (!dh || le16toh(dh->dx_magic) != PNLFS_DX_MAGIC ||
+	    le16toh(dh->dx_limit) != PNLFS_DX_LIMIT(img->block_size) ||
+	    le16toh(dh->dx_count) > le16toh(dh->dx_limit))
+		return NULL;
+	return dh;
+}
+
+static inline struct pnlfs_dx_entry *dx_entries(struct pnlfs_dx_header *dh)
+{
+	return (struct pnlfs_dx_entry *) (dh + 1);
+}
+
+/* A leaf whose records chain up to the end of the block, NULL if not */
+static unsigned char *dx_leaf(struct pnlfs_image *img, uint32_t bno)
+{
+	unsigned char *leaf = pnlfs_block(img, bno);
+	struct pnlfs_dir_entry *de;
+	uint32_t offs = 0, len;
+
+	if (!leaf)
+		return NULL;
+	while (offs < img->block_size) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		len = rec_len(de);
+		if (len < PNLFS_DIR_REC_LEN(0) || len & 3 ||
+		    offs + len > img->block_size ||
+		    (de->inode && PNLFS_DIR_REC_LEN(de->name_len) > len))
+			return NULL;
+		offs += len;
+	}
+	return leaf;
+}
+
+static int leaf_iterate(struct pnlfs_image *img, uint32_t bno,
+			pnlfs_filldir_t filldir, void *priv)
+{
+	unsigned char *leaf = dx_leaf(img, bno);
+	struct pnlfs_dir_entry *de;
+	uint32_t offs;
+	int ret;
+
+	if (!leaf)
+		return -EIO;
+	for (offs = 0; offs < img->block_size; offs += rec_len(de)) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		if (!de->inode)
+			continue;
+		ret = filldir(priv, de->name, de->name_len,
+			      le32toh(de->inode), de->file_type);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Leaves under the index node bno, levels being the levels below it */
+static int dx_iterate(struct pnlfs_image *img, uint32_t bno, int levels,
+		      pnlfs_filldir_t filldir, void *priv)
+{
+	struct pnlfs_dx_header *dh = dx_node(img, bno);
+	uint32_t child;
+	int i, ret;
+
+	if (!dh)
+		return -EIO;
+	for (i = 0; i < le16toh(dh->dx_count); i++) {
+		child = le32toh(dx_entries(dh)[i].block);
+		if (levels)
+			ret = dx_iterate(img, child, levels - 1, filldir, priv);
+		else
+			ret = leaf_iterate(img, child, filldir, priv);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Names of the directory, in no particular order */
+int pnlfs_iterate(struct pnlfs_image *img, uint32_t dir,
+		  pnlfs_filldir_t filldir, void *priv)
+{
+	struct pnlfs_dx_header *dh;
+	struct pnlfs_stat st;
+	int err;
+
+	err = pnlfs_stat(img, dir, &st);
+	if (err)
+		return err;
+	if (!S_ISDIR(st.mode))
+		return -ENOTDIR;
+	if (!(st.flags & PNLFS_INODE_HTREE))
+		return old_iterate(img, &st, filldir, priv);
+
+	dh = dx_node(img, st.index_block);
+	if (!dh || le16toh(dh->dx_levels) > PNLFS_DX_MAX_LEVELS)
+		return -EIO;
+	return dx_iterate(img, st.index_block, le16toh(dh->dx_levels),
+			  filldir, priv);
+}
+
+/* Child of the node covering hash, the first one covers every lower hash */
+static int dx_search(struct pnlfs_dx_header *dh, uint32_t hash)
+{
+	struct pnlfs_dx_entry *entries = dx_entries(dh);
+	int l = 1, r = le16toh(dh->dx_count) - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (le32toh(entries[m].hash) <= hash)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+	return l - 1;
+}
+
+/* Names with the same hash are in the same leaf, only one is read */
+static int dx_lookup(struct pnlfs_image *img, const struct pnlfs_stat *st,
+		     const char *name, int len, uint32_t *ino)
+{
+	uint32_t hash = pnlfs_dirhash(name, len), bno = st->index_block;
+	struct pnlfs_dx_header *dh;
+	struct pnlfs_dir_entry *de;
+	unsigned char *leaf;
+	uint32_t offs;
+	int levels, level;
+
+	dh = dx_node(img, bno);
+	if (!dh || le16toh(dh->dx_levels) > PNLFS_DX_MAX_LEVELS)
+		return -EIO;
+	levels = le16toh(dh->dx_levels);
+	for (level = 0; ; level++) {
+		if (!dh->dx_count)
+			return level ? -EIO : -ENOENT;
+		bno = le32toh(dx_entries(dh)[dx_search(dh, hash)].block);
+		if (level == levels)
+			break;
+		dh = dx_node(img, bno);
+		if (!dh)
+			return -EIO;
+	}
+
+	leaf = dx_leaf(img, bno);
+	if (!leaf)
+		return -EIO;
+	for (offs = 0; offs < img->block_size; offs += rec_len(de)) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		if (de->inode && de->name_len == len &&
+		    !memcmp(de->name, name, len)) {
+			*ino = le32toh(de->inode);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+struct old_lookup {
+	const char *name;
+	int len;
+	uint32_t ino;
+};
+
+static int old_lookup_actor(void *priv, const char *name, int len,
+			    uint32_t ino, unsigned int type)
+{
+	struct old_lookup *l = priv;
+
+	if (len != l->len || memcmp(name, l->name, len))
+		return 0;
+	l->ino = ino;
+	return 1;
+}
+
+int pnlfs_lookup(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t *ino)
+{
+	struct old_lookup l = { name, len, 0 };
+	struct pnlfs_stat st;
+	int err;
+
+	err = pnlfs_stat(img, dir, &st);
+	if (err)
+		return err;
+	if (!S_ISDIR(st.mode))
+		return -ENOTDIR;
+	if (st.flags & PNLFS_INODE_HTREE)
+		return dx_lookup(img, &st, name, len, ino);
+
+	err = old_iterate(img, &st, old_lookup_actor, &l);
+	if (err < 0)
+		return err;
+	if (!err)
+		return -ENOENT;
+	*ino = l.ino;
+	return 0;
+}
+
+/* Inode of a path from the root, "/" and "" being the root itself */
+int pnlfs_namei(struct pnlfs_image *img, const char *path, uint32_t *ino)
+{
+	const char *end;
+	uint32_t cur = 0;
+	int err;
+
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		end = strchrnul(path, '/');
+		if (end - path > PNLFS_NAME_LEN)
+			return -ENAMETOOLONG;
+		err = pnlfs_lookup(img, cur, path, end - path, &cur);
+		if (err)
+			return err;
+		path = end;
+	}
+	*ino = cur;
+	return 0;
+}
+
+static inline struct pnlfs_extent *ext_first(struct pnlfs_extent_header *eh)
+{
+	return (struct pnlfs_extent *) (eh + 1);
+}
+
+static inline struct pnlfs_extent_idx *idx_first(struct pnlfs_extent_header *eh)
+{
+	return (struct pnlfs_extent_idx *) (eh + 1);
+}
+
+static struct pnlfs_extent_header *ext_node(struct pnlfs_image *img,
+					    uint32_t bno)
+{
+	struct pnlfs_extent_header *eh = pnlfs_block(img, bno);
+
+	if (!eh || le16toh(eh->eh_magic) != PNLFS_EXT_MAGIC ||
+	    le16toh(eh->eh_max) != PNLFS_EXT_PER_BLOCK(img->block_size) ||
+	    le16toh(eh->eh_entries) > le16toh(eh->eh_max) ||
+	    le16toh(eh->eh_depth) > PNLFS_EXT_MAX_DEPTH)
+		return NULL;
+	return eh;
+}
+
+/* Last entry of the node with a key at or before iblock, -1 if none */
+static int ext_search(struct pnlfs_extent_header *eh, uint32_t iblock)
+{
+	/* Extents and index entries both start with their logical block */
+	struct pnlfs_extent *ex = ext_first(eh);
+	int l = 0, r = le16toh(eh->eh_entries) - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (le32toh(ex[m].ee_block) <= iblock)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+	return l - 1;
+}
+
+/*
+ * Walk the tree down to the leaf covering iblock, as the module does.
+ * Returns 1 if iblock is mapped, with in pblk its block, in len the blocks
+ * mapped contiguously from there and in unwritten the state of the
+ * extent. Returns 0 for a hole, len being its length and pblk the block
+ * after the previous extent on disk, where new blocks would best go.
+ */
+static int ext_lookup(struct pnlfs_image *img, uint32_t root, uint32_t iblock,
+		      uint32_t *pblk, uint32_t *len, int *unwritten)
+{
+	struct pnlfs_extent_header *eh = ext_node(img, root);
+	struct pnlfs_extent *ex;
+	uint32_t next = UINT32_MAX, start, elen;
+	int depth, pos;
+
+	if (!eh)
+		return -EIO;
+	for (depth = le16toh(eh->eh_depth); depth; depth--) {
+		if (!eh->eh_entries)
+			return -EIO;
+		/* The first child covers every block before its key */
+		pos = ext_search(eh, iblock);
+		if (pos < 0)
+			pos = 0;
+		if (pos + 1 < le16toh(eh->eh_entries))
+			next = le32toh(idx_first(eh)[pos + 1].ei_block);
+		eh = ext_node(img, le32toh(idx_first(eh)[pos].ei_leaf));
+		if (!eh || le16toh(eh->eh_depth) != depth - 1)
+			return -EIO;
+	}
+
+	pos = ext_search(eh, iblock);
+	if (pos + 1 < le16toh(eh->eh_entries))
+		next = le32toh(ext_first(eh)[pos + 1].ee_block);
+	*pblk = root + 1;
+	if (pos >= 0) {
+		ex = &ext_first(eh)[pos];
+		start = le32toh(ex->ee_block);
+		elen = le32toh(ex->ee_len) & PNLFS_EXT_MAX_LEN;
+		*pblk = le32toh(ex->ee_start) + iblock - start;
+		if (iblock - start < elen) {
+			*len = elen - (iblock - start);
+			if ((uint64_t) *pblk + *len > img->nr_blocks)
+				return -EIO;
+			*unwritten = !!(le32toh(ex->ee_len) &
+					PNLFS_EXT_UNWRITTEN);
+			return 1;
+		}
+	}
+	*len = next - iblock;
+	return 0;
+}
+
+static int ext_bmap(struct pnlfs_image *img, uint32_t root, uint32_t iblock,
+		    uint32_t *pblk, uint32_t *len)
+{
+	int unwritten, ret;
+
+	ret = ext_lookup(img, root, iblock, pblk, len, &unwritten);
+	/* Unwritten blocks read as zeroes */
+	return ret == 1 ? !unwritten : ret;
+}
+
+/* Files before extents: the index block is an array of block numbers */
+static int map_bmap(struct pnlfs_image *img, uint32_t index, uint32_t iblock,
+		    uint32_t *pblk, uint32_t *len)
+{
+	uint32_t *blocks = pnlfs_block(img, index), entries, bno, n;
+
+	entries = img->block_size / sizeof(uint32_t);
+	if (!blocks)
+		return -EIO;
+	if (iblock >= entries) {
+		*len = UINT32_MAX - iblock;
+		return 0;
+	}
+	bno = le32toh(blocks[iblock]);
+	for (n = 1; iblock + n < entries; n++)
+		if (le32toh(blocks[iblock + n]) != (bno ? bno + n : 0))
+			break;
+	*pblk = bno;
+	*len = n;
+	if (bno && (uint64_t) bno + n > img->nr_blocks)
+		return -EIO;
+	return !!bno;
+}
+
+/*
+ * Block of the file holding iblock. Returns 1 if it has data, with in pblk
+ * its block and in len the blocks contiguous on disk from there. Returns
+ * 0 for a hole or an unwritten extent, len being its length.
+ */
+int pnlfs_bmap(struct pnlfs_image *img, const struct pnlfs_stat *st,
+	       uint32_t iblock, uint32_t *pblk, uint32_t *len)
+{
+	if (st->flags & PNLFS_INODE_INLINE)
+		return -EINVAL;
+	if (st->flags & PNLFS_INODE_EXTENTS)
+		return ext_bmap(img, st->index_block, iblock, pblk, len);
+	return map_bmap(img, st->index_block, iblock, pblk, len);
+}
+
+/* Copy [off, off + count) of the file to buf, which must be in i_size */
+static ssize_t file_read(struct pnlfs_image *img, const struct pnlfs_stat *st,
+			 void *buf, size_t count, uint64_t off)
+{
+	unsigned char *p = buf;
+	uint32_t iblock, pblk, len, in_block;
+	uint64_t n;
+	size_t done = 0;
+	int ret;
+
+	if (st->flags & PNLFS_INODE_INLINE) {
+		if (st->size > pnlfs_inline_size(img))
+			return -EIO;
+		memcpy(buf, (unsigned char *) (pnlfs_raw_inode(img, st->ino) + 1) +
+		       off, count);
+		return count;
+	}
+
+	while (done < count) {
+		iblock = off / img->block_size;
+		in_block = off % img->block_size;
+		ret = pnlfs_bmap(img, st, iblock, &pblk, &len);
+		if (ret < 0)
+			return done ? (ssize_t) done : ret;
+		n = (uint64_t) len * img->block_size - in_block;
+		if (n > count - done)
+			n = count - done;
+		if (ret)
+			memcpy(p, img->map + (uint64_t) pblk * img->block_size +
+			       in_block, n);
+		else
+			memset(p, 0, n);
+		p += n;
+		off += n;
+		done += n;
+	}
+	return done;
+}
+
+ssize_t pnlfs_pread(struct pnlfs_image *img, uint32_t ino, void *buf,
+		    size_t count, uint64_t off)
+{
+	struct pnlfs_stat st;
+	int err;
+
+	err = pnlfs_stat(img, ino, &st);
+	if (err)
+		return err;
+	if (S_ISDIR(st.mode))
+		return -EISDIR;
+	if (off >= st.size)
+		return 0;
+	if (count > st.size - off)
+		count = st.size - off;
+	return file_read(img, &st, buf, count, off);
+}
+
+/* Nodes and leaves under the index node bno */
+static int dx_walk(struct pnlfs_image *img, uint32_t bno, int levels,
+		   pnlfs_blockfn_t fn, void *priv)
+{
+	struct pnlfs_dx_header *dh = dx_node(img, bno);
+	uint32_t child;
+	int i, ret;
+
+	if (!dh)
+		return -EIO;
+	ret = fn(priv, bno, 1, 1);
+	for (i = 0; !ret && i < le16toh(dh->dx_count); i++) {
+		child = le32toh(dx_entries(dh)[i].block);
+		if (levels)
+			ret = dx_walk(img, child, levels - 1, fn, priv);
+		else if (!dx_leaf(img, child))
+			ret = -EIO;
+		else
+			ret = fn(priv, child, 1, 1);
+	}
+	return ret;
+}
+
+/* The node bno and what is under it, depth being what its parent expects */
+static int ext_walk(struct pnlfs_image *img, uint32_t bno, int depth,
+		    pnlfs_blockfn_t fn, void *priv)
+{
+	struct pnlfs_extent_header *eh = ext_node(img, bno);
+	struct pnlfs_extent *ex;
+	uint32_t len;
+	int i, ret;
+
+	if (!eh || (depth >= 0 && le16toh(eh->eh_depth) != depth))
+		return -EIO;
+	depth = le16toh(eh->eh_depth);
+	ret = fn(priv, bno, 1, 1);
+	for (i = 0; !ret && i < le16toh(eh->eh_entries); i++) {
+		if (depth) {
+			ret = ext_walk(img, le32toh(idx_first(eh)[i].ei_leaf),
+				       depth - 1, fn, priv);
+			continue;
+		}
+		ex = &ext_first(eh)[i];
+		len = le32toh(ex->ee_len) & PNLFS_EXT_MAX_LEN;
+		if ((uint64_t) le32toh(ex->ee_start) + len > img->nr_blocks)
+			return -EIO;
+		if (len)
+			ret = fn(priv, le32toh(ex->ee_start), len, 0);
+	}
+	return ret;
+}
+
+/* The index block and the runs of blocks it lists */
+static int map_walk(struct pnlfs_image *img, uint32_t index,
+		    pnlfs_blockfn_t fn, void *priv)
+{
+	uint32_t *blocks = pnlfs_block(img, index), entries, bno, i, n;
+	int ret;
+
+	if (!blocks)
+		return -EIO;
+	entries = img->block_size / sizeof(uint32_t);
+	ret = fn(priv, index, 1, 1);
+	for (i = 0; !ret && i < entries; i += n) {
+		bno = le32toh(blocks[i]);
+		for (n = 1; i + n < entries; n++)
+			if (le32toh(blocks[i + n]) != (bno ? bno + n : 0))
+				break;
+		if (!bno)
+			continue;
+		if ((uint64_t) bno + n > img->nr_blocks)
+			return -EIO;
+		ret = fn(priv, bno, n, 0);
+	}
+	return ret;
+}
+
+/*
+ * Call fn for each block of the inode: the blocks of its index with meta
+ * set, then its data by runs. Returns -EIO if the index is corrupted, or
+ * the first non zero return of fn.
+ */
+int pnlfs_walk_blocks(struct pnlfs_image *img, const struct pnlfs_stat *st,
+		      pnlfs_blockfn_t fn, void *priv)
+{
+	struct pnlfs_dx_header *dh;
+
+	if (st->flags & PNLFS_INODE_INLINE)
+		return 0;
+	if (S_ISDIR(st->mode)) {
+		if (!(st->flags & PNLFS_INODE_HTREE))
+			return pnlfs_block(img, st->index_block) ?
+				fn(priv, st->index_block, 1, 1) : -EIO;
+		dh = dx_node(img, st->index_block);
+		if (!dh || le16toh(dh->dx_levels) > PNLFS_DX_MAX_LEVELS)
+			return -EIO;
+		return dx_walk(img, st->index_block, le16toh(dh->dx_levels),
+			       fn, priv);
+	}
+	if (st->flags & PNLFS_INODE_EXTENTS)
+		return ext_walk(img, st->index_block, -1, fn, priv);
+	return map_walk(img, st->index_block, fn, priv);
+}
+
+static inline void le32_add(__le32 *v, int32_t n)
+{
+	*v = htole32(le32toh(*v) + n);
+}
+
+/* First set bit of the bitmap in [from, nr_bits), nr_bits if there is none */
+static uint32_t bitmap_find(struct pnlfs_image *img, uint32_t first,
+			    uint32_t from, uint32_t nr_bits)
+{
+	const uint64_t *words = (const uint64_t *) pnlfs_block(img, first);
+	uint32_t i = from / 64, end = (nr_bits + 63) / 64;
+	uint64_t w;
+
+	if (from >= nr_bits)
+		return nr_bits;
+	w = le64toh(words[i]) & (~0ULL << (from % 64));
+	while (!w) {
+		if (++i == end)
+			return nr_bits;
+		w = le64toh(words[i]);
+	}
+	i = i * 64 + __builtin_ctzll(w);
+	return i < nr_bits ? i : nr_bits;
+}
+
+/* Zero the store blocks mkfs left up to the one of ino, as the module does */
+static void istore_init(struct pnlfs_image *img, uint32_t ino)
+{
+	uint32_t block = ino / img->inodes_per_block;
+
+	if (block < img->istore_init)
+		return;
+	memset(pnlfs_block(img, 1 + img->istore_init), 0,
+	       (uint64_t) (block + 1 - img->istore_init) * img->block_size);
+	img->istore_init = block + 1;
+	img->sb->itable_unused = htole32(le32toh(img->sb->nr_istore_blocks) -
+					 img->istore_init);
+}
+
+/* A free inode, its record zeroed */
+int pnlfs_new_inode(struct pnlfs_image *img, uint32_t *ino)
+{
+	uint32_t i;
+	int err = 0;
+
+	pthread_mutex_lock(&img->lock);
+	i = bitmap_find(img, img->ifree_start, img->next_ino, img->nr_inodes);
+	if (i == img->nr_inodes && img->next_ino)
+		i = bitmap_find(img, img->ifree_start, 0, img->nr_inodes);
+	if (i == img->nr_inodes) {
+		err = -ENOSPC;
+		goto out;
+	}
+	pnlfs_inode_set_free(img, i, 0);
+	le32_add(&img->sb->nr_free_inodes, -1);
+	istore_init(img, i);
+	memset(pnlfs_raw_inode(img, i), 0, img->inode_size);
+	img->next_ino = i + 1;
+	*ino = i;
+out:
+	pthread_mutex_unlock(&img->lock);
+	return err;
+}
+
+void pnlfs_free_inode(struct pnlfs_image *img, uint32_t ino)
+{
+	pthread_mutex_lock(&img->lock);
+	pnlfs_inode_set_free(img, ino, 1);
+	le32_add(&img->sb->nr_free_inodes, 1);
+	if (ino < img->next_ino)
+		img->next_ino = ino;
+	pthread_mutex_unlock(&img->lock);
+}
+
+/*
+ * Take up to count free blocks in a row, from goal or the first free
+ * block after it. count is what was taken, at least one.
+ */
+int pnlfs_new_blocks(struct pnlfs_image *img, uint32_t goal, uint32_t *bno,
+		     uint32_t *count)
+{
+	uint32_t b, n, i;
+	int err = 0;
+
+	pthread_mutex_lock(&img->lock);
+	if (!goal || goal >= img->nr_blocks)
+		goal = img->next_block;
+	b = bitmap_find(img, img->bfree_start, goal, img->nr_blocks);
+	if (b == img->nr_blocks && goal)
+		b = bitmap_find(img, img->bfree_start, 0, img->nr_blocks);
+	if (b == img->nr_blocks) {
+		err = -ENOSPC;
+		goto out;
+	}
+	for (n = 1; n < *count && b + n < img->nr_blocks; n++)
+		if (pnlfs_block_is_free(img, b + n) != 1)
+			break;
+	for (i = 0; i < n; i++)
+		pnlfs_block_set_free(img, b + i, 0);
+	le32_add(&img->sb->nr_free_blocks, -n);
+	img->next_block = b + n;
+	*bno = b;
+	*count = n;
+out:
+	pthread_mutex_unlock(&img->lock);
+	return err;
+}
+
+void pnlfs_free_blocks(struct pnlfs_image *img, uint32_t bno, uint32_t count)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&img->lock);
+	for (i = 0; i < count; i++)
+		pnlfs_block_set_free(img, bno + i, 1);
+	le32_add(&img->sb->nr_free_blocks, count);
+	pthread_mutex_unlock(&img->lock);
+}
+
+/* A block for the index of an inode, zeroed */
+static int new_meta_block(struct pnlfs_image *img, uint32_t goal,
+			  uint32_t *bno)
+{
+	uint32_t count = 1;
+	int err;
+
+	err = pnlfs_new_blocks(img, goal, bno, &count);
+	if (!err)
+		memset(pnlfs_block(img, *bno), 0, img->block_size);
+	return err;
+}
+
+/*
+ * Extent trees, changed as extents.c does. A node of the path is a
+ * pointer into the mapping, it stays valid when the tree changes.
+ */
+struct ext_path {
+	struct pnlfs_extent_header *hdr;
+	int pos;
+};
+
+static inline uint32_t ext_len(struct pnlfs_extent *ex)
+{
+	return le32toh(ex->ee_len) & PNLFS_EXT_MAX_LEN;
+}
+
+static inline int ext_is_unwritten(struct pnlfs_extent *ex)
+{
+	return !!(le32toh(ex->ee_len) & PNLFS_EXT_UNWRITTEN);
+}
+
+static inline void ext_set_len(struct pnlfs_extent *ex, uint32_t len,
+			       int unwritten)
+{
+	ex->ee_len = htole32(len | (unwritten ? PNLFS_EXT_UNWRITTEN : 0));
+}
+
+static void ext_init_header(struct pnlfs_image *img,
+			    struct pnlfs_extent_header *eh, int depth)
+{
+	eh->eh_magic = htole16(PNLFS_EXT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = htole16(PNLFS_EXT_PER_BLOCK(img->block_size));
+	eh->eh_depth = htole16(depth);
+	eh->eh_reserved = 0;
+}
+
+/* Down to the leaf covering iblock, returns the depth of the tree */
+static int ext_find(struct pnlfs_image *img, uint32_t root, uint32_t iblock,
+		    struct ext_path *path)
+{
+	struct pnlfs_extent_header *eh;
+	uint32_t bno = root;
+	int level = 0, depth = 0;
+
+	for (;;) {
+		eh = ext_node(img, bno);
+		if (!eh || (level && le16toh(eh->eh_depth) != depth - level))
+			return -EIO;
+		if (!level)
+			depth = le16toh(eh->eh_depth);
+		path[level].hdr = eh;
+		path[level].pos = ext_search(eh, iblock);
+		if (level == depth)
+			return depth;
+		if (!eh->eh_entries)
+			return -EIO;
+		if (path[level].pos < 0)
+			path[level].pos = 0;
+		bno = le32toh(idx_first(eh)[path[level].pos].ei_leaf);
+		level++;
+	}
+}
+
+/* The root is full: move its content in a new node and point to it */
+static int ext_grow(struct pnlfs_image *img, uint32_t root,
+		    struct ext_path *path)
+{
+	struct pnlfs_extent_header *eh = path[0].hdr;
+	struct pnlfs_extent_idx *ix;
+	int depth = le16toh(eh->eh_depth), err;
+	uint32_t bno;
+
+	if (depth >= PNLFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+	err = new_meta_block(img, root + 1, &bno);
+	if (err)
+		return err;
+	memcpy(pnlfs_block(img, bno), eh, img->block_size);
+
+	eh->eh_entries = htole16(1);
+	eh->eh_depth = htole16(depth + 1);
+	ix = idx_first(eh);
+	ix->ei_block = 0;
+	ix->ei_leaf = htole32(bno);
+	ix->ei_unused = 0;
+	return 0;
+}
+
+/* Make room in the full node at level, its parent being split first */
+static int ext_split(struct pnlfs_image *img, uint32_t root,
+		     struct ext_path *path, int depth, int level)
+{
+	struct pnlfs_extent_header *eh, *neh, *peh;
+	struct pnlfs_extent_idx *pix;
+	int entries, move, ppos, err;
+	uint32_t bno;
+
+	if (!level)
+		return ext_grow(img, root, path);
+	peh = path[level - 1].hdr;
+	if (peh->eh_entries == peh->eh_max)
+		return ext_split(img, root, path, depth, level - 1);
+
+	eh = path[level].hdr;
+	entries = le16toh(eh->eh_entries);
+	err = new_meta_block(img, root + 1, &bno);
+	if (err)
+		return err;
+	neh = pnlfs_block(img, bno);
+	ext_init_header(img, neh, le16toh(eh->eh_depth));
+
+	/* Appending to a leaf keeps it full, otherwise split in halves */
+	if (level == depth && path[level].pos == entries - 1)
+		move = 1;
+	else
+		move = entries / 2;
+	memcpy(ext_first(neh), &ext_first(eh)[entries - move],
+	       move * sizeof(struct pnlfs_extent));
+	neh->eh_entries = htole16(move);
+	eh->eh_entries = htole16(entries - move);
+
+	pix = idx_first(peh);
+	ppos = path[level - 1].pos + 1;
+	memmove(&pix[ppos + 1], &pix[ppos],
+		(le16toh(peh->eh_entries) - ppos) * sizeof(*pix));
+	pix[ppos].ei_block = ext_first(neh)[0].ee_block;
+	pix[ppos].ei_leaf = htole32(bno);
+	pix[ppos].ei_unused = 0;
+	peh->eh_entries = htole16(le16toh(peh->eh_entries) + 1);
+	return 0;
+}
+
+/* Record that the len blocks from iblock are stored from pblk */
+static int ext_insert(struct pnlfs_image *img, uint32_t root, uint32_t iblock,
+		      uint32_t pblk, uint32_t len, int unwritten)
+{
+	struct ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent_header *eh;
+	struct pnlfs_extent *ex;
+	int depth, pos, entries, err;
+
+again:
+	depth = ext_find(img, root, iblock, path);
+	if (depth < 0)
+		return depth;
+	eh = path[depth].hdr;
+	ex = ext_first(eh);
+	pos = path[depth].pos;
+	entries = le16toh(eh->eh_entries);
+
+	/* Merge with the extent before */
+	if (pos >= 0 && ext_is_unwritten(&ex[pos]) == unwritten &&
+	    le32toh(ex[pos].ee_block) + ext_len(&ex[pos]) == iblock &&
+	    le32toh(ex[pos].ee_start) + ext_len(&ex[pos]) == pblk &&
+	    ext_len(&ex[pos]) + len <= PNLFS_EXT_MAX_LEN) {
+		ext_set_len(&ex[pos], ext_len(&ex[pos]) + len, unwritten);
+		return 0;
+	}
+
+	/* Merge with the extent after */
+	if (pos + 1 < entries && ext_is_unwritten(&ex[pos + 1]) == unwritten &&
+	    iblock + len == le32toh(ex[pos + 1].ee_block) &&
+	    pblk + len == le32toh(ex[pos + 1].ee_start) &&
+	    ext_len(&ex[pos + 1]) + len <= PNLFS_EXT_MAX_LEN) {
+		ex[pos + 1].ee_block = htole32(iblock);
+		ex[pos + 1].ee_start = htole32(pblk);
+		ext_set_len(&ex[pos + 1], ext_len(&ex[pos + 1]) + len,
+			    unwritten);
+		return 0;
+	}
+
+	if (eh->eh_entries == eh->eh_max) {
+		err = ext_split(img, root, path, depth, depth);
+		if (err)
+			return err;
+		goto again;
+	}
+
+	memmove(&ex[pos + 2], &ex[pos + 1], (entries - pos - 1) * sizeof(*ex));
+	ex[pos + 1].ee_block = htole32(iblock);
+	ex[pos + 1].ee_start = htole32(pblk);
+	ext_set_len(&ex[pos + 1], len, unwritten);
+	eh->eh_entries = htole16(entries + 1);
+	return 0;
+}
+
+/*
+ * The n blocks from iblock, in an unwritten extent, are about to get
+ * data: the extent is cut around them.
+ */
+static int ext_mark_written(struct pnlfs_image *img, uint32_t root,
+			    uint32_t iblock, uint32_t n)
+{
+	struct ext_path path[PNLFS_EXT_MAX_DEPTH + 1];
+	struct pnlfs_extent *ex;
+	uint32_t start, pblk, head, tail;
+	int depth, err = 0;
+
+	depth = ext_find(img, root, iblock, path);
+	if (depth < 0)
+		return depth;
+	if (path[depth].pos < 0)
+		return -EIO;
+	ex = &ext_first(path[depth].hdr)[path[depth].pos];
+	start = le32toh(ex->ee_block);
+	pblk = le32toh(ex->ee_start);
+	head = iblock - start;
+	tail = ext_len(ex) - head - n;
+
+	if (head) {
+		ext_set_len(ex, head, 1);
+		err = ext_insert(img, root, iblock, pblk + head, n, 0);
+	} else {
+		ext_set_len(ex, n, 0);
+	}
+	if (!err && tail)
+		err = ext_insert(img, root, iblock + n, pblk + head + n, tail, 1);
+	return err;
+}
+
+/*
+ * Unmap the blocks from logical block from in the node bno, freeing them
+ * and the nodes left empty but bno itself. Returns the entries left.
+ */
+static int ext_trunc(struct pnlfs_image *img, uint32_t bno, int depth,
+		     uint32_t from, uint32_t *freed)
+{
+	struct pnlfs_extent_header *eh = ext_node(img, bno);
+	struct pnlfs_extent_idx *ix;
+	struct pnlfs_extent *ex;
+	uint32_t start, len;
+	int n, left, stop;
+
+	if (!eh || (depth >= 0 && le16toh(eh->eh_depth) != depth))
+		return -EIO;
+	depth = le16toh(eh->eh_depth);
+	n = le16toh(eh->eh_entries);
+
+	/* Entries are sorted, those to drop are the last ones */
+	while (n && !depth) {
+		ex = &ext_first(eh)[n - 1];
+		start = le32toh(ex->ee_block);
+		len = ext_len(ex);
+		if ((uint64_t) le32toh(ex->ee_start) + len > img->nr_blocks)
+			return -EIO;
+		if (start + len <= from)
+			break;
+		if (start < from) {
+			pnlfs_free_blocks(img, le32toh(ex->ee_start) +
+					  from - start, start + len - from);
+			*freed += start + len - from;
+			ext_set_len(ex, from - start, ext_is_unwritten(ex));
+			break;
+		}
+		pnlfs_free_blocks(img, le32toh(ex->ee_start), len);
+		*freed += len;
+		n--;
+	}
+	while (n && depth) {
+		ix = &idx_first(eh)[n - 1];
+		left = ext_trunc(img, le32toh(ix->ei_leaf), depth - 1, from,
+				 freed);
+		if (left < 0)
+			return left;
+		/* The children before only have blocks before this key */
+		stop = le32toh(ix->ei_block) <= from;
+		if (!left) {
+			pnlfs_free_blocks(img, le32toh(ix->ei_leaf), 1);
+			n--;
+		}
+		if (stop)
+			break;
+	}
+	eh->eh_entries = htole16(n);
+	return n;
+}
+
+/* Old files: a block for each entry of the index block, one at a time */
+static int map_write(struct pnlfs_image *img, const struct pnlfs_stat *st,
+		     uint32_t iblock, uint32_t *pblk, uint32_t *len)
+{
+	uint32_t *blocks = pnlfs_block(img, st->index_block), goal, count = 1;
+	int ret;
+
+	ret = map_bmap(img, st->index_block, iblock, pblk, len);
+	if (ret)
+		return ret < 0 ? ret : 0;
+	if (iblock >= img->block_size / sizeof(uint32_t))
+		return -EFBIG;
+	goal = iblock && blocks[iblock - 1] ?
+		le32toh(blocks[iblock - 1]) + 1 : st->index_block + 1;
+	ret = pnlfs_new_blocks(img, goal, pblk, &count);
+	if (ret)
+		return ret;
+	blocks[iblock] = htole32(*pblk);
+	*len = 1;
+	return 1;
+}
+
+/* Give an inline file an extent tree, its data going to its first block */
+static int inline_convert(struct pnlfs_image *img, struct pnlfs_stat *st)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(img, st->ino);
+	unsigned char *data = (unsigned char *) (raw + 1);
+	uint32_t root, bno, count = 1;
+	int err;
+
+	if (st->size > pnlfs_inline_size(img))
+		return -EIO;
+	err = new_meta_block(img, 0, &root);
+	if (err)
+		return err;
+	ext_init_header(img, pnlfs_block(img, root), 0);
+	if (st->size) {
+		err = pnlfs_new_blocks(img, root + 1, &bno, &count);
+		if (err) {
+			pnlfs_free_blocks(img, root, 1);
+			return err;
+		}
+		memset(pnlfs_block(img, bno), 0, img->block_size);
+		memcpy(pnlfs_block(img, bno), data, st->size);
+		/* An empty root has room */
+		ext_insert(img, root, 0, bno, 1, 0);
+		raw->nr_used_blocks = htole32(1);
+	}
+	memset(data, 0, pnlfs_inline_size(img));
+
+	st->flags = (st->flags & ~PNLFS_INODE_INLINE) | PNLFS_INODE_EXTENTS;
+	st->index_block = root;
+	raw->index_block = htole32(root);
+	raw->mode = htole32(st->mode | st->flags);
+	return 0;
+}
+
+/*
+ * Map up to want blocks from iblock for a write, allocating them where
+ * there are none. Returns 1 for new blocks, the caller zeroing what it
+ * does not write of them, or 0 for blocks which have data already. pblk
+ * and len are as for pnlfs_bmap(). An inline file gets an extent tree.
+ */
+int pnlfs_map_write(struct pnlfs_image *img, uint32_t ino, uint32_t iblock,
+		    uint32_t want, uint32_t *pblk, uint32_t *len)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(img, ino);
+	struct pnlfs_stat st;
+	uint32_t count;
+	int unwritten, ret;
+
+	ret = pnlfs_stat(img, ino, &st);
+	if (ret)
+		return ret;
+	if (S_ISDIR(st.mode))
+		return -EISDIR;
+	if (st.flags & PNLFS_INODE_INLINE) {
+		ret = inline_convert(img, &st);
+		if (ret)
+			return ret;
+	}
+	if (!(st.flags & PNLFS_INODE_EXTENTS)) {
+		ret = map_write(img, &st, iblock, pblk, len);
+		if (ret == 1)
+			le32_add(&raw->nr_used_blocks, 1);
+		if (ret >= 0 && *len > want)
+			*len = want;
+		return ret;
+	}
+
+	ret = ext_lookup(img, st.index_block, iblock, pblk, len, &unwritten);
+	if (ret < 0)
+		return ret;
+	if (*len > want)
+		*len = want;
+	if (ret && !unwritten)
+		return 0;
+	if (ret) {
+		ret = ext_mark_written(img, st.index_block, iblock, *len);
+		return ret ? ret : 1;
+	}
+
+	count = *len;
+	ret = pnlfs_new_blocks(img, *pblk, pblk, &count);
+	if (ret)
+		return ret;
+	ret = ext_insert(img, st.index_block, iblock, *pblk, count, 0);
+	if (ret) {
+		pnlfs_free_blocks(img, *pblk, count);
+		return ret;
+	}
+	le32_add(&raw->nr_used_blocks, count);
+	*len = count;
+	return 1;
+}
+
+/* Write buf at off, the file growing and getting blocks as needed */
+ssize_t pnlfs_pwrite(struct pnlfs_image *img, uint32_t ino, const void *buf,
+		     size_t count, uint64_t off)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(img, ino);
+	const unsigned char *p = buf;
+	unsigned char *dst;
+	struct pnlfs_stat st;
+	uint32_t pblk, len, in_block, bs = img->block_size;
+	uint64_t end = off + count, n;
+	size_t done = 0;
+	int ret;
+
+	if (!img->writable)
+		return -EBADF;
+	ret = pnlfs_stat(img, ino, &st);
+	if (ret)
+		return ret;
+	if (S_ISDIR(st.mode))
+		return -EISDIR;
+	if (!count)
+		return 0;
+	if (end > PNLFS_MAX_FILESIZE)
+		return -EFBIG;
+
+	/* The record is zeroed past the size, no gap to fill */
+	if (st.flags & PNLFS_INODE_INLINE && end <= pnlfs_inline_size(img)) {
+		memcpy((unsigned char *) (raw + 1) + off, buf, count);
+		if (end > st.size)
+			raw->filesize = htole32(end);
+		return count;
+	}
+
+	while (done < count) {
+		in_block = off % bs;
+		ret = pnlfs_map_write(img, ino, off / bs,
+				      (in_block + end - off + bs - 1) / bs,
+				      &pblk, &len);
+		if (ret < 0)
+			break;
+		dst = img->map + (uint64_t) pblk * bs;
+		n = (uint64_t) len * bs - in_block;
+		if (n > count - done)
+			n = count - done;
+		if (ret) {
+			memset(dst, 0, in_block);
+			memset(dst + in_block + n, 0,
+			       (uint64_t) len * bs - in_block - n);
+		}
+		memcpy(dst + in_block, p, n);
+		p += n;
+		off += n;
+		done += n;
+	}
+	if (off > st.size)
+		raw->filesize = htole32(off);
+	return done ? (ssize_t) done : ret;
+}
+
+/* Set the size of the file, freeing the blocks past a smaller one */
+int pnlfs_truncate(struct pnlfs_image *img, uint32_t ino, uint64_t size)
+{
+	struct pnlfs_inode *raw = pnlfs_raw_inode(img, ino);
+	struct pnlfs_extent_header *eh;
+	struct pnlfs_stat st;
+	uint32_t bs = img->block_size, from, pblk, len, freed = 0, *blocks, i;
+	int ret;
+
+	if (!img->writable)
+		return -EBADF;
+	ret = pnlfs_stat(img, ino, &st);
+	if (ret)
+		return ret;
+	if (S_ISDIR(st.mode))
+		return -EISDIR;
+	if (size > PNLFS_MAX_FILESIZE)
+		return -EFBIG;
+
+	if (st.flags & PNLFS_INODE_INLINE) {
+		/* Past the smaller size is zeroed, a file growing reads zeroes */
+		if (size <= pnlfs_inline_size(img)) {
+			from = size < st.size ? size : st.size;
+			memset((unsigned char *) (raw + 1) + from, 0,
+			       pnlfs_inline_size(img) - from);
+			raw->filesize = htole32(size);
+			return 0;
+		}
+		ret = inline_convert(img, &st);
+		if (ret)
+			return ret;
+	}
+	if (size >= st.size) {
+		raw->filesize = htole32(size);
+		return 0;
+	}
+
+	from = (size + bs - 1) / bs;
+	if (st.flags & PNLFS_INODE_EXTENTS) {
+		ret = ext_trunc(img, st.index_block, -1, from, &freed);
+		if (!ret) {
+			eh = pnlfs_block(img, st.index_block);
+			eh->eh_depth = 0;
+		}
+	} else {
+		blocks = pnlfs_block(img, st.index_block);
+		for (i = from; blocks && i < bs / sizeof(uint32_t); i++) {
+			if (!blocks[i] || le32toh(blocks[i]) >= img->nr_blocks)
+				continue;
+			pnlfs_free_blocks(img, le32toh(blocks[i]), 1);
+			blocks[i] = 0;
+			freed++;
+		}
+		ret = blocks ? 0 : -EIO;
+	}
+	raw->nr_used_blocks = htole32(le32toh(raw->nr_used_blocks) > freed ?
+				      le32toh(raw->nr_used_blocks) - freed : 0);
+	raw->filesize = htole32(size);
+	if (ret < 0)
+		return ret;
+
+	/* The end of the last block is zeroed for a file growing again */
+	if (size % bs && pnlfs_bmap(img, &st, size / bs, &pblk, &len) == 1)
+		memset(img->map + (uint64_t) pblk * bs + size % bs, 0,
+		       bs - size % bs);
+	return 0;
+}
+
+/* Hashed directories, changed as dir.c does */
+struct dx_path {
+	struct pnlfs_dx_header *hdr;
+	int pos;
+};
+
+/* A name of a leaf, to split the leaf in hash order */
+struct dx_map {
+	uint32_t hash;
+	uint32_t offs;
+	uint32_t size;
+};
+
+static inline void set_rec_len(struct pnlfs_dir_entry *de, uint32_t len)
+{
+	de->rec_len = htole16(len < 0xffff ? len : 0xffff);
+}
+
+static void dx_init_header(struct pnlfs_image *img, struct pnlfs_dx_header *dh)
+{
+	dh->dx_magic = htole16(PNLFS_DX_MAGIC);
+	dh->dx_count = 0;
+	dh->dx_limit = htole16(PNLFS_DX_LIMIT(img->block_size));
+	dh->dx_levels = 0;
+	dh->dx_reserved = 0;
+}
+
+/* An empty leaf is a single unused record over the whole block */
+static void dx_init_leaf(struct pnlfs_image *img, unsigned char *leaf)
+{
+	memset(leaf, 0, img->block_size);
+	set_rec_len((struct pnlfs_dir_entry *) leaf, img->block_size);
+}
+
+/* Down to the leaf covering hash, returns the levels under the root */
+static int dx_find(struct pnlfs_image *img, uint32_t root, uint32_t hash,
+		   struct dx_path *path)
+{
+	struct pnlfs_dx_header *dh;
+	uint32_t bno = root;
+	int level = 0, levels = 0;
+
+	for (;;) {
+		dh = dx_node(img, bno);
+		if (!dh)
+			return -EIO;
+		path[level].hdr = dh;
+		if (!level) {
+			levels = le16toh(dh->dx_levels);
+			if (levels > PNLFS_DX_MAX_LEVELS)
+				return -EIO;
+		}
+		/* An empty root has no leaf at all */
+		if (!dh->dx_count)
+			return level ? -EIO : levels;
+		path[level].pos = dx_search(dh, hash);
+		if (level == levels)
+			return levels;
+		bno = le32toh(dx_entries(dh)[path[level].pos].block);
+		level++;
+	}
+}
+
+static unsigned char *dx_path_leaf(struct pnlfs_image *img,
+				   struct dx_path *path, int levels)
+{
+	return dx_leaf(img, le32toh(dx_entries(path[levels].hdr)
+				    [path[levels].pos].block));
+}
+
+/* Put a new record in the leaf if there is room left */
+static int leaf_add(struct pnlfs_image *img, unsigned char *leaf,
+		    const char *name, int len, uint32_t ino, uint32_t mode)
+{
+	struct pnlfs_dir_entry *de;
+	uint32_t offs = 0, rlen, used, need = PNLFS_DIR_REC_LEN(len);
+
+	while (offs < img->block_size) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		rlen = rec_len(de);
+		used = de->inode ? PNLFS_DIR_REC_LEN(de->name_len) : 0;
+		if (rlen - used >= need) {
+			/* Cut the free space at the end of that record */
+			if (used) {
+				set_rec_len(de, used);
+				de = (struct pnlfs_dir_entry *) (leaf + offs +
+								 used);
+				set_rec_len(de, rlen - used);
+			}
+			de->inode = htole32(ino);
+			de->name_len = len;
+			de->file_type = (mode & S_IFMT) >> 12;
+			memcpy(de->name, name, len);
+			return 0;
+		}
+		offs += rlen;
+	}
+	return -ENOSPC;
+}
+
+static int dx_map_cmp(const void *a, const void *b)
+{
+	const struct dx_map *ma = a, *mb = b;
+
+	if (ma->hash != mb->hash)
+		return ma->hash < mb->hash ? -1 : 1;
+	return 0;
+}
+
+/* Write the records of map packed at the start of the leaf */
+static void leaf_fill(struct pnlfs_image *img, unsigned char *leaf,
+		      const unsigned char *from, struct dx_map *map, int n)
+{
+	struct pnlfs_dir_entry *de = NULL;
+	uint32_t offs = 0;
+	int i;
+
+	dx_init_leaf(img, leaf);
+	for (i = 0; i < n; i++) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		memcpy(de, from + map[i].offs, map[i].size);
+		set_rec_len(de, map[i].size);
+		offs += map[i].size;
+	}
+	/* The last record takes what is left of the block */
+	if (de)
+		set_rec_len(de, rec_len(de) + img->block_size - offs);
+}
+
+/* Insert the child (hash, bno) after the current position of the node */
+static void dx_insert(struct dx_path *node, uint32_t hash, uint32_t bno)
+{
+	struct pnlfs_dx_entry *entries = dx_entries(node->hdr);
+	int pos = node->pos + 1;
+
+	memmove(&entries[pos + 1], &entries[pos],
+		(le16toh(node->hdr->dx_count) - pos) * sizeof(*entries));
+	entries[pos].hash = htole32(hash);
+	entries[pos].block = htole32(bno);
+	node->hdr->dx_count = htole16(le16toh(node->hdr->dx_count) + 1);
+}
+
+/* Make room in the full index node at level, the root getting deeper */
+static int dx_split_index(struct pnlfs_image *img, uint32_t root,
+			  struct dx_path *path, int level)
+{
+	struct pnlfs_dx_header *dh = path[level].hdr, *ndh;
+	int count = le16toh(dh->dx_count), move, err;
+	uint32_t bno;
+
+	if (level && path[level - 1].hdr->dx_count ==
+		     path[level - 1].hdr->dx_limit)
+		return dx_split_index(img, root, path, level - 1);
+	if (!level && le16toh(dh->dx_levels) == PNLFS_DX_MAX_LEVELS)
+		return -ENOSPC;
+	err = new_meta_block(img, root + 1, &bno);
+	if (err)
+		return err;
+	ndh = pnlfs_block(img, bno);
+	dx_init_header(img, ndh);
+
+	if (!level) {
+		memcpy(dx_entries(ndh), dx_entries(dh),
+		       count * sizeof(struct pnlfs_dx_entry));
+		ndh->dx_count = htole16(count);
+		dx_entries(dh)[0].hash = 0;
+		dx_entries(dh)[0].block = htole32(bno);
+		dh->dx_count = htole16(1);
+		dh->dx_levels = htole16(le16toh(dh->dx_levels) + 1);
+		return 0;
+	}
+	move = count / 2;
+	memcpy(dx_entries(ndh), &dx_entries(dh)[count - move],
+	       move * sizeof(struct pnlfs_dx_entry));
+	ndh->dx_count = htole16(move);
+	dh->dx_count = htole16(count - move);
+	dx_insert(&path[level - 1], le32toh(dx_entries(ndh)[0].hash), bno);
+	return 0;
+}
+
+/*
+ * Move the upper half of the full leaf, in hash order, to a new leaf.
+ * Names with the same hash always stay in the same leaf.
+ */
+static int dx_split_leaf(struct pnlfs_image *img, uint32_t root,
+			 struct dx_path *path, int levels, unsigned char *leaf)
+{
+	struct pnlfs_dir_entry *de;
+	struct dx_map *map;
+	unsigned char *copy;
+	uint32_t offs, bno;
+	int n = 0, m, err;
+
+	if (path[levels].hdr->dx_count == path[levels].hdr->dx_limit)
+		return dx_split_index(img, root, path, levels);
+
+	map = malloc(img->block_size / PNLFS_DIR_REC_LEN(1) * sizeof(*map));
+	copy = malloc(img->block_size);
+	if (!map || !copy) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(copy, leaf, img->block_size);
+	for (offs = 0; offs < img->block_size; offs += rec_len(de)) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		if (!de->inode)
+			continue;
+		map[n].hash = pnlfs_dirhash(de->name, de->name_len);
+		map[n].offs = offs;
+		map[n].size = PNLFS_DIR_REC_LEN(de->name_len);
+		n++;
+	}
+	qsort(map, n, sizeof(*map), dx_map_cmp);
+
+	m = n / 2;
+	while (m > 0 && map[m].hash == map[m - 1].hash)
+		m--;
+	if (!m) {
+		m = n / 2;
+		while (m < n && map[m].hash == map[m - 1].hash)
+			m++;
+	}
+	if (!m || m == n) {
+		err = -ENOSPC;
+		goto out;
+	}
+	err = new_meta_block(img, root + 1, &bno);
+	if (err)
+		goto out;
+	leaf_fill(img, pnlfs_block(img, bno), copy, &map[m], n - m);
+	leaf_fill(img, leaf, copy, map, m);
+	dx_insert(&path[levels], map[m].hash, bno);
+out:
+	free(copy);
+	free(map);
+	return err;
+}
+
+static int dx_add(struct pnlfs_image *img, uint32_t root, const char *name,
+		  int len, uint32_t ino, uint32_t mode)
+{
+	struct dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	uint32_t hash = pnlfs_dirhash(name, len), bno;
+	unsigned char *leaf;
+	int levels, err;
+
+	for (;;) {
+		levels = dx_find(img, root, hash, path);
+		if (levels < 0)
+			return levels;
+
+		/* The first name of the directory gets the first leaf */
+		if (!path[0].hdr->dx_count) {
+			err = new_meta_block(img, root + 1, &bno);
+			if (err)
+				return err;
+			dx_init_leaf(img, pnlfs_block(img, bno));
+			path[0].pos = -1;
+			dx_insert(&path[0], 0, bno);
+			continue;
+		}
+
+		leaf = dx_path_leaf(img, path, levels);
+		if (!leaf)
+			return -EIO;
+		err = leaf_add(img, leaf, name, len, ino, mode);
+		if (err != -ENOSPC)
+			return err;
+		err = dx_split_leaf(img, root, path, levels, leaf);
+		if (err)
+			return err;
+	}
+}
+
+static int dx_remove(struct pnlfs_image *img, uint32_t root, const char *name,
+		     int len)
+{
+	struct dx_path path[PNLFS_DX_MAX_LEVELS + 1];
+	struct pnlfs_dir_entry *de, *prev = NULL;
+	unsigned char *leaf;
+	uint32_t offs;
+	int levels;
+
+	levels = dx_find(img, root, pnlfs_dirhash(name, len), path);
+	if (levels < 0)
+		return levels;
+	if (!path[0].hdr->dx_count)
+		return -ENOENT;
+	leaf = dx_path_leaf(img, path, levels);
+	if (!leaf)
+		return -EIO;
+
+	for (offs = 0; offs < img->block_size; offs += rec_len(de)) {
+		de = (struct pnlfs_dir_entry *) (leaf + offs);
+		if (de->inode && de->name_len == len &&
+		    !memcmp(de->name, name, len)) {
+			/* The previous record gets the space back */
+			if (prev)
+				set_rec_len(prev, rec_len(prev) + rec_len(de));
+			else
+				de->inode = 0;
+			return 0;
+		}
+		prev = de;
+	}
+	return -ENOENT;
+}
+
+#define DX_CONVERT_LEAVES 4
+
+/*
+ * Turn an old directory into a hashed one, as the module does: the names
+ * go to new leaves first, the old block is only made the root once they
+ * are all there.
+ */
+static int dx_convert(struct pnlfs_image *img, struct pnlfs_stat *st)
+{
+	struct pnlfs_dir_block *old = pnlfs_block(img, st->index_block);
+	struct pnlfs_dx_header *dh = (struct pnlfs_dx_header *) old;
+	uint32_t leaves[DX_CONVERT_LEAVES], used;
+	int starts[DX_CONVERT_LEAVES];
+	struct pnlfs_dir_entry *de;
+	struct dx_map *map;
+	struct pnlfs_file *f;
+	unsigned char *recs;
+	int i, n = 0, first, nr_leaves = 0, offs = 0, len, err = 0;
+
+	map = malloc(PNLFS_MAX_DIR_ENTRIES * sizeof(*map));
+	recs = malloc(PNLFS_MAX_DIR_ENTRIES *
+		      PNLFS_DIR_REC_LEN(PNLFS_FILENAME_LEN));
+	if (!map || !recs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* The old names as records of a leaf, in hash order */
+	for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+		f = &old->files[i];
+		if (!f->inode)
+			continue;
+		len = strnlen(f->filename, PNLFS_FILENAME_LEN);
+		de = (struct pnlfs_dir_entry *) (recs + offs);
+		de->inode = f->inode;
+		de->name_len = len;
+		de->file_type = 0;
+		memcpy(de->name, f->filename, len);
+		map[n].hash = pnlfs_dirhash(f->filename, len);
+		map[n].offs = offs;
+		map[n].size = PNLFS_DIR_REC_LEN(len);
+		offs += map[n].size;
+		n++;
+	}
+	qsort(map, n, sizeof(*map), dx_map_cmp);
+
+	/* Fill the leaves, the names of a hash staying in the same one */
+	for (first = 0; first < n || !nr_leaves; first = i) {
+		used = 0;
+		for (i = first; i < n; i++) {
+			if (used + map[i].size > img->block_size &&
+			    map[i].hash != map[i - 1].hash)
+				break;
+			used += map[i].size;
+		}
+		if (used > img->block_size ||
+		    nr_leaves == DX_CONVERT_LEAVES) {
+			err = -ENOSPC;
+			goto out_leaves;
+		}
+		err = new_meta_block(img, st->index_block + 1,
+				     &leaves[nr_leaves]);
+		if (err)
+			goto out_leaves;
+		starts[nr_leaves] = first;
+		leaf_fill(img, pnlfs_block(img, leaves[nr_leaves++]), recs,
+			  &map[first], i - first);
+	}
+
+	/* Nothing can fail past that point */
+	memset(old, 0, img->block_size);
+	dx_init_header(img, dh);
+	for (i = 0; i < nr_leaves; i++) {
+		dx_entries(dh)[i].hash = htole32(i ? map[starts[i]].hash : 0);
+		dx_entries(dh)[i].block = htole32(leaves[i]);
+	}
+	dh->dx_count = htole16(nr_leaves);
+	st->flags |= PNLFS_INODE_HTREE;
+	pnlfs_raw_inode(img, st->ino)->mode = htole32(st->mode | st->flags);
+	goto out;
+
+out_leaves:
+	for (i = 0; i < nr_leaves; i++)
+		pnlfs_free_blocks(img, leaves[i], 1);
+out:
+	free(recs);
+	free(map);
+	return err;
+}
+
+/* Add a name for ino to the directory, which must not have it yet */
+int pnlfs_link(struct pnlfs_image *img, uint32_t dir, const char *name,
+	       int len, uint32_t ino)
+{
+	struct pnlfs_stat st, ist;
+	struct pnlfs_dir_block *db;
+	int i, err;
+
+	if (!img->writable)
+		return -EBADF;
+	if (len > PNLFS_NAME_LEN)
+		return -ENAMETOOLONG;
+	err = pnlfs_stat(img, ino, &ist);
+	if (!err)
+		err = pnlfs_stat(img, dir, &st);
+	if (err)
+		return err;
+	if (!S_ISDIR(st.mode))
+		return -ENOTDIR;
+
+	/* The old format has a fixed number of short names */
+	if (!(st.flags & PNLFS_INODE_HTREE) &&
+	    (st.nr_entries >= PNLFS_MAX_DIR_ENTRIES ||
+	     len >= PNLFS_FILENAME_LEN)) {
+		err = dx_convert(img, &st);
+		if (err)
+			return err;
+	}
+
+	if (st.flags & PNLFS_INODE_HTREE) {
+		err = dx_add(img, st.index_block, name, len, ino, ist.mode);
+	} else {
+		db = pnlfs_block(img, st.index_block);
+		err = -ENOSPC;
+		for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+			if (db->files[i].inode)
+				continue;
+			db->files[i].inode = htole32(ino);
+			memset(db->files[i].filename, 0, PNLFS_FILENAME_LEN);
+			memcpy(db->files[i].filename, name, len);
+			err = 0;
+			break;
+		}
+	}
+	if (!err)
+		le32_add(&pnlfs_raw_inode(img, dir)->nr_entries, 1);
+	return err;
+}
+
+/* Take the name out of the directory, whatever it names */
+static int remove_name(struct pnlfs_image *img, uint32_t dir,
+		       const char *name, int len)
+{
+	struct pnlfs_stat st;
+	struct pnlfs_dir_block *db;
+	int i, err;
+
+	err = pnlfs_stat(img, dir, &st);
+	if (err)
+		return err;
+	if (st.flags & PNLFS_INODE_HTREE) {
+		err = dx_remove(img, st.index_block, name, len);
+	} else {
+		db = pnlfs_block(img, st.index_block);
+		err = -ENOENT;
+		for (i = 0; i < PNLFS_MAX_DIR_ENTRIES; i++) {
+			if (!db->files[i].inode ||
+			    strnlen(db->files[i].filename,
+				    PNLFS_FILENAME_LEN) != len ||
+			    memcmp(db->files[i].filename, name, len))
+				continue;
+			memset(&db->files[i], 0, sizeof(db->files[i]));
+			err = 0;
+			break;
+		}
+	}
+	if (err)
+		return err;
+	le32_add(&pnlfs_raw_inode(img, dir)->nr_entries, -1);
+	return 0;
+}
+
+/*
+ * Remove a name from the directory, giving in ino the inode it named. A
+ * directory must be empty. The inode is left to pnlfs_release().
+ */
+int pnlfs_unlink(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t *ino)
+{
+	struct pnlfs_stat ist;
+	uint32_t victim;
+	int err;
+
+	if (!img->writable)
+		return -EBADF;
+	err = pnlfs_lookup(img, dir, name, len, &victim);
+	if (!err)
+		err = pnlfs_stat(img, victim, &ist);
+	if (err)
+		return err;
+	if (S_ISDIR(ist.mode) && ist.nr_entries)
+		return -ENOTEMPTY;
+
+	err = remove_name(img, dir, name, len);
+	if (err)
+		return err;
+	*ino = victim;
+	return 0;
+}
+
+/*
+ * Move a name, which can be that of a directory with names in it. newname
+ * must not be in newdir: the new name is added before the old one goes,
+ * so that the inode always has one of them.
+ */
+int pnlfs_rename(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t newdir, const char *newname, int newlen)
+{
+	uint32_t ino;
+	int err;
+
+	if (!img->writable)
+		return -EBADF;
+	err = pnlfs_lookup(img, dir, name, len, &ino);
+	if (!err)
+		err = pnlfs_link(img, newdir, newname, newlen, ino);
+	if (err)
+		return err;
+	err = remove_name(img, dir, name, len);
+	if (err)
+		remove_name(img, newdir, newname, newlen);
+	return err;
+}
+
+/*
+ * Create a file or a directory named name in dir. A file is inline while
+ * its data fits in the record, a directory is hashed from the start.
+ */
+int pnlfs_create(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t mode, uint32_t *ino)
+{
+	struct pnlfs_inode *raw;
+	uint32_t new, bno = 0, flags;
+	int err;
+
+	if (!img->writable)
+		return -EBADF;
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
+		return -EINVAL;
+	if (len > PNLFS_NAME_LEN)
+		return -ENAMETOOLONG;
+	err = pnlfs_lookup(img, dir, name, len, &new);
+	if (err != -ENOENT)
+		return err ? err : -EEXIST;
+
+	err = pnlfs_new_inode(img, &new);
+	if (err)
+		return err;
+	raw = pnlfs_raw_inode(img, new);
+	if (S_ISREG(mode) && pnlfs_inline_size(img)) {
+		flags = PNLFS_INODE_INLINE;
+	} else {
+		err = new_meta_block(img, 0, &bno);
+		if (err)
+			goto err_inode;
+		if (S_ISDIR(mode)) {
+			dx_init_header(img, pnlfs_block(img, bno));
+			flags = PNLFS_INODE_HTREE;
+		} else {
+			ext_init_header(img, pnlfs_block(img, bno), 0);
+			flags = PNLFS_INODE_EXTENTS;
+		}
+	}
+	raw->mode = htole32((mode & ~PNLFS_INODE_FL_MASK) | flags);
+	raw->index_block = htole32(bno);
+
+	err = pnlfs_link(img, dir, name, len, new);
+	if (err)
+		goto err_block;
+	*ino = new;
+	return 0;
+
+err_block:
+	if (bno)
+		pnlfs_free_blocks(img, bno, 1);
+err_inode:
+	pnlfs_free_inode(img, new);
+	return err;
+}
+
+static int free_actor(void *priv, uint32_t bno, uint32_t len, int meta)
+{
+	pnlfs_free_blocks(priv, bno, len);
+	return 0;
+}
+
+/* Free an inode with no name left, and its blocks */
+int pnlfs_release(struct pnlfs_image *img, uint32_t ino)
+{
+	struct pnlfs_stat st;
+	int err;
+
+	if (!img->writable)
+		return -EBADF;
+	err = pnlfs_stat(img, ino, &st);
+	if (err)
+		return err;
+	/* A corrupted index leaks its blocks, fsck.pnlfs gets them back */
+	err = pnlfs_walk_blocks(img, &st, free_actor, img);
+	pnlfs_free_inode(img, ino);
+	return err;
+}
@@ -0,0 +1,126 @@
+#ifndef _LIBPNLFS_H
+#define _LIBPNLFS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "pnlfs_disk.h"
+
+/*
+ * libpnlfs: reading and changing a pnlfs image from userspace, without
+ * the module. The image is mapped whole, a block is a pointer into the
+ * mapping. Every block number read from the image is checked against the
+ * size of the disk, a corrupted image gives -EIO and not a crash.
+ *
+ * Functions returning int give 0 or a negative errno. Inode numbers are
+ * those of the module, the root being inode 0.
+ *
+ * Changes go to the mapping and reach the image at pnlfs_sync() or
+ * pnlfs_close(). They are not journaled: an image is opened for writing
+ * only when its journal is empty, and must not be mounted meanwhile.
+ *
+ * Allocation takes the lock of the image, so threads may change different
+ * files at once. The caller serializes the changes of a file, and those of
+ * the names, a directory changing along with the inodes it names.
+ */
+
+struct pnlfs_image {
+	int fd;
+	int writable;
+	unsigned char *map;
+	uint64_t map_size;              /* Bytes mapped, the whole disk */
+	struct pnlfs_superblock *sb;    /* In the mapping */
+
+	uint32_t block_size;
+	uint32_t nr_blocks;
+	uint32_t nr_inodes;
+	uint32_t inode_size;
+	uint32_t inodes_per_block;
+	uint32_t ifree_start;           /* First block of each bitmap */
+	uint32_t bfree_start;
+	uint32_t istore_init;           /* Store blocks before it are in use */
+	int needs_recovery;             /* The journal was not replayed */
+
+	pthread_mutex_t lock;           /* Bitmaps, free counts, inode store */
+	uint32_t next_ino;              /* Where allocation looks first */
+	uint32_t next_block;
+};
+
+/* What the module calls the inode, from its record */
+struct pnlfs_stat {
+	uint32_t ino;
+	uint32_t mode;                  /* S_IFDIR or S_IFREG and permissions */
+	uint32_t flags;                 /* PNLFS_INODE_* */
+	uint32_t size;
+	uint32_t index_block;
+	uint32_t nr_entries;            /* nr_used_blocks for a file */
+};
+
+/* Called for each name of a directory, a non zero return stops the walk */
+typedef int (*pnlfs_filldir_t)(void *priv, const char *name, int len,
+			       uint32_t ino, unsigned int type);
+
+/* Called for each run of blocks of an inode, meta for those of its index */
+typedef int (*pnlfs_blockfn_t)(void *priv, uint32_t bno, uint32_t len,
+			       int meta);
+
+int pnlfs_open(struct pnlfs_image *img, const char *path, int writable);
+int pnlfs_sync(struct pnlfs_image *img);
+void pnlfs_close(struct pnlfs_image *img);
+
+/* Superblock and bitmaps */
+void *pnlfs_block(struct pnlfs_image *img, uint32_t bno);
+int pnlfs_inode_is_free(struct pnlfs_image *img, uint32_t ino);
+int pnlfs_block_is_free(struct pnlfs_image *img, uint32_t bno);
+void pnlfs_inode_set_free(struct pnlfs_image *img, uint32_t ino, int free);
+void pnlfs_block_set_free(struct pnlfs_image *img, uint32_t bno, int free);
+uint32_t pnlfs_count_free(struct pnlfs_image *img, uint32_t first,
+			  uint32_t nr_bits);
+
+/* Inode store */
+struct pnlfs_inode *pnlfs_raw_inode(struct pnlfs_image *img, uint32_t ino);
+int pnlfs_stat(struct pnlfs_image *img, uint32_t ino, struct pnlfs_stat *st);
+uint32_t pnlfs_inline_size(struct pnlfs_image *img);
+
+/* Directories */
+int pnlfs_iterate(struct pnlfs_image *img, uint32_t dir,
+		  pnlfs_filldir_t filldir, void *priv);
+int pnlfs_lookup(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t *ino);
+int pnlfs_namei(struct pnlfs_image *img, const char *path, uint32_t *ino);
+
+/* Files */
+int pnlfs_bmap(struct pnlfs_image *img, const struct pnlfs_stat *st,
+	       uint32_t iblock, uint32_t *pblk, uint32_t *len);
+ssize_t pnlfs_pread(struct pnlfs_image *img, uint32_t ino, void *buf,
+		    size_t count, uint64_t off);
+ssize_t pnlfs_pwrite(struct pnlfs_image *img, uint32_t ino, const void *buf,
+		     size_t count, uint64_t off);
+int pnlfs_map_write(struct pnlfs_image *img, uint32_t ino, uint32_t iblock,
+		    uint32_t want, uint32_t *pblk, uint32_t *len);
+int pnlfs_truncate(struct pnlfs_image *img, uint32_t ino, uint64_t size);
+
+/* Allocation, a goal of 0 for anywhere */
+int pnlfs_new_inode(struct pnlfs_image *img, uint32_t *ino);
+void pnlfs_free_inode(struct pnlfs_image *img, uint32_t ino);
+int pnlfs_new_blocks(struct pnlfs_image *img, uint32_t goal, uint32_t *bno,
+		     uint32_t *count);
+void pnlfs_free_blocks(struct pnlfs_image *img, uint32_t bno, uint32_t count);
+
+/* Names */
+int pnlfs_create(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t mode, uint32_t *ino);
+int pnlfs_link(struct pnlfs_image *img, uint32_t dir, const char *name,
+	       int len, uint32_t ino);
+int pnlfs_unlink(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t *ino);
+int pnlfs_rename(struct pnlfs_image *img, uint32_t dir, const char *name,
+		 int len, uint32_t newdir, const char *newname, int newlen);
+int pnlfs_release(struct pnlfs_image *img, uint32_t ino);
+
+/* Every block an inode owns, files and directories */
+int pnlfs_walk_blocks(struct pnlfs_image *img, const struct pnlfs_stat *st,
+		      pnlfs_blockfn_t fn, void *priv);
+
+#endif /* _LIBPNLFS_H */
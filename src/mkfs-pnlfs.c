@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -5,64 +6,45 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 
-#define PNLFS_MAGIC           0x434F5746
+#include "pnlfs_disk.h"
 
-#define PNLFS_SB_BLOCK_NR              0
+/* An inode record, struct pnlfs_inode followed by the inline data */
+#define PNLFS_INODE_SIZE             128
+#define PNLFS_INLINE_SIZE (PNLFS_INODE_SIZE - sizeof(struct pnlfs_inode))
+#define PNLFS_INODES_PER_BLOCK (block_size / PNLFS_INODE_SIZE)
 
-#define PNLFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
-#define PNLFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
-#define PNLFS_FILENAME_LEN            28
-#define PNLFS_MAX_DIR_ENTRIES        128
+/* Default bytes of disk per inode */
+#define PNLFS_INODE_RATIO          16384
 
-struct pnlfs_inode {
-	mode_t mode;		  /* File mode */
-	uint32_t index_block;	  /* Block with list of block for this file */
-	uint32_t filesize;	  /* File size in bytes */
-	union {
-		uint32_t nr_used_blocks;  /* Number of blocks used by file */
-		uint32_t nr_entries;	  /* Number of dirs/files in dir */
-	};
-};
+/* Bytes written by one call */
+#define CHUNK_SIZE               (1 << 20)
+#define CHUNK_BLOCKS (CHUNK_SIZE / block_size)
 
-#define PNLFS_INODES_PER_BLOCK (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode))
-
-struct pnlfs_superblock {
-	uint32_t magic;		  /* Magic number */
-
-	uint32_t nr_blocks;	  /* Total number of blocks (incl sb & inodes) */
-	uint32_t nr_inodes;       /* Total number of inodes */
-
-	uint32_t nr_istore_blocks;/* Number of inode store blocks */
-	uint32_t nr_ifree_blocks; /* Number of free inodes bitmask blocks */
-	uint32_t nr_bfree_blocks; /* Number of free blocks bitmask blocks */
-
-	uint32_t nr_free_inodes;  /* Number of free inodes */
-	uint32_t nr_free_blocks;  /* Number of free blocks */
-
-	char padding[4064];       /* Padding to match block size */
-};
-
-struct pnlfs_file_index_block {
-	uint32_t blocks[PNLFS_BLOCK_SIZE >> 2];
-};
-
-struct pnlfs_dir_block {
-	struct pnlfs_file {
-		uint32_t inode;
-		char filename[PNLFS_FILENAME_LEN];
-	} files[PNLFS_MAX_DIR_ENTRIES];
-};
+/* Bytes of a block of the image, -b */
+static uint32_t block_size = PNLFS_BLOCK_SIZE;
 
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
-		appname);
+		"%s [-s size] [-b block_size] [-i bytes_per_inode] "
+		"[-j journal_blocks] disk\n"
+		"\t-s: size of the image, created or resized if it is a file\n"
+		"\t-b: bytes of a block, a power of 2 from %d to %d (default %d)\n"
+		"\t-i: bytes of disk per inode (default %d)\n"
+		"\t-j: blocks of the metadata journal, 0 for none\n"
+		"Sizes take a K, M, G or T suffix.\n",
+		appname, PNLFS_BLOCK_SIZE, PNLFS_MAX_BLOCK_SIZE,
+		PNLFS_BLOCK_SIZE, PNLFS_INODE_RATIO);
 }
 
 /* Returns ceil(a/b) */
@@ -74,27 +56,138 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct pnlfs_superblock *write_superblock(int fd, struct stat *fstats)
+/* A size with an optional binary suffix, -1 if it is not one */
+static long long parse_size(const char *arg)
+{
+	char *end;
+	long long size = strtoll(arg, &end, 0);
+
+	if (size < 0 || end == arg)
+		return -1;
+	switch (*end) {
+	case 'T': case 't':
+		size <<= 10;
+		/* fallthrough */
+	case 'G': case 'g':
+		size <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+	return *end ? -1 : size;
+}
+
+/* Write count blocks from block, going on after short writes */
+static int write_blocks(int fd, uint32_t block, const void *buf,
+			uint32_t count)
+{
+	const char *p = buf;
+	size_t len = (size_t) count * block_size;
+	off_t off = (off_t) block * block_size;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Zero count blocks from block. A file gets a hole, a disk is asked to
+ * zero the range itself, the zeroes are only written when neither works.
+ */
+static int zero_blocks(int fd, uint32_t block, uint32_t count)
+{
+	static char zero[CHUNK_SIZE];
+	uint64_t range[2] = { (uint64_t) block * block_size,
+			      (uint64_t) count * block_size };
+	uint32_t n;
+
+	if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       range[0], range[1]))
+		return 0;
+	if (!ioctl(fd, BLKZEROOUT, range))
+		return 0;
+	while (count) {
+		n = count < CHUNK_BLOCKS ? count : CHUNK_BLOCKS;
+		if (write_blocks(fd, block, zero, n))
+			return -1;
+		block += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * An eighth of the disk up to 128 MiB, no journal when that is less than
+ * the minimum of jbd2
+ */
+static uint32_t default_journal_len(uint32_t nr_blocks)
+{
+	uint32_t len = nr_blocks / 8, max = (128 << 20) / block_size;
+
+	if (len < JBD2_MIN_JOURNAL_BLOCKS)
+		return 0;
+	return len > max ? max : len;
+}
+
+/* Lay out the disk in sb, which is written last */
+static int fill_superblock(struct pnlfs_superblock *sb, uint64_t size,
+			   long ratio, long journal_len)
 {
-	int ret;
-	struct pnlfs_superblock *sb;
-	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
-	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
-	uint32_t mod;
-
-	sb = malloc(sizeof(struct pnlfs_superblock));
-	if (!sb)
-		return NULL;
-
-	nr_blocks = fstats->st_size / PNLFS_BLOCK_SIZE;
-	nr_inodes = nr_blocks;
-	mod = nr_inodes % PNLFS_INODES_PER_BLOCK;
-	if (mod != 0)
-		nr_inodes += mod;
-	nr_istore_blocks = idiv_ceil(nr_inodes, PNLFS_INODES_PER_BLOCK);
-	nr_ifree_blocks = idiv_ceil(nr_inodes, PNLFS_BLOCK_SIZE * 8);
-	nr_bfree_blocks = idiv_ceil(nr_blocks, PNLFS_BLOCK_SIZE * 8);
-	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+	uint64_t nr_inodes;
+	uint32_t nr_blocks, nr_ifree_blocks, nr_bfree_blocks, nr_istore_blocks;
+	uint32_t nr_data_blocks, nr_meta_blocks;
+
+	if (size / block_size > UINT32_MAX) {
+		fprintf(stderr, "Image too large, %u blocks at most\n",
+			UINT32_MAX);
+		return -1;
+	}
+	nr_blocks = size / block_size;
+
+	/* Whole blocks of records */
+	nr_inodes = size / ratio;
+	nr_inodes = (nr_inodes + PNLFS_INODES_PER_BLOCK - 1) /
+		PNLFS_INODES_PER_BLOCK * PNLFS_INODES_PER_BLOCK;
+	if (nr_inodes < PNLFS_INODES_PER_BLOCK)
+		nr_inodes = PNLFS_INODES_PER_BLOCK;
+	if (nr_inodes > UINT32_MAX - PNLFS_INODES_PER_BLOCK + 1)
+		nr_inodes = UINT32_MAX - PNLFS_INODES_PER_BLOCK + 1;
+	nr_istore_blocks = nr_inodes / PNLFS_INODES_PER_BLOCK;
+	nr_ifree_blocks = idiv_ceil(nr_inodes, block_size * 8);
+	nr_bfree_blocks = idiv_ceil(nr_blocks, block_size * 8);
+
+	if (journal_len < 0)
+		journal_len = default_journal_len(nr_blocks);
+	if (journal_len && (journal_len < JBD2_MIN_JOURNAL_BLOCKS ||
+			    journal_len > nr_blocks / 2)) {
+		fprintf(stderr, "Journal of %ld blocks, it takes from %d to %u\n",
+			journal_len, JBD2_MIN_JOURNAL_BLOCKS, nr_blocks / 2);
+		return -1;
+	}
+
+	/* sb + istore + ifree + bfree + journal + 2 blocks for the root */
+	nr_meta_blocks = 1 + nr_istore_blocks + nr_ifree_blocks +
+		nr_bfree_blocks + journal_len;
+	if ((uint64_t) nr_meta_blocks + 2 + 100 > nr_blocks) {
+		fprintf(stderr, "Image too small for %" PRIu64 " inodes, "
+			"raise the bytes per inode\n", nr_inodes);
+		return -1;
+	}
+	nr_data_blocks = nr_blocks - nr_meta_blocks;
 
 	memset(sb, 0, sizeof(struct pnlfs_superblock));
 	sb->magic = htole32(PNLFS_MAGIC);
@@ -104,264 +197,356 @@ static struct pnlfs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 2);
-	sb->nr_free_blocks = htole32(nr_data_blocks - 3);
-
-	ret = write(fd, sb, sizeof(struct pnlfs_superblock));
-	if (ret != sizeof(struct pnlfs_superblock)) {
-		free(sb);
-		return NULL;
+	sb->nr_free_blocks = htole32(nr_data_blocks - 2);
+	sb->inode_size = htole32(PNLFS_INODE_SIZE);
+	sb->block_size = htole32(block_size);
+	if (journal_len) {
+		sb->journal_start = htole32(1 + nr_istore_blocks +
+					    nr_ifree_blocks + nr_bfree_blocks);
+		sb->journal_len = htole32(journal_len);
 	}
+	/* Only the block of the root is written, the kernel does the rest */
+	sb->itable_unused = htole32(nr_istore_blocks - 1);
+	sb->state = htole32(PNLFS_STATE_CLEAN);
+	return 0;
+}
 
-	printf("Superblock: (%ld)\n"
+static int write_superblock(int fd, struct pnlfs_superblock *sb)
+{
+	static char block[PNLFS_MAX_BLOCK_SIZE];
+
+	/* In the first 4 KiB of block 0 whatever its size */
+	memcpy(block, sb, sizeof(*sb));
+	if (write_blocks(fd, PNLFS_SB_BLOCK_NR, block, 1))
+		return -1;
+
+	printf("Superblock: (%zu)\n"
 	       "\tmagic=%#x\n"
 	       "\tnr_blocks=%u\n"
-	       "\tnr_inodes=%u (istore=%u blocks)\n"
+	       "\tnr_inodes=%u (istore=%u blocks, %u not initialized)\n"
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tinode_size=%u\n"
+	       "\tblock_size=%u\n"
+	       "\tjournal_start=%u\n"
+	       "\tjournal_len=%u\n",
 	       sizeof(struct pnlfs_superblock),
-	       sb->magic, sb->nr_blocks, sb->nr_inodes, sb->nr_istore_blocks,
-	       sb->nr_ifree_blocks, sb->nr_bfree_blocks, sb->nr_free_inodes,
-	       sb->nr_free_blocks);
+	       le32toh(sb->magic), le32toh(sb->nr_blocks),
+	       le32toh(sb->nr_inodes), le32toh(sb->nr_istore_blocks),
+	       le32toh(sb->itable_unused), le32toh(sb->nr_ifree_blocks),
+	       le32toh(sb->nr_bfree_blocks), le32toh(sb->nr_free_inodes),
+	       le32toh(sb->nr_free_blocks), le32toh(sb->inode_size),
+	       le32toh(sb->block_size), le32toh(sb->journal_start),
+	       le32toh(sb->journal_len));
 
-	return sb;
+	return 0;
 }
 
+/*
+ * First block of the inode store, with the root and /foo. The other
+ * blocks are left as they are, itable_unused tells the kernel.
+ */
 static int write_inode_store(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
-	struct pnlfs_inode inode;
+	static char block[PNLFS_MAX_BLOCK_SIZE];
+	struct pnlfs_inode *inode;
 	uint32_t first_data_block;
 
 	/* Root inode (inode 0) */
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
 		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_istore_blocks);
-	memset(&inode, 0, sizeof(inode));
-	inode.mode = htole32(S_IFDIR |
-			     S_IRUSR | S_IRGRP | S_IROTH |
-			     S_IWUSR | S_IWGRP |
-			     S_IXUSR | S_IXGRP | S_IXOTH);
-	inode.index_block = htole32(first_data_block++);
-	inode.filesize = htole32(PNLFS_BLOCK_SIZE);
-	inode.nr_entries = htole32(1);
-
-	ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-	if (ret != sizeof(struct pnlfs_inode))
+		le32toh(sb->nr_istore_blocks) + le32toh(sb->journal_len);
+	memset(block, 0, sizeof(block));
+	inode = (struct pnlfs_inode *) block;
+	inode->mode = htole32(S_IFDIR | PNLFS_INODE_HTREE |
+			      S_IRUSR | S_IRGRP | S_IROTH |
+			      S_IWUSR | S_IWGRP |
+			      S_IXUSR | S_IXGRP | S_IXOTH);
+	inode->index_block = htole32(first_data_block++);
+	inode->filesize = htole32(block_size);
+	inode->nr_entries = htole32(1);
+
+	/* /foo inode (inode 1), its data is inline */
+	inode = (struct pnlfs_inode *) (block + PNLFS_INODE_SIZE);
+	inode->mode = htole32(S_IFREG | PNLFS_INODE_INLINE |
+			      S_IRUSR | S_IRGRP | S_IROTH |
+			      S_IWUSR | S_IWGRP | S_IWOTH);
+	inode->filesize = htole32(strlen("foo\n"));
+	memcpy(inode + 1, "foo\n", strlen("foo\n"));
+
+	if (write_blocks(fd, 1, block, 1))
 		return -1;
 
-	/* /foo inode (inode 1) */
-	memset(&inode, 0, sizeof(inode));
-	inode.mode = htole32(S_IFREG |
-			     S_IRUSR | S_IRGRP | S_IROTH |
-			     S_IWUSR | S_IWGRP | S_IWOTH);
-	inode.index_block = htole32(first_data_block++);
-	inode.filesize = htole32(strlen("foo\n"));
-	inode.nr_used_blocks = htole32(1);
-
-	ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-	if (ret != sizeof(struct pnlfs_inode))
-		return -1;
+	printf("Inode store: wrote 1 of %u blocks\n"
+	       "\tinode size = %d (inline data up to %zu bytes)\n",
+	       le32toh(sb->nr_istore_blocks), PNLFS_INODE_SIZE,
+	       PNLFS_INLINE_SIZE);
 
-	/* Other empty inodes (inodes 2 -> end) */
-	memset(&inode, 0, sizeof(inode));
-	for (i = 2; i < le32toh(sb->nr_inodes); i++) {
-		ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-		if (ret != sizeof(struct pnlfs_inode))
+	return 0;
+}
+
+/*
+ * Write a bitmap of nr_blocks blocks from block, a bit set for a free
+ * item: the first nr_used ones are in use. Chunks of CHUNK_BLOCKS blocks
+ * go in one write.
+ */
+static int write_bitmap(int fd, uint32_t block, uint32_t nr_blocks,
+			uint32_t nr_used)
+{
+	static uint64_t chunk[CHUNK_SIZE / 8];
+	uint64_t bit, nr_bits;
+	uint32_t n;
+
+	while (nr_blocks) {
+		n = nr_blocks < CHUNK_BLOCKS ? nr_blocks : CHUNK_BLOCKS;
+		nr_bits = (uint64_t) n * block_size * 8;
+		memset(chunk, 0xff, (size_t) n * block_size);
+		for (bit = 0; bit < nr_bits && nr_used; bit++, nr_used--)
+			chunk[bit / 64] &= htole64(~(1ULL << (bit % 64)));
+		if (write_blocks(fd, block, chunk, n))
 			return -1;
+		block += n;
+		nr_blocks -= n;
 	}
-
-	printf("Inode store: wrote %ld blocks\n"
-	       "\tinode size = %ld\n",
-	       i / PNLFS_INODES_PER_BLOCK, sizeof(struct pnlfs_inode));
-
 	return 0;
 }
 
 static int write_ifree_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
-	uint64_t ifree[PNLFS_BLOCK_SIZE / 8];
-
-	/* Set all bits to 1 */
-	memset(ifree, 0xff, PNLFS_BLOCK_SIZE);
-
-	/* First ifree block, containing first 2 used inodes */
-	ifree[0] = htole64(0xfffffffffffffffc);
-	ret = write(fd, ifree, PNLFS_BLOCK_SIZE);
-	if (ret != PNLFS_BLOCK_SIZE)
+	/* The root and /foo */
+	if (write_bitmap(fd, 1 + le32toh(sb->nr_istore_blocks),
+			 le32toh(sb->nr_ifree_blocks), 2))
 		return -1;
 
-	/* All ifree blocks except the one containing 2 first inodes */
-	ifree[0] = 0xffffffffffffffff;
-	for (i = 1; i < le32toh(sb->nr_ifree_blocks); i++) {
-		ret = write(fd, ifree, PNLFS_BLOCK_SIZE);
-		if (ret != PNLFS_BLOCK_SIZE)
-			return -1;
-	}
-
-	printf("Ifree blocks: wrote %d blocks\n", i);
+	printf("Ifree blocks: wrote %u blocks\n", le32toh(sb->nr_ifree_blocks));
 
 	return 0;
 }
 
 static int write_bfree_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
-	uint64_t bfree[PNLFS_BLOCK_SIZE / 8], mask, line;
+	/* sb + istore + ifree + bfree + journal + 2 blocks for the root */
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_bfree_blocks) + 4;
-
-	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 3 used blocks)
-	 * we suppose it won't go further than the first block
-	 */
-	memset(bfree, 0xff, PNLFS_BLOCK_SIZE);
-	i = 0;
-	while (nr_used) {
-		line = 0xffffffffffffffff;
-		for (mask = 0x1; mask != 0x0; mask <<= 1) {
-			line &= ~mask;
-			nr_used--;
-			if (!nr_used)
-				break;
-		}
-		bfree[i] = htole64(line);
-		i++;
-	}
-	ret = write(fd, bfree, PNLFS_BLOCK_SIZE);
-	if (ret != PNLFS_BLOCK_SIZE)
+		le32toh(sb->nr_bfree_blocks) + le32toh(sb->journal_len) + 3;
+
+	if (write_bitmap(fd, 1 + le32toh(sb->nr_istore_blocks) +
+			 le32toh(sb->nr_ifree_blocks),
+			 le32toh(sb->nr_bfree_blocks), nr_used))
 		return -1;
 
-	/* other blocks */
-	memset(bfree, 0xff, PNLFS_BLOCK_SIZE);
-	for (i = 1; i < le32toh(sb->nr_bfree_blocks); i++) {
-		ret = write(fd, bfree, PNLFS_BLOCK_SIZE);
-		if (ret != PNLFS_BLOCK_SIZE)
-			return errno;
-	}
+	printf("Bfree blocks: wrote %u blocks\n", le32toh(sb->nr_bfree_blocks));
 
-	printf("Bfree blocks: wrote %d blocks\n", i);
+	return 0;
+}
+
+/*
+ * An empty journal: its superblock, then a zeroed log. A stale block
+ * could pass for a transaction at the first replay.
+ */
+static int write_journal(int fd, struct pnlfs_superblock *sb)
+{
+	static char block[PNLFS_MAX_BLOCK_SIZE];
+	struct jbd2_superblock jsb;
+	uint32_t start = le32toh(sb->journal_start);
+	uint32_t len = le32toh(sb->journal_len);
+
+	if (!len)
+		return 0;
+	memset(&jsb, 0, sizeof(jsb));
+	jsb.h_magic = htobe32(JBD2_MAGIC_NUMBER);
+	jsb.h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+	jsb.s_blocksize = htobe32(block_size);
+	jsb.s_maxlen = htobe32(len);
+	jsb.s_first = htobe32(1);
+	jsb.s_sequence = htobe32(1);
+	jsb.s_feature_incompat = htobe32(JBD2_FEATURE_INCOMPAT_REVOKE);
+	jsb.s_nr_users = htobe32(1);
+	memcpy(block, &jsb, sizeof(jsb));
+	if (write_blocks(fd, start, block, 1))
+		return -1;
+	if (zero_blocks(fd, start + 1, len - 1))
+		return -1;
+
+	printf("Journal: %u blocks\n", len);
 
 	return 0;
 }
 
 static int write_data_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0;
-	struct pnlfs_dir_block root_block;
-	struct pnlfs_file_index_block foo_block;
-	char foo[PNLFS_BLOCK_SIZE];
+	static char root_block[2 * PNLFS_MAX_BLOCK_SIZE];
+	struct pnlfs_dx_header *dh = (struct pnlfs_dx_header *) root_block;
+	struct pnlfs_dx_entry *dx = (struct pnlfs_dx_entry *) (dh + 1);
+	struct pnlfs_dir_entry *de = (struct pnlfs_dir_entry *)
+		(root_block + block_size);
 	uint32_t first_block = le32toh(sb->nr_istore_blocks) +
-		le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3;
-
-	/* Root block (/) */
-	memset(&root_block, 0, sizeof(root_block));
-	strncpy(root_block.files[0].filename, "foo", PNLFS_FILENAME_LEN);
-	root_block.files[0].inode = htole32(1);
-	ret = write(fd, &root_block, sizeof(root_block));
-	if (ret != PNLFS_BLOCK_SIZE)
-		return errno;
-
-	/* foo index block (/foo) */
-	memset(&foo_block, 0, sizeof(foo_block));
-	foo_block.blocks[0] = htole32(first_block);
-	ret = write(fd, &foo_block, sizeof(foo_block));
-	if (ret != PNLFS_BLOCK_SIZE)
-		return errno;
-
-	/* /foo data block */
-	memset(foo, 0, PNLFS_BLOCK_SIZE);
-	strncpy(foo, "foo\n", strlen("foo\n"));
-	ret = write(fd, foo, PNLFS_BLOCK_SIZE);
-	if (ret != PNLFS_BLOCK_SIZE)
-		return errno;
-
-	return 0;
+		le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) +
+		le32toh(sb->journal_len) + 1;
+
+	/* Root index block (/), a single leaf for all the hashes */
+	dh->dx_magic = htole16(PNLFS_DX_MAGIC);
+	dh->dx_count = htole16(1);
+	dh->dx_limit = htole16(PNLFS_DX_LIMIT(block_size));
+	dx[0].hash = 0;
+	dx[0].block = htole32(first_block + 1);
+
+	/* Root leaf block (/), foo takes the whole block, 0xffff for 64 KiB */
+	de->inode = htole32(1);
+	de->rec_len = htole16(block_size < 0xffff ? block_size : 0xffff);
+	de->name_len = strlen("foo");
+	de->file_type = 8;	/* DT_REG */
+	memcpy(de->name, "foo", strlen("foo"));
+
+	return write_blocks(fd, first_block, root_block, 2);
 }
 
 int main(int argc, char **argv)
 {
-	int ret = EXIT_SUCCESS, fd;
-	long int min_size;
+	int ret = EXIT_FAILURE, fd, opt;
+	long int journal_len = -1, ratio = PNLFS_INODE_RATIO;
+	long long size = -1, bsize;
+	uint64_t dev_size;
+	char *end;
 	struct stat stat_buf;
-	struct pnlfs_superblock *sb = NULL;
-
-	if (argc != 2) {
+	struct pnlfs_superblock sb;
+
+	while ((opt = getopt(argc, argv, "s:b:i:j:")) != -1) {
+		switch (opt) {
+		case 's':
+			size = parse_size(optarg);
+			if (size < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			bsize = parse_size(optarg);
+			if (bsize < PNLFS_BLOCK_SIZE ||
+			    bsize > PNLFS_MAX_BLOCK_SIZE || bsize & (bsize - 1)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			block_size = bsize;
+			break;
+		case 'i':
+			ratio = parse_size(optarg);
+			if (ratio < PNLFS_INODE_SIZE) {
+				fprintf(stderr, "At least %d bytes per inode\n",
+					PNLFS_INODE_SIZE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			journal_len = strtol(optarg, &end, 0);
+			if (*end || journal_len < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	/* Open disk image, a file is created if its size is given */
+	fd = open(argv[optind], O_RDWR | (size >= 0 ? O_CREAT : 0), 0644);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
 	}
 
 	/* Get image size */
-	ret = fstat(fd, &stat_buf);
-	if (ret != 0) {
+	if (fstat(fd, &stat_buf) != 0) {
 		perror("fstat():");
-		ret = EXIT_FAILURE;
 		goto fclose;
 	}
+	if (S_ISBLK(stat_buf.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+			perror("ioctl(BLKGETSIZE64):");
+			goto fclose;
+		}
+		if (size > (long long) dev_size) {
+			fprintf(stderr, "The device has only %" PRIu64
+				" bytes\n", dev_size);
+			goto fclose;
+		}
+		if (size < 0)
+			size = dev_size;
+	} else if (size >= 0) {
+		if (ftruncate(fd, size)) {
+			perror("ftruncate():");
+			goto fclose;
+		}
+	} else {
+		size = stat_buf.st_size;
+	}
 
 	/* Check if image is large enough */
-	min_size = 100 * PNLFS_BLOCK_SIZE;
-	if (stat_buf.st_size <= min_size) {
+	if (size <= 100LL * block_size) {
 		fprintf(stderr,
-			"File is not large enough (size=%ld, min size=%ld)\n",
-			stat_buf.st_size,
-			min_size);
-		ret = EXIT_FAILURE;
+			"File is not large enough (size=%lld, min size=%u)\n",
+			size, 100 * block_size);
 		goto fclose;
 	}
-
-	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
-	if (!sb) {
-		perror("write_superblock():");
-		ret = EXIT_FAILURE;
+	/* The kernel keeps a block in a page */
+	if (block_size > sysconf(_SC_PAGESIZE))
+		fprintf(stderr, "Blocks of %u bytes cannot be mounted on a "
+			"host with pages of %ld bytes\n", block_size,
+			sysconf(_SC_PAGESIZE));
+	if (fill_superblock(&sb, size, ratio, journal_len))
 		goto fclose;
-	}
+
+	/* A file is made sparse, what mkfs does not write reads zeroes */
+	if (S_ISREG(stat_buf.st_mode) &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size))
+		fprintf(stderr, "Cannot punch the image (%s), old data stays\n",
+			strerror(errno));
 
 	/* Write inode store blocks (from block 1) */
-	ret = write_inode_store(fd, sb);
-	if (ret != 0) {
+	if (write_inode_store(fd, &sb)) {
 		perror("write_inode_store():");
-		ret = EXIT_FAILURE;
-		goto free_sb;
+		goto fclose;
 	}
 
 	/* Write inode free bitmap blocks */
-	ret = write_ifree_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_ifree_blocks(fd, &sb)) {
 		perror("write_ifree_blocks()");
-		ret = EXIT_FAILURE;
-		goto free_sb;
+		goto fclose;
 	}
 
 	/* Write block free bitmap blocks */
-	ret = write_bfree_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_bfree_blocks(fd, &sb)) {
 		perror("write_bfree_blocks()");
-		ret = EXIT_FAILURE;
-		goto free_sb;
+		goto fclose;
+	}
+
+	/* Write the journal */
+	if (write_journal(fd, &sb)) {
+		perror("write_journal()");
+		goto fclose;
 	}
 
 	/* Write data blocks */
-	ret = write_data_blocks(fd, sb);
-	if (ret != 0) {
+	if (write_data_blocks(fd, &sb)) {
 		perror("write_data_blocks():");
-		ret = EXIT_FAILURE;
-		goto free_sb;
+		goto fclose;
+	}
+
+	/* The superblock goes last, a format cut short is not mountable */
+	if (fsync(fd) || write_superblock(fd, &sb) || fsync(fd)) {
+		perror("write_superblock():");
+		goto fclose;
 	}
+	ret = EXIT_SUCCESS;
 
-free_sb:
-	free(sb);
 fclose:
 	close(fd);
 
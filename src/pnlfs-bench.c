@@ -0,0 +1,793 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * One run of a data path workload on a mounted pnlfs, printed as a row of
+ * CSV. bench.sh runs it for each file system, block size, workload, I/O
+ * size and cache state.
+ *
+ * usage: pnlfs-bench [-c] [-d] [-l label] [-w workload] [-s io_size]
+ *                    [-S file_size] [-n files] [-t threads] [-p percent] dir
+ *        pnlfs-bench [-c] [-l label] -w exec -- command [args...]
+ *        pnlfs-bench -H label_columns
+ *
+ * The file the workloads read or overwrite is written first, untimed, and
+ * kept from one run to the next, as are the files of smallcat. With -c
+ * the caches are dropped after that, which needs root. Each read or write
+ * call is timed, a file for smallcat; the writing workloads end with an
+ * fsync counted in their time. With -d the file is opened with O_DIRECT
+ * for the timed part, the buffer is aligned on a page. CPU time is that
+ * of the process, the work of the module being done in its system calls.
+ * exec times a command, pnlfs-extract or fsck.pnlfs, as a single
+ * operation.
+ *
+ * copy and sendfile send the file to a socket whose other end is read by
+ * a thread, io_size bytes at a time: copy reads them into the buffer and
+ * writes them, sendfile has the kernel move them. An operation is the
+ * sending of io_size bytes; the system time shows the copy that sendfile
+ * saves.
+ *
+ * aged first fills the file system to percent of its blocks, untimed, with
+ * files of 4 KiB to 1 MiB of which one in three is removed again, so that
+ * the free space is in pieces. It is kept for the next runs. It then
+ * times an append of file_size bytes, as append does: the allocator works
+ * on a nearly full disk, and fsck.pnlfs reports how fragmented the files
+ * are.
+ *
+ * create runs threads creators at once, each making empty files in a
+ * directory of its own, nr_files in all. An operation is the open that
+ * creates a file and its close. The files of the previous run are
+ * removed first, untimed.
+ *
+ * fsync runs threads writers at once, each appending io_size bytes then
+ * calling fsync on a file of its own, file_size bytes being written in
+ * all. An operation is the write and its fsync: the journal commits
+ * shared by concurrent writers show in the throughput.
+ *
+ * appenders runs threads writers appending io_size bytes at a time to a
+ * file of their own, interleaved, file_size bytes in all, then calling
+ * fsync once. An operation is a write: the blocks of the files are
+ * allocated as they are written back, how many allocator calls that took
+ * is in the stats of the mount, and how fragmented the files are in the
+ * output of fsck.pnlfs.
+ */
+
+#define NR_RANDOM_OPS_MAX   (1 << 20)   /* Operations of the random workloads */
+
+enum workload {
+	SEQWRITE,
+	SEQREAD,
+	RANDREAD,
+	RANDWRITE,
+	APPEND,
+	OVERWRITE,
+	SMALLCAT,
+	FSYNC,
+	AGED,
+	CREATE,
+	APPENDERS,
+	COPY,
+	SENDFILE,
+	EXEC,
+	NR_WORKLOADS
+};
+
+static const char *workload_names[NR_WORKLOADS] = {
+	"seqwrite", "seqread", "randread", "randwrite", "append", "overwrite",
+	"smallcat", "fsync", "aged", "create",
+	"appenders", "copy", "sendfile", "exec",
+};
+
+/* A thread of the workloads with several of them */
+struct worker {
+	pthread_t tid;
+	int id;
+	char dir[4096];                 /* Where create makes its files */
+	char *buf;
+	size_t io_size;
+	uint64_t ops;
+	uint64_t *lat;                  /* Its part of lat */
+	int fd;
+};
+
+/* The workers and the main thread start the timed part together */
+static pthread_barrier_t start_barrier;
+
+static uint64_t *lat;                   /* Nanoseconds of each operation */
+static uint64_t nr_ops, nr_bytes;
+static uint64_t t_start, t_end;         /* The timed part */
+static struct rusage ru_start, ru_end;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static void die(const char *what)
+{
+	fprintf(stderr, "pnlfs-bench: %s: %s\n", what, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64, the same offsets from one run to the next */
+static uint64_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static void drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		die("/proc/sys/vm/drop_caches");
+	close(fd);
+}
+
+/* Write the file of the workload unless it is there already */
+static void prepare(const char *path, uint64_t size, char *buf,
+		    size_t io_size)
+{
+	struct stat st;
+	uint64_t off;
+	size_t n;
+	int fd;
+
+	if (!stat(path, &st) && (uint64_t) st.st_size == size)
+		return;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	for (off = 0; off < size; off += n) {
+		n = size - off < io_size ? size - off : io_size;
+		if (pwrite(fd, buf, n, off) != (ssize_t) n)
+			die(path);
+	}
+	if (fsync(fd))
+		die(path);
+	close(fd);
+}
+
+static void timed_io(int fd, char *buf, size_t len, uint64_t off,
+		     enum workload w)
+{
+	uint64_t t0 = now_ns();
+	ssize_t ret;
+
+	if (w == APPEND)
+		ret = write(fd, buf, len);
+	else if (w == SEQREAD || w == RANDREAD)
+		ret = pread(fd, buf, len, off);
+	else
+		ret = pwrite(fd, buf, len, off);
+	if (ret != (ssize_t) len)
+		die(workload_names[w]);
+	lat[nr_ops++] = now_ns() - t0;
+	nr_bytes += len;
+}
+
+/* Offsets of io_size aligned in the file, one pass or random */
+static uint64_t offset(enum workload w, uint64_t i, uint64_t size,
+		       size_t io_size)
+{
+	if (w == RANDREAD || w == RANDWRITE)
+		return next_random() % (size / io_size) * io_size;
+	return i * io_size;
+}
+
+/* Bytes to write before pct % of the blocks of the file system are used */
+static uint64_t room(int fd, int pct)
+{
+	struct statvfs st;
+	uint64_t target, used;
+
+	sync();
+	if (fstatvfs(fd, &st))
+		die("fstatvfs");
+	target = (uint64_t) pct * st.f_blocks / 100;
+	used = st.f_blocks - st.f_bfree;
+	return used >= target ? 0 : (target - used) * st.f_frsize;
+}
+
+/* Fill the file system of dir to pct % of its blocks, free space in holes */
+static void age(const char *dir, char *buf, size_t io_size, int pct)
+{
+	char path[4096];
+	uint64_t size, off, written = 0, check = 0, left;
+	ssize_t ret;
+	size_t n;
+	long i;
+	int dfd, fd;
+
+	snprintf(path, sizeof(path), "%s/aged", dir);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		die(path);
+	dfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0)
+		die(path);
+
+	for (i = 0; ; i++) {
+		/* Looked at again halfway, sync is not cheap */
+		if (written >= check) {
+			left = room(dfd, pct);
+			if (!left)
+				break;
+			check = written + left / 2;
+		}
+		snprintf(path, sizeof(path), "%s/aged/%ld", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0 && errno == EEXIST)
+			continue;
+		if (fd < 0)
+			die(path);
+		size = (next_random() % 256 + 1) * 4096;
+		for (off = 0; off < size; off += n) {
+			n = size - off < io_size ? size - off : io_size;
+			ret = pwrite(fd, buf, n, off);
+			if (ret != (ssize_t) n) {
+				if (ret >= 0)
+					errno = ENOSPC;
+				break;
+			}
+		}
+		close(fd);
+		/* The disk is full before pct, what is there will do */
+		if (off < size) {
+			if (errno != ENOSPC)
+				die(path);
+			unlink(path);
+			break;
+		}
+		written += size;
+		if (i % 3 == 2) {
+			snprintf(path, sizeof(path), "%s/aged/%ld", dir, i - 1);
+			unlink(path);
+		}
+	}
+	close(dfd);
+}
+
+static void run_file(enum workload w, const char *dir, char *buf,
+		     size_t io_size, uint64_t size, int cold, int direct)
+{
+	int writes = w != SEQREAD && w != RANDREAD;
+	int flags = (writes ? O_WRONLY : O_RDONLY) | (direct ? O_DIRECT : 0);
+	char path[4096];
+	uint64_t i, ops;
+	int fd;
+
+	if (w == SEQWRITE || w == APPEND) {
+		snprintf(path, sizeof(path), "%s/new.dat", dir);
+		unlink(path);
+		flags |= O_CREAT | O_TRUNC | (w == APPEND ? O_APPEND : 0);
+	} else {
+		snprintf(path, sizeof(path), "%s/data.dat", dir);
+		prepare(path, size, buf, io_size);
+	}
+	if (cold)
+		drop_caches();
+
+	ops = size / io_size;
+	if ((w == RANDREAD || w == RANDWRITE) && ops > NR_RANDOM_OPS_MAX)
+		ops = NR_RANDOM_OPS_MAX;
+	lat = malloc((ops + 1) * sizeof(*lat));
+	if (!lat)
+		die("malloc");
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	t_start = now_ns();
+	fd = open(path, flags, 0644);
+	if (fd < 0)
+		die(path);
+	for (i = 0; i < ops; i++)
+		timed_io(fd, buf, io_size, offset(w, i, size, io_size), w);
+	if (writes && fsync(fd))
+		die("fsync");
+	close(fd);
+	t_end = now_ns();
+	getrusage(RUSAGE_SELF, &ru_end);
+}
+
+static void *sink(void *arg)
+{
+	int fd = *(int *) arg;
+	char b[65536];
+
+	while (read(fd, b, sizeof(b)) > 0)
+		;
+	return NULL;
+}
+
+/* Send the file to a socket, by read() and write() or by sendfile() */
+static void run_send(enum workload w, const char *dir, char *buf,
+		     size_t io_size, uint64_t size, int cold)
+{
+	char path[4096];
+	uint64_t i, ops, t0;
+	size_t done;
+	ssize_t ret;
+	pthread_t tid;
+	int fd, sv[2];
+
+	snprintf(path, sizeof(path), "%s/data.dat", dir);
+	prepare(path, size, buf, io_size);
+	if (cold)
+		drop_caches();
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		die("socketpair");
+	errno = pthread_create(&tid, NULL, sink, &sv[1]);
+	if (errno)
+		die("pthread_create");
+
+	ops = size / io_size;
+	lat = malloc((ops + 1) * sizeof(*lat));
+	if (!lat)
+		die("malloc");
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	t_start = now_ns();
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+	for (i = 0; i < ops; i++) {
+		t0 = now_ns();
+		for (done = 0; done < io_size; done += ret) {
+			if (w == SENDFILE) {
+				ret = sendfile(sv[0], fd, NULL, io_size - done);
+			} else {
+				ret = read(fd, buf, io_size - done);
+				if (ret > 0 && write(sv[0], buf, ret) != ret)
+					ret = -1;
+			}
+			if (ret <= 0)
+				die(workload_names[w]);
+		}
+		lat[nr_ops++] = now_ns() - t0;
+		nr_bytes += io_size;
+	}
+	close(fd);
+	t_end = now_ns();
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	close(sv[0]);
+	pthread_join(tid, NULL);
+	close(sv[1]);
+}
+
+/* Read nr_files files of io_size bytes, opening each one */
+static void run_smallcat(const char *dir, char *buf, size_t io_size,
+			 long nr_files, int cold)
+{
+	char path[4096];
+	uint64_t t0;
+	ssize_t n;
+	long i;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/small", dir);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		die(path);
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), "%s/small/%ld", dir, i);
+		prepare(path, io_size, buf, io_size);
+	}
+	if (cold)
+		drop_caches();
+	lat = malloc(nr_files * sizeof(*lat));
+	if (!lat)
+		die("malloc");
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	t_start = now_ns();
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), "%s/small/%ld", dir, i);
+		t0 = now_ns();
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			die(path);
+		while ((n = read(fd, buf, io_size)) > 0)
+			nr_bytes += n;
+		if (n < 0)
+			die(path);
+		close(fd);
+		lat[nr_ops++] = now_ns() - t0;
+	}
+	t_end = now_ns();
+	getrusage(RUSAGE_SELF, &ru_end);
+}
+
+static void *fsync_worker(void *arg)
+{
+	struct worker *wk = arg;
+	size_t len = wk->io_size;
+	uint64_t i, t0;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < wk->ops; i++) {
+		t0 = now_ns();
+		if (write(wk->fd, wk->buf, len) != (ssize_t) len)
+			die("write");
+		if (fsync(wk->fd))
+			die("fsync");
+		wk->lat[i] = now_ns() - t0;
+	}
+	return NULL;
+}
+
+/* Run fn in nr_threads workers, ops_each operations each */
+static void run_workers(void *(*fn)(void *), struct worker *wk,
+			int nr_threads, uint64_t ops_each)
+{
+	int i;
+
+	lat = malloc((nr_threads * ops_each + 1) * sizeof(*lat));
+	if (!lat)
+		die("malloc");
+	if (pthread_barrier_init(&start_barrier, NULL, nr_threads + 1))
+		die("pthread_barrier_init");
+	for (i = 0; i < nr_threads; i++) {
+		wk[i].ops = ops_each;
+		wk[i].lat = lat + i * ops_each;
+		errno = pthread_create(&wk[i].tid, NULL, fn, &wk[i]);
+		if (errno)
+			die("pthread_create");
+	}
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	t_start = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(wk[i].tid, NULL);
+	t_end = now_ns();
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	pthread_barrier_destroy(&start_barrier);
+	nr_ops = nr_threads * ops_each;
+	nr_bytes = nr_ops * wk[0].io_size;
+}
+
+static void *append_worker(void *arg)
+{
+	struct worker *wk = arg;
+	size_t len = wk->io_size;
+	uint64_t i, t0;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < wk->ops; i++) {
+		t0 = now_ns();
+		if (write(wk->fd, wk->buf, len) != (ssize_t) len)
+			die("write");
+		wk->lat[i] = now_ns() - t0;
+	}
+	if (fsync(wk->fd))
+		die("fsync");
+	return NULL;
+}
+
+/* Writers each appending to a file name.<thread> of their own */
+static void run_writers(void *(*fn)(void *), const char *name,
+			const char *dir, char *buf, size_t io_size,
+			uint64_t size, int nr_threads)
+{
+	struct worker *wk;
+	char path[4096];
+	int i;
+
+	wk = calloc(nr_threads, sizeof(*wk));
+	if (!wk)
+		die("malloc");
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", dir, name, i);
+		wk[i].fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+				0644);
+		if (wk[i].fd < 0)
+			die(path);
+		wk[i].id = i;
+		wk[i].buf = buf;
+		wk[i].io_size = io_size;
+	}
+	run_workers(fn, wk, nr_threads, size / io_size / nr_threads);
+	for (i = 0; i < nr_threads; i++)
+		close(wk[i].fd);
+	free(wk);
+}
+
+static void *create_worker(void *arg)
+{
+	struct worker *wk = arg;
+	char path[4200];
+	uint64_t i, t0;
+	int fd;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < wk->ops; i++) {
+		snprintf(path, sizeof(path), "%s/%" PRIu64, wk->dir, i);
+		t0 = now_ns();
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			die(path);
+		close(fd);
+		wk->lat[i] = now_ns() - t0;
+	}
+	return NULL;
+}
+
+/* Remove the files of a directory, and the directory */
+static void remove_dir(const char *path)
+{
+	char sub[4096];
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(path);
+	if (!d) {
+		if (errno == ENOENT)
+			return;
+		die(path);
+	}
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+		if (unlink(sub) && errno == EISDIR)
+			remove_dir(sub);
+	}
+	closedir(d);
+	if (rmdir(path))
+		die(path);
+}
+
+/* Creators each making nr_files / nr_threads files in their directory */
+static void run_create(const char *dir, long nr_files, int nr_threads)
+{
+	struct worker *wk;
+	char path[4096];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/create", dir);
+	remove_dir(path);
+	if (mkdir(path, 0755))
+		die(path);
+	wk = calloc(nr_threads, sizeof(*wk));
+	if (!wk)
+		die("malloc");
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(wk[i].dir, sizeof(wk[i].dir), "%s/create/%d", dir, i);
+		if (mkdir(wk[i].dir, 0755))
+			die(wk[i].dir);
+		wk[i].id = i;
+	}
+	run_workers(create_worker, wk, nr_threads, nr_files / nr_threads);
+	free(wk);
+}
+
+/* The command writes to stderr, stdout is the CSV */
+static void run_exec(char **argv, int cold)
+{
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	if (cold)
+		drop_caches();
+	lat = malloc(sizeof(*lat));
+	if (!lat)
+		die("malloc");
+	memset(&ru_start, 0, sizeof(ru_start));
+
+	t_start = now_ns();
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		dup2(2, 1);
+		execvp(argv[0], argv);
+		die(argv[0]);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0)
+		die("wait4");
+	t_end = now_ns();
+	lat[nr_ops++] = t_end - t_start;
+	ru_end = ru;
+	/* fsck.pnlfs exits with 1 when it fixed the image */
+	if (!WIFEXITED(status) || WEXITSTATUS(status) >= 4) {
+		fprintf(stderr, "pnlfs-bench: %s failed\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double q)
+{
+	uint64_t i = q * nr_ops;
+
+	if (!nr_ops)
+		return 0;
+	return lat[i < nr_ops ? i : nr_ops - 1] / 1e3;
+}
+
+static double cpu_secs(struct timeval *a, struct timeval *b)
+{
+	return b->tv_sec - a->tv_sec + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void usage(const char *appname)
+{
+	fprintf(stderr,
+		"Usage: %s [-c] [-d] [-l label] [-w workload] [-s io_size] "
+		"[-S file_size] [-n files] [-t threads] [-p percent] dir\n"
+		"       %s [-c] [-l label] -w exec -- command [args...]\n"
+		"       %s -H label_columns\n"
+		"\t-c: drop the caches before the timed part (root)\n"
+		"\t-d: O_DIRECT, io_size a multiple of the block size\n"
+		"\t-l: values put first on the row, comma separated\n"
+		"\t-w: seqwrite, seqread, randread, randwrite, append, "
+		"overwrite,\n\t    smallcat, fsync, aged, create, appenders, "
+		"copy, sendfile\n\t    or exec (default seqread)\n"
+		"\t-s: bytes of each read or write (default 4096)\n"
+		"\t-S: bytes of the file (default 1 GiB)\n"
+		"\t-n: files read by smallcat, of io_size each, or made by "
+		"create\n\t    (default 1000)\n"
+		"\t-t: threads of fsync, create and appenders (default 1)\n"
+		"\t-p: blocks in use before aged appends, in %% (default 90)\n"
+		"\t-H: print the header of the CSV, after label_columns\n",
+		appname, appname, appname);
+}
+
+int main(int argc, char **argv)
+{
+	enum workload w = SEQREAD;
+	const char *label = "", *name;
+	uint64_t file_size = 1ULL << 30;
+	size_t io_size = 4096;
+	long nr_files = 1000;
+	int opt, cold = 0, direct = 0, nr_threads = 1, pct = 90, i;
+	double secs;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "cdl:w:s:S:n:t:p:H:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cold = 1;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'w':
+			for (i = 0; i < NR_WORKLOADS; i++)
+				if (!strcmp(optarg, workload_names[i]))
+					break;
+			if (i == NR_WORKLOADS) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			w = i;
+			break;
+		case 's':
+			io_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			file_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_files = atol(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'p':
+			pct = atoi(optarg);
+			break;
+		case 'H':
+			printf("%s%sworkload,threads,io_size,file_size,ops,"
+			       "bytes,secs,mib_s,iops,lat_p50_us,lat_p90_us,"
+			       "lat_p99_us,lat_p999_us,lat_max_us,user_s,"
+			       "sys_s\n",
+			       optarg, *optarg ? "," : "");
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || (w != EXEC && optind != argc - 1) ||
+	    !io_size || file_size < io_size || nr_files < 1 ||
+	    nr_threads < 1 || file_size / io_size < (uint64_t) nr_threads ||
+	    nr_files < nr_threads ||
+	    pct < 0 || pct > 100) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buf = aligned_alloc(4096, (io_size + 4095) & ~4095UL);
+	if (!buf)
+		die("malloc");
+	for (i = 0; i < (int) io_size; i++)
+		buf[i] = next_random();
+
+	/* Only fsync, create and appenders run several threads */
+	if (w != FSYNC && w != CREATE && w != APPENDERS)
+		nr_threads = 1;
+	name = workload_names[w];
+	if (w == EXEC) {
+		run_exec(&argv[optind], cold);
+		name = basename(argv[optind]);
+		io_size = 0;
+		file_size = 0;
+	} else if (w == SMALLCAT) {
+		run_smallcat(argv[optind], buf, io_size, nr_files, cold);
+		file_size = io_size;
+	} else if (w == FSYNC) {
+		run_writers(fsync_worker, "fsync", argv[optind], buf, io_size,
+			    file_size, nr_threads);
+	} else if (w == APPENDERS) {
+		run_writers(append_worker, "appenders", argv[optind], buf,
+			    io_size, file_size, nr_threads);
+	} else if (w == CREATE) {
+		run_create(argv[optind], nr_files, nr_threads);
+		io_size = 0;
+		file_size = 0;
+	} else if (w == COPY || w == SENDFILE) {
+		run_send(w, argv[optind], buf, io_size, file_size, cold);
+	} else if (w == AGED) {
+		age(argv[optind], buf, io_size, pct);
+		run_file(APPEND, argv[optind], buf, io_size, file_size, cold,
+			 direct);
+	} else {
+		run_file(w, argv[optind], buf, io_size, file_size, cold,
+			 direct);
+	}
+
+	secs = (t_end - t_start) / 1e9;
+	qsort(lat, nr_ops, sizeof(*lat), cmp_u64);
+	printf("%s%s%s,%d,%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.6f,%.2f,"
+	       "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.3f\n", label,
+	       *label ? "," : "", name, nr_threads, io_size, file_size, nr_ops,
+	       nr_bytes, secs,
+	       secs > 0 ? nr_bytes / secs / (1 << 20) : 0.0,
+	       secs > 0 ? nr_ops / secs : 0.0,
+	       percentile_us(0.5), percentile_us(0.9), percentile_us(0.99),
+	       percentile_us(0.999), nr_ops ? lat[nr_ops - 1] / 1e3 : 0.0,
+	       cpu_secs(&ru_start.ru_utime, &ru_end.ru_utime),
+	       cpu_secs(&ru_start.ru_stime, &ru_end.ru_stime));
+	free(buf);
+	free(lat);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libpnlfs.h"
+
+/*
+ * Copy the files of a pnlfs image to a directory, without the module.
+ *
+ * usage: pnlfs-extract [-t threads] [-p path] image destdir
+ *
+ * Workers take jobs from a shared stack: a directory to create and list,
+ * or a range of a file to copy. Large files are cut in ranges of
+ * RANGE_SIZE so that one file keeps every worker busy. Data goes from
+ * the mapping of the image to the destination with one write per run of
+ * contiguous blocks, holes are left as holes.
+ */
+
+#define RANGE_SIZE   (64 << 20)         /* Bytes of a file copied by a job */
+#define WRITE_SIZE   (8 << 20)          /* Bytes of the image read ahead */
+
+struct job {
+	struct job *next;
+	uint32_t ino;
+	int is_dir;
+	uint64_t off;                   /* Range of a file */
+	uint64_t len;
+	char path[];                    /* Destination */
+};
+
+static struct pnlfs_image img;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct job *jobs;
+static unsigned long pending;           /* Jobs queued or running */
+static unsigned char *seen;             /* Directories listed, by inode */
+static uintptr_t page_mask;
+
+static uint64_t nr_files, nr_dirs, nr_bytes;
+static int failed;
+
+static void error(const char *path, int err)
+{
+	fprintf(stderr, "pnlfs-extract: %s: %s\n", path, strerror(err));
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void push(uint32_t ino, int is_dir, const char *path, uint64_t off,
+		 uint64_t len)
+{
+	struct job *job = malloc(sizeof(*job) + strlen(path) + 1);
+
+	if (!job) {
+		error(path, ENOMEM);
+		return;
+	}
+	job->ino = ino;
+	job->is_dir = is_dir;
+	job->off = off;
+	job->len = len;
+	strcpy(job->path, path);
+
+	pthread_mutex_lock(&lock);
+	job->next = jobs;
+	jobs = job;
+	pending++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Next job, NULL once every job is done */
+static struct job *pop(void)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&lock);
+	while (!jobs && pending)
+		pthread_cond_wait(&cond, &lock);
+	job = jobs;
+	if (job)
+		jobs = job->next;
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+static void done(struct job *job)
+{
+	free(job);
+	pthread_mutex_lock(&lock);
+	if (!--pending)
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Write len bytes of the image from addr, a piece at a time */
+static int write_run(int fd, const unsigned char *addr, uint64_t len,
+		     uint64_t off)
+{
+	uint64_t n;
+	ssize_t ret;
+
+	while (len) {
+		n = len < WRITE_SIZE ? len : WRITE_SIZE;
+		madvise((void *) ((uintptr_t) addr & ~page_mask),
+			n + ((uintptr_t) addr & page_mask), MADV_WILLNEED);
+		ret = pwrite(fd, addr, n, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? errno : EIO;
+		addr += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Copy [off, off + len) of the file, which ends at size */
+static int copy_range(struct pnlfs_stat *st, int fd, uint64_t off,
+		      uint64_t len)
+{
+	uint64_t end = off + len, n;
+	uint32_t iblock, pblk, run, in_block;
+	int ret;
+
+	while (off < end) {
+		iblock = off / img.block_size;
+		in_block = off % img.block_size;
+		ret = pnlfs_bmap(&img, st, iblock, &pblk, &run);
+		if (ret < 0)
+			return -ret;
+		n = (uint64_t) run * img.block_size - in_block;
+		if (n > end - off)
+			n = end - off;
+		if (ret) {
+			ret = write_run(fd, img.map + (uint64_t) pblk *
+					img.block_size + in_block, n, off);
+			if (ret)
+				return ret;
+		}
+		off += n;
+	}
+	__atomic_add_fetch(&nr_bytes, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void extract_range(struct job *job)
+{
+	struct pnlfs_stat st;
+	int fd, err;
+
+	err = -pnlfs_stat(&img, job->ino, &st);
+	if (err) {
+		error(job->path, err);
+		return;
+	}
+	fd = open(job->path, O_WRONLY);
+	if (fd < 0) {
+		error(job->path, errno);
+		return;
+	}
+	err = copy_range(&st, fd, job->off, job->len);
+	if (err)
+		error(job->path, err);
+	close(fd);
+}
+
+/* Create the file at its size, its data is copied by range jobs */
+static void extract_file(uint32_t ino, struct pnlfs_stat *st,
+			 const char *path)
+{
+	unsigned char buf[PNLFS_MAX_BLOCK_SIZE / 2];
+	uint64_t off;
+	ssize_t n;
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+		  (st->mode & 07777) | S_IWUSR);
+	if (fd < 0) {
+		error(path, errno);
+		return;
+	}
+	__atomic_add_fetch(&nr_files, 1, __ATOMIC_RELAXED);
+
+	/* The data of an inline file is in its record */
+	if (st->flags & PNLFS_INODE_INLINE) {
+		n = pnlfs_pread(&img, ino, buf, sizeof(buf), 0);
+		err = n < 0 ? -n : write_run(fd, buf, n, 0);
+		if (err)
+			error(path, err);
+		else
+			__atomic_add_fetch(&nr_bytes, n, __ATOMIC_RELAXED);
+		close(fd);
+		return;
+	}
+
+	if (ftruncate(fd, st->size))
+		error(path, errno);
+	close(fd);
+	for (off = 0; off < st->size; off += RANGE_SIZE)
+		push(ino, 0, path, off, st->size - off < RANGE_SIZE ?
+		     st->size - off : RANGE_SIZE);
+}
+
+struct walk {
+	const char *path;
+	char *buf;                      /* path/name */
+	size_t size;
+};
+
+/* A name which could leave the destination is not extracted */
+static int bad_name(const char *name, int len)
+{
+	return !len || memchr(name, '/', len) || memchr(name, '\0', len) ||
+		(len == 1 && name[0] == '.') ||
+		(len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+static int walk_actor(void *priv, const char *name, int len, uint32_t ino,
+		      unsigned int type)
+{
+	struct walk *w = priv;
+	struct pnlfs_stat st;
+	int err;
+
+	snprintf(w->buf, w->size, "%s/%.*s", w->path, len, name);
+	if (bad_name(name, len)) {
+		error(w->buf, EUCLEAN);
+		return 0;
+	}
+	err = -pnlfs_stat(&img, ino, &st);
+	if (err) {
+		error(w->buf, err);
+		return 0;
+	}
+	if (S_ISDIR(st.mode))
+		push(ino, 1, w->buf, 0, 0);
+	else
+		extract_file(ino, &st, w->buf);
+	return 0;
+}
+
+static void extract_dir(struct job *job)
+{
+	char buf[PATH_MAX];
+	struct walk w = { job->path, buf, sizeof(buf) };
+	struct pnlfs_stat st;
+	int err;
+
+	err = -pnlfs_stat(&img, job->ino, &st);
+	if (err) {
+		error(job->path, err);
+		return;
+	}
+	/* A directory reachable twice is corrupted, do not loop */
+	if (__atomic_exchange_n(&seen[job->ino], 1, __ATOMIC_RELAXED)) {
+		error(job->path, ELOOP);
+		return;
+	}
+	if (mkdir(job->path, (st.mode & 07777) | S_IRWXU) && errno != EEXIST) {
+		error(job->path, errno);
+		return;
+	}
+	__atomic_add_fetch(&nr_dirs, 1, __ATOMIC_RELAXED);
+	err = -pnlfs_iterate(&img, job->ino, walk_actor, &w);
+	if (err)
+		error(job->path, err);
+}
+
+static void *worker(void *arg)
+{
+	struct job *job;
+
+	while ((job = pop())) {
+		if (job->is_dir)
+			extract_dir(job);
+		else
+			extract_range(job);
+		done(job);
+	}
+	return NULL;
+}
+
+static void usage(const char *appname)
+{
+	fprintf(stderr,
+		"Usage: %s [-t threads] [-p path] image destdir\n"
+		"\t-t: workers copying in parallel (default: online CPUs)\n"
+		"\t-p: directory of the image to extract (default /)\n",
+		appname);
+}
+
+int main(int argc, char **argv)
+{
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *from = "/";
+	struct timespec t0, t1;
+	pthread_t *threads;
+	uint32_t root;
+	double secs;
+	int opt, err;
+	long i;
+
+	while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atol(optarg);
+			break;
+		case 'p':
+			from = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 2 || nr_threads < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	err = -pnlfs_open(&img, argv[optind], 0);
+	if (err) {
+		error(argv[optind], err);
+		return EXIT_FAILURE;
+	}
+	if (img.needs_recovery)
+		fprintf(stderr, "pnlfs-extract: the journal of %s was not "
+			"replayed, recent changes are missing\n", argv[optind]);
+	err = -pnlfs_namei(&img, from, &root);
+	if (err) {
+		error(from, err);
+		return EXIT_FAILURE;
+	}
+	seen = calloc(img.nr_inodes, 1);
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!seen || !threads) {
+		error(argv[optind], ENOMEM);
+		return EXIT_FAILURE;
+	}
+
+	page_mask = sysconf(_SC_PAGESIZE) - 1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	push(root, 1, argv[optind + 1], 0, 0);
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&threads[i], NULL, worker, NULL);
+		if (err) {
+			error("pthread_create", err);
+			break;
+		}
+	}
+	while (i--)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%" PRIu64 " directories, %" PRIu64 " files, %" PRIu64
+	       " bytes in %.3f s (%.1f MiB/s)\n", nr_dirs, nr_files, nr_bytes,
+	       secs, secs > 0 ? nr_bytes / secs / (1 << 20) : 0.0);
+
+	pnlfs_close(&img);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,917 @@
+#define FUSE_USE_VERSION 34
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+
+#include "libpnlfs.h"
+
+/*
+ * Serve a pnlfs image with FUSE, without the module.
+ *
+ * usage: pnlfs-fuse [options] image mountpoint
+ *
+ * The image is mapped whole by libpnlfs and that mapping is the block
+ * cache: it shares the page cache of the image, metadata is read and
+ * changed in place and reaches the disk when the kernel writes the pages
+ * back, at fsync or at unmount. When the kernel can splice, file data
+ * does not go through the daemon: a read is answered with the ranges of
+ * the image holding the blocks of the file, a write goes from the request
+ * pipe to the blocks allocated for it.
+ *
+ * Requests are served by the threads of fuse_session_loop_mt(). Names are
+ * under a read-write lock, each file under a lock of a table hashed by
+ * inode, allocation under the lock of the image. There is no journal: the
+ * image is not clean while it is served, so that fsck.pnlfs checks it
+ * after a crash, as after one of the module.
+ *
+ * FUSE inode numbers are those of pnlfs plus one, FUSE_ROOT_ID being 1.
+ */
+
+#define TIMEOUT      1.0                /* Seconds the kernel keeps attributes */
+#define NR_ILOCKS    256
+#define NR_NODES     4096
+#define ZERO_SIZE    (1 << 20)          /* Bytes of zeroes sent for a hole */
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* An inode known to the kernel, released at its last forget once unlinked */
+struct node {
+	struct node *next;
+	uint32_t ino;
+	int unlinked;
+	uint64_t nlookup;
+};
+
+/* Names of a directory, read at opendir */
+struct dir_handle {
+	size_t count;
+	size_t size;
+	struct dir_name {
+		uint32_t ino;
+		mode_t type;
+		char *name;
+	} *names;
+};
+
+static const char *image;
+static struct pnlfs_image img;
+static int read_only;
+static int served;                      /* init was called, destroy will be */
+static struct timespec mount_time;
+
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t ilocks[NR_ILOCKS];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node *nodes[NR_NODES];
+static char zeroes[ZERO_SIZE];
+
+static inline uint32_t to_ino(fuse_ino_t ino)
+{
+	return ino - 1;
+}
+
+static inline fuse_ino_t to_fuse(uint32_t ino)
+{
+	return (fuse_ino_t) ino + 1;
+}
+
+static inline pthread_rwlock_t *ilock(uint32_t ino)
+{
+	return &ilocks[ino % NR_ILOCKS];
+}
+
+/* Node of ino, the link pointing to it in its bucket */
+static struct node **node_slot(uint32_t ino)
+{
+	struct node **np = &nodes[ino % NR_NODES];
+
+	while (*np && (*np)->ino != ino)
+		np = &(*np)->next;
+	return np;
+}
+
+/* Free an unlinked inode once nothing uses it any more */
+static void release(uint32_t ino)
+{
+	int err;
+
+	pthread_rwlock_wrlock(ilock(ino));
+	err = pnlfs_release(&img, ino);
+	pthread_rwlock_unlock(ilock(ino));
+	if (err)
+		fprintf(stderr, "pnlfs-fuse: inode %u: %s\n", ino,
+			strerror(-err));
+}
+
+static int node_ref(uint32_t ino)
+{
+	struct node **np, *n;
+
+	pthread_mutex_lock(&nodes_lock);
+	np = node_slot(ino);
+	n = *np;
+	if (!n) {
+		n = calloc(1, sizeof(*n));
+		if (!n) {
+			pthread_mutex_unlock(&nodes_lock);
+			return -ENOMEM;
+		}
+		n->ino = ino;
+		*np = n;
+	}
+	n->nlookup++;
+	pthread_mutex_unlock(&nodes_lock);
+	return 0;
+}
+
+static void node_forget(uint32_t ino, uint64_t nlookup)
+{
+	struct node **np, *n;
+	int unlinked = 0;
+
+	pthread_mutex_lock(&nodes_lock);
+	np = node_slot(ino);
+	n = *np;
+	if (n && n->nlookup <= nlookup) {
+		unlinked = n->unlinked;
+		*np = n->next;
+		free(n);
+	} else if (n) {
+		n->nlookup -= nlookup;
+	}
+	pthread_mutex_unlock(&nodes_lock);
+	if (unlinked)
+		release(ino);
+}
+
+/* The last name of ino is gone, it is freed now or at its last forget */
+static void node_unlinked(uint32_t ino)
+{
+	struct node *n;
+
+	pthread_mutex_lock(&nodes_lock);
+	n = *node_slot(ino);
+	if (n)
+		n->unlinked = 1;
+	pthread_mutex_unlock(&nodes_lock);
+	if (!n)
+		release(ino);
+}
+
+static int fill_stat(uint32_t ino, struct stat *stbuf)
+{
+	struct pnlfs_stat st;
+	int err;
+
+	err = pnlfs_stat(&img, ino, &st);
+	if (err)
+		return err;
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = to_fuse(ino);
+	stbuf->st_mode = st.mode;
+	stbuf->st_nlink = S_ISDIR(st.mode) ? 2 : 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = st.size;
+	stbuf->st_blksize = img.block_size;
+	if (S_ISREG(st.mode))
+		stbuf->st_blocks = (uint64_t) st.nr_entries *
+			img.block_size / 512;
+	/* Times are not on disk, the module does not keep them either */
+	stbuf->st_atim = mount_time;
+	stbuf->st_mtim = mount_time;
+	stbuf->st_ctim = mount_time;
+	return 0;
+}
+
+static int fill_entry(uint32_t ino, struct fuse_entry_param *e)
+{
+	int err;
+
+	memset(e, 0, sizeof(*e));
+	err = fill_stat(ino, &e->attr);
+	if (err)
+		return err;
+	e->ino = to_fuse(ino);
+	e->attr_timeout = TIMEOUT;
+	e->entry_timeout = TIMEOUT;
+	return node_ref(ino);
+}
+
+/* The image is not clean while it is served, as for a mount of the module */
+static int set_clean(int clean)
+{
+	uint32_t state = le32toh(img.sb->state);
+
+	if (clean)
+		state |= PNLFS_STATE_CLEAN;
+	else
+		state &= ~PNLFS_STATE_CLEAN;
+	img.sb->state = htole32(state);
+	return pnlfs_sync(&img);
+}
+
+static void pnlfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	served = 1;
+	/* Reads answered from the image, writes taken from the request pipe */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+}
+
+static void pnlfs_fuse_destroy(void *userdata)
+{
+	struct node *n, *next;
+	int i, err;
+
+	/* The kernel does not forget every inode at unmount */
+	for (i = 0; i < NR_NODES; i++) {
+		for (n = nodes[i]; n; n = next) {
+			next = n->next;
+			if (n->unlinked)
+				release(n->ino);
+			free(n);
+		}
+		nodes[i] = NULL;
+	}
+	if (read_only)
+		return;
+	err = set_clean(1);
+	if (err)
+		fprintf(stderr, "pnlfs-fuse: %s\n", strerror(-err));
+}
+
+static void pnlfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
+			      const char *name)
+{
+	struct fuse_entry_param e;
+	uint32_t ino;
+	int err;
+
+	pthread_rwlock_rdlock(&names_lock);
+	err = pnlfs_lookup(&img, to_ino(parent), name, strlen(name), &ino);
+	if (!err)
+		err = fill_entry(ino, &e);
+	pthread_rwlock_unlock(&names_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else if (fuse_reply_entry(req, &e))
+		node_forget(ino, 1);
+}
+
+static void pnlfs_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+			      uint64_t nlookup)
+{
+	node_forget(to_ino(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void pnlfs_fuse_forget_multi(fuse_req_t req, size_t count,
+				    struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		node_forget(to_ino(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void pnlfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	int err;
+
+	pthread_rwlock_rdlock(ilock(to_ino(ino)));
+	err = fill_stat(to_ino(ino), &stbuf);
+	pthread_rwlock_unlock(ilock(to_ino(ino)));
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, TIMEOUT);
+}
+
+static void pnlfs_fuse_setattr(fuse_req_t req, fuse_ino_t fino,
+			       struct stat *attr, int to_set,
+			       struct fuse_file_info *fi)
+{
+	uint32_t ino = to_ino(fino);
+	struct pnlfs_inode *raw;
+	struct stat stbuf;
+	int err = 0;
+
+	/* There are no owners on disk, the files belong to the daemon */
+	if (((to_set & FUSE_SET_ATTR_UID) && attr->st_uid != getuid()) ||
+	    ((to_set & FUSE_SET_ATTR_GID) && attr->st_gid != getgid())) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	if (read_only && (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_SIZE))) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	pthread_rwlock_wrlock(ilock(ino));
+	raw = pnlfs_raw_inode(&img, ino);
+	if (!raw)
+		err = -ENOENT;
+	if (!err && (to_set & FUSE_SET_ATTR_MODE))
+		raw->mode = htole32((le32toh(raw->mode) & ~07777) |
+				    (attr->st_mode & 07777));
+	if (!err && (to_set & FUSE_SET_ATTR_SIZE))
+		err = pnlfs_truncate(&img, ino, attr->st_size);
+	if (!err)
+		err = fill_stat(ino, &stbuf);
+	pthread_rwlock_unlock(ilock(ino));
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, TIMEOUT);
+}
+
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	uint32_t ino;
+	int err;
+
+	if (read_only) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	pthread_rwlock_wrlock(&names_lock);
+	err = pnlfs_create(&img, to_ino(parent), name, strlen(name), mode,
+			   &ino);
+	if (!err)
+		err = fill_entry(ino, &e);
+	pthread_rwlock_unlock(&names_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else if (fi ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e))
+		node_forget(ino, 1);
+}
+
+static void pnlfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
+			     const char *name, mode_t mode)
+{
+	do_create(req, parent, name, S_IFDIR | (mode & 07777), NULL);
+}
+
+static void pnlfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
+			      const char *name, mode_t mode,
+			      struct fuse_file_info *fi)
+{
+	do_create(req, parent, name, S_IFREG | (mode & 07777), fi);
+}
+
+static void do_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      int dir)
+{
+	struct pnlfs_stat st;
+	uint32_t ino;
+	int err;
+
+	if (read_only) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	pthread_rwlock_wrlock(&names_lock);
+	err = pnlfs_lookup(&img, to_ino(parent), name, strlen(name), &ino);
+	if (!err)
+		err = pnlfs_stat(&img, ino, &st);
+	if (!err && !S_ISDIR(st.mode) != !dir)
+		err = dir ? -ENOTDIR : -EISDIR;
+	if (!err)
+		err = pnlfs_unlink(&img, to_ino(parent), name, strlen(name),
+				   &ino);
+	pthread_rwlock_unlock(&names_lock);
+	if (!err)
+		node_unlinked(ino);
+	fuse_reply_err(req, -err);
+}
+
+static void pnlfs_fuse_unlink(fuse_req_t req, fuse_ino_t parent,
+			      const char *name)
+{
+	do_remove(req, parent, name, 0);
+}
+
+static void pnlfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent,
+			     const char *name)
+{
+	do_remove(req, parent, name, 1);
+}
+
+/* The kernel checks that a directory does not move under itself */
+static void pnlfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
+			      const char *name, fuse_ino_t newparent,
+			      const char *newname, unsigned int flags)
+{
+	int len = strlen(name), newlen = strlen(newname), err;
+	uint32_t ino, old, replaced = 0;
+	struct pnlfs_stat st, ost;
+
+	if (flags & ~RENAME_NOREPLACE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (read_only) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	pthread_rwlock_wrlock(&names_lock);
+	err = pnlfs_lookup(&img, to_ino(parent), name, len, &ino);
+	if (!err)
+		err = pnlfs_stat(&img, ino, &st);
+	if (err)
+		goto out;
+
+	err = pnlfs_lookup(&img, to_ino(newparent), newname, newlen, &old);
+	if (err != -ENOENT) {
+		if (!err && (flags & RENAME_NOREPLACE))
+			err = -EEXIST;
+		if (err || old == ino)
+			goto out;
+		err = pnlfs_stat(&img, old, &ost);
+		if (!err && S_ISDIR(ost.mode) && !S_ISDIR(st.mode))
+			err = -EISDIR;
+		if (!err && !S_ISDIR(ost.mode) && S_ISDIR(st.mode))
+			err = -ENOTDIR;
+		if (!err)
+			err = pnlfs_unlink(&img, to_ino(newparent), newname,
+					   newlen, &replaced);
+		if (err)
+			goto out;
+	}
+
+	err = pnlfs_rename(&img, to_ino(parent), name, len, to_ino(newparent),
+			   newname, newlen);
+	/* The replaced file gets its name back rather than be released */
+	if (err && replaced) {
+		if (pnlfs_link(&img, to_ino(newparent), newname, newlen,
+			       replaced))
+			fprintf(stderr, "pnlfs-fuse: inode %u lost its name\n",
+				replaced);
+		else
+			replaced = 0;
+	}
+out:
+	pthread_rwlock_unlock(&names_lock);
+	if (replaced)
+		node_unlinked(replaced);
+	fuse_reply_err(req, -err);
+}
+
+static void pnlfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	if (read_only && (fi->flags & O_ACCMODE) != O_RDONLY)
+		fuse_reply_err(req, EROFS);
+	else
+		fuse_reply_open(req, fi);
+}
+
+/*
+ * Answer with the ranges of the image holding [off, off + size) of the
+ * file, the kernel splicing them to the reader. Holes are sent as zeroes
+ * from memory. The lock of the file keeps its blocks until the reply is
+ * sent.
+ */
+static void pnlfs_fuse_read(fuse_req_t req, fuse_ino_t fino, size_t size,
+			    off_t off, struct fuse_file_info *fi)
+{
+	uint32_t ino = to_ino(fino), bs = img.block_size;
+	uint32_t iblock, pblk, len, in_block;
+	struct fuse_bufvec *bv = NULL;
+	struct pnlfs_stat st;
+	struct fuse_buf *buf;
+	uint64_t n;
+	size_t max;
+	int ret;
+
+	pthread_rwlock_rdlock(ilock(ino));
+	ret = pnlfs_stat(&img, ino, &st);
+	if (ret)
+		goto out;
+	if ((uint64_t) off >= st.size) {
+		fuse_reply_buf(req, NULL, 0);
+		goto out;
+	}
+	if (size > st.size - off)
+		size = st.size - off;
+	if (st.flags & PNLFS_INODE_INLINE) {
+		fuse_reply_buf(req, (char *) (pnlfs_raw_inode(&img, ino) + 1) +
+			       off, size);
+		goto out;
+	}
+
+	max = size / bs + size / ZERO_SIZE + 2;
+	bv = malloc(offsetof(struct fuse_bufvec, buf) + max * sizeof(*buf));
+	ret = -ENOMEM;
+	if (!bv)
+		goto out;
+	bv->count = 0;
+	bv->idx = 0;
+	bv->off = 0;
+	while (size) {
+		iblock = off / bs;
+		in_block = off % bs;
+		ret = pnlfs_bmap(&img, &st, iblock, &pblk, &len);
+		if (ret < 0)
+			goto out;
+		n = (uint64_t) len * bs - in_block;
+		if (!ret && n > ZERO_SIZE)
+			n = ZERO_SIZE;
+		if (n > size)
+			n = size;
+		buf = &bv->buf[bv->count++];
+		memset(buf, 0, sizeof(*buf));
+		buf->size = n;
+		if (ret) {
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			buf->fd = img.fd;
+			buf->pos = (uint64_t) pblk * bs + in_block;
+		} else {
+			buf->mem = zeroes;
+		}
+		off += n;
+		size -= n;
+	}
+	ret = 0;
+	fuse_reply_data(req, bv, 0);
+out:
+	pthread_rwlock_unlock(ilock(ino));
+	free(bv);
+	if (ret)
+		fuse_reply_err(req, -ret);
+}
+
+/*
+ * Allocate the blocks of [off, off + size) of the file and copy the data
+ * of the request to them, spliced into the image when it comes in a pipe.
+ * What is not written of new blocks is zeroed first, through the mapping.
+ */
+static void pnlfs_fuse_write_buf(fuse_req_t req, fuse_ino_t fino,
+				 struct fuse_bufvec *in_buf, off_t off,
+				 struct fuse_file_info *fi)
+{
+	uint32_t ino = to_ino(fino), bs = img.block_size;
+	uint32_t pblk, len, in_block;
+	size_t size = fuse_buf_size(in_buf), mapped = 0, max;
+	struct fuse_bufvec *dst = NULL;
+	struct pnlfs_inode *raw;
+	struct pnlfs_stat st;
+	struct fuse_buf *buf;
+	unsigned char *data;
+	uint64_t end = off + size, n;
+	ssize_t ret;
+
+	if (read_only || !size) {
+		if (read_only)
+			fuse_reply_err(req, EROFS);
+		else
+			fuse_reply_write(req, 0);
+		return;
+	}
+	pthread_rwlock_wrlock(ilock(ino));
+	ret = pnlfs_stat(&img, ino, &st);
+	if (ret)
+		goto out;
+	ret = -EFBIG;
+	if (end > PNLFS_MAX_FILESIZE)
+		goto out;
+	raw = pnlfs_raw_inode(&img, ino);
+
+	max = size / bs + 2;
+	dst = malloc(offsetof(struct fuse_bufvec, buf) + max * sizeof(*buf));
+	ret = -ENOMEM;
+	if (!dst)
+		goto out;
+	dst->count = 0;
+	dst->idx = 0;
+	dst->off = 0;
+
+	/* A small file stays in its record, zeroed past its size */
+	if (st.flags & PNLFS_INODE_INLINE && end <= pnlfs_inline_size(&img)) {
+		buf = &dst->buf[dst->count++];
+		memset(buf, 0, sizeof(*buf));
+		buf->size = size;
+		buf->mem = (char *) (raw + 1) + off;
+		mapped = size;
+	}
+
+	while (mapped < size) {
+		in_block = (off + mapped) % bs;
+		ret = pnlfs_map_write(&img, ino, (off + mapped) / bs,
+				      (in_block + size - mapped + bs - 1) / bs,
+				      &pblk, &len);
+		if (ret < 0)
+			break;
+		data = img.map + (uint64_t) pblk * bs;
+		n = (uint64_t) len * bs - in_block;
+		if (n > size - mapped)
+			n = size - mapped;
+		if (ret) {
+			memset(data, 0, in_block);
+			memset(data + in_block + n, 0,
+			       (uint64_t) len * bs - in_block - n);
+		}
+		buf = &dst->buf[dst->count++];
+		memset(buf, 0, sizeof(*buf));
+		buf->size = n;
+		buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf->fd = img.fd;
+		buf->pos = (uint64_t) pblk * bs + in_block;
+		mapped += n;
+	}
+	/* Write what could be allocated, the error is for the next write */
+	if (!mapped)
+		goto out;
+
+	ret = fuse_buf_copy(dst, in_buf, 0);
+	if (ret > 0 && off + ret > st.size)
+		raw->filesize = htole32(off + ret);
+out:
+	pthread_rwlock_unlock(ilock(ino));
+	free(dst);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void pnlfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			     struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -pnlfs_sync(&img));
+}
+
+static int dir_actor(void *priv, const char *name, int len, uint32_t ino,
+		     unsigned int type)
+{
+	struct dir_handle *h = priv;
+	struct dir_name *names;
+	struct pnlfs_stat st;
+
+	if (h->count == h->size) {
+		h->size = h->size ? h->size * 2 : 64;
+		names = realloc(h->names, h->size * sizeof(*names));
+		if (!names)
+			return -ENOMEM;
+		h->names = names;
+	}
+	/* Names of the old format have no type */
+	if (!type && !pnlfs_stat(&img, ino, &st))
+		type = (st.mode & S_IFMT) >> 12;
+	h->names[h->count].ino = ino;
+	h->names[h->count].type = type << 12;
+	h->names[h->count].name = strndup(name, len);
+	if (!h->names[h->count].name)
+		return -ENOMEM;
+	h->count++;
+	return 0;
+}
+
+static void free_dir(struct dir_handle *h)
+{
+	size_t i;
+
+	for (i = 0; i < h->count; i++)
+		free(h->names[i].name);
+	free(h->names);
+	free(h);
+}
+
+/* The names are read once, readdir goes through them by index */
+static void pnlfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+	struct dir_handle *h = calloc(1, sizeof(*h));
+	int err = -ENOMEM;
+
+	if (h) {
+		dir_actor(h, ".", 1, to_ino(ino), S_IFDIR >> 12);
+		dir_actor(h, "..", 2, to_ino(ino), S_IFDIR >> 12);
+		pthread_rwlock_rdlock(&names_lock);
+		err = pnlfs_iterate(&img, to_ino(ino), dir_actor, h);
+		pthread_rwlock_unlock(&names_lock);
+	}
+	if (err) {
+		if (h)
+			free_dir(h);
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fi->fh = (uintptr_t) h;
+	if (fuse_reply_open(req, fi))
+		free_dir(h);
+}
+
+static void pnlfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			       off_t off, struct fuse_file_info *fi)
+{
+	struct dir_handle *h = (struct dir_handle *) (uintptr_t) fi->fh;
+	struct stat stbuf;
+	size_t used = 0, n;
+	char *buf;
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memset(&stbuf, 0, sizeof(stbuf));
+	for (; (size_t) off < h->count; off++) {
+		stbuf.st_ino = to_fuse(h->names[off].ino);
+		stbuf.st_mode = h->names[off].type;
+		n = fuse_add_direntry(req, buf + used, size - used,
+				      h->names[off].name, &stbuf, off + 1);
+		if (n > size - used)
+			break;
+		used += n;
+	}
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void pnlfs_fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
+				  struct fuse_file_info *fi)
+{
+	free_dir((struct dir_handle *) (uintptr_t) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void pnlfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs s;
+
+	memset(&s, 0, sizeof(s));
+	s.f_bsize = img.block_size;
+	s.f_frsize = img.block_size;
+	s.f_blocks = img.nr_blocks;
+	s.f_bfree = le32toh(img.sb->nr_free_blocks);
+	s.f_bavail = s.f_bfree;
+	s.f_files = img.nr_inodes;
+	s.f_ffree = le32toh(img.sb->nr_free_inodes);
+	s.f_favail = s.f_ffree;
+	s.f_namemax = PNLFS_NAME_LEN;
+	fuse_reply_statfs(req, &s);
+}
+
+static const struct fuse_lowlevel_ops pnlfs_fuse_ops = {
+	.init		= pnlfs_fuse_init,
+	.destroy	= pnlfs_fuse_destroy,
+	.lookup		= pnlfs_fuse_lookup,
+	.forget		= pnlfs_fuse_forget,
+	.forget_multi	= pnlfs_fuse_forget_multi,
+	.getattr	= pnlfs_fuse_getattr,
+	.setattr	= pnlfs_fuse_setattr,
+	.mkdir		= pnlfs_fuse_mkdir,
+	.unlink		= pnlfs_fuse_unlink,
+	.rmdir		= pnlfs_fuse_rmdir,
+	.rename		= pnlfs_fuse_rename,
+	.create		= pnlfs_fuse_create,
+	.open		= pnlfs_fuse_open,
+	.read		= pnlfs_fuse_read,
+	.write_buf	= pnlfs_fuse_write_buf,
+	.fsync		= pnlfs_fuse_fsync,
+	.opendir	= pnlfs_fuse_opendir,
+	.readdir	= pnlfs_fuse_readdir,
+	.releasedir	= pnlfs_fuse_releasedir,
+	.fsyncdir	= pnlfs_fuse_fsync,
+	.statfs		= pnlfs_fuse_statfs,
+};
+
+enum { KEY_RO };
+
+static const struct fuse_opt pnlfs_fuse_opts[] = {
+	FUSE_OPT_KEY("ro", KEY_RO),
+	FUSE_OPT_END
+};
+
+/* The first argument which is not an option is the image */
+static int opt_proc(void *data, const char *arg, int key,
+		    struct fuse_args *outargs)
+{
+	if (key == KEY_RO)
+		read_only = 1;
+	if (key == FUSE_OPT_KEY_NONOPT && !image) {
+		image = arg;
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(const char *appname)
+{
+	printf("Usage: %s [options] image mountpoint\n"
+	       "\t-o ro: serve the image read-only\n"
+	       "\t-s: a single thread, -o max_idle_threads=N otherwise\n\n",
+	       appname);
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	int i, err, was_clean, ret = EXIT_FAILURE;
+
+	if (fuse_opt_parse(&args, NULL, pnlfs_fuse_opts, opt_proc) ||
+	    fuse_parse_cmdline(&args, &opts))
+		return EXIT_FAILURE;
+	if (opts.show_help) {
+		usage(argv[0]);
+		ret = EXIT_SUCCESS;
+		goto out_args;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = EXIT_SUCCESS;
+		goto out_args;
+	}
+	if (!image || !opts.mountpoint) {
+		usage(argv[0]);
+		goto out_args;
+	}
+
+	err = pnlfs_open(&img, image, !read_only);
+	if (err == -EUCLEAN)
+		fprintf(stderr, "pnlfs-fuse: the journal of %s must be "
+			"replayed, mount it once with the module or use -o ro\n",
+			image);
+	else if (err)
+		fprintf(stderr, "pnlfs-fuse: %s: %s\n", image, strerror(-err));
+	if (err)
+		goto out_args;
+	was_clean = le32toh(img.sb->state) & PNLFS_STATE_CLEAN;
+	if (!was_clean)
+		fprintf(stderr, "pnlfs-fuse: %s was not cleanly unmounted, "
+			"running fsck.pnlfs is recommended\n", image);
+	if (!read_only) {
+		err = set_clean(0);
+		if (err) {
+			fprintf(stderr, "pnlfs-fuse: %s: %s\n", image,
+				strerror(-err));
+			goto out_close;
+		}
+	}
+	for (i = 0; i < NR_ILOCKS; i++)
+		pthread_rwlock_init(&ilocks[i], NULL);
+	clock_gettime(CLOCK_REALTIME, &mount_time);
+
+	se = fuse_session_new(&args, &pnlfs_fuse_ops, sizeof(pnlfs_fuse_ops),
+			      NULL);
+	if (!se)
+		goto out_clean;
+	if (fuse_set_signal_handlers(se))
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		err = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		err = fuse_session_loop_mt(se, &config);
+	}
+	ret = err ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	/* Calls destroy, which marks the image clean, if it was served */
+	fuse_session_destroy(se);
+out_clean:
+	if (!read_only && !served && set_clean(was_clean))
+		fprintf(stderr, "pnlfs-fuse: %s: cannot restore its state\n",
+			image);
+out_close:
+	pnlfs_close(&img);
+out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret;
+}
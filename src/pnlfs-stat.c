@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <time.h>
+
+/*
+ * Print what a pnlfs mount did in each interval, from the files of
+ * /sys/fs/pnlfs/<dev>/ (see stats.c in the module).
+ *
+ * usage: pnlfs-stat <dev> [interval in seconds]
+ */
+
+#define MAX_STATS     32
+#define MAX_HISTS      8
+#define HIST_BUCKETS  32
+#define NAME_LEN      32
+
+struct snapshot {
+	int nr_stats;
+	char stat_names[MAX_STATS][NAME_LEN];
+	uint64_t stats[MAX_STATS];
+	int nr_hists;
+	char hist_names[MAX_HISTS][NAME_LEN];
+	uint64_t hists[MAX_HISTS][HIST_BUCKETS];
+};
+
+/* These are levels, not counters: their value is printed as is */
+static const char *levels[] = { "free_blocks", "free_inodes",
+				"dirty_blocks", NULL };
+
+static int is_level(const char *name)
+{
+	int i;
+
+	for (i = 0; levels[i]; i++)
+		if (!strcmp(levels[i], name))
+			return 1;
+	return 0;
+}
+
+static int read_stats(const char *dir, struct snapshot *s)
+{
+	char path[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	s->nr_stats = 0;
+	while (s->nr_stats < MAX_STATS &&
+	       fscanf(f, "%31s %" SCNu64, s->stat_names[s->nr_stats],
+		      &s->stats[s->nr_stats]) == 2)
+		s->nr_stats++;
+	fclose(f);
+	return 0;
+}
+
+static int read_latency(const char *dir, struct snapshot *s)
+{
+	char path[256];
+	FILE *f;
+	int b;
+
+	snprintf(path, sizeof(path), "%s/latency", dir);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	s->nr_hists = 0;
+	while (s->nr_hists < MAX_HISTS &&
+	       fscanf(f, "%31s", s->hist_names[s->nr_hists]) == 1) {
+		for (b = 0; b < HIST_BUCKETS; b++)
+			if (fscanf(f, "%" SCNu64, &s->hists[s->nr_hists][b]) != 1)
+				break;
+		if (b < HIST_BUCKETS)
+			break;
+		s->nr_hists++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static uint64_t stat_delta(struct snapshot *old, struct snapshot *new,
+			   const char *name)
+{
+	int i;
+
+	for (i = 0; i < new->nr_stats; i++)
+		if (!strcmp(new->stat_names[i], name))
+			return new->stats[i] - old->stats[i];
+	return 0;
+}
+
+/* Upper bound in microseconds of the bucket holding the q-th quantile */
+static double quantile(uint64_t *delta, uint64_t total, double q)
+{
+	uint64_t sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		sum += delta[b];
+		if (sum >= q * total)
+			break;
+	}
+	return (double) (1ULL << (b + 1)) / 1000;
+}
+
+static void print_delta(struct snapshot *old, struct snapshot *new,
+			double secs)
+{
+	uint64_t delta[HIST_BUCKETS], total, calls;
+	int i, b;
+
+	for (i = 0; i < new->nr_stats; i++) {
+		if (is_level(new->stat_names[i]))
+			printf("%-16s %12" PRIu64 "\n", new->stat_names[i],
+			       new->stats[i]);
+		else
+			printf("%-16s %12.1f/s\n", new->stat_names[i],
+			       (new->stats[i] - old->stats[i]) / secs);
+	}
+
+	calls = stat_delta(old, new, "ialloc_calls");
+	if (calls)
+		printf("%-16s %12.1f\n", "scanned/ialloc",
+		       (double) stat_delta(old, new, "ialloc_scanned") / calls);
+	calls = stat_delta(old, new, "balloc_calls");
+	if (calls)
+		printf("%-16s %12.1f\n", "blocks/balloc",
+		       (double) stat_delta(old, new, "balloc_blocks") / calls);
+
+	printf("%-8s %10s %12s %12s %12s\n",
+	       "op", "calls/s", "p50 (us)", "p99 (us)", "max (us)");
+	for (i = 0; i < new->nr_hists; i++) {
+		total = 0;
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			delta[b] = new->hists[i][b] - old->hists[i][b];
+			total += delta[b];
+		}
+		if (!total) {
+			printf("%-8s %10.1f\n", new->hist_names[i], 0.0);
+			continue;
+		}
+		printf("%-8s %10.1f %12.1f %12.1f %12.1f\n",
+		       new->hist_names[i], total / secs,
+		       quantile(delta, total, 0.5),
+		       quantile(delta, total, 0.99),
+		       quantile(delta, total, 1));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct snapshot snap[2];
+	struct timespec t[2];
+	char dir[256];
+	double secs;
+	int interval = 1, cur = 0;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <dev> [interval]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 3)
+		interval = atoi(argv[2]);
+	if (interval <= 0)
+		interval = 1;
+
+	/* /dev/loop0 and loop0 both name /sys/fs/pnlfs/loop0 */
+	snprintf(dir, sizeof(dir), "/sys/fs/pnlfs/%s", basename(argv[1]));
+	if (read_stats(dir, &snap[cur]) || read_latency(dir, &snap[cur])) {
+		perror(dir);
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t[cur]);
+
+	for (;;) {
+		sleep(interval);
+		cur = !cur;
+		if (read_stats(dir, &snap[cur]) ||
+		    read_latency(dir, &snap[cur])) {
+			perror(dir);
+			return EXIT_FAILURE;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t[cur]);
+		secs = (t[cur].tv_sec - t[!cur].tv_sec) +
+			(t[cur].tv_nsec - t[!cur].tv_nsec) / 1e9;
+
+		printf("--- %s, %.2f s\n", argv[1], secs);
+		print_delta(&snap[!cur], &snap[cur], secs);
+		fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
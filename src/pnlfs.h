@@ -1,15 +1,6 @@
 #ifndef _PNLFS_H
 #define _PNLFS_H
 
-#define PNLFS_MAGIC           0x434F5746
-
-#define PNLFS_SB_BLOCK_NR              0
-
-#define PNLFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
-#define PNLFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
-#define PNLFS_FILENAME_LEN            28
-#define PNLFS_MAX_DIR_ENTRIES        128
-
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/fs.h>
@@ -20,90 +11,350 @@
 #include <linux/version.h>
 #include <linux/parser.h>
 #include <linux/blkdev.h>
-/*
- * pnlFS partition layout
- *
- * +---------------+
- * |  superblock   |  1 block
- * +---------------+
- * |  inode store  |  sb->nr_istore_blocks blocks
- * +---------------+
- * | ifree bitmap  |  sb->nr_ifree_blocks blocks
- * +---------------+
- * | bfree bitmap  |  sb->nr_bfree_blocks blocks
- * +---------------+
- * |    data       |
- * |      blocks   |  rest of the blocks
- * +---------------+
- *
- */
+#include <linux/mpage.h>
+#include <linux/writeback.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/rculist.h>
+#include <linux/shrinker.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/falloc.h>
+#include <linux/jbd2.h>
 
-struct pnlfs_inode {
-	__le32 mode;		  /* File mode */
-	__le32 index_block;	  /* Block with list of blocks for this file */
-	__le32 filesize;	  /* File size in bytes */
-	union {
-		__le32 nr_used_blocks;  /* Number of blocks used by file */
-		__le32 nr_entries;     /* Number of files/dirs in directory */
-	};
-};
+#include "pnlfs_disk.h"
 
 struct pnlfs_inode_info {
 	uint32_t index_block;
 	uint32_t nr_entries;
+	uint32_t flags;                 /* PNLFS_INODE_* flags */
+	struct rw_semaphore map_sem;    /* Protects the block mapping */
+	struct pnlfs_dcache __rcu *dcache; /* Names of a directory, or NULL */
+	spinlock_t dcache_lock;         /* Protects changes of dcache */
+	struct list_head dcache_lru;    /* Entry in the list of the shrinker */
+	spinlock_t da_lock;             /* Protects da_ranges and da_reserved */
+	struct list_head da_ranges;     /* Blocks waiting for writeback */
+	u32 da_reserved;                /* Number of blocks in da_ranges */
+	tid_t sync_tid;                 /* Last transaction changing it */
 	struct inode vfs_inode;
 };
 
-#define PNLFS_INODES_PER_BLOCK (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode))
+static inline struct pnlfs_inode_info *PNLFS_I(struct inode *inode)
+{
+	return container_of(inode, struct pnlfs_inode_info, vfs_inode);
+}
 
-struct pnlfs_superblock {
-	__le32 magic;	        /* Magic number */
 
-	__le32 nr_blocks;       /* Total number of blocks (incl sb & inodes) */
-	__le32 nr_inodes;       /* Total number of inodes */
+/* A bitmap of the disk, see bitmap.c */
+#define PNLFS_BITS_PER_GROUP(sb) ((u32) (sb)->s_blocksize * 8)
 
-	__le32 nr_istore_blocks;/* Number of inode store blocks */
-	__le32 nr_ifree_blocks; /* Number of inode free bitmap blocks */
-	__le32 nr_bfree_blocks; /* Number of block free bitmap blocks */
+struct pnlfs_bitmap {
+	u32 first;                      /* Block of the first group */
+	u32 nr_bits;
+	u32 group_bits;                 /* Bits of a block */
+	u32 nr_groups;                  /* Number of blocks of the bitmap */
+	struct buffer_head **bh;        /* Groups read so far, or NULL */
+	atomic_t *nr_free;              /* Free bits of each group */
+	unsigned long *dirty;           /* Groups changed since last written */
+	struct mutex lock;              /* Serializes the reads */
+	void (*on_load)(struct super_block *sb, u32 group,
+			struct buffer_head *bh);
+};
+
+#define PNLFS_DEFAULT_COMMIT 5          /* Seconds between two commits */
+
+/*
+ * Buffers a handle may dirty: one operation, or one step of a long one
+ * such as a truncate, which asks for more before each step.
+ */
+#define PNLFS_JOURNAL_CREDITS 64
 
-	__le32 nr_free_inodes;  /* Number of free inodes */
-	__le32 nr_free_blocks;  /* Number of free blocks */
+/* Inode store blocks zeroed at once, with the superblock in the handle */
+#define PNLFS_ISTORE_BATCH 16
 
-	char padding[4064];     /* Padding to match block size */
+/* Statistics of a mount, see stats.c */
+enum {
+	PNLFS_STAT_LOOKUP,              /* Names looked up in a directory */
+	PNLFS_STAT_LOOKUP_HIT,          /* ... answered by the name cache */
+	PNLFS_STAT_LOOKUP_MISS,         /* ... that read the directory */
+	PNLFS_STAT_BLOCKS_READ,         /* File blocks read */
+	PNLFS_STAT_BLOCKS_WRITTEN,      /* File blocks written back */
+	PNLFS_STAT_BALLOC,              /* Calls of pnlfs_new_blocks */
+	PNLFS_STAT_BALLOC_BLOCKS,       /* Blocks they allocated */
+	PNLFS_STAT_BGROUP_READ,         /* Groups of the block bitmap read */
+	PNLFS_STAT_IALLOC,              /* Inodes allocated */
+	PNLFS_STAT_IALLOC_SCANNED,      /* Bitmap words and bits looked at */
+	PNLFS_STAT_BITMAP_WRITES,       /* Bitmap groups written by commits */
+	PNLFS_STAT_SB_WRITES,           /* Superblock writes */
+	PNLFS_STAT_INODE_WRITES,        /* Calls of write_inode */
+	PNLFS_NR_STATS
+};
+
+enum {
+	PNLFS_HIST_LOOKUP,
+	PNLFS_HIST_CREATE,
+	PNLFS_HIST_READ,
+	PNLFS_HIST_WRITE,
+	PNLFS_HIST_SYNC,
+	PNLFS_NR_HISTS
+};
+
+#define PNLFS_HIST_BUCKETS 32           /* log2 of ns, the last one is >= 2s */
+
+struct pnlfs_stats {
+	u64 count[PNLFS_NR_STATS];
+	u64 hist[PNLFS_NR_HISTS][PNLFS_HIST_BUCKETS];
 };
 
 struct pnlfs_sb_info {
+	struct super_block *sb;
 	uint32_t nr_blocks;      /* Total number of blocks (incl sb & inodes) */
 	uint32_t nr_inodes;      /* Total number of inodes */
 
 	uint32_t nr_istore_blocks;/* Number of inode store blocks */
 	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
 	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+	uint32_t inode_size;     /* Bytes of an inode record */
+	uint32_t inodes_per_block;
+	journal_t *journal;             /* NULL if the image has none */
 
-	uint32_t nr_free_inodes;  /* Number of free inodes */
-	uint32_t nr_free_blocks;  /* Number of free blocks */
+	/* Inode store blocks before it are initialized */
+	struct mutex istore_lock;       /* Serializes the ones moving it */
+	u32 istore_init;
 
-	unsigned long *ifree_bitmap;
-	unsigned long *bfree_bitmap;
-};
+	struct percpu_counter free_inodes; /* Number of free inodes */
+	struct percpu_counter free_blocks; /* Number of free blocks */
+	struct percpu_counter dirty_blocks; /* Reserved by delayed writes */
+	u32 sb_free_inodes;             /* Free counts last written */
+	u32 sb_free_blocks;
+
+	/* Unwritten blocks written back, to mark written, see file.c */
+	spinlock_t conv_lock;           /* Protects conv_list */
+	struct buffer_head *conv_list;  /* Linked by b_private */
+	struct work_struct conv_work;
+
+	/* Writes the changed bitmap groups and the superblock */
+	struct delayed_work commit_work;
+	unsigned int commit_interval;   /* In seconds */
+
+	struct pnlfs_stats __percpu *stats;
+	struct kobject s_kobj;          /* /sys/fs/pnlfs/<dev> */
+	struct completion s_kobj_unregister;
+
+	struct pnlfs_bitmap ibitmap;    /* Free inodes */
+	struct pnlfs_bitmap bbitmap;    /* Free blocks */
 
-struct pnlfs_file_index_block {
-	__le32 blocks[PNLFS_BLOCK_SIZE >> 2];
+	/* Free extents of the groups of bbitmap read so far, see balloc.c */
+	spinlock_t balloc_lock;         /* Protects the trees and the cursor */
+	struct rb_root free_by_start;
+	struct rb_root free_by_len;
+	u32 balloc_cursor;              /* Block after the last window */
+	struct pnlfs_window __percpu *bwin;
+	u32 bload_cursor;               /* Groups before it have been read */
+
+	/* Words of ibitmap owned by a CPU */
+	spinlock_t ialloc_lock;         /* Protects iclaimed and the cursor */
+	unsigned long *iclaimed;
+	u32 ialloc_cursor;
+	struct pnlfs_window __percpu *iwin;
 };
 
-struct pnlfs_dir_block {
-	struct pnlfs_file {
-		__le32 inode;
-		char filename[PNLFS_FILENAME_LEN];
-	} files[PNLFS_MAX_DIR_ENTRIES];
+/* Blocks or inodes a CPU allocates from without the global locks */
+struct pnlfs_window {
+	spinlock_t lock;
+	u32 start;                      /* Next one to hand out */
+	u32 end;
 };
 
+static inline struct pnlfs_sb_info *PNLFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+/* Bytes of data an inline file can hold, 0 if the image has none */
+static inline u32 pnlfs_inline_size(struct super_block *sb)
+{
+	return PNLFS_SB(sb)->inode_size - sizeof(struct pnlfs_inode);
+}
+
+static inline void pnlfs_stat_add(struct super_block *sb, int stat, u64 n)
+{
+	this_cpu_add(PNLFS_SB(sb)->stats->count[stat], n);
+}
+
+static inline void pnlfs_stat_inc(struct super_block *sb, int stat)
+{
+	this_cpu_inc(PNLFS_SB(sb)->stats->count[stat]);
+}
+
+/* A record over a whole block of 64 KiB does not fit in rec_len */
+static inline int pnlfs_rec_len(struct pnlfs_dir_entry *de)
+{
+	unsigned int len = le16_to_cpu(de->rec_len);
+
+	return len == 0xffff ? PNLFS_MAX_BLOCK_SIZE : len;
+}
+
+static inline void pnlfs_set_rec_len(struct pnlfs_dir_entry *de, int len)
+{
+	de->rec_len = cpu_to_le16(min(len, 0xffff));
+}
+
+/* Debug messages, off unless the debug parameter of the module is set */
+DECLARE_STATIC_KEY_FALSE(pnlfs_debug_key);
+#define pnlfs_debug(fmt, ...)						\
+	do {								\
+		if (static_branch_unlikely(&pnlfs_debug_key))		\
+			pr_info(fmt, ##__VA_ARGS__);			\
+	} while (0)
+
 extern struct pnlfs_sb_info *sbi;
 extern struct inode_operations i_op;
 extern struct file_operations i_fop;
+extern struct file_operations d_fop;
+extern struct address_space_operations pnlfs_aops;
 
 
+extern void pnlfs_commit_kick(struct super_block *sb);
 extern struct inode *pnlfs_iget(struct super_block *sb, unsigned long ino);
+extern struct pnlfs_inode *pnlfs_raw_inode(struct super_block *sb,
+					   unsigned long ino,
+					   struct buffer_head **bhp);
+extern int pnlfs_istore_init(struct super_block *sb, unsigned long ino);
+extern struct buffer_head *pnlfs_new_meta_block(struct super_block *sb);
+extern void pnlfs_free_meta_block(struct super_block *sb, u32 bno);
+extern int pnlfs_get_block(struct inode *inode, sector_t iblock,
+			   struct buffer_head *bh_result, int create);
+extern void pnlfs_truncate_blocks(struct inode *inode);
+extern struct workqueue_struct *pnlfs_conv_wq;
+extern void pnlfs_conv_work(struct work_struct *work);
+
+/* bitmap.c */
+extern int pnlfs_bitmap_init(struct super_block *sb, struct pnlfs_bitmap *bm,
+			     u32 first, u32 nr_bits,
+			     void (*on_load)(struct super_block *, u32,
+					     struct buffer_head *));
+extern void pnlfs_bitmap_destroy(struct pnlfs_bitmap *bm);
+extern struct buffer_head *pnlfs_bitmap_load(struct super_block *sb,
+					     struct pnlfs_bitmap *bm,
+					     u32 group);
+extern u32 pnlfs_bitmap_nr_free(struct super_block *sb,
+				struct pnlfs_bitmap *bm, u32 group);
+extern u32 pnlfs_bitmap_find(struct pnlfs_bitmap *bm, u32 group, u32 start,
+			     u32 end);
+extern int pnlfs_bitmap_access(struct super_block *sb,
+			       struct pnlfs_bitmap *bm, u32 group);
+extern void pnlfs_bitmap_dirty(struct super_block *sb,
+			       struct pnlfs_bitmap *bm, u32 group);
+extern bool pnlfs_bitmap_take(struct pnlfs_bitmap *bm, u32 bit);
+extern int pnlfs_bitmap_set_range(struct super_block *sb,
+				  struct pnlfs_bitmap *bm, u32 start,
+				  u32 count, bool free);
+extern u32 pnlfs_bitmap_sync(struct pnlfs_bitmap *bm, int wait);
+
+/* balloc.c */
+extern u32 pnlfs_new_blocks(struct super_block *sb, u32 goal, u32 *count);
+extern void pnlfs_free_blocks(struct super_block *sb, u32 start, u32 count);
 extern int pnlfs_reserv_new_block(struct super_block *sb);
 extern int pnlfs_free_block(struct super_block *sb, int bno);
+extern unsigned long pnlfs_reserv_new_inode(struct super_block *sb);
+extern int pnlfs_free_inode(struct super_block *sb, unsigned long ino);
+extern int pnlfs_claim_blocks(struct super_block *sb, u32 count);
+extern void pnlfs_unclaim_blocks(struct super_block *sb, u32 count);
+extern int pnlfs_balloc_init(struct super_block *sb, u32 free_blocks,
+			     u32 free_inodes);
+extern void pnlfs_balloc_exit(struct super_block *sb);
+
+/* journal.c */
+extern int pnlfs_journal_load(struct super_block *sb, u32 start, u32 len);
+extern void pnlfs_journal_params(struct super_block *sb);
+extern void pnlfs_journal_destroy(struct super_block *sb);
+extern handle_t *pnlfs_journal_start(struct super_block *sb, int credits);
+extern int pnlfs_journal_stop(handle_t *handle);
+extern int pnlfs_journal_extend(struct super_block *sb, int credits,
+				struct rw_semaphore *sem);
+extern int pnlfs_journal_access(struct super_block *sb,
+				struct buffer_head *bh);
+extern void pnlfs_journal_dirty(struct super_block *sb,
+				struct buffer_head *bh);
+extern void pnlfs_journal_revoke(struct super_block *sb, u32 bno);
+extern void pnlfs_journal_mark_inode(struct inode *inode);
+extern int pnlfs_journal_commit(struct super_block *sb, int wait);
+extern int pnlfs_journal_sync_inode(struct inode *inode);
+
+/* delalloc.c */
+#define PNLFS_DA_MAX_RUN 2048           /* Longest run allocated at once */
+extern int pnlfs_da_get_block_prep(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create);
+extern u32 pnlfs_da_run(struct inode *inode, u32 iblock, u32 max);
+extern void pnlfs_da_unreserve(struct inode *inode, u32 iblock, u32 len);
+extern void pnlfs_da_invalidatepage(struct page *page, unsigned int offset,
+				    unsigned int length);
+
+/* inline.c */
+extern int pnlfs_inline_readpage(struct inode *inode, struct page *page);
+extern int pnlfs_inline_writepage(struct inode *inode, struct page *page);
+extern int pnlfs_inline_write_begin(struct address_space *mapping,
+				    unsigned flags, struct page **pagep);
+extern int pnlfs_inline_write_end(struct address_space *mapping, loff_t pos,
+				  unsigned copied, struct page *page);
+extern int pnlfs_inline_truncate(struct inode *inode, loff_t newsize);
+extern int pnlfs_inline_convert(struct inode *inode);
+
+/* extents.c */
+extern void pnlfs_ext_init_root(struct super_block *sb,
+				struct buffer_head *bh);
+extern int pnlfs_ext_get_block(struct inode *inode, sector_t iblock,
+			       struct buffer_head *bh_result, int create);
+extern int pnlfs_ext_remove(struct inode *inode, u32 first, u32 end);
+extern int pnlfs_ext_prealloc(struct inode *inode, u32 first, u32 end);
+extern int pnlfs_ext_convert(struct inode *inode, u32 first, u32 end);
+
+/*
+ * Position in a hashed directory: the hash of the next name, and its rank
+ * among the names of the same hash, which all live in one leaf.
+ */
+#define PNLFS_DX_RANK_BITS 30
+#define PNLFS_DX_POS(hash, rank)					\
+	((((loff_t) (hash) << PNLFS_DX_RANK_BITS) | (rank)) + 2)
+#define PNLFS_DX_POS_END PNLFS_DX_POS((u64) U32_MAX + 1, 0)
+
+/* dir.c */
+extern void pnlfs_dx_init_root(struct super_block *sb,
+			       struct buffer_head *bh);
+extern int pnlfs_dx_convert(struct inode *dir);
+extern int pnlfs_dx_lookup(struct inode *dir, const char *name, int len,
+			   unsigned long *ino);
+extern int pnlfs_dx_add(struct inode *dir, const char *name, int len,
+			unsigned long ino, umode_t mode);
+extern int pnlfs_dx_remove(struct inode *dir, const char *name, int len);
+extern int pnlfs_dx_iterate(struct inode *dir, struct dir_context *ctx);
+extern void pnlfs_dx_free(struct inode *dir);
+
+/* stats.c */
+extern void pnlfs_stat_latency(struct super_block *sb, int hist, u64 start);
+extern int pnlfs_stats_register(struct super_block *sb);
+extern void pnlfs_stats_unregister(struct super_block *sb);
+extern int pnlfs_stats_init(void);
+extern void pnlfs_stats_exit(void);
+
+/* dcache.c */
+extern int pnlfs_dcache_init(void);
+extern void pnlfs_dcache_exit(void);
+extern int pnlfs_dcache_lookup(struct inode *dir, const char *name, int len,
+			       unsigned long *ino, int *slot);
+extern int pnlfs_dcache_free_slot(struct inode *dir);
+extern void pnlfs_dcache_insert(struct inode *dir, const char *name, int len,
+				unsigned long ino, int slot);
+extern void pnlfs_dcache_remove(struct inode *dir, const char *name, int len);
+extern void pnlfs_dcache_drop(struct inode *dir);
 #endif	/* _PNLFS_H */
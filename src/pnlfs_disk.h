@@ -0,0 +1,233 @@
+#ifndef _PNLFS_DISK_H
+#define _PNLFS_DISK_H
+
+/*
+ * On-disk format of pnlfs, shared by the module, mkfs-pnlfs and libpnlfs.
+ * Everything is little endian but the journal, which belongs to jbd2.
+ */
+
+#include <linux/types.h>
+
+#define PNLFS_MAGIC           0x434F5746
+
+#define PNLFS_SB_BLOCK_NR              0
+
+#define PNLFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB, the default */
+#define PNLFS_MAX_BLOCK_SIZE   (1 << 16)  /* 64 KiB */
+#define PNLFS_MAX_FILESIZE     0xffffffffULL  /* filesize is 32 bits */
+#define PNLFS_FILENAME_LEN            28
+#define PNLFS_MAX_DIR_ENTRIES        128
+
+/*
+ * pnlFS partition layout
+ *
+ * +---------------+
+ * |  superblock   |  1 block
+ * +---------------+
+ * |  inode store  |  sb->nr_istore_blocks blocks
+ * +---------------+
+ * | ifree bitmap  |  sb->nr_ifree_blocks blocks
+ * +---------------+
+ * | bfree bitmap  |  sb->nr_bfree_blocks blocks
+ * +---------------+
+ * |    journal    |  sb->journal_len blocks, from sb->journal_start
+ * +---------------+
+ * |    data       |
+ * |      blocks   |  rest of the blocks
+ * +---------------+
+ *
+ * An inode record of the store is sb->inode_size bytes, a struct
+ * pnlfs_inode followed by the data of an inline file. Images without
+ * inode_size have 16 bytes records and no inline file. Images without
+ * journal_len have no journal, their metadata is written in place.
+ *
+ * The last sb->itable_unused blocks of the inode store were never written
+ * by mkfs and may hold anything. They are zeroed before an inode in them
+ * is first used, see pnlfs_istore_init().
+ */
+
+struct pnlfs_inode {
+	__le32 mode;		  /* File mode */
+	__le32 index_block;	  /* Block with list of blocks for this file */
+	__le32 filesize;	  /* File size in bytes */
+	union {
+		__le32 nr_used_blocks;  /* Number of blocks used by file */
+		__le32 nr_entries;     /* Number of files/dirs in directory */
+	};
+};
+
+/*
+ * The 16 high bits of the on-disk mode are not used by i_mode, they hold
+ * the flags of the inode.
+ */
+#define PNLFS_INODE_FL_MASK   0xffff0000
+#define PNLFS_INODE_EXTENTS   0x00010000  /* index_block is an extent tree */
+#define PNLFS_INODE_HTREE     0x00020000  /* index_block is a hashed dir */
+#define PNLFS_INODE_INLINE    0x00040000  /* Data is in the inode record */
+
+struct pnlfs_superblock {
+	__le32 magic;	        /* Magic number */
+
+	__le32 nr_blocks;       /* Total number of blocks (incl sb & inodes) */
+	__le32 nr_inodes;       /* Total number of inodes */
+
+	__le32 nr_istore_blocks;/* Number of inode store blocks */
+	__le32 nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	__le32 nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	__le32 nr_free_inodes;  /* Number of free inodes */
+	__le32 nr_free_blocks;  /* Number of free blocks */
+
+	__le32 inode_size;      /* Bytes of an inode record, 0 for 16 */
+
+	__le32 journal_start;   /* First block of the jbd2 journal */
+	__le32 journal_len;     /* Its number of blocks, 0 for none */
+
+	__le32 itable_unused;   /* Inode store blocks not initialized yet */
+
+	__le32 block_size;      /* Bytes of a block, 0 for 4096 */
+
+	__le32 state;           /* PNLFS_STATE_* */
+
+	char padding[4040];     /* Padding to 4 KiB, the smallest block */
+};
+
+/*
+ * A read-write mount clears PNLFS_STATE_CLEAN until it is unmounted,
+ * fsck.pnlfs sets it back once the image is consistent. Images from
+ * before the flag are never clean, they are checked once.
+ */
+#define PNLFS_STATE_CLEAN     0x00000001
+
+struct pnlfs_file_index_block {
+	__le32 blocks[PNLFS_MAX_BLOCK_SIZE >> 2]; /* block_size >> 2 used */
+};
+
+/*
+ * Extent tree. The root node is stored in the index block of the inode,
+ * the other nodes in blocks of their own. Leaves (depth 0) hold extents
+ * sorted by logical block, index nodes hold the first logical block
+ * covered by each child. The first child of an index node also covers
+ * every block before its key.
+ *
+ * The high bit of ee_len marks an unwritten extent: its blocks are
+ * allocated by fallocate but read as zeroes until they are written.
+ */
+#define PNLFS_EXT_MAGIC              0xE47E
+#define PNLFS_EXT_MAX_DEPTH               4
+#define PNLFS_EXT_MAX_LEN        0x7fffffff
+#define PNLFS_EXT_UNWRITTEN      0x80000000
+
+struct pnlfs_extent_header {
+	__le16 eh_magic;        /* PNLFS_EXT_MAGIC */
+	__le16 eh_entries;      /* Number of valid entries */
+	__le16 eh_max;          /* Capacity of the node */
+	__le16 eh_depth;        /* 0 for a leaf */
+	__le32 eh_reserved;
+};
+
+struct pnlfs_extent {
+	__le32 ee_block;        /* First logical block */
+	__le32 ee_start;        /* First physical block */
+	__le32 ee_len;          /* Number of blocks */
+};
+
+struct pnlfs_extent_idx {
+	__le32 ei_block;        /* First logical block of the child */
+	__le32 ei_leaf;         /* Block of the child node */
+	__le32 ei_unused;
+};
+
+/* Entries of a node of size bytes */
+#define PNLFS_EXT_PER_BLOCK(size) (((size) -				\
+				    sizeof(struct pnlfs_extent_header)) / \
+				   sizeof(struct pnlfs_extent))
+
+struct pnlfs_dir_block {
+	struct pnlfs_file {
+		__le32 inode;
+		char filename[PNLFS_FILENAME_LEN];
+	} files[PNLFS_MAX_DIR_ENTRIES];
+};
+
+/*
+ * Hashed directories. The index block of the directory is the root of a
+ * tree of (hash, block) pairs sorted by hash, each one covering the names
+ * whose hash is between its own and the next one; the first pair of a
+ * node also covers every hash below it. dx_levels in the root counts the
+ * index levels under it. The tree leads to leaf blocks made of variable
+ * length entries, as in ext2.
+ */
+#define PNLFS_DX_MAGIC               0xD1C7
+#define PNLFS_DX_MAX_LEVELS               2
+#define PNLFS_NAME_LEN                  255
+
+struct pnlfs_dx_header {
+	__le16 dx_magic;        /* PNLFS_DX_MAGIC */
+	__le16 dx_count;        /* Number of entries in use */
+	__le16 dx_limit;        /* Capacity of the node */
+	__le16 dx_levels;       /* Index levels below the root */
+	__le32 dx_reserved;
+};
+
+struct pnlfs_dx_entry {
+	__le32 hash;            /* Lowest hash of the child */
+	__le32 block;           /* Block of the child */
+};
+
+#define PNLFS_DX_LIMIT(size) (((size) -					\
+			       sizeof(struct pnlfs_dx_header)) /	\
+			      sizeof(struct pnlfs_dx_entry))
+
+struct pnlfs_dir_entry {
+	__le32 inode;           /* Inode number, 0 for an unused record */
+	__le16 rec_len;         /* Length of the record */
+	__u8 name_len;
+	__u8 file_type;         /* DT_* type of the inode */
+	char name[];            /* Not NUL terminated */
+};
+
+#define PNLFS_DIR_REC_LEN(len) (((len) + 8 + 3) & ~3)
+
+/* FNV-1a, the hash of the names must not change from one host to another */
+static inline __u32 pnlfs_dirhash(const char *name, int len)
+{
+	__u32 hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#ifndef __KERNEL__
+/*
+ * Superblock of a jbd2 journal, in its first block. Big endian, only the
+ * fields pnlfs uses are named. The module has its own in linux/jbd2.h.
+ */
+#define JBD2_MAGIC_NUMBER     0xc03b3998
+#define JBD2_SUPERBLOCK_V2             4
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD2_MIN_JOURNAL_BLOCKS     1024
+
+struct jbd2_superblock {
+	__be32 h_magic;
+	__be32 h_blocktype;
+	__be32 h_sequence;
+	__be32 s_blocksize;
+	__be32 s_maxlen;        /* Blocks of the journal */
+	__be32 s_first;         /* First block of the log */
+	__be32 s_sequence;      /* First transaction expected */
+	__be32 s_start;         /* Start of the log, 0 when it is clean */
+	__be32 s_errno;
+	__be32 s_feature_compat;
+	__be32 s_feature_incompat;
+	__be32 s_feature_ro_compat;
+	__u8 s_uuid[16];
+	__be32 s_nr_users;
+	char padding[PNLFS_BLOCK_SIZE - 0x44];
+};
+#endif
+
+#endif /* _PNLFS_DISK_H */
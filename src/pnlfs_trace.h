@@ -0,0 +1,264 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pnlfs
+
+#if !defined(_PNLFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PNLFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Events of pnlfs, in /sys/kernel/debug/tracing/events/pnlfs. They cost
+ * a static branch when they are off.
+ */
+
+TRACE_EVENT(pnlfs_iget,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(umode_t, mode)
+		__field(loff_t, size)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->mode = inode->i_mode;
+		__entry->size = inode->i_size;
+	),
+	TP_printk("dev %d,%d ino %lu mode 0%o size %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->mode, __entry->size)
+);
+
+DECLARE_EVENT_CLASS(pnlfs_dirent_class,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino),
+	TP_ARGS(dir, dentry, ino),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino)
+);
+
+/* ino is 0 when lookup finds nothing */
+DEFINE_EVENT(pnlfs_dirent_class, pnlfs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(pnlfs_dirent_class, pnlfs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(pnlfs_dirent_class, pnlfs_unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+/* read_iter and write_iter, latency is in nanoseconds */
+DECLARE_EVENT_CLASS(pnlfs_rw_class,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret,
+		 u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld count %zu ret %zd latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->count, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(pnlfs_rw_class, pnlfs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret,
+		 u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency)
+);
+
+DEFINE_EVENT(pnlfs_rw_class, pnlfs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret,
+		 u64 latency),
+	TP_ARGS(inode, pos, count, ret, latency)
+);
+
+TRACE_EVENT(pnlfs_get_block,
+	TP_PROTO(struct inode *inode, sector_t iblock,
+		 struct buffer_head *bh, int create, int ret),
+	TP_ARGS(inode, iblock, bh, create, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, iblock)
+		__field(sector_t, pblock)
+		__field(size_t, size)
+		__field(int, create)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->iblock = iblock;
+		__entry->pblock = buffer_mapped(bh) ? bh->b_blocknr : 0;
+		__entry->size = bh->b_size;
+		__entry->create = create;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu iblock %llu pblock %llu size %zu "
+		  "create %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long) __entry->iblock,
+		  (unsigned long long) __entry->pblock, __entry->size,
+		  __entry->create, __entry->ret)
+);
+
+TRACE_EVENT(pnlfs_alloc_blocks,
+	TP_PROTO(struct super_block *sb, u32 goal, u32 start, u32 count),
+	TP_ARGS(sb, goal, start, count),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u32, goal)
+		__field(u32, start)
+		__field(u32, count)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->start = start;
+		__entry->count = count;
+	),
+	TP_printk("dev %d,%d goal %u start %u count %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal,
+		  __entry->start, __entry->count)
+);
+
+TRACE_EVENT(pnlfs_free_blocks,
+	TP_PROTO(struct super_block *sb, u32 start, u32 count),
+	TP_ARGS(sb, start, count),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u32, start)
+		__field(u32, count)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->start = start;
+		__entry->count = count;
+	),
+	TP_printk("dev %d,%d start %u count %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->start,
+		  __entry->count)
+);
+
+DECLARE_EVENT_CLASS(pnlfs_ino_class,
+	TP_PROTO(struct super_block *sb, unsigned long ino),
+	TP_ARGS(sb, ino),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+	),
+	TP_printk("dev %d,%d ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino)
+);
+
+DEFINE_EVENT(pnlfs_ino_class, pnlfs_alloc_ino,
+	TP_PROTO(struct super_block *sb, unsigned long ino),
+	TP_ARGS(sb, ino)
+);
+
+DEFINE_EVENT(pnlfs_ino_class, pnlfs_free_ino,
+	TP_PROTO(struct super_block *sb, unsigned long ino),
+	TP_ARGS(sb, ino)
+);
+
+TRACE_EVENT(pnlfs_write_inode,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, size)
+		__field(blkcnt_t, blocks)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->size = inode->i_size;
+		__entry->blocks = inode->i_blocks;
+	),
+	TP_printk("dev %d,%d ino %lu size %lld blocks %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->size, (unsigned long long) __entry->blocks)
+);
+
+TRACE_EVENT(pnlfs_evict_inode,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(unsigned int, nlink)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nlink = inode->i_nlink;
+	),
+	TP_printk("dev %d,%d ino %lu nlink %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->nlink)
+);
+
+TRACE_EVENT(pnlfs_sync_fs,
+	TP_PROTO(struct super_block *sb, int wait, u64 latency),
+	TP_ARGS(sb, wait, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, wait)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->wait = wait;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d,%d wait %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->wait,
+		  __entry->latency)
+);
+
+#endif /* _PNLFS_TRACE_H */
+
+/* The header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pnlfs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,184 @@
+#include "pnlfs.h"
+
+/*
+ * Statistics of a mount, in /sys/fs/pnlfs/<dev>/. Counters and latency
+ * histograms are per CPU and only summed when the files are read.
+ *
+ * stats holds one "name value" line per counter. latency holds one line
+ * per operation, with the number of calls whose latency in nanoseconds
+ * is in [2^i, 2^(i+1)) for each bucket i.
+ */
+static const char * const pnlfs_stat_names[PNLFS_NR_STATS] = {
+	[PNLFS_STAT_LOOKUP] = "lookups",
+	[PNLFS_STAT_LOOKUP_HIT] = "lookup_hits",
+	[PNLFS_STAT_LOOKUP_MISS] = "lookup_misses",
+	[PNLFS_STAT_BLOCKS_READ] = "blocks_read",
+	[PNLFS_STAT_BLOCKS_WRITTEN] = "blocks_written",
+	[PNLFS_STAT_BALLOC] = "balloc_calls",
+	[PNLFS_STAT_BALLOC_BLOCKS] = "balloc_blocks",
+	[PNLFS_STAT_BGROUP_READ] = "bgroup_reads",
+	[PNLFS_STAT_IALLOC] = "ialloc_calls",
+	[PNLFS_STAT_IALLOC_SCANNED] = "ialloc_scanned",
+	[PNLFS_STAT_BITMAP_WRITES] = "bitmap_writes",
+	[PNLFS_STAT_SB_WRITES] = "sb_writes",
+	[PNLFS_STAT_INODE_WRITES] = "inode_writes",
+};
+
+static const char * const pnlfs_hist_names[PNLFS_NR_HISTS] = {
+	[PNLFS_HIST_LOOKUP] = "lookup",
+	[PNLFS_HIST_CREATE] = "create",
+	[PNLFS_HIST_READ] = "read",
+	[PNLFS_HIST_WRITE] = "write",
+	[PNLFS_HIST_SYNC] = "sync",
+};
+
+static struct kset *pnlfs_kset;
+
+void pnlfs_stat_latency(struct super_block *sb, int hist, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	int bucket = ns ? min_t(int, ilog2(ns), PNLFS_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(PNLFS_SB(sb)->stats->hist[hist][bucket]);
+}
+
+static u64 pnlfs_stat_sum(struct pnlfs_sb_info *sbi, int stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[stat];
+	return sum;
+}
+
+static ssize_t pnlfs_stats_show(struct pnlfs_sb_info *sbi, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < PNLFS_NR_STATS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+				 pnlfs_stat_names[i], pnlfs_stat_sum(sbi, i));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "free_blocks %lld\n",
+			 percpu_counter_sum_positive(&sbi->free_blocks));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "free_inodes %lld\n",
+			 percpu_counter_sum_positive(&sbi->free_inodes));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "dirty_blocks %lld\n",
+			 percpu_counter_sum_positive(&sbi->dirty_blocks));
+	return len;
+}
+
+static ssize_t pnlfs_latency_show(struct pnlfs_sb_info *sbi, char *buf)
+{
+	ssize_t len = 0;
+	u64 n;
+	int i, b, cpu;
+
+	for (i = 0; i < PNLFS_NR_HISTS; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s",
+				 pnlfs_hist_names[i]);
+		for (b = 0; b < PNLFS_HIST_BUCKETS; b++) {
+			n = 0;
+			for_each_possible_cpu(cpu)
+				n += per_cpu_ptr(sbi->stats, cpu)->hist[i][b];
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu", n);
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	return len;
+}
+
+struct pnlfs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct pnlfs_sb_info *sbi, char *buf);
+};
+
+static struct pnlfs_attr pnlfs_attr_stats = {
+	.attr = { .name = "stats", .mode = 0444 },
+	.show = pnlfs_stats_show,
+};
+
+static struct pnlfs_attr pnlfs_attr_latency = {
+	.attr = { .name = "latency", .mode = 0444 },
+	.show = pnlfs_latency_show,
+};
+
+static struct attribute *pnlfs_attrs[] = {
+	&pnlfs_attr_stats.attr,
+	&pnlfs_attr_latency.attr,
+	NULL,
+};
+
+static ssize_t pnlfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			       char *buf)
+{
+	struct pnlfs_sb_info *sbi = container_of(kobj, struct pnlfs_sb_info,
+						 s_kobj);
+	struct pnlfs_attr *a = container_of(attr, struct pnlfs_attr, attr);
+
+	return a->show(sbi, buf);
+}
+
+static const struct sysfs_ops pnlfs_attr_ops = {
+	.show = pnlfs_attr_show,
+};
+
+/* put_super waits for the last reference before freeing sbi */
+static void pnlfs_sb_release(struct kobject *kobj)
+{
+	struct pnlfs_sb_info *sbi = container_of(kobj, struct pnlfs_sb_info,
+						 s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type pnlfs_sb_ktype = {
+	.default_attrs = pnlfs_attrs,
+	.sysfs_ops = &pnlfs_attr_ops,
+	.release = pnlfs_sb_release,
+};
+
+int pnlfs_stats_register(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+	int err;
+
+	sbi->stats = alloc_percpu(struct pnlfs_stats);
+	if (!sbi->stats)
+		return -ENOMEM;
+
+	init_completion(&sbi->s_kobj_unregister);
+	sbi->s_kobj.kset = pnlfs_kset;
+	err = kobject_init_and_add(&sbi->s_kobj, &pnlfs_sb_ktype, NULL,
+				   "%s", sb->s_id);
+	if (err) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+		free_percpu(sbi->stats);
+	}
+	return err;
+}
+
+void pnlfs_stats_unregister(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = PNLFS_SB(sb);
+
+	kobject_del(&sbi->s_kobj);
+	kobject_put(&sbi->s_kobj);
+	wait_for_completion(&sbi->s_kobj_unregister);
+	free_percpu(sbi->stats);
+}
+
+int __init pnlfs_stats_init(void)
+{
+	pnlfs_kset = kset_create_and_add("pnlfs", NULL, fs_kobj);
+	if (!pnlfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void pnlfs_stats_exit(void)
+{
+	kset_unregister(pnlfs_kset);
+}
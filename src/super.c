@@ -1,23 +1,140 @@
 #include "pnlfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "pnlfs_trace.h"
+
 MODULE_DESCRIPTION("pnlfs");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Leplus");
 
 struct pnlfs_sb_info *sbi;
 
+/* pnlfs_debug() prints nothing unless the debug parameter is set */
+DEFINE_STATIC_KEY_FALSE(pnlfs_debug_key);
+static bool pnlfs_debug_param;
+
+static int pnlfs_set_debug(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+
+	if (err)
+		return err;
+	if (pnlfs_debug_param)
+		static_branch_enable(&pnlfs_debug_key);
+	else
+		static_branch_disable(&pnlfs_debug_key);
+	return 0;
+}
+
+static const struct kernel_param_ops pnlfs_debug_ops = {
+	.set = pnlfs_set_debug,
+	.get = param_get_bool,
+};
+module_param_cb(debug, &pnlfs_debug_ops, &pnlfs_debug_param, 0644);
+MODULE_PARM_DESC(debug, "Log the operations in the kernel log");
+
+/*
+ * Set or clear PNLFS_STATE_CLEAN in the superblock and wait for it to be
+ * on disk. With a journal, a crash while mounted replays a cleared flag.
+ */
+static int pnlfs_set_clean(struct super_block *sb, bool clean)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct pnlfs_superblock *superblk;
+	struct buffer_head *bh;
+	handle_t *handle;
+	u32 state;
+	int err, err2;
+
+	handle = pnlfs_journal_start(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	bh = sb_bread(sb, PNLFS_SB_BLOCK_NR);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = pnlfs_journal_access(sb, bh);
+	if (!err) {
+		superblk = (struct pnlfs_superblock *) bh->b_data;
+		state = le32_to_cpu(superblk->state);
+		if (clean)
+			state |= PNLFS_STATE_CLEAN;
+		else
+			state &= ~PNLFS_STATE_CLEAN;
+		superblk->state = cpu_to_le32(state);
+		pnlfs_journal_dirty(sb, bh);
+		if (!sbi->journal)
+			err = sync_dirty_buffer(bh);
+		pnlfs_stat_inc(sb, PNLFS_STAT_SB_WRITES);
+	}
+	brelse(bh);
+out:
+	err2 = pnlfs_journal_stop(handle);
+	if (err || err2)
+		return err ? err : err2;
+	if (sbi->journal)
+		return pnlfs_journal_commit(sb, 1);
+	return 0;
+}
+
 /* That function undo all the change made by fill_super function */
 static void pnlfs_put_super(struct super_block *sb)
 {
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 	sbi = sb->s_fs_info;
-	if (sbi->bfree_bitmap)
-		kfree(sbi->bfree_bitmap);
-	if (sbi->ifree_bitmap)
-		kfree(sbi->ifree_bitmap);
+	/* sync_fs was called before, there is nothing left to write */
+	cancel_delayed_work_sync(&sbi->commit_work);
+	/* The writeback waited for the blocks to mark written */
+	flush_work(&sbi->conv_work);
+	if (!(sb->s_flags & MS_RDONLY) && pnlfs_set_clean(sb, true))
+		pr_err("%s : cannot mark the filesystem clean\n", __func__);
+	pnlfs_journal_destroy(sb);
+	pnlfs_stats_unregister(sb);
+	pnlfs_balloc_exit(sb);
 	if (sbi)
 		kfree(sb->s_fs_info);
-	pr_info("%s End\n",  __func__);
+	pnlfs_debug("%s End\n",  __func__);
+}
+
+static struct kmem_cache *pnlfs_inode_cachep;
+
+/*
+ * Slab constructor, called once per object and not on each allocation.
+ * An inode is freed with its lists empty, no directory cache and no
+ * delayed block, so what is set here still holds when it is reused.
+ */
+static void pnlfs_init_once(void *foo)
+{
+	struct pnlfs_inode_info *i = foo;
+
+	inode_init_once(&i->vfs_inode);
+	init_rwsem(&i->map_sem);
+	RCU_INIT_POINTER(i->dcache, NULL);
+	spin_lock_init(&i->dcache_lock);
+	INIT_LIST_HEAD(&i->dcache_lru);
+	spin_lock_init(&i->da_lock);
+	INIT_LIST_HEAD(&i->da_ranges);
+	i->da_reserved = 0;
+}
+
+static int __init pnlfs_init_inodecache(void)
+{
+	pnlfs_inode_cachep = kmem_cache_create("pnlfs_inode_cache",
+					       sizeof(struct pnlfs_inode_info),
+					       0, SLAB_RECLAIM_ACCOUNT |
+					       SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+					       pnlfs_init_once);
+	if (!pnlfs_inode_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+static void pnlfs_destroy_inodecache(void)
+{
+	/* Wait for the inodes freed by pnlfs_i_callback */
+	rcu_barrier();
+	kmem_cache_destroy(pnlfs_inode_cachep);
 }
 
 /* Inode constructor */
@@ -25,134 +142,306 @@ static struct inode *pnlfs_alloc_inode(struct super_block *sb)
 {
 	struct pnlfs_inode_info *i;
 
-	pr_info("%s Start\n",  __func__);
-	i = kmalloc(sizeof(*i), GFP_KERNEL);
+	pnlfs_debug("%s Start\n",  __func__);
+	i = kmem_cache_alloc(pnlfs_inode_cachep, GFP_KERNEL);
 	if (!i)
-		return ERR_PTR(-ENOMEM);
-	inode_init_once(&i->vfs_inode);
+		return NULL;
+	i->sync_tid = 0;
 	return &i->vfs_inode;
-	pr_info("%s End\n",  __func__);
 }
 
-/* Inode destructor */
+static void pnlfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(pnlfs_inode_cachep, PNLFS_I(inode));
+}
+
+/* Inode destructor, path walks under RCU may still look at the inode */
 static void pnlfs_destroy_inode(struct inode *i)
 {
-	struct pnlfs_inode_info * pnlfs_i;
-	pr_info("%s Start\n",  __func__);
-	pnlfs_i = container_of(i, struct pnlfs_inode_info, vfs_inode);
-	kfree(pnlfs_i);
-	pr_info("%s End\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
+	call_rcu(&i->i_rcu, pnlfs_i_callback);
 }
 
-int pnlfs_sync_fs(struct super_block *sb, int wait)
+/* Release the on-disk resources of an inode without any link left */
+static void pnlfs_evict_inode(struct inode *inode)
 {
-	struct buffer_head *bh, *bitmap_bh;
-	struct pnlfs_superblock *superblk;
-	unsigned long *bitmap;
-	int i, j;
+	struct pnlfs_inode_info *inode_info = PNLFS_I(inode);
+	handle_t *handle;
+
+	trace_pnlfs_evict_inode(inode);
+	truncate_inode_pages_final(&inode->i_data);
+	/* Blocks past the end of file were left delayed by truncate */
+	if (inode_info->da_reserved)
+		pnlfs_da_unreserve(inode, 0, U32_MAX);
+	if (S_ISDIR(inode->i_mode))
+		pnlfs_dcache_drop(inode);
+	if (!inode->i_nlink && !is_bad_inode(inode)) {
+		handle = pnlfs_journal_start(inode->i_sb,
+					     PNLFS_JOURNAL_CREDITS);
+		if (IS_ERR(handle)) {
+			pr_err("%s : inode %lu is lost\n", __func__,
+			       inode->i_ino);
+			goto out;
+		}
+		if (S_ISREG(inode->i_mode)) {
+			inode->i_size = 0;
+			pnlfs_truncate_blocks(inode);
+		} else if (inode_info->flags & PNLFS_INODE_HTREE) {
+			pnlfs_dx_free(inode);
+		}
+		if (!(inode_info->flags & PNLFS_INODE_INLINE))
+			pnlfs_free_meta_block(inode->i_sb,
+					      inode_info->index_block);
+		pnlfs_free_inode(inode->i_sb, inode->i_ino);
+		pnlfs_journal_stop(handle);
+	}
+out:
+	clear_inode(inode);
+}
 
-	pr_info("%s Start\n",  __func__);
+/* Update the free counts of the superblock if they changed */
+static int pnlfs_commit_counts(struct super_block *sb, int wait)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	struct pnlfs_superblock *superblk;
+	u32 free_inodes, free_blocks;
+	int err;
 
-	sbi = sb->s_fs_info;
+	free_inodes = percpu_counter_sum_positive(&sbi->free_inodes);
+	free_blocks = percpu_counter_sum_positive(&sbi->free_blocks);
+	if (free_inodes == sbi->sb_free_inodes &&
+	    free_blocks == sbi->sb_free_blocks)
+		return 0;
 
-	if (!(bh=sb_bread(sb,0)))
+	if (!(bh = sb_bread(sb, PNLFS_SB_BLOCK_NR)))
 		return -EIO;
+	err = pnlfs_journal_access(sb, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
+	superblk = (struct pnlfs_superblock *) bh->b_data;
+	superblk->nr_free_inodes = cpu_to_le32(free_inodes);
+	superblk->nr_free_blocks = cpu_to_le32(free_blocks);
+	pnlfs_journal_dirty(sb, bh);
+	if (!sbi->journal) {
+		if (wait)
+			sync_dirty_buffer(bh);
+		else
+			write_dirty_buffer(bh, 0);
+	}
+	brelse(bh);
+	pnlfs_stat_inc(sb, PNLFS_STAT_SB_WRITES);
 
-	superblk=(struct pnlfs_superblock *) bh->b_data;
-	superblk->nr_blocks = le32_to_cpu(sbi->nr_blocks);
-	superblk->nr_inodes = le32_to_cpu(sbi->nr_inodes);
-	superblk->nr_istore_blocks = le32_to_cpu(sbi->nr_istore_blocks);
-	superblk->nr_ifree_blocks = le32_to_cpu(sbi->nr_ifree_blocks);
-	superblk->nr_bfree_blocks = le32_to_cpu(sbi->nr_bfree_blocks);
-	superblk->nr_free_blocks = le32_to_cpu(sbi->nr_free_blocks);
-	superblk->nr_free_inodes = le32_to_cpu(sbi->nr_free_inodes);
+	sbi->sb_free_inodes = free_inodes;
+	sbi->sb_free_blocks = free_blocks;
+	return 0;
+}
 
-	pr_info("%s PNLFS Information on superblock \n"
-		"\tmagic		= %x\n"
-		"\tnr_block 		= %d\n"
-		"\tnr_inodes 		= %d\n"
-		"\tnr_istore_blocks 	= %d\n"
-		"\tnr_ifree_blocks 	= %d\n"
-		"\tnr_bfree_blocks 	= %d\n"
-		"\tnr_free_inodes 	= %d\n"
-		"\tnr_free_blocks 	= %d\n",
-		__func__, le32_to_cpu(superblk->magic),
-		superblk->nr_blocks, sbi->nr_inodes,
-		superblk->nr_istore_blocks, sbi->nr_ifree_blocks,
-		superblk->nr_bfree_blocks, sbi->nr_free_inodes,
-		superblk->nr_free_blocks);
-
-	/* Read the block containing ifree bitmap */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		bitmap_bh = sb_bread(sb, 1 + sbi->nr_istore_blocks + i);
-		if (!bitmap_bh) {
-			return -EIO;
-		}
-		/* Initiate the bitmap of free inodes  */
-		bitmap = (unsigned long *) bitmap_bh->b_data;
-		for (j = 0; j < 512; j++) {
-			sbi->ifree_bitmap[j] = le64_to_cpu(bitmap[j]);
-		}
+/*
+ * Write the bitmap groups changed since the last commit, and the
+ * superblock if its free counts changed, waiting for them if wait.
+ * With a journal, the groups are already in the running transaction:
+ * the counts join them and the transaction is committed.
+ */
+static int pnlfs_commit(struct super_block *sb, int wait)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	handle_t *handle;
+	int err, err2;
+
+	if (!sbi->journal)
+		pnlfs_stat_add(sb, PNLFS_STAT_BITMAP_WRITES,
+			       pnlfs_bitmap_sync(&sbi->ibitmap, wait) +
+			       pnlfs_bitmap_sync(&sbi->bbitmap, wait));
+
+	handle = pnlfs_journal_start(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = pnlfs_commit_counts(sb, wait);
+	err2 = pnlfs_journal_stop(handle);
+	if (err || err2)
+		return err ? err : err2;
+	if (sbi->journal)
+		return pnlfs_journal_commit(sb, wait);
+	return 0;
+}
 
-		brelse(bitmap_bh);
-	}
+static void pnlfs_commit_work(struct work_struct *work)
+{
+	struct pnlfs_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct pnlfs_sb_info,
+						 commit_work);
 
-	/* Read the block containing blocks bitmap */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		bitmap_bh = sb_bread(sb,1 + sbi->nr_bfree_blocks
-					+ sbi->nr_istore_blocks + i);
-		if (!bitmap_bh) {
-			return -EIO;
-		}
-		/* Initiate the bitmap of free blocks  */
-		bitmap = (unsigned long *) bitmap_bh->b_data;
-		for (j = 0; j < 512; j++) {
-			sbi->bfree_bitmap[j] = le64_to_cpu(bitmap[j]);
+	pnlfs_commit(sbi->sb, 0);
+}
+
+/* Something changed in the bitmaps, make sure a commit will write it */
+void pnlfs_commit_kick(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+
+	if (!delayed_work_pending(&sbi->commit_work))
+		queue_delayed_work(system_long_wq, &sbi->commit_work,
+				   READ_ONCE(sbi->commit_interval) * HZ);
+}
+
+int pnlfs_sync_fs(struct super_block *sb, int wait)
+{
+	u64 start = ktime_get_ns();
+	int err;
+
+	pnlfs_debug("%s Start\n",  __func__);
+	err = pnlfs_commit(sb, wait);
+	pnlfs_stat_latency(sb, PNLFS_HIST_SYNC, start);
+	if (trace_pnlfs_sync_fs_enabled())
+		trace_pnlfs_sync_fs(sb, wait, ktime_get_ns() - start);
+	return err;
+}
+
+enum { Opt_commit, Opt_err };
+
+static const match_table_t pnlfs_tokens = {
+	{Opt_commit, "commit=%u"},
+	{Opt_err, NULL}
+};
+
+/* Parse the mount options, false if one is wrong */
+static bool pnlfs_parse_options(char *options, struct pnlfs_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int token, n;
+
+	if (!options)
+		return true;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, pnlfs_tokens, args);
+		switch (token) {
+		case Opt_commit:
+			if (match_int(&args[0], &n) || n < 0)
+				return false;
+			sbi->commit_interval = n ? n : PNLFS_DEFAULT_COMMIT;
+			break;
+		default:
+			pr_err("%s Unknown option \"%s\"\n",  __func__, p);
+			return false;
 		}
+	}
+	return true;
+}
+
+static int pnlfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct pnlfs_sb_info *sbi = root->d_sb->s_fs_info;
+
+	if (sbi->commit_interval != PNLFS_DEFAULT_COMMIT)
+		seq_printf(m, ",commit=%u", sbi->commit_interval);
+	return 0;
+}
+
+static int pnlfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	struct pnlfs_sb_info *sbi = sb->s_fs_info;
+	unsigned int old = sbi->commit_interval;
 
-		brelse(bitmap_bh);
+	sync_filesystem(sb);
+	if (!pnlfs_parse_options(data, sbi)) {
+		sbi->commit_interval = old;
+		return -EINVAL;
 	}
-	brelse(bh);
+	pnlfs_journal_params(sb);
+	/* Read-only, nothing can change until the next remount */
+	if ((*flags & MS_RDONLY) != (sb->s_flags & MS_RDONLY))
+		return pnlfs_set_clean(sb, *flags & MS_RDONLY);
 	return 0;
 }
 
-static
-int pnlfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+/* Copy the inode in its record, whose buffer is given back in bhp */
+static int pnlfs_update_inode(struct inode *inode, struct buffer_head **bhp)
 {
 	struct pnlfs_inode_info *inode_info;
 	struct buffer_head *bh;
 	struct pnlfs_inode *i;
-	int index;
-	unsigned long bno;
+	int err;
 
-	pr_info("%s Start writing on inode %lu\n",  __func__, inode->i_ino);
+	if (!S_ISDIR(inode->i_mode) && !S_ISREG(inode->i_mode))
+		return -EFAULT;
 
 	inode_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	bno = inode->i_ino;
-	index = do_div(bno, PNLFS_INODES_PER_BLOCK);
-	
-	if (!(bh = sb_bread(inode->i_sb, bno + 1)))
-		return -EIO;
+	i = pnlfs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(i))
+		return PTR_ERR(i);
+	err = pnlfs_journal_access(inode->i_sb, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
 
-	i = (struct pnlfs_inode *) bh->b_data;
-	i[index].mode = cpu_to_le32(inode->i_mode);
-	i[index].index_block = cpu_to_le32(inode_info->index_block);
-	i[index].filesize = cpu_to_le32(inode->i_size);
+	i->mode = cpu_to_le32(inode->i_mode | inode_info->flags);
+	i->index_block = cpu_to_le32(inode_info->index_block);
+	i->filesize = cpu_to_le32(inode->i_size);
 
-	if (S_ISDIR(inode->i_mode)){
-		i[index].nr_entries = cpu_to_le32(inode_info->nr_entries);
-	}
-	else if (S_ISREG(inode->i_mode)){
-		i[index].nr_used_blocks = cpu_to_le32(inode->i_blocks);
-	}
-	else{	
+	if (S_ISDIR(inode->i_mode))
+		i->nr_entries = cpu_to_le32(inode_info->nr_entries);
+	else
+		i->nr_used_blocks = cpu_to_le32(inode->i_blocks);
+	pnlfs_journal_dirty(inode->i_sb, bh);
+	*bhp = bh;
+	return 0;
+}
+
+/*
+ * With a journal, the record follows each change of the inode in the
+ * transaction of the operation which made it.
+ */
+static void pnlfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct buffer_head *bh;
+	handle_t *handle;
+
+	if (!PNLFS_SB(inode->i_sb)->journal)
+		return;
+	handle = pnlfs_journal_start(inode->i_sb, 1);
+	if (IS_ERR(handle))
+		return;
+	if (!pnlfs_update_inode(inode, &bh))
 		brelse(bh);
-		return -EFAULT;
+	pnlfs_journal_mark_inode(inode);
+	pnlfs_journal_stop(handle);
+}
+
+static
+int pnlfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct buffer_head *bh;
+	int err;
+
+	pnlfs_debug("%s Start writing on inode %lu\n",  __func__, inode->i_ino);
+	trace_pnlfs_write_inode(inode);
+	pnlfs_stat_inc(inode->i_sb, PNLFS_STAT_INODE_WRITES);
+
+	/* The record is journaled already, sync(2) commits in sync_fs */
+	if (PNLFS_SB(inode->i_sb)->journal) {
+		if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+			return 0;
+		return pnlfs_journal_sync_inode(inode);
 	}
-	mark_buffer_dirty(bh);
+
+	err = pnlfs_update_inode(inode, &bh);
+	if (err)
+		return err;
+	/* fsync waits for the record, it holds the data of inline files */
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh);
 	brelse(bh);
 
-	pr_info("%s End\n",  __func__);
+	pnlfs_debug("%s End\n",  __func__);
 	return 0;
 }
 
@@ -161,24 +450,29 @@ struct super_operations pnlfs_op = {
 	.put_super = pnlfs_put_super,
 	.alloc_inode = pnlfs_alloc_inode,
 	.destroy_inode = pnlfs_destroy_inode,
+	.dirty_inode = pnlfs_dirty_inode,
 	.write_inode = pnlfs_write_inode,
+	.evict_inode = pnlfs_evict_inode,
 	.sync_fs = pnlfs_sync_fs,
+	.remount_fs = pnlfs_remount_fs,
+	.show_options = pnlfs_show_options,
 };
 
 /* CallBack called during mount, fill the super block */
 static int pnlfs_fill_super(struct super_block *sb, void *data, int flags)
 {
 	struct inode *root;
-	struct buffer_head *bh, *bitmap_bh;
+	struct buffer_head *bh;
 	struct pnlfs_superblock *tmp_sb;
-	unsigned long *bitmap;
-	int i, j, err;
+	u32 block_size, state;
+	int err;
 
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 
 	/* Part 1 of the subject : Init the struct super_block */
 	sb->s_magic = PNLFS_MAGIC;
-	sb->s_blocksize = PNLFS_BLOCK_SIZE;
+	if (!sb_set_blocksize(sb, PNLFS_BLOCK_SIZE))
+		return -EINVAL;
 	sb->s_maxbytes = PNLFS_MAX_FILESIZE;
 
 	/**
@@ -186,25 +480,52 @@ static int pnlfs_fill_super(struct super_block *sb, void *data, int flags)
 	 * partition sb. The size correspond to sb->s_blocksize, and the data
 	 * are accessible from the buffer_head struct returned
 	 */
-	pr_info("%s Get buffer_head\n",  __func__);
+	pnlfs_debug("%s Get buffer_head\n",  __func__);
 	bh = sb_bread(sb, 0);
 	if (!bh) return -EIO;
 
 	/* Compare the Magic number */
-	pr_info("%s Compare the Magic number\n",  __func__);
+	pnlfs_debug("%s Compare the Magic number\n",  __func__);
   tmp_sb = (struct pnlfs_superblock *) bh->b_data;
 	if (le32_to_cpu(tmp_sb->magic) != PNLFS_MAGIC) 
 	{
 		err = -EPERM;
 		goto exit;
 	}
-	brelse(bh);
+
+	/*
+	 * The superblock is in the first 4 KiB whatever the block size. A
+	 * block cannot be larger than a page, 64 KiB blocks need 64 KiB pages.
+	 */
+	block_size = le32_to_cpu(tmp_sb->block_size);
+	if (block_size && block_size != PNLFS_BLOCK_SIZE) {
+		if (block_size < PNLFS_BLOCK_SIZE ||
+		    block_size > PNLFS_MAX_BLOCK_SIZE ||
+		    !is_power_of_2(block_size)) {
+			pr_err("%s Bad block size %u\n", __func__, block_size);
+			err = -EINVAL;
+			goto exit;
+		}
+		if (block_size > PAGE_SIZE) {
+			pr_err("%s Block size %u larger than the pages (%lu)\n",
+			       __func__, block_size, PAGE_SIZE);
+			err = -EINVAL;
+			goto exit;
+		}
+		brelse(bh);
+		if (!sb_set_blocksize(sb, block_size))
+			return -EINVAL;
+		bh = sb_bread(sb, 0);
+		if (!bh)
+			return -EIO;
+		tmp_sb = (struct pnlfs_superblock *) bh->b_data;
+	}
 
 	/* Set operations */
 	sb->s_op = &pnlfs_op;
 
 	/* Allocate the pnlfs_sb_info struct */
-	pr_info("%s Compare the Magic number\n",  __func__);
+	pnlfs_debug("%s Compare the Magic number\n",  __func__);
 	sbi = kzalloc(sizeof(struct pnlfs_sb_info), GFP_KERNEL);
 	if(!sbi) {
 		err = -ENOMEM;
@@ -215,10 +536,29 @@ static int pnlfs_fill_super(struct super_block *sb, void *data, int flags)
 	sbi->nr_istore_blocks = le32_to_cpu(tmp_sb->nr_istore_blocks);
 	sbi->nr_ifree_blocks = le32_to_cpu(tmp_sb->nr_ifree_blocks);
 	sbi->nr_bfree_blocks = le32_to_cpu(tmp_sb->nr_bfree_blocks);
-	sbi->nr_free_blocks = le32_to_cpu(tmp_sb->nr_free_blocks);
-	sbi->nr_free_inodes = le32_to_cpu(tmp_sb->nr_free_inodes);
+	/* Records of 16 bytes, the only ones before inline files */
+	sbi->inode_size = le32_to_cpu(tmp_sb->inode_size);
+	if (!sbi->inode_size)
+		sbi->inode_size = sizeof(struct pnlfs_inode);
+	if (sbi->inode_size < sizeof(struct pnlfs_inode) ||
+	    sbi->inode_size > sb->s_blocksize / 2 ||
+	    !is_power_of_2(sbi->inode_size)) {
+		pr_err("%s Bad inode size %u\n",  __func__, sbi->inode_size);
+		err = -EINVAL;
+		goto exit1;
+	}
+	sbi->inodes_per_block = sb->s_blocksize / sbi->inode_size;
+	sbi->sb = sb;
+	sbi->commit_interval = PNLFS_DEFAULT_COMMIT;
+	INIT_DELAYED_WORK(&sbi->commit_work, pnlfs_commit_work);
+	spin_lock_init(&sbi->conv_lock);
+	INIT_WORK(&sbi->conv_work, pnlfs_conv_work);
+	if (!pnlfs_parse_options(data, sbi)) {
+		err = -EINVAL;
+		goto exit1;
+	}
 
-	pr_info("%s PNLFS Information on superblock \n"
+	pnlfs_debug("%s PNLFS Information on superblock \n"
 		"\tmagic		= %x\n"
 		"\tnr_block 		= %d\n"
 		"\tnr_inodes 		= %d\n"
@@ -226,67 +566,63 @@ static int pnlfs_fill_super(struct super_block *sb, void *data, int flags)
 		"\tnr_ifree_blocks 	= %d\n"
 		"\tnr_bfree_blocks 	= %d\n"
 		"\tnr_free_inodes 	= %d\n"
-		"\tnr_free_blocks 	= %d\n",
+		"\tnr_free_blocks 	= %d\n"
+		"\tinode_size 		= %u\n"
+		"\tblock_size 		= %lu\n",
 		__func__, le32_to_cpu(tmp_sb->magic),
 		sbi->nr_blocks, sbi->nr_inodes,
 		sbi->nr_istore_blocks, sbi->nr_ifree_blocks,
-		sbi->nr_bfree_blocks, sbi->nr_free_inodes,
-		sbi->nr_free_blocks);
+		sbi->nr_bfree_blocks, le32_to_cpu(tmp_sb->nr_free_inodes),
+		le32_to_cpu(tmp_sb->nr_free_blocks), sbi->inode_size,
+		sb->s_blocksize);
 
-	/* Allocate the bitmap of free inodes */
-	sbi->ifree_bitmap = (unsigned long*) kmalloc(512* sizeof(unsigned long),
-			GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		err = -ENOMEM;
-		goto exit1;
-	}
+	sb->s_fs_info = sbi;
 
-	/* Read the block containing ifree bitmap */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		bitmap_bh = sb_bread(sb, 1 + sbi->nr_istore_blocks + i);
-		if (!bitmap_bh) {
-			err = -EIO;
-			goto exit3;
-		}
-		/* Initiate the bitmap of free inodes  */
-		bitmap = (unsigned long *) bitmap_bh->b_data;
-		for (j = 0; j < 512; j++) {
-			sbi->ifree_bitmap[j] = le64_to_cpu(bitmap[j]);
-		}
-		brelse(bitmap_bh);
+	/* The replay may change any metadata, block 0 in bh included */
+	if (le32_to_cpu(tmp_sb->journal_len)) {
+		err = pnlfs_journal_load(sb, le32_to_cpu(tmp_sb->journal_start),
+					 le32_to_cpu(tmp_sb->journal_len));
+		if (err)
+			goto exit1;
 	}
+	sbi->sb_free_inodes = le32_to_cpu(tmp_sb->nr_free_inodes);
+	sbi->sb_free_blocks = le32_to_cpu(tmp_sb->nr_free_blocks);
+	/* The first block holds the root, mkfs always writes it */
+	if (le32_to_cpu(tmp_sb->itable_unused) >= sbi->nr_istore_blocks) {
+		pr_err("%s Bad itable_unused %u\n", __func__,
+		       le32_to_cpu(tmp_sb->itable_unused));
+		err = -EINVAL;
+		goto exit3;
+	}
+	sbi->istore_init = sbi->nr_istore_blocks -
+		le32_to_cpu(tmp_sb->itable_unused);
+	state = le32_to_cpu(tmp_sb->state);
+	mutex_init(&sbi->istore_lock);
 
-	/* Allocate the bitmap of free blocks */
-	sbi->bfree_bitmap = (unsigned long*) kmalloc(512* sizeof(unsigned long),
-			GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
-		err = -ENOMEM;
+	/* Set up the allocators, the bitmaps are read when they are used */
+	err = pnlfs_balloc_init(sb, sbi->sb_free_blocks, sbi->sb_free_inodes);
+	if (err)
+		goto exit3;
+	err = pnlfs_stats_register(sb);
+	if (err)
 		goto exit2;
-	}
+	brelse(bh);
 
-	/* Read the block containing blocks bitmap */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		bitmap_bh = sb_bread(sb,1 + sbi->nr_ifree_blocks
-					+ sbi->nr_istore_blocks + i);
-		if (!bitmap_bh) {
-			err = -EIO;
-			goto exit3;
-		}
-		/* Initiate the bitmap of free blocks  */
-		bitmap = (unsigned long *) bitmap_bh->b_data;
-		for (j = 0; j < 512; j++) {
-			sbi->bfree_bitmap[j] = le64_to_cpu(bitmap[j]);
-		}
-		brelse(bitmap_bh);
+	if (!(state & PNLFS_STATE_CLEAN))
+		pr_warn("%s Filesystem not cleanly unmounted, running "
+			"fsck.pnlfs is recommended\n", __func__);
+	if (!(sb->s_flags & MS_RDONLY)) {
+		err = pnlfs_set_clean(sb, false);
+		if (err)
+			goto exit5;
 	}
-	sb->s_fs_info = sbi;
 	// Partie 2
 
 	/* Ask an inode to the VFS */
 	root = pnlfs_iget(sb, 0); 
 	if (IS_ERR(root)) {
 		err = PTR_ERR(root);
-		goto exit3;
+		goto exit5;
 	}
 
 	/* Set this inode as the root inode */
@@ -297,18 +633,25 @@ static int pnlfs_fill_super(struct super_block *sb, void *data, int flags)
 		err = -ENOMEM;
 		goto exit4;
 	}
-	pr_warn("%s End\n",  __func__);
+	pnlfs_debug("%s End\n",  __func__);
 	return 0;
 
 	exit4:
 		iput(root);
-	exit3:
-		kfree(sbi->bfree_bitmap);
+	exit5:
+		pnlfs_stats_unregister(sb);
+		pnlfs_balloc_exit(sb);
+		pnlfs_journal_destroy(sb);
+		kfree(sbi);
+		return err;
 	exit2:
-		kfree(sbi->ifree_bitmap);
+		pnlfs_balloc_exit(sb);
+	exit3:
+		pnlfs_journal_destroy(sb);
 	exit1:
 		kfree(sbi);
 	exit:
+		brelse(bh);
 		return err;
 }
 
@@ -317,21 +660,21 @@ static struct dentry *pnlfs_mount
 (struct file_system_type *fs, int flags, const char *dev, void *data)
 {
 	struct dentry * entry;
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 	entry = mount_bdev(fs, flags, dev, data, pnlfs_fill_super);
 	if (IS_ERR(entry))
 		pr_err("%s Mounting Error\n",  __func__);
 	else
-		pr_info("%s End\n",  __func__);
+		pnlfs_debug("%s End\n",  __func__);
 	return entry;
 }
 
 /* Function called for unmounting, set in file_system_type */
 static void pnlfs_kill_super(struct super_block *sb)
 {
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
 	kill_block_super(sb);
-	pr_info("%s End\n", __func__);
+	pnlfs_debug("%s End\n", __func__);
 }
 
 static struct file_system_type pnlfs_fs_type = {
@@ -342,26 +685,57 @@ static struct file_system_type pnlfs_fs_type = {
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
+/* Marks unwritten blocks written, writeback and reclaim wait for it */
+struct workqueue_struct *pnlfs_conv_wq;
+
 /* Init function */
 int __init init_pnlfs_fs(void)
 {
 	int err;
-	pr_info("%s Start\n",  __func__);
+	pnlfs_debug("%s Start\n",  __func__);
+	err = pnlfs_init_inodecache();
+	if (err)
+		return err;
+	err = pnlfs_dcache_init();
+	if (err)
+		goto err_inodecache;
+	err = pnlfs_stats_init();
+	if (err)
+		goto err_dcache;
+	pnlfs_conv_wq = alloc_workqueue("pnlfs-conv", WQ_MEM_RECLAIM, 0);
+	if (!pnlfs_conv_wq) {
+		err = -ENOMEM;
+		goto err_stats;
+	}
 	err = register_filesystem(&pnlfs_fs_type);
 	if (err)
 	{
 		pr_err("%s Registering error : %d\n",  __func__, err);
-		return err;
+		goto err_wq;
 	}
 	return 0;
-	pr_info("%s End\n", __func__);
+
+err_wq:
+	destroy_workqueue(pnlfs_conv_wq);
+err_stats:
+	pnlfs_stats_exit();
+err_dcache:
+	pnlfs_dcache_exit();
+err_inodecache:
+	pnlfs_destroy_inodecache();
+	return err;
+	pnlfs_debug("%s End\n", __func__);
 }
 
 /* Exit function */
 void __exit exit_pnlfs_fs(void)
 {
-	pr_info("%s Start\n", __func__);
+	pnlfs_debug("%s Start\n", __func__);
 	unregister_filesystem(&pnlfs_fs_type);
+	destroy_workqueue(pnlfs_conv_wq);
+	pnlfs_stats_exit();
+	pnlfs_dcache_exit();
+	pnlfs_destroy_inodecache();
 }
 
 module_init(init_pnlfs_fs);